@@ -0,0 +1,416 @@
+/**\file BatchEigenSolver.hpp
+ *
+ * Batched neighborhood covariances and normals from the smallest
+ * eigenpair of symmetric 3x3 matrices
+ *
+ * Points, covariances and normals are kept as structures of arrays.
+ * The smallest eigenvalue comes from the trigonometric solution of the
+ * characteristic cubic and the eigenvector from the cross products of
+ * the rows of (A - lambda I). With AVX2 (-mavx2, see the USE_AVX2
+ * option) four matrices are solved at once; the matrices with a
+ * (nearly) repeated smallest eigenvalue go to the iterative solver of
+ * Eigen.
+ *
+ * @author Javier Hidalgo Carrio et. al
+ * See LICENSE for the license information
+ *
+ */
+
+
+#ifndef __ENVIRE_SAM_BATCH_EIGEN_SOLVER__
+#define __ENVIRE_SAM_BATCH_EIGEN_SOLVER__
+
+#include <cmath>
+#include <vector>
+#include <limits>
+#include <cstddef>
+#include <algorithm>
+
+#include <Eigen/Core>
+#include <Eigen/Eigenvalues>
+
+#include <pcl/point_cloud.h>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+namespace envire { namespace sam
+{
+
+    struct PointBatch
+    {
+        std::vector<double> x, y, z;
+
+        inline std::size_t size() const { return x.size(); }
+    };
+
+    /** Upper triangle of symmetric matrices and the number of points behind each one **/
+    struct CovarianceBatch
+    {
+        std::vector<double> xx, xy, xz, yy, yz, zz;
+        std::vector<double> count;
+
+        inline std::size_t size() const { return xx.size(); }
+
+        void resize(const std::size_t size)
+        {
+            xx.resize(size); xy.resize(size); xz.resize(size);
+            yy.resize(size); yz.resize(size); zz.resize(size);
+            count.resize(size);
+        }
+
+        inline void set(const std::size_t i, const Eigen::Matrix3d &matrix, const double number_points)
+        {
+            xx[i] = matrix(0,0); xy[i] = matrix(0,1); xz[i] = matrix(0,2);
+            yy[i] = matrix(1,1); yz[i] = matrix(1,2); zz[i] = matrix(2,2);
+            count[i] = number_points;
+        }
+    };
+
+    /** Unit normals (sign arbitrary) and curvature, NaN with fewer than three points **/
+    struct NormalBatch
+    {
+        std::vector<double> x, y, z, curvature;
+
+        inline std::size_t size() const { return x.size(); }
+
+        void resize(const std::size_t size)
+        {
+            x.resize(size); y.resize(size); z.resize(size);
+            curvature.resize(size);
+        }
+    };
+
+    template <class PointType>
+    void toPointBatch(const pcl::PointCloud<PointType> &cloud, PointBatch &batch)
+    {
+        batch.x.resize(cloud.size());
+        batch.y.resize(cloud.size());
+        batch.z.resize(cloud.size());
+        for (std::size_t i=0; i<cloud.size(); ++i)
+        {
+            batch.x[i] = cloud.points[i].x;
+            batch.y[i] = cloud.points[i].y;
+            batch.z[i] = cloud.points[i].z;
+        }
+    }
+
+    namespace detail
+    {
+        /** Relative size of the cross products below which the eigenvector is not trusted **/
+        static const double degenerate_threshold = 1e-10;
+
+        /** Iterative solver for the matrices the closed form cannot resolve **/
+        inline void robustNormal(const CovarianceBatch &covariances, const std::size_t i, NormalBatch &normals)
+        {
+            Eigen::Matrix3d matrix;
+            matrix << covariances.xx[i], covariances.xy[i], covariances.xz[i],
+                   covariances.xy[i], covariances.yy[i], covariances.yz[i],
+                   covariances.xz[i], covariances.yz[i], covariances.zz[i];
+
+            Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> solver(matrix);
+            const Eigen::Vector3d normal = solver.eigenvectors().col(0);
+            const double trace = solver.eigenvalues().sum();
+            normals.x[i] = normal[0];
+            normals.y[i] = normal[1];
+            normals.z[i] = normal[2];
+            normals.curvature[i] = (trace > 0.0) ? std::max(solver.eigenvalues()[0], 0.0) / trace : 0.0;
+        }
+
+        inline void invalidNormal(const std::size_t i, NormalBatch &normals)
+        {
+            const double nan = std::numeric_limits<double>::quiet_NaN();
+            normals.x[i] = normals.y[i] = normals.z[i] = normals.curvature[i] = nan;
+        }
+
+        inline void scalarNormal(const CovarianceBatch &covariances, const std::size_t i, NormalBatch &normals)
+        {
+            if (!(covariances.count[i] >= 3.0))
+            {
+                invalidNormal(i, normals);
+                return;
+            }
+
+            /** Scaled to the largest coefficient **/
+            const double scale = std::max(std::max(std::max(std::fabs(covariances.xx[i]), std::fabs(covariances.xy[i])),
+                        std::max(std::fabs(covariances.xz[i]), std::fabs(covariances.yy[i]))),
+                    std::max(std::fabs(covariances.yz[i]), std::fabs(covariances.zz[i])));
+            if (!(scale > 0.0))
+            {
+                robustNormal(covariances, i, normals);
+                return;
+            }
+
+            const double inverse_scale = 1.0 / scale;
+            const double a00 = covariances.xx[i] * inverse_scale, a01 = covariances.xy[i] * inverse_scale,
+                  a02 = covariances.xz[i] * inverse_scale, a11 = covariances.yy[i] * inverse_scale,
+                  a12 = covariances.yz[i] * inverse_scale, a22 = covariances.zz[i] * inverse_scale;
+
+            /** Traceless part B = A - mI, its characteristic polynomial is x^3 - 3px - 2q **/
+            const double m = (a00 + a11 + a22) / 3.0;
+            const double b00 = a00 - m, b11 = a11 - m, b22 = a22 - m;
+            const double p = (b00*b00 + b11*b11 + b22*b22 + 2.0 * (a01*a01 + a02*a02 + a12*a12)) / 6.0;
+            const double q = 0.5 * (b00 * (b11*b22 - a12*a12) - a01 * (a01*b22 - a12*a02) + a02 * (a01*a12 - b11*a02));
+            const double sqrt_p = std::sqrt(p);
+            const double r = std::min(std::max(q / (p * sqrt_p), -1.0), 1.0);
+            const double lambda = m + 2.0 * sqrt_p * std::cos(std::acos(r) / 3.0 + 2.0 * M_PI / 3.0);
+
+            /** Null space of A - lambda I from the largest cross product of its rows **/
+            const Eigen::Vector3d row0(a00 - lambda, a01, a02), row1(a01, a11 - lambda, a12), row2(a02, a12, a22 - lambda);
+            const Eigen::Vector3d v01 = row0.cross(row1), v02 = row0.cross(row2), v12 = row1.cross(row2);
+            const double n01 = v01.squaredNorm(), n02 = v02.squaredNorm(), n12 = v12.squaredNorm();
+            const double largest = std::max(n01, std::max(n02, n12));
+            if (!(largest > degenerate_threshold) || !(p > degenerate_threshold))
+            {
+                robustNormal(covariances, i, normals);
+                return;
+            }
+
+            const Eigen::Vector3d normal = ((n01 >= n02 && n01 >= n12) ? v01 : ((n02 >= n12) ? v02 : v12)) / std::sqrt(largest);
+            normals.x[i] = normal[0];
+            normals.y[i] = normal[1];
+            normals.z[i] = normal[2];
+            normals.curvature[i] = std::max(lambda, 0.0) / (3.0 * m);
+        }
+
+        #ifdef __AVX2__
+        /** acos(x) = sqrt(1-x) P(x) for x in [0, 1] (Abramowitz and Stegun 4.4.46), |error| < 2e-8 **/
+        inline __m256d acos4(const __m256d x)
+        {
+            const __m256d sign_mask = _mm256_set1_pd(-0.0);
+            const __m256d ax = _mm256_andnot_pd(sign_mask, x);
+            __m256d poly = _mm256_set1_pd(-0.0012624911);
+            poly = _mm256_add_pd(_mm256_mul_pd(poly, ax), _mm256_set1_pd(0.0066700901));
+            poly = _mm256_add_pd(_mm256_mul_pd(poly, ax), _mm256_set1_pd(-0.0170881256));
+            poly = _mm256_add_pd(_mm256_mul_pd(poly, ax), _mm256_set1_pd(0.0308918810));
+            poly = _mm256_add_pd(_mm256_mul_pd(poly, ax), _mm256_set1_pd(-0.0501743046));
+            poly = _mm256_add_pd(_mm256_mul_pd(poly, ax), _mm256_set1_pd(0.0889789874));
+            poly = _mm256_add_pd(_mm256_mul_pd(poly, ax), _mm256_set1_pd(-0.2145988016));
+            poly = _mm256_add_pd(_mm256_mul_pd(poly, ax), _mm256_set1_pd(1.5707963050));
+            const __m256d positive = _mm256_mul_pd(_mm256_sqrt_pd(_mm256_sub_pd(_mm256_set1_pd(1.0), ax)), poly);
+
+            /** acos(-x) = pi - acos(x) **/
+            const __m256d negative = _mm256_sub_pd(_mm256_set1_pd(M_PI), positive);
+            return _mm256_blendv_pd(positive, negative, x);
+        }
+
+        /** cos(u) for u in [0, pi/3], truncated series with |error| < 3e-11 **/
+        inline __m256d cos4(const __m256d u)
+        {
+            const __m256d u2 = _mm256_mul_pd(u, u);
+            __m256d poly = _mm256_set1_pd(1.0 / 479001600.0);
+            poly = _mm256_add_pd(_mm256_mul_pd(poly, u2), _mm256_set1_pd(-1.0 / 3628800.0));
+            poly = _mm256_add_pd(_mm256_mul_pd(poly, u2), _mm256_set1_pd(1.0 / 40320.0));
+            poly = _mm256_add_pd(_mm256_mul_pd(poly, u2), _mm256_set1_pd(-1.0 / 720.0));
+            poly = _mm256_add_pd(_mm256_mul_pd(poly, u2), _mm256_set1_pd(1.0 / 24.0));
+            poly = _mm256_add_pd(_mm256_mul_pd(poly, u2), _mm256_set1_pd(-0.5));
+            return _mm256_add_pd(_mm256_mul_pd(poly, u2), _mm256_set1_pd(1.0));
+        }
+
+        inline __m256d abs4(const __m256d x)
+        {
+            return _mm256_andnot_pd(_mm256_set1_pd(-0.0), x);
+        }
+
+        /** Four matrices from i, returns the lanes for the scalar path **/
+        inline int simdNormals(const CovarianceBatch &covariances, const std::size_t i, NormalBatch &normals)
+        {
+            const __m256d count = _mm256_loadu_pd(&covariances.count[i]);
+            __m256d a00 = _mm256_loadu_pd(&covariances.xx[i]), a01 = _mm256_loadu_pd(&covariances.xy[i]),
+                    a02 = _mm256_loadu_pd(&covariances.xz[i]), a11 = _mm256_loadu_pd(&covariances.yy[i]),
+                    a12 = _mm256_loadu_pd(&covariances.yz[i]), a22 = _mm256_loadu_pd(&covariances.zz[i]);
+
+            /** Scaled to the largest coefficient **/
+            const __m256d scale = _mm256_max_pd(_mm256_max_pd(_mm256_max_pd(abs4(a00), abs4(a01)), _mm256_max_pd(abs4(a02), abs4(a11))),
+                    _mm256_max_pd(abs4(a12), abs4(a22)));
+            const __m256d inverse_scale = _mm256_div_pd(_mm256_set1_pd(1.0), scale);
+            a00 = _mm256_mul_pd(a00, inverse_scale); a01 = _mm256_mul_pd(a01, inverse_scale);
+            a02 = _mm256_mul_pd(a02, inverse_scale); a11 = _mm256_mul_pd(a11, inverse_scale);
+            a12 = _mm256_mul_pd(a12, inverse_scale); a22 = _mm256_mul_pd(a22, inverse_scale);
+
+            /** Traceless part B = A - mI, its characteristic polynomial is x^3 - 3px - 2q **/
+            const __m256d m = _mm256_mul_pd(_mm256_add_pd(_mm256_add_pd(a00, a11), a22), _mm256_set1_pd(1.0 / 3.0));
+            const __m256d b00 = _mm256_sub_pd(a00, m), b11 = _mm256_sub_pd(a11, m), b22 = _mm256_sub_pd(a22, m);
+            const __m256d off = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(a01, a01), _mm256_mul_pd(a02, a02)), _mm256_mul_pd(a12, a12));
+            const __m256d diagonal = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(b00, b00), _mm256_mul_pd(b11, b11)), _mm256_mul_pd(b22, b22));
+            const __m256d p = _mm256_mul_pd(_mm256_add_pd(diagonal, _mm256_add_pd(off, off)), _mm256_set1_pd(1.0 / 6.0));
+            const __m256d minor0 = _mm256_sub_pd(_mm256_mul_pd(b11, b22), _mm256_mul_pd(a12, a12));
+            const __m256d minor1 = _mm256_sub_pd(_mm256_mul_pd(a01, b22), _mm256_mul_pd(a12, a02));
+            const __m256d minor2 = _mm256_sub_pd(_mm256_mul_pd(a01, a12), _mm256_mul_pd(b11, a02));
+            const __m256d q = _mm256_mul_pd(_mm256_set1_pd(0.5), _mm256_add_pd(_mm256_sub_pd(_mm256_mul_pd(b00, minor0),
+                            _mm256_mul_pd(a01, minor1)), _mm256_mul_pd(a02, minor2)));
+
+            const __m256d sqrt_p = _mm256_sqrt_pd(p);
+            __m256d r = _mm256_div_pd(q, _mm256_mul_pd(p, sqrt_p));
+            r = _mm256_min_pd(_mm256_max_pd(r, _mm256_set1_pd(-1.0)), _mm256_set1_pd(1.0));
+
+            /** cos(acos(r)/3 + 2pi/3) = -cos(pi/3 - acos(r)/3) **/
+            const __m256d u = _mm256_sub_pd(_mm256_set1_pd(M_PI / 3.0), _mm256_mul_pd(acos4(r), _mm256_set1_pd(1.0 / 3.0)));
+            const __m256d two_sqrt_p = _mm256_add_pd(sqrt_p, sqrt_p);
+            __m256d x = _mm256_sub_pd(_mm256_setzero_pd(), _mm256_mul_pd(two_sqrt_p, cos4(u)));
+
+            /** One Newton step on the cubic for the accuracy lost in the approximations **/
+            const __m256d x2 = _mm256_mul_pd(x, x);
+            const __m256d three_p = _mm256_mul_pd(_mm256_set1_pd(3.0), p);
+            const __m256d value = _mm256_sub_pd(_mm256_mul_pd(x, _mm256_sub_pd(x2, three_p)), _mm256_add_pd(q, q));
+            const __m256d slope = _mm256_sub_pd(_mm256_mul_pd(_mm256_set1_pd(3.0), x2), three_p);
+            const __m256d steep = _mm256_cmp_pd(slope, _mm256_mul_pd(p, _mm256_set1_pd(1e-3)), _CMP_GT_OQ);
+            x = _mm256_blendv_pd(x, _mm256_sub_pd(x, _mm256_div_pd(value, slope)), steep);
+            const __m256d lambda = _mm256_add_pd(m, x);
+
+            /** Null space of A - lambda I from the largest cross product of its rows **/
+            const __m256d c00 = _mm256_sub_pd(a00, lambda), c11 = _mm256_sub_pd(a11, lambda), c22 = _mm256_sub_pd(a22, lambda);
+            // row0 x row1, row0 = (c00, a01, a02), row1 = (a01, c11, a12), row2 = (a02, a12, c22)
+            const __m256d v01x = _mm256_sub_pd(_mm256_mul_pd(a01, a12), _mm256_mul_pd(a02, c11));
+            const __m256d v01y = _mm256_sub_pd(_mm256_mul_pd(a02, a01), _mm256_mul_pd(c00, a12));
+            const __m256d v01z = _mm256_sub_pd(_mm256_mul_pd(c00, c11), _mm256_mul_pd(a01, a01));
+            const __m256d v02x = _mm256_sub_pd(_mm256_mul_pd(a01, c22), _mm256_mul_pd(a02, a12));
+            const __m256d v02y = _mm256_sub_pd(_mm256_mul_pd(a02, a02), _mm256_mul_pd(c00, c22));
+            const __m256d v02z = _mm256_sub_pd(_mm256_mul_pd(c00, a12), _mm256_mul_pd(a01, a02));
+            const __m256d v12x = _mm256_sub_pd(_mm256_mul_pd(c11, c22), _mm256_mul_pd(a12, a12));
+            const __m256d v12y = _mm256_sub_pd(_mm256_mul_pd(a12, a02), _mm256_mul_pd(a01, c22));
+            const __m256d v12z = _mm256_sub_pd(_mm256_mul_pd(a01, a12), _mm256_mul_pd(c11, a02));
+            const __m256d n01 = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(v01x, v01x), _mm256_mul_pd(v01y, v01y)), _mm256_mul_pd(v01z, v01z));
+            const __m256d n02 = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(v02x, v02x), _mm256_mul_pd(v02y, v02y)), _mm256_mul_pd(v02z, v02z));
+            const __m256d n12 = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(v12x, v12x), _mm256_mul_pd(v12y, v12y)), _mm256_mul_pd(v12z, v12z));
+
+            const __m256d use02 = _mm256_cmp_pd(n02, n01, _CMP_GT_OQ);
+            __m256d vx = _mm256_blendv_pd(v01x, v02x, use02), vy = _mm256_blendv_pd(v01y, v02y, use02), vz = _mm256_blendv_pd(v01z, v02z, use02);
+            __m256d largest = _mm256_max_pd(n01, n02);
+            const __m256d use12 = _mm256_cmp_pd(n12, largest, _CMP_GT_OQ);
+            vx = _mm256_blendv_pd(vx, v12x, use12); vy = _mm256_blendv_pd(vy, v12y, use12); vz = _mm256_blendv_pd(vz, v12z, use12);
+            largest = _mm256_max_pd(largest, n12);
+
+            const __m256d inverse_norm = _mm256_div_pd(_mm256_set1_pd(1.0), _mm256_sqrt_pd(largest));
+            _mm256_storeu_pd(&normals.x[i], _mm256_mul_pd(vx, inverse_norm));
+            _mm256_storeu_pd(&normals.y[i], _mm256_mul_pd(vy, inverse_norm));
+            _mm256_storeu_pd(&normals.z[i], _mm256_mul_pd(vz, inverse_norm));
+            _mm256_storeu_pd(&normals.curvature[i], _mm256_div_pd(_mm256_max_pd(lambda, _mm256_setzero_pd()),
+                        _mm256_mul_pd(_mm256_set1_pd(3.0), m)));
+
+            /** Too few points, zero or repeated smallest eigenvalue (NaN compares false) **/
+            const __m256d threshold = _mm256_set1_pd(degenerate_threshold);
+            const __m256d good = _mm256_and_pd(_mm256_and_pd(_mm256_cmp_pd(count, _mm256_set1_pd(3.0), _CMP_GE_OQ),
+                        _mm256_cmp_pd(scale, _mm256_setzero_pd(), _CMP_GT_OQ)),
+                    _mm256_and_pd(_mm256_cmp_pd(largest, threshold, _CMP_GT_OQ), _mm256_cmp_pd(p, threshold, _CMP_GT_OQ)));
+            return ~_mm256_movemask_pd(good) & 0xf;
+        }
+        #endif
+    }
+
+    /**@brief Normal and curvature of every covariance with the closed form, one at a time **/
+    inline void solveNormalsScalar(const CovarianceBatch &covariances, NormalBatch &normals)
+    {
+        normals.resize(covariances.size());
+        for (std::size_t i=0; i<covariances.size(); ++i)
+            detail::scalarNormal(covariances, i, normals);
+    }
+
+    /**@brief Normal and curvature of every covariance
+     *
+     * Four at a time with AVX2, the same as solveNormalsScalar()
+     * otherwise.
+     */
+    inline void solveNormals(const CovarianceBatch &covariances, NormalBatch &normals)
+    {
+        normals.resize(covariances.size());
+        std::size_t i = 0;
+
+        #ifdef __AVX2__
+        for (; i + 4 <= covariances.size(); i += 4)
+        {
+            const int scalar_lanes = detail::simdNormals(covariances, i, normals);
+            for (int lane=0; scalar_lanes && lane<4; ++lane)
+            {
+                if (scalar_lanes & (1 << lane))
+                    detail::scalarNormal(covariances, i + lane, normals);
+            }
+        }
+        #endif
+
+        for (; i<covariances.size(); ++i)
+            detail::scalarNormal(covariances, i, normals);
+    }
+
+    /**@brief Covariance of the neighborhood of each query point
+     *
+     * The neighbors of query i are indices[offsets[i]] to
+     * indices[offsets[i+1]] (offsets has one entry more than queries).
+     * The sums are taken relative to the first neighbor so the
+     * coordinates far from the origin do not cancel.
+     */
+    inline void accumulateCovariances(const PointBatch &points, const std::vector<int> &indices,
+            const std::vector<std::size_t> &offsets, CovarianceBatch &covariances)
+    {
+        const std::size_t number_queries = offsets.empty() ? 0 : offsets.size() - 1;
+        covariances.resize(number_queries);
+        for (std::size_t i=0; i<number_queries; ++i)
+        {
+            const std::size_t begin = offsets[i], end = offsets[i+1];
+            const double n = end - begin;
+            covariances.count[i] = n;
+            if (end == begin)
+            {
+                covariances.xx[i] = covariances.xy[i] = covariances.xz[i] = 0.0;
+                covariances.yy[i] = covariances.yz[i] = covariances.zz[i] = 0.0;
+                continue;
+            }
+
+            const double ox = points.x[indices[begin]], oy = points.y[indices[begin]], oz = points.z[indices[begin]];
+            double sx = 0.0, sy = 0.0, sz = 0.0, sxx = 0.0, sxy = 0.0, sxz = 0.0, syy = 0.0, syz = 0.0, szz = 0.0;
+            std::size_t k = begin;
+
+            #ifdef __AVX2__
+            __m256d vsx = _mm256_setzero_pd(), vsy = _mm256_setzero_pd(), vsz = _mm256_setzero_pd();
+            __m256d vsxx = _mm256_setzero_pd(), vsxy = _mm256_setzero_pd(), vsxz = _mm256_setzero_pd();
+            __m256d vsyy = _mm256_setzero_pd(), vsyz = _mm256_setzero_pd(), vszz = _mm256_setzero_pd();
+            const __m256d vox = _mm256_set1_pd(ox), voy = _mm256_set1_pd(oy), voz = _mm256_set1_pd(oz);
+            for (; k + 4 <= end; k += 4)
+            {
+                const __m128i index = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&indices[k]));
+                const __m256d dx = _mm256_sub_pd(_mm256_i32gather_pd(points.x.data(), index, 8), vox);
+                const __m256d dy = _mm256_sub_pd(_mm256_i32gather_pd(points.y.data(), index, 8), voy);
+                const __m256d dz = _mm256_sub_pd(_mm256_i32gather_pd(points.z.data(), index, 8), voz);
+                vsx = _mm256_add_pd(vsx, dx); vsy = _mm256_add_pd(vsy, dy); vsz = _mm256_add_pd(vsz, dz);
+                vsxx = _mm256_add_pd(vsxx, _mm256_mul_pd(dx, dx));
+                vsxy = _mm256_add_pd(vsxy, _mm256_mul_pd(dx, dy));
+                vsxz = _mm256_add_pd(vsxz, _mm256_mul_pd(dx, dz));
+                vsyy = _mm256_add_pd(vsyy, _mm256_mul_pd(dy, dy));
+                vsyz = _mm256_add_pd(vsyz, _mm256_mul_pd(dy, dz));
+                vszz = _mm256_add_pd(vszz, _mm256_mul_pd(dz, dz));
+            }
+
+            double lanes[4];
+            _mm256_storeu_pd(lanes, vsx); sx = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+            _mm256_storeu_pd(lanes, vsy); sy = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+            _mm256_storeu_pd(lanes, vsz); sz = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+            _mm256_storeu_pd(lanes, vsxx); sxx = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+            _mm256_storeu_pd(lanes, vsxy); sxy = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+            _mm256_storeu_pd(lanes, vsxz); sxz = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+            _mm256_storeu_pd(lanes, vsyy); syy = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+            _mm256_storeu_pd(lanes, vsyz); syz = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+            _mm256_storeu_pd(lanes, vszz); szz = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+            #endif
+
+            for (; k<end; ++k)
+            {
+                const double dx = points.x[indices[k]] - ox, dy = points.y[indices[k]] - oy, dz = points.z[indices[k]] - oz;
+                sx += dx; sy += dy; sz += dz;
+                sxx += dx*dx; sxy += dx*dy; sxz += dx*dz;
+                syy += dy*dy; syz += dy*dz; szz += dz*dz;
+            }
+
+            const double mx = sx / n, my = sy / n, mz = sz / n;
+            covariances.xx[i] = sxx / n - mx*mx;
+            covariances.xy[i] = sxy / n - mx*my;
+            covariances.xz[i] = sxz / n - mx*mz;
+            covariances.yy[i] = syy / n - my*my;
+            covariances.yz[i] = syz / n - my*mz;
+            covariances.zz[i] = szz / n - mz*mz;
+        }
+    }
+
+}}
+
+#endif
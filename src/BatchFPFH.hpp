@@ -0,0 +1,407 @@
+/**\file BatchFPFH.hpp
+ *
+ * Fast Point Feature Histograms vectorized over the neighbors and
+ * parallel over the points
+ *
+ * Same algorithm and binning as pcl::FPFHEstimation (33 bins, the SPFH
+ * of the neighbors weighted by the inverse squared distance, the query
+ * point itself left out), so the descriptors stay comparable with the
+ * ones of pcl up to float rounding. The pair features of a point and
+ * its neighbors are computed eight at a time with AVX2 (see the
+ * USE_AVX2 option), with an approximated atan2 of float accuracy, and
+ * the points are distributed with TBB when GTSAM has it.
+ *
+ * @author Javier Hidalgo Carrio et. al
+ * See LICENSE for the license information
+ *
+ */
+
+
+#ifndef __ENVIRE_SAM_BATCH_FPFH__
+#define __ENVIRE_SAM_BATCH_FPFH__
+
+#include <cmath>
+#include <vector>
+#include <limits>
+#include <cstddef>
+#include <algorithm>
+
+#include <gtsam/config.h>
+#ifdef GTSAM_USE_TBB
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
+#endif
+
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+#include <pcl/search/kdtree.h>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+namespace envire { namespace sam
+{
+
+    /** Search surface with its normals as structure of arrays **/
+    struct SurfaceBatch
+    {
+        std::vector<float> x, y, z;
+        std::vector<float> nx, ny, nz;
+
+        inline std::size_t size() const { return x.size(); }
+    };
+
+    template <class PointType>
+    void toSurfaceBatch(const pcl::PointCloud<PointType> &points, const pcl::PointCloud<pcl::Normal> &normals, SurfaceBatch &surface)
+    {
+        const std::size_t size = points.size();
+        surface.x.resize(size); surface.y.resize(size); surface.z.resize(size);
+        surface.nx.resize(size); surface.ny.resize(size); surface.nz.resize(size);
+        for (std::size_t i=0; i<size; ++i)
+        {
+            surface.x[i] = points.points[i].x;
+            surface.y[i] = points.points[i].y;
+            surface.z[i] = points.points[i].z;
+            surface.nx[i] = normals.points[i].normal_x;
+            surface.ny[i] = normals.points[i].normal_y;
+            surface.nz[i] = normals.points[i].normal_z;
+        }
+    }
+
+    namespace detail
+    {
+        static const int fpfh_bins = 11;
+
+        /** Run function(i) for i in [0, size), in parallel with TBB **/
+        template <typename F>
+        void parallelFor(const std::size_t size, const F &function)
+        {
+            #ifdef GTSAM_USE_TBB
+            tbb::parallel_for(tbb::blocked_range<std::size_t>(0, size), [&function](const tbb::blocked_range<std::size_t> &range)
+            {
+                for (std::size_t i=range.begin(); i!=range.end(); ++i)
+                    function(i);
+            });
+            #else
+            for (std::size_t i=0; i<size; ++i)
+                function(i);
+            #endif
+        }
+
+        /** Histogram bin of the features as pcl, NaN goes to the first bin **/
+        inline int fpfhBin(const double value)
+        {
+            const double bin = std::floor(value);
+            if (!(bin >= 0.0))
+                return 0;
+            return (bin >= fpfh_bins) ? fpfh_bins - 1 : static_cast<int>(bin);
+        }
+
+        /** Pair features of pcl::computePairFeatures, false for coincident points or parallel normal and offset **/
+        inline bool pairFeatures(const SurfaceBatch &surface, const int p, const int q, float &f1, float &f2, float &f3)
+        {
+            float dx = surface.x[q] - surface.x[p], dy = surface.y[q] - surface.y[p], dz = surface.z[q] - surface.z[p];
+            const float f4 = std::sqrt(dx*dx + dy*dy + dz*dz);
+            if (f4 == 0.0f)
+                return false;
+
+            float ux = surface.nx[p], uy = surface.ny[p], uz = surface.nz[p];
+            float ox = surface.nx[q], oy = surface.ny[q], oz = surface.nz[q];
+            const float angle1 = (ux*dx + uy*dy + uz*dz) / f4;
+            const float angle2 = (ox*dx + oy*dy + oz*dz) / f4;
+
+            /** The same point is the source of the pair whichever is the query **/
+            if (std::fabs(angle1) < std::fabs(angle2))
+            {
+                std::swap(ux, ox); std::swap(uy, oy); std::swap(uz, oz);
+                dx = -dx; dy = -dy; dz = -dz;
+                f3 = -angle2;
+            }
+            else
+                f3 = angle1;
+
+            /** Darboux frame u = n1, v = d x u, w = u x v **/
+            float vx = dy*uz - dz*uy, vy = dz*ux - dx*uz, vz = dx*uy - dy*ux;
+            const float v_norm = std::sqrt(vx*vx + vy*vy + vz*vz);
+            if (v_norm == 0.0f)
+                return false;
+            vx /= v_norm; vy /= v_norm; vz /= v_norm;
+            const float wx = uy*vz - uz*vy, wy = uz*vx - ux*vz, wz = ux*vy - uy*vx;
+
+            f2 = vx*ox + vy*oy + vz*oz;
+            f1 = std::atan2(wx*ox + wy*oy + wz*oz, ux*ox + uy*oy + uz*oz);
+            return true;
+        }
+
+        inline void addPairScalar(const SurfaceBatch &surface, const int p, const int q, const float increment, float *histogram)
+        {
+            float f1, f2, f3;
+            if (!pairFeatures(surface, p, q, f1, f2, f3))
+                return;
+
+            histogram[fpfhBin(fpfh_bins * ((f1 + M_PI) * (1.0f / (2.0f * static_cast<float>(M_PI)))))] += increment;
+            histogram[fpfh_bins + fpfhBin(fpfh_bins * ((f2 + 1.0) * 0.5))] += increment;
+            histogram[2 * fpfh_bins + fpfhBin(fpfh_bins * ((f3 + 1.0) * 0.5))] += increment;
+        }
+
+        #ifdef __AVX2__
+        /** atan(x) for x in [0, inf) with the range reduction and polynomial of the cephes atanf **/
+        inline __m256 atan8(const __m256 x)
+        {
+            const __m256 big = _mm256_cmp_ps(x, _mm256_set1_ps(2.414213562373095f), _CMP_GT_OQ);
+            const __m256 medium = _mm256_andnot_ps(big, _mm256_cmp_ps(x, _mm256_set1_ps(0.4142135623730950f), _CMP_GT_OQ));
+            const __m256 one = _mm256_set1_ps(1.0f);
+
+            __m256 reduced = _mm256_blendv_ps(x, _mm256_div_ps(_mm256_sub_ps(x, one), _mm256_add_ps(x, one)), medium);
+            reduced = _mm256_blendv_ps(reduced, _mm256_div_ps(_mm256_set1_ps(-1.0f), x), big);
+            __m256 offset = _mm256_and_ps(medium, _mm256_set1_ps(static_cast<float>(M_PI_4)));
+            offset = _mm256_blendv_ps(offset, _mm256_set1_ps(static_cast<float>(M_PI_2)), big);
+
+            const __m256 z = _mm256_mul_ps(reduced, reduced);
+            __m256 poly = _mm256_set1_ps(8.05374449538e-2f);
+            poly = _mm256_sub_ps(_mm256_mul_ps(poly, z), _mm256_set1_ps(1.38776856032e-1f));
+            poly = _mm256_add_ps(_mm256_mul_ps(poly, z), _mm256_set1_ps(1.99777106478e-1f));
+            poly = _mm256_sub_ps(_mm256_mul_ps(poly, z), _mm256_set1_ps(3.33329491539e-1f));
+            poly = _mm256_add_ps(_mm256_mul_ps(_mm256_mul_ps(poly, z), reduced), reduced);
+            return _mm256_add_ps(offset, poly);
+        }
+
+        inline __m256 atan28(const __m256 y, const __m256 x)
+        {
+            const __m256 sign_mask = _mm256_set1_ps(-0.0f);
+            const __m256 ax = _mm256_andnot_ps(sign_mask, x), ay = _mm256_andnot_ps(sign_mask, y);
+
+            /** atan(|y|/|x|) in the first quadrant, then reflected **/
+            const __m256 ratio = _mm256_div_ps(ay, ax);
+            const __m256 defined = _mm256_cmp_ps(ax, _mm256_setzero_ps(), _CMP_GT_OQ);
+            __m256 angle = _mm256_blendv_ps(_mm256_set1_ps(static_cast<float>(M_PI_2)), atan8(ratio), defined);
+            angle = _mm256_and_ps(angle, _mm256_cmp_ps(_mm256_or_ps(ax, ay), _mm256_setzero_ps(), _CMP_NEQ_UQ));
+            angle = _mm256_blendv_ps(angle, _mm256_sub_ps(_mm256_set1_ps(static_cast<float>(M_PI)), angle), x);
+            angle = _mm256_or_ps(angle, _mm256_and_ps(y, sign_mask));
+
+            /** NaN in, NaN out **/
+            return _mm256_or_ps(angle, _mm256_cmp_ps(x, y, _CMP_UNORD_Q));
+        }
+
+        /** Bins of eight values (as doubles as pcl), -1 where invalid **/
+        inline void bins8(const __m256 value, const double factor, const double shift, const double scale,
+                const __m256 valid, int *bins_out)
+        {
+            const __m256d factors = _mm256_set1_pd(factor), shifts = _mm256_set1_pd(shift), scales = _mm256_set1_pd(scale);
+            const __m256d low = _mm256_cvtps_pd(_mm256_castps256_ps128(value));
+            const __m256d high = _mm256_cvtps_pd(_mm256_extractf128_ps(value, 1));
+            const __m128i low_bins = _mm256_cvttpd_epi32(_mm256_floor_pd(_mm256_mul_pd(factors, _mm256_mul_pd(_mm256_add_pd(low, shifts), scales))));
+            const __m128i high_bins = _mm256_cvttpd_epi32(_mm256_floor_pd(_mm256_mul_pd(factors, _mm256_mul_pd(_mm256_add_pd(high, shifts), scales))));
+            __m256i bins = _mm256_set_m128i(high_bins, low_bins);
+
+            /** NaN converts to INT_MIN, the first bin as in pcl **/
+            bins = _mm256_max_epi32(bins, _mm256_setzero_si256());
+            bins = _mm256_min_epi32(bins, _mm256_set1_epi32(fpfh_bins - 1));
+            bins = _mm256_blendv_epi8(_mm256_set1_epi32(-1), bins, _mm256_castps_si256(valid));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(bins_out), bins);
+        }
+
+        /** Pair features of p with eight neighbors at once **/
+        inline void addPairs8(const SurfaceBatch &surface, const int p, const int *neighbors, const float increment, float *histogram)
+        {
+            const __m256i index = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(neighbors));
+            __m256 dx = _mm256_sub_ps(_mm256_i32gather_ps(surface.x.data(), index, 4), _mm256_set1_ps(surface.x[p]));
+            __m256 dy = _mm256_sub_ps(_mm256_i32gather_ps(surface.y.data(), index, 4), _mm256_set1_ps(surface.y[p]));
+            __m256 dz = _mm256_sub_ps(_mm256_i32gather_ps(surface.z.data(), index, 4), _mm256_set1_ps(surface.z[p]));
+            const __m256 qx = _mm256_i32gather_ps(surface.nx.data(), index, 4);
+            const __m256 qy = _mm256_i32gather_ps(surface.ny.data(), index, 4);
+            const __m256 qz = _mm256_i32gather_ps(surface.nz.data(), index, 4);
+            const __m256 px = _mm256_set1_ps(surface.nx[p]), py = _mm256_set1_ps(surface.ny[p]), pz = _mm256_set1_ps(surface.nz[p]);
+
+            const __m256 f4 = _mm256_sqrt_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)), _mm256_mul_ps(dz, dz)));
+            const __m256 angle1 = _mm256_div_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(px, dx), _mm256_mul_ps(py, dy)), _mm256_mul_ps(pz, dz)), f4);
+            const __m256 angle2 = _mm256_div_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(qx, dx), _mm256_mul_ps(qy, dy)), _mm256_mul_ps(qz, dz)), f4);
+
+            /** The same point is the source of the pair whichever is the query **/
+            const __m256 sign_mask = _mm256_set1_ps(-0.0f);
+            const __m256 swap = _mm256_cmp_ps(_mm256_andnot_ps(sign_mask, angle1), _mm256_andnot_ps(sign_mask, angle2), _CMP_LT_OQ);
+            const __m256 ux = _mm256_blendv_ps(px, qx, swap), uy = _mm256_blendv_ps(py, qy, swap), uz = _mm256_blendv_ps(pz, qz, swap);
+            const __m256 ox = _mm256_blendv_ps(qx, px, swap), oy = _mm256_blendv_ps(qy, py, swap), oz = _mm256_blendv_ps(qz, pz, swap);
+            const __m256 flip = _mm256_and_ps(swap, sign_mask);
+            dx = _mm256_xor_ps(dx, flip); dy = _mm256_xor_ps(dy, flip); dz = _mm256_xor_ps(dz, flip);
+            const __m256 f3 = _mm256_blendv_ps(angle1, _mm256_xor_ps(angle2, sign_mask), swap);
+
+            /** Darboux frame u = n1, v = d x u, w = u x v **/
+            __m256 vx = _mm256_sub_ps(_mm256_mul_ps(dy, uz), _mm256_mul_ps(dz, uy));
+            __m256 vy = _mm256_sub_ps(_mm256_mul_ps(dz, ux), _mm256_mul_ps(dx, uz));
+            __m256 vz = _mm256_sub_ps(_mm256_mul_ps(dx, uy), _mm256_mul_ps(dy, ux));
+            const __m256 v_norm = _mm256_sqrt_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(vx, vx), _mm256_mul_ps(vy, vy)), _mm256_mul_ps(vz, vz)));
+            vx = _mm256_div_ps(vx, v_norm); vy = _mm256_div_ps(vy, v_norm); vz = _mm256_div_ps(vz, v_norm);
+            const __m256 wx = _mm256_sub_ps(_mm256_mul_ps(uy, vz), _mm256_mul_ps(uz, vy));
+            const __m256 wy = _mm256_sub_ps(_mm256_mul_ps(uz, vx), _mm256_mul_ps(ux, vz));
+            const __m256 wz = _mm256_sub_ps(_mm256_mul_ps(ux, vy), _mm256_mul_ps(uy, vx));
+
+            const __m256 f2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(vx, ox), _mm256_mul_ps(vy, oy)), _mm256_mul_ps(vz, oz));
+            const __m256 f1 = atan28(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(wx, ox), _mm256_mul_ps(wy, oy)), _mm256_mul_ps(wz, oz)),
+                    _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ux, ox), _mm256_mul_ps(uy, oy)), _mm256_mul_ps(uz, oz)));
+
+            /** Skipped as pcl: coincident points or null Darboux frame (NaN normals are kept) **/
+            const __m256 zero = _mm256_setzero_ps();
+            const __m256 valid = _mm256_and_ps(_mm256_cmp_ps(f4, zero, _CMP_NEQ_UQ), _mm256_cmp_ps(v_norm, zero, _CMP_NEQ_UQ));
+
+            int bins[3][8];
+            bins8(f1, fpfh_bins, M_PI, 1.0f / (2.0f * static_cast<float>(M_PI)), valid, bins[0]);
+            bins8(f2, fpfh_bins, 1.0, 0.5, valid, bins[1]);
+            bins8(f3, fpfh_bins, 1.0, 0.5, valid, bins[2]);
+            for (int lane=0; lane<8; ++lane)
+            {
+                if (bins[0][lane] < 0)
+                    continue;
+                histogram[bins[0][lane]] += increment;
+                histogram[fpfh_bins + bins[1][lane]] += increment;
+                histogram[2 * fpfh_bins + bins[2][lane]] += increment;
+            }
+        }
+        #endif
+    }
+
+    /**@brief Simplified point feature histogram of a surface point
+     *
+     * neighbors holds the radius neighborhood of p (p included) and the
+     * 33 bins of histogram_out are overwritten.
+     */
+    inline void computeSPFH(const SurfaceBatch &surface, const int p, const std::vector<int> &neighbors, float *histogram_out)
+    {
+        std::fill(histogram_out, histogram_out + 3 * detail::fpfh_bins, 0.0f);
+        const float increment = 100.0f / static_cast<float>(neighbors.size() - 1);
+
+        std::vector<int> others;
+        others.reserve(neighbors.size());
+        for (std::size_t i=0; i<neighbors.size(); ++i)
+        {
+            if (neighbors[i] != p)
+                others.push_back(neighbors[i]);
+        }
+
+        std::size_t i = 0;
+        #ifdef __AVX2__
+        for (; i + 8 <= others.size(); i += 8)
+            detail::addPairs8(surface, p, &others[i], increment, histogram_out);
+        #endif
+        for (; i<others.size(); ++i)
+            detail::addPairScalar(surface, p, others[i], increment, histogram_out);
+    }
+
+    /**@brief FPFH of a point from the SPFH of its neighbors
+     *
+     * rows are the SPFH rows of the neighbors and squared_distances their
+     * squared distances to the point, the neighbors at distance zero are
+     * left out (pcl::FPFHEstimation::weightPointSPFHSignature).
+     */
+    inline void weightSPFH(const std::vector<float> &spfh, const std::vector<int> &rows,
+            const std::vector<float> &squared_distances, float *histogram_out)
+    {
+        const int bins = 3 * detail::fpfh_bins;
+        double sums[3] = {0.0, 0.0, 0.0};
+        std::fill(histogram_out, histogram_out + bins, 0.0f);
+        for (std::size_t i=0; i<rows.size(); ++i)
+        {
+            if (squared_distances[i] == 0)
+                continue;
+
+            const float weight = static_cast<float>(1.0 / squared_distances[i]);
+            const float *row = &spfh[rows[i] * bins];
+            for (int j=0; j<bins; ++j)
+            {
+                const float value = row[j] * weight;
+                sums[j / detail::fpfh_bins] += value;
+                histogram_out[j] += value;
+            }
+        }
+
+        /** Each feature sums up to 100 **/
+        for (int f=0; f<3; ++f)
+        {
+            if (sums[f] != 0)
+                sums[f] = 100.0 / sums[f];
+            for (int j=f * detail::fpfh_bins; j<(f+1) * detail::fpfh_bins; ++j)
+                histogram_out[j] *= static_cast<float>(sums[f]);
+        }
+    }
+
+    /**@brief FPFH descriptors at the query points over a surface with normals
+     *
+     * Drop-in for pcl::FPFHEstimation with setSearchSurface(surface),
+     * setInputNormals(normals), setInputCloud(queries) and
+     * setRadiusSearch(radius). Queries without neighbors get NaN.
+     */
+    template <class PointType, class QueryType>
+    void computeFPFH(const typename pcl::PointCloud<PointType>::Ptr &surface_points,
+            const pcl::PointCloud<pcl::Normal> &normals, const pcl::PointCloud<QueryType> &queries,
+            const float radius, pcl::PointCloud<pcl::FPFHSignature33> &descriptors_out)
+    {
+        const int bins = 3 * detail::fpfh_bins;
+        pcl::search::KdTree<PointType> tree;
+        tree.setInputCloud(surface_points);
+
+        SurfaceBatch surface;
+        toSurfaceBatch(*surface_points, normals, surface);
+
+        /** Neighborhoods of the queries in the surface **/
+        std::vector< std::vector<int> > query_neighbors(queries.size());
+        std::vector< std::vector<float> > query_distances(queries.size());
+        detail::parallelFor(queries.size(), [&](const std::size_t i)
+        {
+            PointType query;
+            query.x = queries.points[i].x;
+            query.y = queries.points[i].y;
+            query.z = queries.points[i].z;
+            tree.radiusSearch(query, radius, query_neighbors[i], query_distances[i]);
+        });
+
+        /** One SPFH per surface point in any neighborhood **/
+        std::vector<int> spfh_points;
+        for (std::size_t i=0; i<queries.size(); ++i)
+            spfh_points.insert(spfh_points.end(), query_neighbors[i].begin(), query_neighbors[i].end());
+        std::sort(spfh_points.begin(), spfh_points.end());
+        spfh_points.erase(std::unique(spfh_points.begin(), spfh_points.end()), spfh_points.end());
+
+        std::vector<int> spfh_row(surface.size(), -1);
+        for (std::size_t row=0; row<spfh_points.size(); ++row)
+            spfh_row[spfh_points[row]] = row;
+
+        std::vector<float> spfh(spfh_points.size() * bins, 0.0f);
+        detail::parallelFor(spfh_points.size(), [&](const std::size_t row)
+        {
+            std::vector<int> neighbors;
+            std::vector<float> distances;
+            if (tree.radiusSearch(static_cast<int>(spfh_points[row]), radius, neighbors, distances) > 0)
+                computeSPFH(surface, spfh_points[row], neighbors, &spfh[row * bins]);
+        });
+
+        /** Weighted by the neighbors of each query **/
+        descriptors_out.points.resize(queries.size());
+        descriptors_out.width = queries.size();
+        descriptors_out.height = 1;
+        descriptors_out.is_dense = true;
+        detail::parallelFor(queries.size(), [&](const std::size_t i)
+        {
+            float *histogram = descriptors_out.points[i].histogram;
+            if (query_neighbors[i].empty())
+            {
+                std::fill(histogram, histogram + bins, std::numeric_limits<float>::quiet_NaN());
+                return;
+            }
+
+            std::vector<int> rows(query_neighbors[i].size());
+            for (std::size_t k=0; k<rows.size(); ++k)
+                rows[k] = spfh_row[query_neighbors[i][k]];
+            weightSPFH(spfh, rows, query_distances[i], histogram);
+        });
+
+        for (std::size_t i=0; i<queries.size(); ++i)
+        {
+            if (query_neighbors[i].empty())
+                descriptors_out.is_dense = false;
+        }
+    }
+
+}}
+
+#endif
@@ -0,0 +1,152 @@
+/**\file BinaryDescriptor.hpp
+ *
+ * Binarized FPFH descriptors matched by Hamming distance
+ *
+ * Each of the 33 bins of an FPFH is coded as a thermometer of five
+ * thresholds (165 bits in three 64 bit words): the Hamming distance of
+ * two codes is the L1 distance of the quantized histograms. A descriptor
+ * takes 24 bytes instead of 132 and a distance is three xor and
+ * popcount. On x86 built without -mpopcnt the search is compiled twice
+ * and the hardware popcnt version is picked at run time.
+ *
+ * @author Javier Hidalgo Carrio et. al
+ * See LICENSE for the license information
+ *
+ */
+
+
+#ifndef __ENVIRE_SAM_BINARY_DESCRIPTOR__
+#define __ENVIRE_SAM_BINARY_DESCRIPTOR__
+
+#include <vector>
+#include <limits>
+#include <cstddef>
+
+#include <boost/cstdint.hpp>
+
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+
+namespace envire { namespace sam
+{
+
+    struct BinaryFPFHSignature
+    {
+        boost::uint64_t bits[3];
+
+        BinaryFPFHSignature()
+        {
+            bits[0] = bits[1] = bits[2] = 0;
+        }
+    };
+
+    typedef std::vector<BinaryFPFHSignature> BinaryFPFHDescriptors;
+
+    /** Thresholds of the thermometer code of a bin (each histogram of 11 bins sums up to 100) **/
+    static const float binary_fpfh_thresholds[5] = {2.0f, 5.0f, 10.0f, 20.0f, 40.0f};
+
+    /** Invalid (NaN) histograms give an empty code **/
+    inline BinaryFPFHSignature binarizeFPFH(const pcl::FPFHSignature33 &descriptor)
+    {
+        BinaryFPFHSignature signature;
+        for (int j=0; j<33; ++j)
+        {
+            for (int t=0; t<5; ++t)
+            {
+                if (descriptor.histogram[j] > binary_fpfh_thresholds[t])
+                {
+                    const int bit = 5 * j + t;
+                    signature.bits[bit / 64] |= boost::uint64_t(1) << (bit % 64);
+                }
+            }
+        }
+        return signature;
+    }
+
+    inline void binarizeFPFH(const pcl::PointCloud<pcl::FPFHSignature33> &descriptors, BinaryFPFHDescriptors &signatures_out)
+    {
+        signatures_out.resize(descriptors.size());
+        for (std::size_t i=0; i<descriptors.size(); ++i)
+            signatures_out[i] = binarizeFPFH(descriptors.points[i]);
+    }
+
+    #if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && !defined(__POPCNT__)
+    #define ENVIRE_SAM_POPCNT_DISPATCH
+    #endif
+
+    #ifdef __GNUC__
+    __attribute__((always_inline))
+    #endif
+    inline int hammingDistance(const BinaryFPFHSignature &a, const BinaryFPFHSignature &b)
+    {
+        return __builtin_popcountll(a.bits[0] ^ b.bits[0]) +
+            __builtin_popcountll(a.bits[1] ^ b.bits[1]) +
+            __builtin_popcountll(a.bits[2] ^ b.bits[2]);
+    }
+
+    namespace detail
+    {
+        #ifdef __GNUC__
+        __attribute__((always_inline))
+        #endif
+        inline void hammingSearch(const BinaryFPFHDescriptors &source, const BinaryFPFHDescriptors &target,
+                std::vector<int> &correspondences_out, std::vector<float> &correspondence_scores_out)
+        {
+            correspondences_out.assign(source.size(), -1);
+            correspondence_scores_out.assign(source.size(), 3 * 64);
+            for (std::size_t i=0; i<source.size(); ++i)
+            {
+                int best_distance = std::numeric_limits<int>::max();
+                for (std::size_t j=0; j<target.size(); ++j)
+                {
+                    const int distance = hammingDistance(source[i], target[j]);
+                    if (distance < best_distance)
+                    {
+                        best_distance = distance;
+                        correspondences_out[i] = j;
+                    }
+                }
+                if (!target.empty())
+                    correspondence_scores_out[i] = best_distance;
+            }
+        }
+
+        #ifdef ENVIRE_SAM_POPCNT_DISPATCH
+        /** Same search with the popcnt instruction **/
+        __attribute__((target("popcnt")))
+        inline void hammingSearchPopcnt(const BinaryFPFHDescriptors &source, const BinaryFPFHDescriptors &target,
+                std::vector<int> &correspondences_out, std::vector<float> &correspondence_scores_out)
+        {
+            hammingSearch(source, target, correspondences_out, correspondence_scores_out);
+        }
+
+        inline bool cpuHasPopcnt()
+        {
+            static const bool popcnt = __builtin_cpu_supports("popcnt");
+            return popcnt;
+        }
+        #endif
+    }
+
+    /**@brief Nearest target of each source signature by exhaustive Hamming search
+     *
+     * Same outputs as the kd-tree search of the float descriptors: the
+     * index of the best target and its distance (-1 and the maximum
+     * distance if there are no targets).
+     */
+    inline void findHammingCorrespondences(const BinaryFPFHDescriptors &source, const BinaryFPFHDescriptors &target,
+            std::vector<int> &correspondences_out, std::vector<float> &correspondence_scores_out)
+    {
+        #ifdef ENVIRE_SAM_POPCNT_DISPATCH
+        if (detail::cpuHasPopcnt())
+        {
+            detail::hammingSearchPopcnt(source, target, correspondences_out, correspondence_scores_out);
+            return;
+        }
+        #endif
+        detail::hammingSearch(source, target, correspondences_out, correspondence_scores_out);
+    }
+
+}}
+
+#endif
@@ -9,6 +9,9 @@
 #ifndef __ENVIRE_CONFIGURATION__
 #define __ENVIRE_CONFIGURATION__
 
+#include <string>
+#include <cstddef>
+
 namespace envire { namespace sam
 {
     enum OutlierFilterType
@@ -18,6 +21,26 @@ namespace envire { namespace sam
         RADIUS
     };
 
+    enum SparsificationType
+    {
+        DENSE, //keep the dense marginal on the Markov blanket
+        CHOW_LIU //approximate the marginal with a Chow-Liu tree of relative constraints
+    };
+
+    enum DatasetFormat
+    {
+        G2O, //VERTEX_SE3:QUAT/EDGE_SE3:QUAT (and planar VERTEX_SE2/EDGE_SE2)
+        TORO //VERTEX3/EDGE3 (and planar VERTEX2/EDGE2)
+    };
+
+    enum EliminationOrderingType
+    {
+        COLAMD_ORDERING, //fill-reducing ordering of all the variables
+        LANDMARKS_FIRST, //landmarks before the poses (Schur complement on the poses)
+        RECENT_POSES_LAST, //the most recent poses at the root of the Bayes tree
+        GROUPED_ORDERING //user groups in increasing order, fill-reducing inside each group
+    };
+
     struct BilateralFilterParams
     {
         bool filterOn;
@@ -52,6 +75,289 @@ namespace envire { namespace sam
         float feature_radius;
     };
 
+    struct LandmarkCullingParams
+    {
+        bool cullingOn;
+
+        //landmarks observed by less than this number of frames are weak
+        unsigned int min_observations;
+
+        //weak landmarks not observed in the last max_age keyframes are culled
+        unsigned int max_age;
+
+        //mean chi-square error per observation above which a landmark is culled (<= 0 disables it)
+        double max_residual;
+
+        //trace of the landmark marginal covariance above which it carries too little information (<= 0 disables it)
+        double max_covariance_trace;
+
+        //marginalize the culled landmarks into their observing frames instead of removing them
+        bool marginalize;
+
+        LandmarkCullingParams()
+            :cullingOn(false), min_observations(3), max_age(10),
+            max_residual(0.0), max_covariance_trace(0.0), marginalize(false){}
+    };
+
+    struct SolverParams
+    {
+        //threads used to eliminate the cliques of the Bayes tree (<= 0 uses all cores, needs GTSAM with TBB)
+        int number_threads;
+
+        SolverParams()
+            :number_threads(0){}
+    };
+
+    struct MarginalizationParams
+    {
+        SparsificationType sparsification;
+
+        //added to the diagonal of the marginal information before inverting it
+        double regularization;
+
+        MarginalizationParams()
+            :sparsification(CHOW_LIU), regularization(1e-9){}
+    };
+
+    struct InitializationParams
+    {
+        //chordal relaxation of the rotations and linear translations (weighted by the information
+        //of the relative pose factors) before the nonlinear solve after a loop closure
+        bool chordalOn;
+
+        //relative pose factors between frames further apart than this are loop closures
+        unsigned int min_loop_size;
+
+        InitializationParams()
+            :chordalOn(false), min_loop_size(10){}
+    };
+
+    struct OrderingParams
+    {
+        EliminationOrderingType type;
+
+        //number of poses kept last in RECENT_POSES_LAST
+        unsigned int recent_poses;
+
+        OrderingParams()
+            :type(COLAMD_ORDERING), recent_poses(10){}
+    };
+
+    struct DiagnosticsParams
+    {
+        //record the error, step and residuals per factor type of each iteration
+        bool diagnosticsOn;
+
+        //binary log where each solve is appended (empty for no log)
+        std::string log_filename;
+
+        DiagnosticsParams()
+            :diagnosticsOn(false){}
+    };
+
+    struct TransactionParams
+    {
+        //chi-square significance of the staged factors to commit a transaction
+        double confidence;
+
+        TransactionParams()
+            :confidence(0.95){}
+    };
+
+    struct JournalParams
+    {
+        //directory of the journal segments, the snapshot and the point cloud payloads
+        std::string directory;
+
+        //seconds between syncs of the journal to disk (data which can be lost in a crash)
+        double flush_period;
+
+        //records appended since the last snapshot which trigger a compaction after optimize()
+        unsigned int compaction_records;
+
+        //minimum seconds between the compactions after optimize()
+        double compaction_period;
+
+        JournalParams()
+            :flush_period(1.0), compaction_records(10000), compaction_period(60.0){}
+    };
+
+    struct CandidateSearchParams
+    {
+        //probability that the frame position lies inside the search region
+        double confidence;
+
+        //maximum number of frames to search for correspondences, the closest first (0 is unlimited)
+        unsigned int max_candidates;
+
+        CandidateSearchParams()
+            :confidence(0.95), max_candidates(0){}
+    };
+
+    struct LatencyParams
+    {
+        //adapt the point cloud, keypoint and search parameters to the latency of the frames
+        bool controllerOn;
+
+        //seconds of a frame: pushPointCloud, computeKeypoints and detectLandmarks (with its optimization)
+        double target_latency;
+
+        //fraction of the (logarithmic) latency error corrected after each frame
+        double gain;
+
+        //bounds of the voxel size of the downsampling
+        float min_downsample_size;
+        float max_downsample_size;
+
+        //bounds of the SIFT minimum contrast (a higher contrast gives fewer keypoints)
+        float min_keypoint_contrast;
+        float max_keypoint_contrast;
+
+        //bounds of the radius of the feature descriptors
+        float min_feature_radius;
+        float max_feature_radius;
+
+        //bounds of the number of candidate frames to search for correspondences
+        unsigned int min_candidates;
+        unsigned int max_candidates;
+
+        LatencyParams()
+            :controllerOn(false), target_latency(0.1), gain(0.5),
+            min_downsample_size(0.01), max_downsample_size(0.1),
+            min_keypoint_contrast(5.0), max_keypoint_contrast(30.0),
+            min_feature_radius(0.5), max_feature_radius(1.0),
+            min_candidates(2), max_candidates(10){}
+    };
+
+    struct LoadSheddingParams
+    {
+        //shed work of the frame pipeline while overloaded
+        bool sheddingOn;
+
+        //overloaded when the last frame took longer than this in seconds (0 to ignore)
+        double max_latency;
+
+        //overloaded when this many asynchronous calls wait in the executor (0 to ignore)
+        unsigned int max_queue_depth;
+
+        //drop the point clouds pushed to a frame which already has one
+        bool drop_clouds;
+
+        //skip the statistical outlier removal of the pushed point clouds
+        bool skip_outlier_removal;
+
+        //compute the keypoints of the frame when the executor is idle (the frame is not searched for landmarks)
+        bool defer_keypoints;
+
+        //maximum number of candidate frames to search (0 to keep the candidate search parameters)
+        unsigned int max_candidates;
+
+        LoadSheddingParams()
+            :sheddingOn(false), max_latency(0.2), max_queue_depth(4),
+            drop_clouds(true), skip_outlier_removal(true), defer_keypoints(true),
+            max_candidates(3){}
+    };
+
+    struct PointBudgetParams
+    {
+        //choose the voxel size of each pushed point cloud to store about target_points per frame
+        bool budgetOn;
+
+        //points per frame
+        unsigned int target_points;
+
+        //accepted relative distance to the target
+        double tolerance;
+
+        //bounds of the voxel size in meters
+        float min_leaf_size;
+        float max_leaf_size;
+
+        //maximum number of voxel sizes evaluated per point cloud
+        unsigned int max_iterations;
+
+        PointBudgetParams()
+            :budgetOn(false), target_points(20000), tolerance(0.1),
+            min_leaf_size(0.005), max_leaf_size(0.5), max_iterations(10){}
+    };
+
+    struct OverlapKeypointParams
+    {
+        //compute keypoints only in the regions not covered by the keypoints of the recent frames
+        bool overlapOn;
+
+        //voxel size of the covered regions in meters
+        float voxel_size;
+
+        //previous keyframes whose keypoints (own or linked) cover the regions
+        unsigned int recent_frames;
+
+        OverlapKeypointParams()
+            :overlapOn(false), voxel_size(0.25), recent_frames(3){}
+    };
+
+    struct NormalMapParams
+    {
+        //normals of the keypoints from the running moments of the voxels instead of a radius search
+        bool normalMapOn;
+
+        //voxel size in meters, the normal of a point uses the eight voxels around it (a neighborhood
+        //of about one voxel in each direction): it sets the scale of the map normals instead of the
+        //normal_radius of PFHFeatureParams, which only applies to the points with too few neighbors
+        float voxel_size;
+
+        //minimum number of points around a point to use its normal, otherwise it is computed
+        unsigned int min_points;
+
+        NormalMapParams()
+            :normalMapOn(false), voxel_size(0.2), min_points(5){}
+    };
+
+    struct BinaryDescriptorParams
+    {
+        //binarized FPFH at the keypoints, matched by Hamming distance instead of a kd-tree search
+        bool binaryOn;
+
+        //keep the float FPFH of the frames too (the binary descriptors take 24 bytes instead of 132)
+        bool keep_fpfh;
+
+        BinaryDescriptorParams()
+            :binaryOn(false), keep_fpfh(true){}
+    };
+
+    struct MemoryGovernorParams
+    {
+        //keep the memory of ESAM within the budget after each point cloud and optimization
+        bool governorOn;
+
+        //hard budget in bytes (as estimated by memoryUsage())
+        std::size_t budget;
+
+        //fractions of the budget above which each action applies, in this order
+        double compress_threshold; //quantize the point clouds of the old frames
+        double spill_threshold; //move the quantized point clouds to the spill directory
+        double cull_threshold; //cull the landmarks given the landmark culling parameters
+        double marginalize_threshold; //marginalize the old keyframes
+        //above the budget the sensor data of the oldest frames is dropped
+
+        //quantization step of the compressed point clouds in meters
+        float compression_resolution;
+
+        //directory for the spilled point clouds (empty for no spilling)
+        std::string spill_directory;
+
+        //most recent keyframes which are never compressed, spilled, marginalized or dropped
+        unsigned int keep_frames;
+
+        //keyframes marginalized at once
+        unsigned int marginalize_frames;
+
+        MemoryGovernorParams()
+            :governorOn(false), budget(std::size_t(2) << 30),
+            compress_threshold(0.5), spill_threshold(0.7), cull_threshold(0.85), marginalize_threshold(0.95),
+            compression_resolution(0.005), keep_frames(10), marginalize_frames(10){}
+    };
+
 }}
 
 #endif
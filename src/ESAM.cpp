@@ -9,6 +9,8 @@
 
 #include "ESAM.hpp"
 
+#include <boost/math/distributions/chi_squared.hpp>
+
 #ifndef D2R
 #define D2R M_PI/180.00 /** Convert degree to radian **/
 #endif
@@ -22,6 +24,326 @@ using namespace envire::sam;
 
 static const gtsam::Symbol invalid_symbol('u', 0);
 
+/** Swap the rotation and translation blocks between GTSAM (rotation first) and base (translation first) covariances **/
+static base::Matrix6d swapCovarianceBlocks(const base::Matrix6d &cov)
+{
+    base::Matrix6d swapped;
+    swapped << cov.block<3,3>(3,3), cov.block<3,3>(3,0),
+            cov.block<3,3>(0,3), cov.block<3,3>(0,0);
+    return swapped;
+}
+
+/** Order search candidates by their optimistic distance **/
+static bool closerCandidate(const std::pair<double, boost::shared_ptr<gtsam::Symbol> > &a,
+        const std::pair<double, boost::shared_ptr<gtsam::Symbol> > &b)
+{
+    return a.first < b.first;
+}
+
+namespace
+{
+
+/** Adds the time of a scope to a pipeline stage **/
+class StageTimer
+{
+private:
+    double &seconds;
+    std::chrono::steady_clock::time_point start;
+
+public:
+    explicit StageTimer(double &stage_seconds)
+        :seconds(stage_seconds), start(std::chrono::steady_clock::now()){}
+
+    ~StageTimer()
+    {
+        seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+};
+
+}
+
+/** Voxels of the given size with at least one point, as counted by the voxel grid filter **/
+static std::size_t occupiedVoxels(const PCLPointCloud &points, const float leaf_size)
+{
+    const float inverse_leaf = 1.0 / leaf_size;
+    std::unordered_set<boost::uint64_t> voxels;
+    voxels.reserve(points.size());
+    for(std::size_t i=0; i<points.size(); ++i)
+    {
+        const PointType &point = points.points[i];
+        if (!std::isfinite(point.x) || !std::isfinite(point.y) || !std::isfinite(point.z))
+            continue;
+
+        voxels.insert(voxelKey(point.x, point.y, point.z, inverse_leaf));
+    }
+    return voxels.size();
+}
+
+/**@brief Normals from the covariance of the radius neighborhood of the query points (all if empty)
+ *
+ * Covariances and eigenproblems are solved in batches, see
+ * BatchEigenSolver.hpp. The normals point towards the sensor origin and
+ * are NaN with fewer than three neighbors, as pcl::NormalEstimation.
+ */
+static void batchNormals(const PCLPointCloud::Ptr &points, const std::vector<int> &queries,
+        const float radius, pcl::PointCloud<pcl::Normal> &normals_out)
+{
+    const std::size_t number_queries = queries.empty() ? points->size() : queries.size();
+
+    pcl::search::KdTree<PointType> tree;
+    tree.setInputCloud(points);
+
+    std::vector<int> indices, neighbors;
+    std::vector<float> distances;
+    std::vector<std::size_t> offsets(1, 0);
+    offsets.reserve(number_queries + 1);
+    for(std::size_t i=0; i<number_queries; ++i)
+    {
+        const PointType &query = points->points[queries.empty() ? i : queries[i]];
+        if (std::isfinite(query.x) && std::isfinite(query.y) && std::isfinite(query.z))
+        {
+            tree.radiusSearch(query, radius, neighbors, distances);
+            indices.insert(indices.end(), neighbors.begin(), neighbors.end());
+        }
+        offsets.push_back(indices.size());
+    }
+
+    PointBatch point_batch;
+    CovarianceBatch covariances;
+    NormalBatch normals;
+    toPointBatch(*points, point_batch);
+    accumulateCovariances(point_batch, indices, offsets, covariances);
+    solveNormals(covariances, normals);
+
+    normals_out.points.resize(number_queries);
+    for(std::size_t i=0; i<number_queries; ++i)
+    {
+        const PointType &query = points->points[queries.empty() ? i : queries[i]];
+        const double sign = (normals.x[i] * query.x + normals.y[i] * query.y + normals.z[i] * query.z > 0.0) ? -1.0 : 1.0;
+        pcl::Normal &normal = normals_out.points[i];
+        normal.normal_x = sign * normals.x[i];
+        normal.normal_y = sign * normals.y[i];
+        normal.normal_z = sign * normals.z[i];
+        normal.curvature = normals.curvature[i];
+    }
+    normals_out.width = number_queries;
+    normals_out.height = 1;
+}
+
+/** Information of the out-of-plane components when lifting planar datasets to 3D **/
+static const double planar_information = 1e6;
+
+/** Read the upper triangular part of a symmetric matrix row by row **/
+static bool readUpperTriangular(std::istream &stream, base::Matrix6d &matrix)
+{
+    for (register int i=0; i<6; ++i)
+    {
+        for (register int j=i; j<6; ++j)
+        {
+            if (!(stream >> matrix(i,j)))
+                return false;
+            matrix(j,i) = matrix(i,j);
+        }
+    }
+    return true;
+}
+
+static void writeUpperTriangular(std::ostream &stream, const base::Matrix6d &matrix)
+{
+    for (register int i=0; i<6; ++i)
+    {
+        for (register int j=i; j<6; ++j)
+        {
+            stream<<" "<<matrix(i,j);
+        }
+    }
+}
+
+/** Lift a planar (x, y, theta) information to the GTSAM (rotation, translation) ordering **/
+static base::Matrix6d liftPlanarInformation(const Eigen::Matrix3d &planar)
+{
+    const int idx[3] = {3, 4, 2};
+    base::Matrix6d information(base::Matrix6d::Zero());
+    information.diagonal() << planar_information, planar_information, 0.0, 0.0, 0.0, planar_information;
+    for (register int i=0; i<3; ++i)
+    {
+        for (register int j=0; j<3; ++j)
+        {
+            information(idx[i], idx[j]) = planar(i,j);
+        }
+    }
+    return information;
+}
+
+/** Category of a factor and optionally the size of its object **/
+static FactorType factorType(const gtsam::NonlinearFactor *factor, std::size_t *object_size = NULL)
+{
+    FactorType type = OTHER_FACTOR;
+    std::size_t size = sizeof(gtsam::NonlinearFactor);
+    if (dynamic_cast<const gtsam::PriorFactor<gtsam::Pose3>*>(factor))
+    {
+        type = PRIOR_FACTOR; size = sizeof(gtsam::PriorFactor<gtsam::Pose3>);
+    }
+    else if (dynamic_cast<const gtsam::BetweenFactor<gtsam::Pose3>*>(factor))
+    {
+        type = BETWEEN_FACTOR; size = sizeof(gtsam::BetweenFactor<gtsam::Pose3>);
+    }
+    else if (dynamic_cast<const gtsam::BetweenFactor<gtsam::Point3>*>(factor))
+    {
+        type = BETWEEN_FACTOR; size = sizeof(gtsam::BetweenFactor<gtsam::Point3>);
+    }
+    else if (dynamic_cast<const LandmarkFactor*>(factor))
+    {
+        type = LANDMARK_FACTOR; size = sizeof(LandmarkFactor);
+    }
+    else if (dynamic_cast<const gtsam::BearingRangeFactor<gtsam::Pose2, gtsam::Point2>*>(factor))
+    {
+        type = BEARING_RANGE_FACTOR; size = sizeof(gtsam::BearingRangeFactor<gtsam::Pose2, gtsam::Point2>);
+    }
+    else if (dynamic_cast<const gtsam::LinearContainerFactor*>(factor))
+    {
+        type = LINEAR_FACTOR; size = sizeof(gtsam::LinearContainerFactor);
+    }
+
+    if (object_size)
+        *object_size = size;
+    return type;
+}
+
+/** Error and residuals per factor type of the graph at the given values **/
+static IterationDiagnostics iterationDiagnostics(const gtsam::NonlinearFactorGraph &graph,
+        const gtsam::Values &values, const double step_norm)
+{
+    IterationDiagnostics iteration;
+    iteration.step_norm = step_norm;
+    for(gtsam::NonlinearFactorGraph::const_iterator it = graph.begin(); it != graph.end(); ++it)
+    {
+        if (!(*it))
+            continue;
+        const double error = (*it)->error(values);
+        iteration.error += error;
+        iteration.residuals[factorType((*it).get())].add(2.0 * error);
+    }
+    return iteration;
+}
+
+/** Journal encoding of the geometry **/
+static void writePose3(JournalRecord &record, const gtsam::Pose3 &pose)
+{
+    record.writeMatrix(pose.translation().vector());
+    record.writeMatrix(pose.rotation().toQuaternion().coeffs());
+}
+
+static bool readPose3(JournalRecord &record, gtsam::Pose3 &pose)
+{
+    Eigen::Vector3d translation;
+    Eigen::Vector4d coeffs;
+    if (!record.readMatrix(translation) || !record.readMatrix(coeffs))
+        return false;
+    pose = gtsam::Pose3(gtsam::Rot3(Eigen::Quaterniond(coeffs[3], coeffs[0], coeffs[1], coeffs[2])), gtsam::Point3(translation));
+    return true;
+}
+
+static void writeTransformWithCovariance(JournalRecord &record, const base::TransformWithCovariance &pose_with_cov)
+{
+    record.writeMatrix(pose_with_cov.translation);
+    record.writeMatrix(pose_with_cov.orientation.coeffs());
+    record.writeMatrix(pose_with_cov.cov);
+}
+
+static bool readTransformWithCovariance(JournalRecord &record, base::TransformWithCovariance &pose_with_cov)
+{
+    Eigen::Vector4d coeffs;
+    if (!record.readMatrix(pose_with_cov.translation) || !record.readMatrix(coeffs) ||
+            !record.readMatrix(pose_with_cov.cov))
+        return false;
+    pose_with_cov.orientation = Eigen::Quaterniond(coeffs[3], coeffs[0], coeffs[1], coeffs[2]);
+    return true;
+}
+
+static gtsam::Matrix noiseCovariance(const gtsam::SharedNoiseModel &model, const size_t dim)
+{
+    gtsam::noiseModel::Gaussian::shared_ptr gaussian = boost::dynamic_pointer_cast<gtsam::noiseModel::Gaussian>(model);
+    if (!gaussian)
+        return gtsam::Matrix::Identity(dim, dim);
+    return gaussian->covariance();
+}
+
+/** Envire edge of a factor, if any, so the replay restores the transform graph too **/
+static void writeEdge(JournalRecord &record, const envire::core::EnvireGraph &graph,
+        const gtsam::Key key1, const gtsam::Key key2)
+{
+    const gtsam::Symbol frame1(key1), frame2(key2);
+    const boost::uint8_t edge = graph.containsEdge(frame1, frame2);
+    record.write(edge);
+    if (edge)
+    {
+        const envire::core::Transform tf = graph.getTransform(frame1, frame2);
+        record.write(static_cast<boost::int64_t>(tf.time.toMicroseconds()));
+        writeTransformWithCovariance(record, tf.transform);
+    }
+}
+
+static bool readEdge(JournalRecord &record, envire::core::EnvireGraph &graph,
+        const gtsam::Key key1, const gtsam::Key key2, base::Time *edge_time = NULL)
+{
+    boost::uint8_t edge = 0;
+    if (!record.read(edge))
+        return false;
+    if (!edge)
+        return true;
+
+    boost::int64_t time = 0;
+    base::TransformWithCovariance transform;
+    if (!record.read(time) || !readTransformWithCovariance(record, transform))
+        return false;
+
+    const gtsam::Symbol frame1(key1), frame2(key2);
+    if (!graph.containsEdge(frame1, frame2))
+        graph.addTransform(frame1, frame2, envire::core::Transform(base::Time::fromMicroseconds(time), transform));
+    if (edge_time)
+        *edge_time = base::Time::fromMicroseconds(time);
+    return true;
+}
+
+/** Point cloud payload: uint32 width, uint32 height, then x, y, z (float) and rgba (uint32) per point **/
+static void writePointCloud(std::ostream &stream, const PCLPointCloud &cloud)
+{
+    const boost::uint32_t width = cloud.width, height = cloud.height;
+    stream.write(reinterpret_cast<const char*>(&width), sizeof(width));
+    stream.write(reinterpret_cast<const char*>(&height), sizeof(height));
+    for (size_t i=0; i<cloud.size(); ++i)
+    {
+        const PointType &point = cloud.points[i];
+        stream.write(reinterpret_cast<const char*>(&point.x), sizeof(float));
+        stream.write(reinterpret_cast<const char*>(&point.y), sizeof(float));
+        stream.write(reinterpret_cast<const char*>(&point.z), sizeof(float));
+        stream.write(reinterpret_cast<const char*>(&point.rgba), sizeof(boost::uint32_t));
+    }
+}
+
+static bool readPointCloud(const std::string &filename, PCLPointCloud &cloud)
+{
+    std::ifstream stream(filename.c_str(), std::ios::binary);
+    boost::uint32_t width = 0, height = 0;
+    if (!stream.read(reinterpret_cast<char*>(&width), sizeof(width)) ||
+            !stream.read(reinterpret_cast<char*>(&height), sizeof(height)))
+        return false;
+
+    cloud.points.resize(static_cast<size_t>(width) * height);
+    for (size_t i=0; i<cloud.points.size(); ++i)
+    {
+        PointType &point = cloud.points[i];
+        stream.read(reinterpret_cast<char*>(&point.x), sizeof(float));
+        stream.read(reinterpret_cast<char*>(&point.y), sizeof(float));
+        stream.read(reinterpret_cast<char*>(&point.z), sizeof(float));
+        stream.read(reinterpret_cast<char*>(&point.rgba), sizeof(boost::uint32_t));
+    }
+    cloud.width = width;
+    cloud.height = height;
+    return static_cast<bool>(stream);
+}
+
 ESAM::ESAM()
 {
     base::Pose pose;
@@ -133,6 +455,16 @@ void ESAM::init(const ::base::TransformWithCovariance &pose_with_cov,
     this->landmark_key = landmark_key;
     this->pose_idx = 0;
     this->landmark_idx = 0;
+    this->loop_closure_pending = false;
+    this->journal_records = 0;
+    this->budget_leaf_size = downsample_size;
+
+    /** Fast pose starts at the prior **/
+    this->pose_times.assign(1, base::Time());
+    this->odometry_deltas.clear();
+    FastPose prior_pose;
+    prior_pose.pose = base::TransformWithCovariance(pose_with_cov.translation, pose_with_cov.orientation, swapCovarianceBlocks(pose_with_cov.cov));
+    this->fast_pose.store(prior_pose);
 
 
     /** Filter and outlier parameters **/
@@ -184,6 +516,16 @@ void ESAM::init(const ::base::Pose &pose, const ::base::Matrix6d &cov_pose,
     this->landmark_key = landmark_key;
     this->pose_idx = 0;
     this->landmark_idx = 0;
+    this->loop_closure_pending = false;
+    this->journal_records = 0;
+    this->budget_leaf_size = downsample_size;
+
+    /** Fast pose starts at the prior **/
+    this->pose_times.assign(1, base::Time());
+    this->odometry_deltas.clear();
+    FastPose prior_pose;
+    prior_pose.pose = base::TransformWithCovariance(pose.position, pose.orientation, swapCovarianceBlocks(cov_pose));
+    this->fast_pose.store(prior_pose);
 
     /** Filter and outlier parameters **/
     this->bfilter_paramaters = bfilter;
@@ -231,6 +573,16 @@ void ESAM::init(const ::base::Pose &pose, const ::base::Vector6d &var_pose,
     this->landmark_key = landmark_key;
     this->pose_idx = 0;
     this->landmark_idx = 0;
+    this->loop_closure_pending = false;
+    this->journal_records = 0;
+    this->budget_leaf_size = downsample_size;
+
+    /** Fast pose starts at the prior **/
+    this->pose_times.assign(1, base::Time());
+    this->odometry_deltas.clear();
+    FastPose prior_pose;
+    prior_pose.pose = base::TransformWithCovariance(pose.position, pose.orientation, swapCovarianceBlocks(base::Matrix6d(var_pose.asDiagonal())));
+    this->fast_pose.store(prior_pose);
 
     /** Filter and outlier parameters **/
     this->bfilter_paramaters = bfilter;
@@ -257,7 +609,39 @@ void ESAM::init(const ::base::Pose &pose, const ::base::Vector6d &var_pose,
 
 ESAM::~ESAM()
 {
+    /** Finish the submitted calls while the state is still there **/
+    this->executor.shutdown();
     this->marginals.reset();
+
+    /** Spilled point clouds do not outlive the map **/
+    for(unsigned long int i=0; i<this->pose_idx+1; ++i)
+    {
+        gtsam::Symbol frame_id(this->pose_key, i);
+        if (this->_transform_graph.containsFrame(frame_id) &&
+                this->_transform_graph.containsItems<envire::sam::CompressedPointCloudItem>(frame_id))
+        {
+            const CompressedPointCloud &compressed = this->_transform_graph.getItem<envire::sam::CompressedPointCloudItem>(frame_id)->getData();
+            if (compressed.spilled())
+                std::remove(compressed.spill_file.c_str());
+        }
+    }
+}
+
+bool ESAM::containsTransform(const gtsam::Symbol &frame1, const gtsam::Symbol &frame2)
+{
+    /** envire adds the inverse edge too **/
+    return this->_transform_graph.containsFrame(frame1) && this->_transform_graph.containsFrame(frame2) &&
+        this->_transform_graph.containsEdge(frame1, frame2);
+}
+
+bool ESAM::marginalizedFactor(const gtsam::Symbol &frame1, const gtsam::Symbol &frame2)
+{
+    if (!this->marginalized_frames.count(frame1) && !this->marginalized_frames.count(frame2))
+        return false;
+
+    std::cerr<<"[FACTOR] Factor between "<<static_cast<std::string>(frame1)<<" and "<<static_cast<std::string>(frame2)
+        <<" involves a marginalized frame\n";
+    return true;
 }
 
 void ESAM::insertPoseFactor(const char key1, const unsigned long int &idx1,
@@ -265,20 +649,40 @@ void ESAM::insertPoseFactor(const char key1, const unsigned long int &idx1,
                 const base::Time &time, const ::base::Pose &delta_pose,
                 const ::base::Vector6d &var_delta_pose)
 {
+    this->executor.drain();
+
     /** Symbols **/
     gtsam::Symbol symbol1 = gtsam::Symbol(key1, idx1);
     gtsam::Symbol symbol2 = gtsam::Symbol(key2, idx2);
 
+    if (this->marginalizedFactor(symbol1, symbol2))
+        return;
+
+    /** Closing a loop **/
+    if (key1 == key2 && std::max(idx1, idx2) - std::min(idx1, idx2) >= this->initialization_parameters.min_loop_size)
+        this->loop_closure_pending = true;
+
+    if (key2 == this->pose_key)
+        this->stampPose(idx2, time);
+
     /** Add the delta pose to the factor graph **/
     this->_factor_graph.add(gtsam::BetweenFactor<gtsam::Pose3>(symbol1, symbol2,
                 gtsam::Pose3(gtsam::Rot3(delta_pose.orientation), gtsam::Point3(delta_pose.position)),
                 gtsam::noiseModel::Diagonal::Variances(var_delta_pose)));
 
-    /** Add the delta pose transformation to envire **/
-    ::base::Matrix6d cov(base::Matrix6d::Identity());
-    cov.diagonal() = var_delta_pose;
-    envire::core::Transform tf(time, delta_pose.position, delta_pose.orientation, cov);
-    this->_transform_graph.addTransform(symbol1, symbol2, tf);
+    /** Add the delta pose transformation to envire, one edge per pair of frames (repeated measurements are factors only) **/
+    if (!this->containsTransform(symbol1, symbol2))
+    {
+        ::base::Matrix6d cov(base::Matrix6d::Identity());
+        cov.diagonal() = var_delta_pose;
+        envire::core::Transform tf(time, delta_pose.position, delta_pose.orientation, cov);
+        this->_transform_graph.addTransform(symbol1, symbol2, tf);
+
+        if (this->transaction.open)
+            this->transaction.transforms.push_back(std::make_pair(symbol1, symbol2));
+    }
+
+    this->journalFactor(this->_factor_graph.back());
 }
 
 void ESAM::insertPoseFactor(const char key1, const unsigned long int &idx1,
@@ -286,18 +690,38 @@ void ESAM::insertPoseFactor(const char key1, const unsigned long int &idx1,
                 const base::Time &time, const ::base::Pose &delta_pose,
                 const ::base::Matrix6d &cov_delta_pose)
 {
+    this->executor.drain();
+
     /** Symbols **/
     gtsam::Symbol symbol1 = gtsam::Symbol(key1, idx1);
     gtsam::Symbol symbol2 = gtsam::Symbol(key2, idx2);
 
+    if (this->marginalizedFactor(symbol1, symbol2))
+        return;
+
+    /** Closing a loop **/
+    if (key1 == key2 && std::max(idx1, idx2) - std::min(idx1, idx2) >= this->initialization_parameters.min_loop_size)
+        this->loop_closure_pending = true;
+
+    if (key2 == this->pose_key)
+        this->stampPose(idx2, time);
+
     /** Add the delta pose to the factor graph **/
     this->_factor_graph.add(gtsam::BetweenFactor<gtsam::Pose3>(symbol1, symbol2,
                 gtsam::Pose3(gtsam::Rot3(delta_pose.orientation), gtsam::Point3(delta_pose.position)),
                 gtsam::noiseModel::Gaussian::Covariance(cov_delta_pose)));
 
-    /** Add the delta pose transformation to envire **/
-    envire::core::Transform tf(time, delta_pose.position, delta_pose.orientation, cov_delta_pose);
-    this->_transform_graph.addTransform(symbol1, symbol2, tf);
+    /** Add the delta pose transformation to envire, one edge per pair of frames (repeated measurements are factors only) **/
+    if (!this->containsTransform(symbol1, symbol2))
+    {
+        envire::core::Transform tf(time, delta_pose.position, delta_pose.orientation, cov_delta_pose);
+        this->_transform_graph.addTransform(symbol1, symbol2, tf);
+
+        if (this->transaction.open)
+            this->transaction.transforms.push_back(std::make_pair(symbol1, symbol2));
+    }
+
+    this->journalFactor(this->_factor_graph.back());
 
 }
 
@@ -306,10 +730,15 @@ void ESAM::insertBearingRangeFactor(const char p_key, const unsigned long int &p
                 const base::Time &time, const double &bearing_angle, const double &range_distance,
                 const ::base::Vector2d &var_measurement)
 {
+    this->executor.drain();
+
     /** Symbols **/
     gtsam::Symbol p_symbol = gtsam::Symbol(p_key, p_idx);
     gtsam::Symbol l_symbol = gtsam::Symbol(l_key, l_idx);
 
+    if (this->marginalizedFactor(p_symbol, l_symbol))
+        return;
+
     /** Add the measurement to the factor graph **/
     this->_factor_graph.add(gtsam::BearingRangeFactor<gtsam::Pose2, gtsam::Point2>(p_symbol, l_symbol,
                 gtsam::Rot2(bearing_angle),
@@ -323,6 +752,11 @@ void ESAM::insertBearingRangeFactor(const char p_key, const unsigned long int &p
     envire::core::Transform tf(time, Eigen::Vector3d(range_distance, 0, 0), orient, cov);
     this->_transform_graph.addTransform(p_symbol, l_symbol, tf);
 
+    if (this->transaction.open)
+        this->transaction.transforms.push_back(std::make_pair(p_symbol, l_symbol));
+
+    this->journalFactor(this->_factor_graph.back());
+
 }
 
 void ESAM::insertLandmarkFactor(const char p_key, const unsigned long int &p_idx,
@@ -330,10 +764,15 @@ void ESAM::insertLandmarkFactor(const char p_key, const unsigned long int &p_idx
                 const base::Time &time, const base::Vector3d &measurement,
                 const ::base::Vector3d &var_measurement)
 {
+    this->executor.drain();
+
     /** Symbols **/
     gtsam::Symbol p_symbol = gtsam::Symbol(p_key, p_idx);
     gtsam::Symbol l_symbol = gtsam::Symbol(l_key, l_idx);
 
+    if (this->marginalizedFactor(p_symbol, l_symbol))
+        return;
+
     /** Add the measurement to the factor graph **/
     this->_factor_graph.add(LandmarkFactor(p_symbol, l_symbol, gtsam::Point3(measurement),
                 gtsam::noiseModel::Diagonal::Variances(var_measurement)));
@@ -344,6 +783,11 @@ void ESAM::insertLandmarkFactor(const char p_key, const unsigned long int &p_idx
     envire::core::Transform tf(time, measurement, Eigen::Quaterniond::Identity(), cov);
     this->_transform_graph.addTransform(p_symbol, l_symbol, tf);
 
+    if (this->transaction.open)
+        this->transaction.transforms.push_back(std::make_pair(p_symbol, l_symbol));
+
+    this->journalFactor(this->_factor_graph.back());
+
 }
 
 void ESAM::addDeltaPoseFactor(const base::Time &time, const ::Eigen::Affine3d &delta_tf, const ::base::Vector6d &var_delta_tf)
@@ -392,11 +836,15 @@ void ESAM::addLandmarkFactor(const char p_key, const unsigned long int &p_idx, c
 
 void ESAM::insertPoseValue(const std::string &frame_id, const ::base::TransformWithCovariance &pose_with_cov)
 {
+    this->executor.drain();
+
     try
     {
         envire::sam::PoseItem::Ptr pose_item(new envire::sam::PoseItem());
         pose_item->setData(pose_with_cov);
         this->_transform_graph.addItemToFrame(frame_id, pose_item);
+        this->transactionItem(pose_item);
+        this->journalValue(frame_id, pose_with_cov);
 
     }catch(envire::core::UnknownFrameException &ufex)
     {
@@ -408,12 +856,16 @@ void ESAM::insertPoseValue(const std::string &frame_id, const ::base::TransformW
 void ESAM::insertPoseValue(const char key, const unsigned long int &idx,
         const ::base::TransformWithCovariance &pose_with_cov)
 {
+    this->executor.drain();
+
     gtsam::Symbol symbol = gtsam::Symbol(key, idx);
     try
     {
         envire::sam::PoseItem::Ptr pose_item(new envire::sam::PoseItem());
         pose_item->setData(pose_with_cov);
         this->_transform_graph.addItemToFrame(symbol, pose_item);
+        this->transactionItem(pose_item);
+        this->journalValue(symbol, pose_with_cov);
 
     }catch(envire::core::UnknownFrameException &ufex)
     {
@@ -425,6 +877,8 @@ void ESAM::insertPoseValue(const char key, const unsigned long int &idx,
 void ESAM::insertPoseValue(const char key, const unsigned long int &idx,
         const ::base::Pose &pose, const ::base::Matrix6d &cov_pose)
 {
+    this->executor.drain();
+
     gtsam::Symbol symbol = gtsam::Symbol(key, idx);
     try
     {
@@ -432,6 +886,8 @@ void ESAM::insertPoseValue(const char key, const unsigned long int &idx,
         base::TransformWithCovariance pose_with_cov(pose.position, pose.orientation, cov_pose);
         pose_item->setData(pose_with_cov);
         this->_transform_graph.addItemToFrame(symbol, pose_item);
+        this->transactionItem(pose_item);
+        this->journalValue(symbol, pose_with_cov);
 
     }catch(envire::core::UnknownFrameException &ufex)
     {
@@ -442,12 +898,16 @@ void ESAM::insertPoseValue(const char key, const unsigned long int &idx,
 void ESAM::insertLandmarkValue(const char l_key, const unsigned long int &l_idx,
          const ::base::Vector3d &measurement)
 {
+    this->executor.drain();
+
     gtsam::Symbol symbol = gtsam::Symbol(l_key, l_idx);
     try
     {
         envire::sam::LandmarkItem::Ptr landmark_item(new envire::sam::LandmarkItem());
         landmark_item->setData(measurement);
         this->_transform_graph.addItemToFrame(symbol, landmark_item);
+        this->transactionItem(landmark_item);
+        this->journalValue(symbol, measurement);
 
     }catch(envire::core::UnknownFrameException &ufex)
     {
@@ -504,283 +964,2535 @@ const std::string ESAM::currentLandmarkId()
 
 void ESAM::optimize()
 {
-    gtsam::Values initialEstimate;
+    this->optimizeAsync().get();
+}
 
-    std::cout<<"GETTING THE ESTIMATES\n";
+std::future<void> ESAM::optimizeAsync()
+{
+    return this->executor.submit(std::bind(&ESAM::runOptimize, this));
+}
 
-    /** Initial estimates for poses **/
-    for(register unsigned int i=0; i<this->pose_idx+1; ++i)
+void ESAM::runOptimize()
+{
+    StageTimer timer(this->latency_statistics.current.stages[OPTIMIZE_STAGE]);
+
+    /** Staged factors are solved when the transaction is committed **/
+    if (this->transaction.open)
     {
-        gtsam::Symbol frame_id(this->pose_key, i);
-        //frame_id.print();
-        try
-        {
-            /** Get Item return an iterator to the first element **/
-            envire::sam::PoseItem &pose_item = *(this->_transform_graph.getItem<envire::sam::PoseItem>(frame_id));
-            gtsam::Pose3 pose(gtsam::Rot3(pose_item.getData().orientation), gtsam::Point3(pose_item.getData().translation));
-            initialEstimate.insert(frame_id, pose);
-        }catch(envire::core::UnknownFrameException &ufex)
-        {
-            std::cerr << ufex.what() << std::endl;
-            return;
-        }
+        std::cout<<"OPTIMIZATION DEFERRED TO THE COMMIT OF THE TRANSACTION\n";
+        return;
     }
 
-    /** Initial estimates for landmarks **/
-    for(register unsigned int i=0; i<this->landmark_idx; ++i)
+    gtsam::Values initialEstimate;
+
+    std::cout<<"GETTING THE ESTIMATES\n";
+
+    /** Initial estimates for the poses and landmarks in the factor graph **/
+    try
     {
-        gtsam::Symbol frame_id(this->landmark_key, i);
-        //frame_id.print();
-        try
-        {
-            /** Get Item return an iterator to the first element **/
-            envire::sam::LandmarkItem &landmark_item =
-                *(this->_transform_graph.getItem<envire::sam::LandmarkItem>(frame_id));
-            gtsam::Point3 landmark(landmark_item.getData());
-            initialEstimate.insert(frame_id, landmark);
-        }catch(envire::core::UnknownFrameException &ufex)
-        {
-            std::cerr << ufex.what() << std::endl;
-            return;
-        }
+        this->currentEstimates(this->_factor_graph.keys(), initialEstimate);
+    }catch(envire::core::UnknownFrameException &ufex)
+    {
+        std::cerr << ufex.what() << std::endl;
+        return;
     }
 
     std::cout<<"FINISHED GETTING ESTIMATES\n";
 
-    initialEstimate.print("\nInitial Estimate:\n"); // print
+    /** Dead reckoning is a poor starting point after a loop closure **/
+    if (this->loop_closure_pending && this->initialization_parameters.chordalOn)
+    {
+        std::cout<<"CHORDAL INITIALIZATION\n";
+        this->chordalInitialization(initialEstimate);
+    }
+    this->loop_closure_pending = false;
 
-    /** Create the optimizer ... **/
-    gtsam::GaussNewtonOptimizer optimizer(this->_factor_graph, initialEstimate, this->optimization_parameters);
+    if (this->optimization_parameters.verbosity >= gtsam::NonlinearOptimizerParams::VALUES)
+        initialEstimate.print("\nInitial Estimate:\n"); // print
 
     /** Optimize **/
-    gtsam::Values result = optimizer.optimize();
-    result.print("Final Result:\n");
+    gtsam::Values result = this->solve(initialEstimate);
 
     std::cout<<"OPTIMIZE\n";
 
-    /** Save the marginals **/
-    this->marginals.reset(new gtsam::Marginals(this->_factor_graph, result));
+    this->updateEstimates(result);
 
-    /** Store the result back in the transform graph **/
-    gtsam::Values::iterator key_value = result.begin();
-    for(; key_value != result.end(); ++key_value)
-    {
-        try
-        {
-            gtsam::Symbol const &frame_id(key_value->key);
+    if (this->normal_map_parameters.normalMapOn)
+        this->updateNormalMap();
 
-            if(frame_id.chr() == this->pose_key)
-            {
-                /** Get Item return an iterator to the first element **/
-                envire::sam::PoseItem &pose_item =
-                   *( this->_transform_graph.getItem<envire::sam::PoseItem>(frame_id));
-                base::TransformWithCovariance result_pose_with_cov;
-                boost::shared_ptr<gtsam::Pose3> pose = boost::reinterpret_pointer_cast<gtsam::Pose3>(key_value->value.clone());
-                result_pose_with_cov.translation = pose->translation().vector();
-                result_pose_with_cov.orientation = pose->rotation().toQuaternion();
-                result_pose_with_cov.cov = this->marginals->marginalCovariance(key_value->key);
-                pose_item.setData(result_pose_with_cov);
-            }
-            else if(frame_id.chr() == this->landmark_key)
-            {
-                /** Get Item return an iterator to the first element **/
-                envire::sam::LandmarkItem &landmark_item = 
-                   *(this->_transform_graph.getItem<envire::sam::LandmarkItem>(frame_id));
-                boost::shared_ptr<gtsam::Point3> point = boost::reinterpret_pointer_cast<gtsam::Point3>(key_value->value.clone());
-                landmark_item.setData(base::Vector3d(point->x(), point->y(), point->z()));
-            }
-        }catch(envire::core::UnknownFrameException &ufex)
-        {
-            std::cerr << ufex.what() << std::endl;
-            return;
-        }
-    }
+    /** The snapshot serializes the whole state, at most once per compaction period **/
+    if (this->journal.isOpen() && this->journal_records >= this->journal_parameters.compaction_records &&
+            (base::Time::now() - this->journal_snapshot_time).toSeconds() >= this->journal_parameters.compaction_period)
+        this->compactJournal();
+
+    if (this->memory_parameters.governorOn)
+        this->governMemory();
 }
 
-::base::TransformWithCovariance ESAM::getTransformPose(const std::string &frame_id)
+void ESAM::setSolverParams(const SolverParams &params)
 {
-    ::base::TransformWithCovariance tf_cov;
-    try
-    {
-        /** Get Item return an iterator to the first element **/
-        envire::sam::PoseItem &pose_item = *(this->_transform_graph.getItem<envire::sam::PoseItem>(frame_id));
-        return pose_item.getData();
-    }catch(envire::core::UnknownFrameException &ufex)
-    {
-        std::cerr << ufex.what() << std::endl;
-    }
+    this->executor.drain();
 
-    return tf_cov;
+    this->solver_parameters = params;
+
+    #ifdef GTSAM_USE_TBB
+    this->solver_arena.reset(new tbb::task_arena(params.number_threads > 0 ?
+                params.number_threads : tbb::task_arena::automatic));
+    #endif
 }
 
-::base::samples::RigidBodyState ESAM::getRbsPose(const std::string &frame_id)
+#ifdef GTSAM_USE_TBB
+tbb::task_arena& ESAM::solverArena()
 {
-    ::base::samples::RigidBodyState rbs_pose;
+    if (!this->solver_arena)
+    {
+        this->solver_arena.reset(new tbb::task_arena(this->solver_parameters.number_threads > 0 ?
+                    this->solver_parameters.number_threads : tbb::task_arena::automatic));
+    }
+    return *this->solver_arena;
+}
+#endif
+
+gtsam::Values ESAM::solve(const gtsam::Values &initial_estimate)
+{
+    #ifdef GTSAM_USE_TBB
+    gtsam::Values result;
+    const std::function<void()> eliminate = [&]() { result = this->gaussNewton(initial_estimate); };
+    this->solverArena().execute(eliminate);
+    return result;
+    #else
+    return this->gaussNewton(initial_estimate);
+    #endif
+}
+
+gtsam::Values ESAM::gaussNewton(const gtsam::Values &initial_estimate)
+{
+    /** Constrained ordering, COLAMD is the optimizer default **/
+    gtsam::GaussNewtonParams parameters(this->optimization_parameters);
+    if (this->ordering_parameters.type != COLAMD_ORDERING)
+        parameters.ordering = this->eliminationOrdering();
+
+    /** Create the optimizer ... **/
+    gtsam::GaussNewtonOptimizer optimizer(this->_factor_graph, initial_estimate, parameters);
+
+    /** Optimize **/
+    gtsam::Values result;
+    if (!this->diagnostics_parameters.diagnosticsOn)
+    {
+        result = optimizer.optimize();
+    }
+    else
+    {
+        /** Same loop as the optimizer, recording each iteration **/
+        this->solver_diagnostics = SolverDiagnostics();
+        this->solver_diagnostics.time = base::Time::now().toMicroseconds();
+        this->solver_diagnostics.iterations.push_back(iterationDiagnostics(this->_factor_graph, initial_estimate, 0.0));
+
+        result = initial_estimate;
+        double current_error = this->solver_diagnostics.iterations.back().error;
+        for (size_t i=0; i<this->optimization_parameters.maxIterations; ++i)
+        {
+            optimizer.iterate();
+            const double step_norm = result.localCoordinates(optimizer.values()).norm();
+            result = optimizer.values();
+            this->solver_diagnostics.iterations.push_back(iterationDiagnostics(this->_factor_graph, result, step_norm));
+
+            const double new_error = this->solver_diagnostics.iterations.back().error;
+            this->solver_diagnostics.converged = gtsam::checkConvergence(this->optimization_parameters.relativeErrorTol,
+                    this->optimization_parameters.absoluteErrorTol, this->optimization_parameters.errorTol,
+                    current_error, new_error);
+            current_error = new_error;
+            if (this->solver_diagnostics.converged)
+                break;
+        }
+
+        if (!this->diagnostics_parameters.log_filename.empty())
+        {
+            std::ofstream log(this->diagnostics_parameters.log_filename.c_str(), std::ios::binary | std::ios::app);
+            writeDiagnostics(log, this->solver_diagnostics);
+        }
+    }
+
+    if (this->optimization_parameters.verbosity >= gtsam::NonlinearOptimizerParams::VALUES)
+        result.print("Final Result:\n");
+
+    return result;
+}
+
+gtsam::Ordering ESAM::eliminationOrdering()
+{
+    gtsam::VariableIndex variable_index(this->_factor_graph);
+    gtsam::FastMap<gtsam::Key, int> groups;
+
+    switch (this->ordering_parameters.type)
+    {
+        case LANDMARKS_FIRST:
+        {
+            gtsam::KeySet keys = this->_factor_graph.keys();
+            for(gtsam::KeySet::const_iterator key = keys.begin(); key != keys.end(); ++key)
+            {
+                if (gtsam::Symbol(*key).chr() != this->landmark_key)
+                    groups[*key] = 1;
+            }
+            break;
+        }
+        case RECENT_POSES_LAST:
+        {
+            gtsam::KeySet keys = this->_factor_graph.keys();
+            for(gtsam::KeySet::const_iterator key = keys.begin(); key != keys.end(); ++key)
+            {
+                gtsam::Symbol symbol(*key);
+                if (symbol.chr() == this->pose_key && symbol.index() + this->ordering_parameters.recent_poses > this->pose_idx)
+                    groups[*key] = 1;
+            }
+            break;
+        }
+        case GROUPED_ORDERING:
+        {
+            for(gtsam::FastMap<gtsam::Key, int>::const_iterator it = this->ordering_groups.begin();
+                    it != this->ordering_groups.end(); ++it)
+            {
+                if (variable_index.find(it->first) != variable_index.end())
+                    groups.insert(*it);
+            }
+            break;
+        }
+        default:
+            return gtsam::Ordering::colamd(variable_index);
+    }
+
+    return gtsam::Ordering::colamdConstrained(variable_index, groups);
+}
+
+void ESAM::updateEstimates(const gtsam::Values &result)
+{
+    this->updateEstimates(result, this->_factor_graph.linearize(result), result);
+}
+
+void ESAM::updateEstimates(const gtsam::Values &result, const boost::shared_ptr<gtsam::GaussianFactorGraph> &linear,
+                        const gtsam::Values &linearization_point)
+{
+    /** Save the estimates **/
+    this->estimates_values = result;
+    this->linear_graph = linear;
+    this->linearization_point = linearization_point;
+
+    /** The marginals are factorized when first asked for **/
+    this->marginals.reset();
+
+    /** Covariance of all the poses in one pass **/
+    gtsam::KeySet pose_keys;
+    for(gtsam::Values::const_iterator key_value = result.begin(); key_value != result.end(); ++key_value)
+    {
+        if (gtsam::Symbol(key_value->key).chr() == this->pose_key)
+            pose_keys.insert(key_value->key);
+    }
+    std::map<gtsam::Key, gtsam::Matrix> pose_covariances;
+    if (!this->marginalCovariances(*linear, pose_keys, pose_covariances))
+    {
+        std::cerr<<"[OPTIMIZE] Batched covariance recovery failed, using the marginals per pose\n";
+    }
+
+    /** Store the result back in the transform graph **/
+    unsigned long int keyframe_idx = 0;
+    gtsam::Values::const_iterator key_value = result.begin();
+    for(; key_value != result.end(); ++key_value)
+    {
+        try
+        {
+            gtsam::Symbol const &frame_id(key_value->key);
+
+            if(frame_id.chr() == this->pose_key)
+            {
+                /** Get Item return an iterator to the first element **/
+                envire::sam::PoseItem &pose_item =
+                   *( this->_transform_graph.getItem<envire::sam::PoseItem>(frame_id));
+                base::TransformWithCovariance result_pose_with_cov;
+                boost::shared_ptr<gtsam::Pose3> pose = boost::reinterpret_pointer_cast<gtsam::Pose3>(key_value->value.clone());
+                result_pose_with_cov.translation = pose->translation().vector();
+                result_pose_with_cov.orientation = pose->rotation().toQuaternion();
+                std::map<gtsam::Key, gtsam::Matrix>::const_iterator cov = pose_covariances.find(key_value->key);
+                result_pose_with_cov.cov = swapCovarianceBlocks((cov != pose_covariances.end()) ?
+                        cov->second : this->currentMarginals()->marginalCovariance(key_value->key));
+                pose_item.setData(result_pose_with_cov);
+                keyframe_idx = std::max(keyframe_idx, static_cast<unsigned long int>(frame_id.index()));
+            }
+            else if(frame_id.chr() == this->landmark_key)
+            {
+                /** Get Item return an iterator to the first element **/
+                envire::sam::LandmarkItem &landmark_item = 
+                   *(this->_transform_graph.getItem<envire::sam::LandmarkItem>(frame_id));
+                boost::shared_ptr<gtsam::Point3> point = boost::reinterpret_pointer_cast<gtsam::Point3>(key_value->value.clone());
+                landmark_item.setData(base::Vector3d(point->x(), point->y(), point->z()));
+            }
+        }catch(envire::core::UnknownFrameException &ufex)
+        {
+            std::cerr << ufex.what() << std::endl;
+            return;
+        }
+    }
+
+    this->publishFastPose(keyframe_idx);
+}
+
+void ESAM::stampPose(const unsigned long int &idx, const base::Time &time)
+{
+    /** The first factor reaching a pose gives its time **/
+    if (idx < this->pose_times.size())
+        return;
+
+    this->pose_times.resize(idx + 1);
+    this->pose_times[idx] = time;
+}
+
+envire::sam::PoseItem* ESAM::poseItem(const unsigned long int &idx)
+{
+    if (idx >= this->pose_items.size())
+        this->pose_items.resize(idx + 1, NULL);
+
+    /** Items stay in their frame, only rollback and recovery remove pose frames **/
+    if (!this->pose_items[idx])
+    {
+        gtsam::Symbol frame_id(this->pose_key, idx);
+        if (this->_transform_graph.containsFrame(frame_id) &&
+                this->_transform_graph.containsItems<envire::sam::PoseItem>(frame_id))
+            this->pose_items[idx] = &(*this->_transform_graph.getItem<envire::sam::PoseItem>(frame_id));
+    }
+
+    return this->pose_items[idx];
+}
+
+void ESAM::publishFastPose(const unsigned long int &keyframe_idx)
+{
+    gtsam::Symbol frame_id(this->pose_key, keyframe_idx);
+    if (!this->_transform_graph.containsItems<envire::sam::PoseItem>(frame_id))
+        return;
+
+    FastPose fast_pose;
+    fast_pose.keyframe_idx = keyframe_idx;
+    fast_pose.time = (keyframe_idx < this->pose_times.size()) ? this->pose_times[keyframe_idx] : base::Time();
+    fast_pose.pose = this->_transform_graph.getItem<envire::sam::PoseItem>(frame_id)->getData();
+
+    std::lock_guard<std::mutex> lock(this->odometry_mutex);
+
+    /** Odometry up to the keyframe is already in its estimate **/
+    while (!this->odometry_deltas.empty() && !(fast_pose.time < this->odometry_deltas.front().first))
+        this->odometry_deltas.pop_front();
+
+    for(std::deque< std::pair<base::Time, base::TransformWithCovariance> >::const_iterator it = this->odometry_deltas.begin();
+            it != this->odometry_deltas.end(); ++it)
+    {
+        fast_pose.pose = fast_pose.pose * it->second;
+        fast_pose.time = it->first;
+        fast_pose.number_deltas++;
+    }
+
+    this->fast_pose.store(fast_pose);
+}
+
+void ESAM::addOdometry(const base::Time &time, const ::base::TransformWithCovariance &delta_pose_with_cov)
+{
+    std::lock_guard<std::mutex> lock(this->odometry_mutex);
+    this->odometry_deltas.push_back(std::make_pair(time, delta_pose_with_cov));
+
+    /** Stores are serialized by the mutex, the load is the last value published **/
+    FastPose fast_pose = this->fast_pose.load();
+    fast_pose.pose = fast_pose.pose * delta_pose_with_cov;
+    fast_pose.time = time;
+    fast_pose.number_deltas++;
+    this->fast_pose.store(fast_pose);
+}
+
+void ESAM::beginTransaction()
+{
+    this->executor.drain();
+
+    if (this->transaction.open)
+    {
+        std::cerr<<"[TRANSACTION] A transaction is already open\n";
+        return;
+    }
+
+    this->transaction.open = true;
+    this->transaction.number_factors = this->_factor_graph.size();
+    this->transaction.pose_idx = this->pose_idx;
+    this->transaction.landmark_idx = this->landmark_idx;
+    this->transaction.loop_closure_pending = this->loop_closure_pending;
+    this->transaction.transforms.clear();
+    this->transaction.items.clear();
+    this->transaction.point_clouds.clear();
+    this->transaction.journal.clear();
+}
+
+bool ESAM::commitTransaction()
+{
+    this->executor.drain();
+
+    if (!this->transaction.open)
+        return false;
+
+    /** Linear system of the last optimization, only the factors added since are linearized **/
+    boost::shared_ptr<gtsam::GaussianFactorGraph> linear(new gtsam::GaussianFactorGraph());
+    gtsam::Values linearization_point;
+    if (this->linear_graph && this->linear_graph->size() <= this->_factor_graph.size())
+    {
+        linear->push_back(*this->linear_graph);
+        linearization_point = this->linearization_point;
+    }
+
+    /** New variables from envire **/
+    gtsam::KeySet keys = this->_factor_graph.keys(), new_keys;
+    for(gtsam::KeySet::const_iterator key = keys.begin(); key != keys.end(); ++key)
+    {
+        if (linearization_point.exists(*key))
+            continue;
+        if (this->estimates_values.exists(*key))
+            linearization_point.insert(*key, this->estimates_values.at(*key));
+        else
+            new_keys.insert(*key);
+    }
+
+    gtsam::Values result;
     try
     {
-        ::base::TransformWithCovariance tf_pose;
+        this->currentEstimates(new_keys, result);
+        linearization_point.insert(result);
 
-        /** Get Item return an iterator to the first element **/
-        envire::sam::PoseItem &pose_item = *(this->_transform_graph.getItem<envire::sam::PoseItem>(frame_id));
-        tf_pose = pose_item.getData();
-        rbs_pose.position = tf_pose.translation;
-        rbs_pose.orientation = tf_pose.orientation;
-        rbs_pose.cov_position = tf_pose.cov.block<3,3>(0,0);
-        rbs_pose.cov_orientation = tf_pose.cov.block<3,3>(3,3);
-    }catch(envire::core::UnknownFrameException &ufex)
+        for(size_t i = linear->size(); i < this->_factor_graph.size(); ++i)
+        {
+            linear->push_back(this->_factor_graph[i] ?
+                    this->_factor_graph[i]->linearize(linearization_point) : gtsam::GaussianFactor::shared_ptr());
+        }
+
+        /** One Gauss-Newton step **/
+        const gtsam::Ordering ordering = this->eliminationOrdering();
+        gtsam::VectorValues delta;
+        #ifdef GTSAM_USE_TBB
+        const std::function<void()> eliminate = [&]() { delta = linear->optimize(ordering); };
+        this->solverArena().execute(eliminate);
+        #else
+        delta = linear->optimize(ordering);
+        #endif
+        result = linearization_point.retract(delta);
+    }catch(std::exception &ex)
     {
-        std::cerr << ufex.what() << std::endl;
+        std::cerr<<"[TRANSACTION] "<<ex.what()<<std::endl;
+        this->rollbackTransaction();
+        return false;
     }
 
-    return rbs_pose;
+    /** Chi-square test of the staged factors at the new solution **/
+    double chi2 = 0.0;
+    size_t dof = 0;
+    for(size_t i = this->transaction.number_factors; i < this->_factor_graph.size(); ++i)
+    {
+        if (!this->_factor_graph[i])
+            continue;
+        chi2 += 2.0 * this->_factor_graph[i]->error(result);
+        dof += this->_factor_graph[i]->dim();
+    }
+
+    if (dof > 0 && chi2 > boost::math::quantile(boost::math::chi_squared(dof), this->transaction_parameters.confidence))
+    {
+        std::cout<<"[TRANSACTION] REJECTED chi2 "<<chi2<<" with "<<dof<<" dof\n";
+        this->rollbackTransaction();
+        return false;
+    }
+
+    std::cout<<"[TRANSACTION] COMMITTED chi2 "<<chi2<<" with "<<dof<<" dof\n";
+    this->transaction.open = false;
+    this->transaction.transforms.clear();
+
+    for(std::vector<JournalRecord>::const_iterator it = this->transaction.journal.begin();
+            it != this->transaction.journal.end(); ++it)
+    {
+        this->appendJournal(*it);
+    }
+    this->transaction.journal.clear();
+    this->transaction.items.clear();
+    this->transaction.point_clouds.clear();
+    this->loop_closure_pending = false;
+    this->updateEstimates(result, linear, linearization_point);
+
+    if (this->normal_map_parameters.normalMapOn)
+        this->updateNormalMap();
+
+    return true;
 }
 
-std::vector< ::base::samples::RigidBodyState > ESAM::getRbsPoses()
+void ESAM::rollbackTransaction()
 {
-    std::vector< ::base::samples::RigidBodyState > rbs_poses;
+    this->executor.drain();
 
-    for(register unsigned int i=0; i<this->pose_idx+1; ++i)
+    if (!this->transaction.open)
+        return;
+
+    /** Staged factors are at the end of the graph **/
+    this->_factor_graph.resize(this->transaction.number_factors);
+
+    /** Staged edges in the envire graph **/
+    std::vector< std::pair<gtsam::Symbol, gtsam::Symbol> >::reverse_iterator it = this->transaction.transforms.rbegin();
+    for(; it != this->transaction.transforms.rend(); ++it)
+    {
+        try
+        {
+            this->_transform_graph.removeTransform(it->first, it->second);
+        }catch(envire::core::UnknownTransformException &utex)
+        {
+            std::cerr << utex.what() << std::endl;
+        }
+    }
+
+    /** Items added to the frames and point clouds merged into existing ones **/
+    std::vector<envire::core::ItemBase::Ptr>::reverse_iterator item = this->transaction.items.rbegin();
+    for(; item != this->transaction.items.rend(); ++item)
+    {
+        try
+        {
+            this->_transform_graph.removeItemFromFrame(*item);
+        }catch(envire::core::UnknownFrameException &ufex)
+        {
+            std::cerr << ufex.what() << std::endl;
+        }
+    }
+    std::vector< std::pair<gtsam::Symbol, PCLPointCloud> >::iterator point_cloud = this->transaction.point_clouds.begin();
+    for(; point_cloud != this->transaction.point_clouds.end(); ++point_cloud)
+    {
+        if (this->_transform_graph.containsItems<envire::sam::PointCloudItem>(point_cloud->first))
+            this->_transform_graph.getItem<envire::sam::PointCloudItem>(point_cloud->first)->setData(point_cloud->second);
+    }
+
+    /** Frames created in the transaction **/
+    for(unsigned long int i = this->transaction.landmark_idx; i < this->landmark_idx; ++i)
+    {
+        gtsam::Symbol frame_id(this->landmark_key, i);
+        if (this->_transform_graph.containsFrame(frame_id))
+        {
+            this->_transform_graph.clearFrame(frame_id);
+            this->_transform_graph.removeFrame(frame_id);
+        }
+    }
+    for(unsigned long int i = this->transaction.pose_idx + 1; i <= this->pose_idx; ++i)
     {
         gtsam::Symbol frame_id(this->pose_key, i);
-        rbs_poses.push_back(this->getRbsPose(frame_id));
+        this->normal_map.remove(frame_id);
+        if (this->_transform_graph.containsFrame(frame_id))
+        {
+            this->_transform_graph.clearFrame(frame_id);
+            this->_transform_graph.removeFrame(frame_id);
+        }
     }
 
-    return rbs_poses;
+    this->pose_idx = this->transaction.pose_idx;
+    this->landmark_idx = this->transaction.landmark_idx;
+    if (this->pose_times.size() > this->pose_idx + 1)
+        this->pose_times.resize(this->pose_idx + 1);
+    if (this->pose_items.size() > this->pose_idx + 1)
+        this->pose_items.resize(this->pose_idx + 1);
+    this->loop_closure_pending = this->transaction.loop_closure_pending;
+    this->transaction.open = false;
+    this->transaction.transforms.clear();
+    this->transaction.items.clear();
+    this->transaction.point_clouds.clear();
+    this->transaction.journal.clear();
 }
 
-PCLPointCloud &ESAM::getPointCloud(const std::string &frame_id)
+void ESAM::transactionItem(const envire::core::ItemBase::Ptr &item)
 {
-    try
+    if (this->transaction.open)
+        this->transaction.items.push_back(item);
+}
+
+bool ESAM::startJournal(const JournalParams &params)
+{
+    this->executor.drain();
+
+    this->stopJournal();
+    this->journal_parameters = params;
+    if (!this->journal.open(params.directory, params.flush_period))
+        return false;
+
+    /** The first snapshot writes all the point clouds **/
+    this->journal_payloads.clear();
+    return this->compactJournal();
+}
+
+void ESAM::stopJournal()
+{
+    this->executor.drain();
+
+    this->journal.close();
+}
+
+bool ESAM::compactJournal()
+{
+    this->executor.drain();
+
+    if (!this->journal.isOpen())
+        return false;
+
+    if (this->transaction.open)
     {
-        /** Get Item return an iterator to the first element **/
-        envire::sam::PointCloudItem &point_cloud_item = *(this->_transform_graph.getItem<envire::sam::PointCloudItem>(frame_id));
-        return point_cloud_item.getData();
-    }catch(envire::core::UnknownFrameException &ufex)
+        std::cerr<<"[JOURNAL] No snapshot while a transaction is open\n";
+        return false;
+    }
+
+    std::vector<JournalRecord> records;
+    std::set<std::string> payloads;
+    this->journalSnapshot(records, payloads);
+    this->journal.snapshot(records, payloads);
+    this->journal_records = 0;
+    this->journal_snapshot_time = base::Time::now();
+
+    #ifdef DEBUG_PRINTS
+    std::cout<<"[JOURNAL] SNAPSHOT WITH "<<records.size()<<" RECORDS\n";
+    #endif
+
+    return true;
+}
+
+bool ESAM::recoverJournal(const std::string &directory)
+{
+    this->executor.drain();
+
+    this->stopJournal();
+
+    std::vector<JournalRecord> records;
+    if (!Journal::recover(directory, records))
+        return false;
+
+    /** Start from an empty state, the snapshot has the prior **/
+    for(unsigned long int i=0; i<this->pose_idx+1; ++i)
     {
-        std::cerr << ufex.what() << std::endl;
-        throw "getPointCloud: point cloud not found\n";
+        gtsam::Symbol frame_id(this->pose_key, i);
+        if (this->_transform_graph.containsFrame(frame_id))
+        {
+            /** Spilled point clouds of the replaced state **/
+            this->dropFrameData(frame_id);
+            this->_transform_graph.disconnectFrame(frame_id);
+            this->_transform_graph.clearFrame(frame_id);
+            this->_transform_graph.removeFrame(frame_id);
+        }
+    }
+    for(unsigned long int i=0; i<this->landmark_idx+1; ++i)
+    {
+        gtsam::Symbol frame_id(this->landmark_key, i);
+        if (this->_transform_graph.containsFrame(frame_id))
+        {
+            this->_transform_graph.disconnectFrame(frame_id);
+            this->_transform_graph.clearFrame(frame_id);
+            this->_transform_graph.removeFrame(frame_id);
+        }
+    }
+
+    this->_factor_graph.resize(0);
+    this->estimates_values.clear();
+    this->marginals.reset();
+    this->linear_graph.reset();
+    this->marginalized_frames.clear();
+    this->transaction = TransactionState();
+    this->loop_closure_pending = false;
+    this->pose_idx = 0;
+    this->landmark_idx = 0;
+    this->pose_times.assign(1, base::Time());
+    this->pose_items.clear();
+    this->normal_map.clear();
+    this->journal_parameters.directory = directory;
+
+    size_t replayed = 0;
+    for(std::vector<JournalRecord>::iterator it = records.begin(); it != records.end(); ++it, ++replayed)
+    {
+        if (!this->applyJournalRecord(*it))
+        {
+            std::cerr<<"[JOURNAL] Cannot replay record "<<replayed<<", recovery stops there\n";
+            break;
+        }
+    }
+
+    /** The replayed clouds are only items of their frames **/
+    if (this->normal_map_parameters.normalMapOn)
+        this->rebuildNormalMap();
+
+    std::cout<<"[JOURNAL] RECOVERED "<<replayed<<" RECORDS: "<<this->_factor_graph.size()<<" FACTORS UP TO POSE "<<this->pose_idx<<"\n";
+
+    return true;
+}
+
+JournalRecord ESAM::journalHeader(const JournalRecordType type)
+{
+    /** Every record carries the indices so the replay resumes the add* numbering **/
+    JournalRecord record;
+    record.write(static_cast<boost::uint8_t>(type));
+    record.write(static_cast<boost::uint64_t>(this->pose_idx));
+    record.write(static_cast<boost::uint64_t>(this->landmark_idx));
+    return record;
+}
+
+bool ESAM::encodeFactor(const gtsam::NonlinearFactor::shared_ptr &factor, JournalRecord &record)
+{
+    if (boost::shared_ptr< gtsam::PriorFactor<gtsam::Pose3> > prior =
+            boost::dynamic_pointer_cast< gtsam::PriorFactor<gtsam::Pose3> >(factor))
+    {
+        record = this->journalHeader(JOURNAL_PRIOR_FACTOR);
+        record.write(static_cast<boost::uint64_t>(prior->key()));
+        writePose3(record, prior->prior());
+        record.writeMatrix(noiseCovariance(prior->noiseModel(), 6));
+        return true;
+    }
+    else if (boost::shared_ptr< gtsam::BetweenFactor<gtsam::Pose3> > between =
+            boost::dynamic_pointer_cast< gtsam::BetweenFactor<gtsam::Pose3> >(factor))
+    {
+        record = this->journalHeader(JOURNAL_POSE_FACTOR);
+        record.write(static_cast<boost::uint64_t>(between->key1()));
+        record.write(static_cast<boost::uint64_t>(between->key2()));
+        writePose3(record, between->measured());
+        record.writeMatrix(noiseCovariance(between->noiseModel(), 6));
+        writeEdge(record, this->_transform_graph, between->key1(), between->key2());
+        return true;
+    }
+    else if (boost::shared_ptr< gtsam::BetweenFactor<gtsam::Point3> > between =
+            boost::dynamic_pointer_cast< gtsam::BetweenFactor<gtsam::Point3> >(factor))
+    {
+        record = this->journalHeader(JOURNAL_POINT_FACTOR);
+        record.write(static_cast<boost::uint64_t>(between->key1()));
+        record.write(static_cast<boost::uint64_t>(between->key2()));
+        record.writeMatrix(between->measured().vector());
+        record.writeMatrix(noiseCovariance(between->noiseModel(), 3));
+        writeEdge(record, this->_transform_graph, between->key1(), between->key2());
+        return true;
+    }
+    else if (boost::shared_ptr<LandmarkFactor> landmark = boost::dynamic_pointer_cast<LandmarkFactor>(factor))
+    {
+        record = this->journalHeader(JOURNAL_LANDMARK_FACTOR);
+        record.write(static_cast<boost::uint64_t>(landmark->key1()));
+        record.write(static_cast<boost::uint64_t>(landmark->key2()));
+        record.writeMatrix(landmark->measured().vector());
+        record.writeMatrix(noiseCovariance(landmark->noiseModel(), 3));
+        writeEdge(record, this->_transform_graph, landmark->key1(), landmark->key2());
+        return true;
+    }
+    else if (boost::shared_ptr< gtsam::BearingRangeFactor<gtsam::Pose2, gtsam::Point2> > bearing_range =
+            boost::dynamic_pointer_cast< gtsam::BearingRangeFactor<gtsam::Pose2, gtsam::Point2> >(factor))
+    {
+        record = this->journalHeader(JOURNAL_BEARING_RANGE_FACTOR);
+        record.write(static_cast<boost::uint64_t>(bearing_range->key1()));
+        record.write(static_cast<boost::uint64_t>(bearing_range->key2()));
+        record.write(bearing_range->measured().first.theta());
+        record.write(bearing_range->measured().second);
+        record.writeMatrix(noiseCovariance(bearing_range->noiseModel(), 2));
+        writeEdge(record, this->_transform_graph, bearing_range->key1(), bearing_range->key2());
+        return true;
+    }
+    else if (boost::shared_ptr<gtsam::LinearContainerFactor> linear =
+            boost::dynamic_pointer_cast<gtsam::LinearContainerFactor>(factor))
+    {
+        /** Whitened jacobian blocks and the linearization point of each key **/
+        const gtsam::GaussianFactor::shared_ptr &gaussian = linear->factor();
+        const std::pair<gtsam::Matrix, gtsam::Vector> jacobian = gaussian->jacobian();
+        const gtsam::Values linearization_point = linear->linearizationPoint() ? *linear->linearizationPoint() : gtsam::Values();
+
+        record = this->journalHeader(JOURNAL_LINEAR_FACTOR);
+        record.write(static_cast<boost::uint32_t>(gaussian->size()));
+        record.write(static_cast<boost::uint32_t>(jacobian.first.rows()));
+        for(gtsam::GaussianFactor::const_iterator key = gaussian->begin(); key != gaussian->end(); ++key)
+        {
+            record.write(static_cast<boost::uint64_t>(*key));
+            record.write(static_cast<boost::uint32_t>(gaussian->getDim(key)));
+            if (linearization_point.exists<gtsam::Pose3>(*key))
+            {
+                record.write(static_cast<boost::uint8_t>(1));
+                writePose3(record, linearization_point.at<gtsam::Pose3>(*key));
+            }
+            else if (linearization_point.exists<gtsam::Point3>(*key))
+            {
+                record.write(static_cast<boost::uint8_t>(2));
+                record.writeMatrix(linearization_point.at<gtsam::Point3>(*key).vector());
+            }
+            else
+            {
+                record.write(static_cast<boost::uint8_t>(0));
+            }
+        }
+
+        size_t column = 0;
+        for(gtsam::GaussianFactor::const_iterator key = gaussian->begin(); key != gaussian->end(); ++key)
+        {
+            const size_t dim = gaussian->getDim(key);
+            record.writeMatrix(jacobian.first.block(0, column, jacobian.first.rows(), dim));
+            column += dim;
+        }
+        record.writeMatrix(jacobian.second);
+        return true;
+    }
+
+    return false;
+}
+
+void ESAM::journalFactor(const gtsam::NonlinearFactor::shared_ptr &factor)
+{
+    if (!this->journal.isOpen())
+        return;
+
+    JournalRecord record;
+    if (this->encodeFactor(factor, record))
+        this->appendJournal(record);
+    else
+        std::cerr<<"[JOURNAL] Factor type without journal record\n";
+}
+
+void ESAM::journalValue(const std::string &frame_id, const ::base::TransformWithCovariance &pose_with_cov)
+{
+    if (!this->journal.isOpen())
+        return;
+
+    JournalRecord record = this->journalHeader(JOURNAL_POSE_VALUE);
+    record.write(frame_id);
+    writeTransformWithCovariance(record, pose_with_cov);
+    this->appendJournal(record);
+}
+
+void ESAM::journalValue(const std::string &frame_id, const ::base::Vector3d &landmark)
+{
+    if (!this->journal.isOpen())
+        return;
+
+    JournalRecord record = this->journalHeader(JOURNAL_LANDMARK_VALUE);
+    record.write(frame_id);
+    record.writeMatrix(landmark);
+    this->appendJournal(record);
+}
+
+void ESAM::journalPointCloud(const gtsam::Symbol &frame_id, const PCLPointCloudPtr &point_cloud)
+{
+    if (!this->journal.isOpen() || !point_cloud)
+        return;
+
+    /** The journal thread keeps the cloud alive until it is written, the record only references the file **/
+    const std::string frame = frame_id, filename = frame + ".cloud";
+    this->journal.appendPayload(filename, [point_cloud](std::ostream &stream){ writePointCloud(stream, *point_cloud); });
+    this->journal_payloads.insert(frame);
+
+    JournalRecord record = this->journalHeader(JOURNAL_POINT_CLOUD);
+    record.write(frame);
+    record.write(filename);
+    this->appendJournal(record);
+}
+
+void ESAM::appendJournal(const JournalRecord &record)
+{
+    /** Staged insertions are journaled if the transaction is committed **/
+    if (this->transaction.open)
+    {
+        this->transaction.journal.push_back(record);
+        return;
+    }
+
+    this->journal.append(record);
+    this->journal_records++;
+}
+
+void ESAM::journalSnapshot(std::vector<JournalRecord> &records, std::set<std::string> &payloads)
+{
+    /** Values and point clouds of the frames **/
+    for(unsigned long int i=0; i<this->pose_idx+1; ++i)
+    {
+        gtsam::Symbol frame_id(this->pose_key, i);
+        if (!this->_transform_graph.containsFrame(frame_id))
+            continue;
+
+        const std::string frame = frame_id;
+        if (this->_transform_graph.containsItems<envire::sam::PoseItem>(frame_id))
+        {
+            JournalRecord record = this->journalHeader(JOURNAL_POSE_VALUE);
+            record.write(frame);
+            writeTransformWithCovariance(record, this->_transform_graph.getItem<envire::sam::PoseItem>(frame_id)->getData());
+            records.push_back(record);
+        }
+
+        if (this->hasPointCloud(frame))
+        {
+            const std::string filename = frame + ".cloud";
+            if (!this->journal_payloads.count(frame))
+            {
+                PCLPointCloudPtr point_cloud(new PCLPointCloud);
+                this->copyPointCloud(frame, *point_cloud);
+                this->journal.appendPayload(filename, [point_cloud](std::ostream &stream){ writePointCloud(stream, *point_cloud); });
+                this->journal_payloads.insert(frame);
+            }
+
+            JournalRecord record = this->journalHeader(JOURNAL_POINT_CLOUD);
+            record.write(frame);
+            record.write(filename);
+            records.push_back(record);
+            payloads.insert(filename);
+        }
+    }
+
+    for(unsigned long int i=0; i<this->landmark_idx+1; ++i)
+    {
+        gtsam::Symbol frame_id(this->landmark_key, i);
+        if (this->_transform_graph.containsFrame(frame_id) &&
+                this->_transform_graph.containsItems<envire::sam::LandmarkItem>(frame_id))
+        {
+            JournalRecord record = this->journalHeader(JOURNAL_LANDMARK_VALUE);
+            record.write(static_cast<std::string>(frame_id));
+            record.writeMatrix(this->_transform_graph.getItem<envire::sam::LandmarkItem>(frame_id)->getData());
+            records.push_back(record);
+        }
+    }
+
+    /** Factors in the order of the graph **/
+    for(gtsam::NonlinearFactorGraph::const_iterator it = this->_factor_graph.begin();
+            it != this->_factor_graph.end(); ++it)
+    {
+        if (!(*it))
+            continue;
+
+        JournalRecord record;
+        if (this->encodeFactor(*it, record))
+            records.push_back(record);
+        else
+            std::cerr<<"[JOURNAL] Factor type without journal record\n";
+    }
+
+    JournalRecord record = this->journalHeader(JOURNAL_MARGINALIZED_FRAMES);
+    record.write(static_cast<boost::uint32_t>(this->marginalized_frames.size()));
+    for(gtsam::KeySet::const_iterator it = this->marginalized_frames.begin(); it != this->marginalized_frames.end(); ++it)
+        record.write(static_cast<boost::uint64_t>(*it));
+    records.push_back(record);
+}
+
+bool ESAM::applyJournalRecord(JournalRecord &record)
+{
+    boost::uint8_t type = 0;
+    boost::uint64_t pose_idx = 0, landmark_idx = 0;
+    if (!record.read(type) || !record.read(pose_idx) || !record.read(landmark_idx))
+        return false;
+
+    this->pose_idx = pose_idx;
+    this->landmark_idx = landmark_idx;
+
+    boost::uint64_t key1 = 0, key2 = 0;
+    switch (type)
+    {
+        case JOURNAL_PRIOR_FACTOR:
+        {
+            gtsam::Pose3 prior;
+            base::Matrix6d cov;
+            if (!record.read(key1) || !readPose3(record, prior) || !record.readMatrix(cov))
+                return false;
+            this->_factor_graph.add(gtsam::PriorFactor<gtsam::Pose3>(key1, prior, gtsam::noiseModel::Gaussian::Covariance(cov)));
+            return true;
+        }
+        case JOURNAL_POSE_FACTOR:
+        {
+            gtsam::Pose3 measured;
+            base::Matrix6d cov;
+            if (!record.read(key1) || !record.read(key2) || !readPose3(record, measured) || !record.readMatrix(cov))
+                return false;
+            this->_factor_graph.add(gtsam::BetweenFactor<gtsam::Pose3>(key1, key2, measured, gtsam::noiseModel::Gaussian::Covariance(cov)));
+
+            base::Time time;
+            if (!readEdge(record, this->_transform_graph, key1, key2, &time))
+                return false;
+            if (gtsam::Symbol(key2).chr() == this->pose_key)
+                this->stampPose(gtsam::Symbol(key2).index(), time);
+            return true;
+        }
+        case JOURNAL_POINT_FACTOR:
+        case JOURNAL_LANDMARK_FACTOR:
+        {
+            base::Vector3d measured;
+            base::Matrix3d cov;
+            if (!record.read(key1) || !record.read(key2) || !record.readMatrix(measured) || !record.readMatrix(cov))
+                return false;
+            if (type == JOURNAL_POINT_FACTOR)
+                this->_factor_graph.add(gtsam::BetweenFactor<gtsam::Point3>(key1, key2, gtsam::Point3(measured), gtsam::noiseModel::Gaussian::Covariance(cov)));
+            else
+                this->_factor_graph.add(LandmarkFactor(key1, key2, gtsam::Point3(measured), gtsam::noiseModel::Gaussian::Covariance(cov)));
+            return readEdge(record, this->_transform_graph, key1, key2);
+        }
+        case JOURNAL_BEARING_RANGE_FACTOR:
+        {
+            double bearing_angle = 0.0, range_distance = 0.0;
+            Eigen::Matrix2d cov;
+            if (!record.read(key1) || !record.read(key2) || !record.read(bearing_angle) ||
+                    !record.read(range_distance) || !record.readMatrix(cov))
+                return false;
+            this->_factor_graph.add(gtsam::BearingRangeFactor<gtsam::Pose2, gtsam::Point2>(key1, key2,
+                        gtsam::Rot2(bearing_angle), range_distance, gtsam::noiseModel::Gaussian::Covariance(cov)));
+            return readEdge(record, this->_transform_graph, key1, key2);
+        }
+        case JOURNAL_LINEAR_FACTOR:
+        {
+            boost::uint32_t number_keys = 0, rows = 0;
+            if (!record.read(number_keys) || !record.read(rows))
+                return false;
+
+            std::vector< std::pair<gtsam::Key, gtsam::Matrix> > terms;
+            gtsam::Values linearization_point;
+            for(boost::uint32_t i=0; i<number_keys; ++i)
+            {
+                boost::uint64_t key = 0;
+                boost::uint32_t dim = 0;
+                boost::uint8_t value_type = 0;
+                if (!record.read(key) || !record.read(dim) || !record.read(value_type))
+                    return false;
+
+                if (value_type == 1)
+                {
+                    gtsam::Pose3 pose;
+                    if (!readPose3(record, pose))
+                        return false;
+                    linearization_point.insert(key, pose);
+                }
+                else if (value_type == 2)
+                {
+                    base::Vector3d point;
+                    if (!record.readMatrix(point))
+                        return false;
+                    linearization_point.insert(key, gtsam::Point3(point));
+                }
+                terms.push_back(std::make_pair(key, gtsam::Matrix(rows, dim)));
+            }
+
+            for(std::vector< std::pair<gtsam::Key, gtsam::Matrix> >::iterator it = terms.begin(); it != terms.end(); ++it)
+            {
+                if (!record.readMatrix(it->second))
+                    return false;
+            }
+
+            gtsam::Vector b(rows);
+            if (!record.readMatrix(b))
+                return false;
+
+            gtsam::GaussianFactor::shared_ptr gaussian(new gtsam::JacobianFactor(terms, b));
+            this->_factor_graph.add(gtsam::LinearContainerFactor(gaussian, linearization_point));
+            return true;
+        }
+        case JOURNAL_POSE_VALUE:
+        {
+            std::string frame_id;
+            base::TransformWithCovariance pose_with_cov;
+            if (!record.read(frame_id) || !readTransformWithCovariance(record, pose_with_cov))
+                return false;
+            if (!this->_transform_graph.containsFrame(frame_id))
+                this->_transform_graph.addFrame(frame_id);
+            this->insertPoseValue(frame_id, pose_with_cov);
+            return true;
+        }
+        case JOURNAL_LANDMARK_VALUE:
+        {
+            std::string frame_id;
+            base::Vector3d landmark;
+            if (!record.read(frame_id) || !record.readMatrix(landmark))
+                return false;
+            if (!this->_transform_graph.containsFrame(frame_id))
+                this->_transform_graph.addFrame(frame_id);
+            envire::sam::LandmarkItem::Ptr landmark_item(new envire::sam::LandmarkItem());
+            landmark_item->setData(landmark);
+            this->_transform_graph.addItemToFrame(frame_id, landmark_item);
+            return true;
+        }
+        case JOURNAL_POINT_CLOUD:
+        {
+            std::string frame_id, filename;
+            PCLPointCloud point_cloud;
+            if (!record.read(frame_id) || !record.read(filename))
+                return false;
+            if (!readPointCloud(this->journal_parameters.directory + "/" + filename, point_cloud))
+            {
+                std::cerr<<"[JOURNAL] Missing point cloud payload "<<filename<<"\n";
+                return true;
+            }
+
+            if (!this->_transform_graph.containsFrame(frame_id))
+                this->_transform_graph.addFrame(frame_id);
+            if (this->_transform_graph.containsItems<envire::sam::PointCloudItem>(frame_id))
+            {
+                this->_transform_graph.getItem<envire::sam::PointCloudItem>(frame_id)->setData(point_cloud);
+            }
+            else
+            {
+                envire::sam::PointCloudItem::Ptr point_cloud_item(new PointCloudItem);
+                point_cloud_item->setData(point_cloud);
+                this->_transform_graph.addItemToFrame(frame_id, point_cloud_item);
+            }
+            return true;
+        }
+        case JOURNAL_REMOVE_LANDMARKS:
+        case JOURNAL_MARGINALIZED_FRAMES:
+        {
+            boost::uint32_t size = 0;
+            gtsam::KeySet keys;
+            if (!record.read(size))
+                return false;
+            for(boost::uint32_t i=0; i<size; ++i)
+            {
+                if (!record.read(key1))
+                    return false;
+                keys.insert(key1);
+            }
+
+            if (type == JOURNAL_REMOVE_LANDMARKS)
+                this->removeLandmarks(keys);
+            else
+                this->dropMarginalizedFrames(keys);
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+
+void ESAM::currentEstimates(const gtsam::KeySet &keys, gtsam::Values &values)
+{
+    for(gtsam::KeySet::const_iterator it = keys.begin(); it != keys.end(); ++it)
+    {
+        gtsam::Symbol frame_id(*it);
+        //frame_id.print();
+        if(frame_id.chr() == this->pose_key)
+        {
+            /** Get Item return an iterator to the first element **/
+            envire::sam::PoseItem &pose_item = *(this->_transform_graph.getItem<envire::sam::PoseItem>(frame_id));
+            gtsam::Pose3 pose(gtsam::Rot3(pose_item.getData().orientation), gtsam::Point3(pose_item.getData().translation));
+            values.insert(frame_id, pose);
+        }
+        else if(frame_id.chr() == this->landmark_key)
+        {
+            /** Get Item return an iterator to the first element **/
+            envire::sam::LandmarkItem &landmark_item =
+                *(this->_transform_graph.getItem<envire::sam::LandmarkItem>(frame_id));
+            gtsam::Point3 landmark(landmark_item.getData());
+            values.insert(frame_id, landmark);
+        }
+    }
+}
+
+::base::TransformWithCovariance ESAM::getTransformPose(const std::string &frame_id)
+{
+    ::base::TransformWithCovariance tf_cov;
+    try
+    {
+        /** Get Item return an iterator to the first element **/
+        envire::sam::PoseItem &pose_item = *(this->_transform_graph.getItem<envire::sam::PoseItem>(frame_id));
+        return pose_item.getData();
+    }catch(envire::core::UnknownFrameException &ufex)
+    {
+        std::cerr << ufex.what() << std::endl;
+    }
+
+    return tf_cov;
+}
+
+::base::samples::RigidBodyState ESAM::getFastRbsPose() const
+{
+    const FastPose fast_pose = this->fast_pose.load();
+
+    ::base::samples::RigidBodyState rbs_pose;
+    rbs_pose.time = fast_pose.time;
+    rbs_pose.position = fast_pose.pose.translation;
+    rbs_pose.orientation = fast_pose.pose.orientation;
+    rbs_pose.cov_position = fast_pose.pose.cov.block<3,3>(0,0);
+    rbs_pose.cov_orientation = fast_pose.pose.cov.block<3,3>(3,3);
+    return rbs_pose;
+}
+
+::base::samples::RigidBodyState ESAM::getRbsPose(const std::string &frame_id)
+{
+    ::base::samples::RigidBodyState rbs_pose;
+    try
+    {
+        ::base::TransformWithCovariance tf_pose;
+
+        /** Get Item return an iterator to the first element **/
+        envire::sam::PoseItem &pose_item = *(this->_transform_graph.getItem<envire::sam::PoseItem>(frame_id));
+        tf_pose = pose_item.getData();
+        rbs_pose.position = tf_pose.translation;
+        rbs_pose.orientation = tf_pose.orientation;
+        rbs_pose.cov_position = tf_pose.cov.block<3,3>(0,0);
+        rbs_pose.cov_orientation = tf_pose.cov.block<3,3>(3,3);
+    }catch(envire::core::UnknownFrameException &ufex)
+    {
+        std::cerr << ufex.what() << std::endl;
+    }
+
+    return rbs_pose;
+}
+
+boost::shared_ptr<gtsam::Marginals> ESAM::currentMarginals()
+{
+    if (!this->marginals)
+    {
+        #ifdef GTSAM_USE_TBB
+        const std::function<void()> factorize = [this]() {
+            this->marginals.reset(new gtsam::Marginals(this->_factor_graph, this->estimates_values)); };
+        this->solverArena().execute(factorize);
+        #else
+        this->marginals.reset(new gtsam::Marginals(this->_factor_graph, this->estimates_values));
+        #endif
+    }
+
+    return this->marginals;
+}
+
+bool ESAM::marginalCovariances(const gtsam::KeySet &keys, std::map<gtsam::Key, gtsam::Matrix> &covariances)
+{
+    return this->marginalCovariances(*this->_factor_graph.linearize(this->estimates_values), keys, covariances);
+}
+
+bool ESAM::marginalCovariances(const gtsam::GaussianFactorGraph &linear, const gtsam::KeySet &keys,
+                        std::map<gtsam::Key, gtsam::Matrix> &covariances)
+{
+    covariances.clear();
+
+    /** Column offset of each variable in the information matrix **/
+    std::map<gtsam::Key, int> offsets;
+    int dim = 0;
+    for(gtsam::Values::iterator key_value = this->estimates_values.begin();
+            key_value != this->estimates_values.end(); ++key_value)
+    {
+        offsets[key_value->key] = dim;
+        dim += key_value->value.dim();
+    }
+
+    /** Unknown keys are an error, not another variable's block **/
+    for(gtsam::KeySet::const_iterator key = keys.begin(); key != keys.end(); ++key)
+    {
+        if (offsets.find(*key) == offsets.end())
+        {
+            std::cerr<<"[COVARIANCE] Variable "<<gtsam::DefaultKeyFormatter(*key)<<" has no estimate\n";
+            return false;
+        }
+    }
+
+    /** Information matrix A^T A of the whitened Jacobians (lower triangle) **/
+    std::vector< Eigen::Triplet<double> > triplets;
+    for(gtsam::GaussianFactorGraph::const_iterator it = linear.begin(); it != linear.end(); ++it)
+    {
+        if (!(*it))
+            continue;
+
+        const gtsam::Matrix A = (*it)->jacobian().first;
+        const gtsam::Matrix H = A.transpose() * A;
+
+        /** Every variable of the factor has to be in the estimates **/
+        std::vector<int> factor_offsets;
+        for(gtsam::GaussianFactor::const_iterator key = (*it)->begin(); key != (*it)->end(); ++key)
+        {
+            std::map<gtsam::Key, int>::const_iterator offset = offsets.find(*key);
+            if (offset == offsets.end())
+            {
+                std::cerr<<"[COVARIANCE] Variable "<<gtsam::DefaultKeyFormatter(*key)<<" of a factor has no estimate\n";
+                return false;
+            }
+            factor_offsets.push_back(offset->second);
+        }
+
+        int col_j = 0;
+        for(gtsam::GaussianFactor::const_iterator key_j = (*it)->begin(); key_j != (*it)->end(); ++key_j)
+        {
+            const int dim_j = (*it)->getDim(key_j);
+            int col_i = 0;
+            for(gtsam::GaussianFactor::const_iterator key_i = (*it)->begin(); key_i != (*it)->end(); ++key_i)
+            {
+                const int dim_i = (*it)->getDim(key_i);
+                for (int r=0; r<dim_i; ++r)
+                {
+                    for (int c=0; c<dim_j; ++c)
+                    {
+                        const int row = factor_offsets[key_i - (*it)->begin()] + r, col = factor_offsets[key_j - (*it)->begin()] + c;
+                        if (row >= col)
+                            triplets.push_back(Eigen::Triplet<double>(row, col, H(col_i + r, col_j + c)));
+                    }
+                }
+                col_i += dim_i;
+            }
+            col_j += dim_j;
+        }
+    }
+
+    SparseInverse::SparseMatrix information(dim, dim);
+    information.setFromTriplets(triplets.begin(), triplets.end());
+
+    SparseInverse inverse;
+    if (!inverse.compute(information))
+        return false;
+
+    for(gtsam::KeySet::const_iterator key = keys.begin(); key != keys.end(); ++key)
+        covariances[*key] = inverse.block(offsets.at(*key), this->estimates_values.at(*key).dim());
+
+    return true;
+}
+
+std::vector< ::base::samples::RigidBodyState > ESAM::getRbsPoses()
+{
+    std::vector< ::base::samples::RigidBodyState > rbs_poses(this->pose_idx+1);
+
+    for(register unsigned int i=0; i<this->pose_idx+1; ++i)
+    {
+        const envire::sam::PoseItem *pose_item = this->poseItem(i);
+        if (!pose_item)
+            continue;
+
+        const ::base::TransformWithCovariance &tf_pose = pose_item->getData();
+        rbs_poses[i].time = (i < this->pose_times.size()) ? this->pose_times[i] : base::Time();
+        rbs_poses[i].position = tf_pose.translation;
+        rbs_poses[i].orientation = tf_pose.orientation;
+        rbs_poses[i].cov_position = tf_pose.cov.block<3,3>(0,0);
+        rbs_poses[i].cov_orientation = tf_pose.cov.block<3,3>(3,3);
+    }
+
+    return rbs_poses;
+}
+
+size_t ESAM::exportTrajectory(boost::int64_t *timestamps, double *positions, double *orientations,
+        double *covariances)
+{
+    typedef Eigen::Matrix<double, 6, 6, Eigen::RowMajor> RowMajorMatrix6d;
+    const double nan = std::numeric_limits<double>::quiet_NaN();
+
+    const size_t number_poses = this->pose_idx + 1;
+    for(size_t i=0; i<number_poses; ++i)
+    {
+        timestamps[i] = (i < this->pose_times.size()) ? this->pose_times[i].toMicroseconds() : 0;
+
+        const envire::sam::PoseItem *pose_item = this->poseItem(i);
+        if (!pose_item)
+        {
+            Eigen::Map<Eigen::Vector3d>(positions + 3*i).setConstant(nan);
+            Eigen::Map<Eigen::Vector4d>(orientations + 4*i).setConstant(nan);
+            if (covariances)
+                Eigen::Map<RowMajorMatrix6d>(covariances + 36*i).setConstant(nan);
+            continue;
+        }
+
+        const ::base::TransformWithCovariance &pose_with_cov = pose_item->getData();
+        Eigen::Map<Eigen::Vector3d>(positions + 3*i) = pose_with_cov.translation;
+        Eigen::Map<Eigen::Vector4d>(orientations + 4*i) = pose_with_cov.orientation.coeffs();
+        if (covariances)
+            Eigen::Map<RowMajorMatrix6d>(covariances + 36*i) = pose_with_cov.cov;
+    }
+
+    return number_poses;
+}
+
+static const boost::uint32_t trajectory_magic = 0x4a415254; //TRAJ
+static const boost::uint32_t trajectory_version = 1;
+
+bool ESAM::writeTrajectory(const std::string &filename, const bool covariances)
+{
+    std::ofstream file(filename.c_str(), std::ios::binary);
+    if (!file.is_open())
+    {
+        std::cerr<<"[WRITE_TRAJECTORY] Cannot open "<<filename<<"\n";
+        return false;
+    }
+
+    const size_t number_poses = this->numberPoses();
+    std::vector<boost::int64_t> timestamps(number_poses);
+    std::vector<double> positions(3 * number_poses), orientations(4 * number_poses);
+    std::vector<double> covariance_array(covariances ? 36 * number_poses : 0);
+    this->exportTrajectory(timestamps.data(), positions.data(), orientations.data(),
+            covariances ? covariance_array.data() : NULL);
+
+    const boost::uint64_t size = number_poses;
+    const boost::uint8_t with_covariances = covariances;
+    file.write(reinterpret_cast<const char*>(&trajectory_magic), sizeof(trajectory_magic));
+    file.write(reinterpret_cast<const char*>(&trajectory_version), sizeof(trajectory_version));
+    file.write(reinterpret_cast<const char*>(&size), sizeof(size));
+    file.write(reinterpret_cast<const char*>(&with_covariances), sizeof(with_covariances));
+    file.write(reinterpret_cast<const char*>(timestamps.data()), timestamps.size() * sizeof(boost::int64_t));
+    file.write(reinterpret_cast<const char*>(positions.data()), positions.size() * sizeof(double));
+    file.write(reinterpret_cast<const char*>(orientations.data()), orientations.size() * sizeof(double));
+    file.write(reinterpret_cast<const char*>(covariance_array.data()), covariance_array.size() * sizeof(double));
+
+    return static_cast<bool>(file);
+}
+
+bool ESAM::readTrajectory(const std::string &filename, std::vector<boost::int64_t> &timestamps,
+        std::vector<double> &positions, std::vector<double> &orientations, std::vector<double> &covariances)
+{
+    std::ifstream file(filename.c_str(), std::ios::binary);
+    boost::uint32_t magic = 0, version = 0;
+    boost::uint64_t size = 0;
+    boost::uint8_t with_covariances = 0;
+    file.read(reinterpret_cast<char*>(&magic), sizeof(magic));
+    file.read(reinterpret_cast<char*>(&version), sizeof(version));
+    file.read(reinterpret_cast<char*>(&size), sizeof(size));
+    file.read(reinterpret_cast<char*>(&with_covariances), sizeof(with_covariances));
+    if (!file || magic != trajectory_magic || version != trajectory_version)
+    {
+        std::cerr<<"[READ_TRAJECTORY] "<<filename<<" is not a trajectory file\n";
+        return false;
+    }
+
+    timestamps.resize(size);
+    positions.resize(3 * size);
+    orientations.resize(4 * size);
+    covariances.resize(with_covariances ? 36 * size : 0);
+    file.read(reinterpret_cast<char*>(timestamps.data()), timestamps.size() * sizeof(boost::int64_t));
+    file.read(reinterpret_cast<char*>(positions.data()), positions.size() * sizeof(double));
+    file.read(reinterpret_cast<char*>(orientations.data()), orientations.size() * sizeof(double));
+    file.read(reinterpret_cast<char*>(covariances.data()), covariances.size() * sizeof(double));
+
+    return static_cast<bool>(file);
+}
+
+void ESAM::relativePoses(const std::vector< std::pair<gtsam::Symbol, gtsam::Symbol> > &frame_pairs,
+        std::vector< ::base::TransformWithCovariance > &relative_poses_out)
+{
+    relative_poses_out.assign(frame_pairs.size(), ::base::TransformWithCovariance());
+
+    boost::shared_ptr<gtsam::Marginals> marginals;
+    for(size_t i = 0; i < frame_pairs.size(); ++i)
+    {
+        const gtsam::Symbol &source(frame_pairs[i].first), &target(frame_pairs[i].second);
+        gtsam::Matrix H1, H2, relative_cov;
+        gtsam::Pose3 relative;
+
+        if (source != target && this->estimates_values.exists(source) && this->estimates_values.exists(target))
+        {
+            /** Joint marginal of the pair only, the Bayes tree is shared by all the pairs **/
+            if (!marginals)
+                marginals = this->currentMarginals();
+
+            std::vector<gtsam::Key> pair_keys;
+            pair_keys.push_back(source);
+            pair_keys.push_back(target);
+            const gtsam::JointMarginal joint_marginal = marginals->jointMarginalCovariance(pair_keys);
+
+            relative = this->estimates_values.at<gtsam::Pose3>(source).between(this->estimates_values.at<gtsam::Pose3>(target), H1, H2);
+            relative_cov = H1 * joint_marginal(source, source) * H1.transpose() +
+                H1 * joint_marginal(source, target) * H2.transpose() +
+                H2 * joint_marginal(target, source) * H1.transpose() +
+                H2 * joint_marginal(target, target) * H2.transpose();
+        }
+        else if (this->_transform_graph.containsFrame(source) && this->_transform_graph.containsItems<envire::sam::PoseItem>(source) &&
+                this->_transform_graph.containsFrame(target) && this->_transform_graph.containsItems<envire::sam::PoseItem>(target))
+        {
+            /** No marginals (yet), poses taken as independent **/
+            const base::TransformWithCovariance &source_pose = this->_transform_graph.getItem<envire::sam::PoseItem>(source)->getData();
+            const base::TransformWithCovariance &target_pose = this->_transform_graph.getItem<envire::sam::PoseItem>(target)->getData();
+            relative = gtsam::Pose3(gtsam::Rot3(source_pose.orientation), gtsam::Point3(source_pose.translation)).between(
+                    gtsam::Pose3(gtsam::Rot3(target_pose.orientation), gtsam::Point3(target_pose.translation)), H1, H2);
+            relative_cov = H1 * swapCovarianceBlocks(source_pose.cov) * H1.transpose() +
+                H2 * swapCovarianceBlocks(target_pose.cov) * H2.transpose();
+        }
+        else
+        {
+            std::cerr<<"[RELATIVE_POSES] No pose for "<<static_cast<std::string>(source)<<" or "<<static_cast<std::string>(target)<<"\n";
+            continue;
+        }
+
+        relative_poses_out[i].translation = relative.translation().vector();
+        relative_poses_out[i].orientation = relative.rotation().toQuaternion();
+        relative_poses_out[i].cov = swapCovarianceBlocks(relative_cov);
+    }
+}
+
+PCLPointCloud &ESAM::getPointCloud(const std::string &frame_id)
+{
+    try
+    {
+        this->restorePointCloud(frame_id);
+
+        /** Get Item return an iterator to the first element **/
+        envire::sam::PointCloudItem &point_cloud_item = *(this->_transform_graph.getItem<envire::sam::PointCloudItem>(frame_id));
+        return point_cloud_item.getData();
+    }catch(envire::core::UnknownFrameException &ufex)
+    {
+        std::cerr << ufex.what() << std::endl;
+        throw "getPointCloud: point cloud not found\n";
+    }
+}
+
+void ESAM::mergePointClouds(PCLPointCloud &merged_point_cloud, bool downsample)
+{
+    merged_point_cloud.clear();
+    for(register unsigned int i=0; i<this->pose_idx+1; ++i)
+    {
+        gtsam::Symbol frame_id(this->pose_key, i);
+        //std::cout<<"MERGING POINT CLOUDS: ";
+        //frame_id.print();
+        if (this->hasPointCloud(frame_id))
+        {
+            /** Compressed point clouds are expanded only for the merge **/
+            PCLPointCloud local_points;
+            this->copyPointCloud(frame_id, local_points);
+            base::TransformWithCovariance tf_cov = this->getTransformPose(frame_id);
+            this->transformPointCloud(local_points, tf_cov.getTransform());
+            merged_point_cloud += local_points;
+            //std::cout<<"local_points.size(); "<<local_points.size()<<"\n";
+        }
+    }
+
+    /** Downsample **/
+    if (downsample)
+    {
+        PCLPointCloudPtr merged_point_cloud_ptr = boost::make_shared<PCLPointCloud>(merged_point_cloud);
+        PCLPointCloudPtr downsample_point_cloud (new PCLPointCloud);
+        this->downsample (merged_point_cloud_ptr, this->downsample_size, downsample_point_cloud);
+
+        merged_point_cloud = *downsample_point_cloud;
+    }
+}
+
+void ESAM::mergePointClouds(base::samples::Pointcloud &base_point_cloud, bool downsample)
+{
+    PCLPointCloud pcl_point_cloud;
+    this->mergePointClouds(pcl_point_cloud, downsample);
+
+    //std::cout<<"merged_points.size(); "<<pcl_point_cloud.size()<<"\n";
+    base_point_cloud.points.clear();
+    base_point_cloud.colors.clear();
+    envire::sam::fromPCLPointCloud<PointType>(base_point_cloud, pcl_point_cloud);
+    //std::cout<<"base merged point cloud.size(); "<<base_point_cloud.points.size()<<"\n";
+}
+
+void ESAM::currentPointCloud(base::samples::Pointcloud &base_point_cloud, bool downsample)
+{
+    /** Get the current point cloud **/
+    gtsam::Symbol frame_id = gtsam::Symbol(this->pose_key, this->pose_idx-1);
+
+    /* Clear point cloud **/
+    base_point_cloud.points.clear();
+    base_point_cloud.colors.clear();
+
+    if (this->hasPointCloud(frame_id))
+    {
+        /** Get point cloud **/
+        PCLPointCloud current_point_cloud;
+        this->copyPointCloud(frame_id, current_point_cloud);
+
+        /** Downsample **/
+        if (downsample)
+        {
+            PCLPointCloudPtr current_point_cloud_ptr = boost::make_shared<PCLPointCloud>(current_point_cloud);
+            PCLPointCloudPtr downsample_point_cloud (new PCLPointCloud);
+            this->downsample (current_point_cloud_ptr, this->downsample_size, downsample_point_cloud);
+            current_point_cloud = *downsample_point_cloud;
+        }
+
+        /** Convert to base point cloud **/
+        envire::sam::fromPCLPointCloud<PointType>(base_point_cloud, current_point_cloud);
+    }
+}
+
+void ESAM::currentPointCloudtoPLY(const std::string &prefixname, bool downsample)
+{
+    base::samples::Pointcloud base_point_cloud;
+
+    /** Get the current point cloud **/
+    gtsam::Symbol frame_id = gtsam::Symbol(this->pose_key, this->pose_idx-1);
+
+    if (this->hasPointCloud(frame_id))
+    {
+        /** Get the point cloud in the frame **/
+        PCLPointCloud current_point_cloud;
+        this->copyPointCloud(frame_id, current_point_cloud);
+
+        /** Downsample **/
+        if (downsample)
+        {
+            PCLPointCloudPtr current_point_cloud_ptr = boost::make_shared<PCLPointCloud>(current_point_cloud);
+            PCLPointCloudPtr downsample_point_cloud (new PCLPointCloud);
+            this->downsample (current_point_cloud_ptr, this->downsample_size, downsample_point_cloud);
+            current_point_cloud = *downsample_point_cloud;
+        }
+
+        /** Convert to base point cloud **/
+        envire::sam::fromPCLPointCloud<PointType>(base_point_cloud, current_point_cloud);
+    }
+
+    /** Write to PLY **/
+    std::string filename; filename = prefixname + static_cast<std::string>(frame_id) + ".ply";
+    this->writePlyFile(base_point_cloud, filename);
+}
+
+
+void ESAM::printMarginals()
+{
+    if (this->estimates_values.empty())
+        return;
+
+    boost::shared_ptr<gtsam::Marginals> marginals = this->currentMarginals();
+    std::cout.precision(3);
+    gtsam::Values::iterator key_value = this->estimates_values.begin();
+    for(; key_value != this->estimates_values.end(); ++key_value)
+    {
+        gtsam::Symbol frame_id(key_value->key);
+        std::cout <<frame_id.chr()<<frame_id.index()<<" covariance:\n" << marginals->marginalCovariance(frame_id) << std::endl;
+    }
+}
+
+MemoryUsage ESAM::memoryUsage()
+{
+    MemoryUsage usage;
+
+    /** Values: pose and landmark storage plus the node in the key map **/
+    for(gtsam::Values::iterator key_value = this->estimates_values.begin();
+            key_value != this->estimates_values.end(); ++key_value)
+    {
+        gtsam::Symbol symbol(key_value->key);
+        std::size_t value_size = key_value->value.dim() * sizeof(double);
+        if (symbol.chr() == this->pose_key)
+            value_size = sizeof(gtsam::Pose3);
+        else if (symbol.chr() == this->landmark_key)
+            value_size = sizeof(gtsam::Point3);
+        usage.values.add(1, value_size + sizeof(gtsam::Key) + 4 * sizeof(void*));
+    }
+
+    /** Factors: the object, its keys and the square root information **/
+    std::size_t linear_system_bytes = 0;
+    for(gtsam::NonlinearFactorGraph::const_iterator it = this->_factor_graph.begin();
+            it != this->_factor_graph.end(); ++it)
+    {
+        if (!(*it))
+            continue;
+
+        const gtsam::NonlinearFactor *factor = (*it).get();
+        std::size_t object_size = 0;
+        const FactorType type = factorType(factor, &object_size);
+
+        const std::size_t rows = factor->dim();
+        usage.factors[type].add(1, object_size + factor->size() * sizeof(gtsam::Key) + rows * rows * sizeof(double));
+
+        /** Jacobian block of the factor once linearized **/
+        std::size_t cols = 1;
+        for(gtsam::NonlinearFactor::const_iterator key = factor->begin(); key != factor->end(); ++key)
+        {
+            if (this->estimates_values.exists(*key))
+                cols += this->estimates_values.at(*key).dim();
+        }
+        linear_system_bytes += rows * cols * sizeof(double);
+    }
+
+    /** Linear system kept for the transactions, the marginals keep another one and its factorization **/
+    if (this->linear_graph)
+    {
+        usage.marginals.add(this->linearization_point.size(), linear_system_bytes);
+    }
+    if (this->marginals)
+    {
+        usage.marginals.add(this->estimates_values.size(), 2 * linear_system_bytes);
+    }
+
+    /** Normal map **/
+    usage.normal_map.add(this->normal_map.numberVoxels() + this->normal_map.numberCells(), this->normal_map.bytes());
+
+    /** Envire graph **/
+    usage.transforms.add(this->_transform_graph.num_edges(), this->_transform_graph.num_edges() * sizeof(envire::core::Transform));
+
+    for(register unsigned long int i=0; i<this->landmark_idx+1; ++i)
+    {
+        gtsam::Symbol frame_id(this->landmark_key, i);
+        if (this->_transform_graph.containsFrame(frame_id))
+            usage.frames.add(1, sizeof(envire::core::FrameId) + sizeof(envire::sam::LandmarkItem));
+    }
+
+    for(register unsigned long int i=0; i<this->pose_idx+1; ++i)
+    {
+        gtsam::Symbol frame_id(this->pose_key, i);
+        if (!this->_transform_graph.containsFrame(frame_id))
+            continue;
+
+        usage.frames.add(1, sizeof(envire::core::FrameId) + sizeof(envire::sam::PoseItem));
+
+        FrameMemoryUsage frame_usage;
+        if (this->_transform_graph.containsItems<envire::sam::PointCloudItem>(frame_id))
+        {
+            const PCLPointCloud &cloud = this->_transform_graph.getItem<envire::sam::PointCloudItem>(frame_id)->getData();
+            frame_usage.point_cloud.add(cloud.size(), cloud.points.capacity() * sizeof(PointType));
+        }
+        if (this->_transform_graph.containsItems<envire::sam::CompressedPointCloudItem>(frame_id))
+        {
+            const CompressedPointCloud &compressed = this->_transform_graph.getItem<envire::sam::CompressedPointCloudItem>(frame_id)->getData();
+            frame_usage.point_cloud.add(compressed.number_points, compressed.bytes());
+        }
+        if (this->_transform_graph.containsItems<envire::sam::KeypointItem>(frame_id))
+        {
+            const pcl::PointCloud<pcl::PointWithScale> &keypoints = this->_transform_graph.getItem<envire::sam::KeypointItem>(frame_id)->getData();
+            frame_usage.keypoints.add(keypoints.size(), keypoints.points.capacity() * sizeof(pcl::PointWithScale));
+        }
+        if (this->_transform_graph.containsItems<envire::sam::FPFHDescriptorItem>(frame_id))
+        {
+            const pcl::PointCloud<pcl::FPFHSignature33> &descriptors = this->_transform_graph.getItem<envire::sam::FPFHDescriptorItem>(frame_id)->getData();
+            frame_usage.descriptors.add(descriptors.size(), descriptors.points.capacity() * sizeof(pcl::FPFHSignature33));
+        }
+        if (this->_transform_graph.containsItems<envire::sam::BinaryDescriptorItem>(frame_id))
+        {
+            const BinaryFPFHDescriptors &descriptors = this->_transform_graph.getItem<envire::sam::BinaryDescriptorItem>(frame_id)->getData();
+            frame_usage.descriptors.add(descriptors.size(), descriptors.capacity() * sizeof(BinaryFPFHSignature));
+        }
+        if (this->_transform_graph.containsItems<envire::sam::PFHDescriptorItem>(frame_id))
+        {
+            const pcl::PointCloud<pcl::PFHSignature125> &descriptors = this->_transform_graph.getItem<envire::sam::PFHDescriptorItem>(frame_id)->getData();
+            frame_usage.descriptors.add(descriptors.size(), descriptors.points.capacity() * sizeof(pcl::PFHSignature125));
+        }
+
+        if (frame_usage.bytes() > 0)
+        {
+            usage.point_clouds.add(frame_usage.point_cloud.count, frame_usage.point_cloud.bytes);
+            usage.keypoints.add(frame_usage.keypoints.count, frame_usage.keypoints.bytes);
+            usage.descriptors.add(frame_usage.descriptors.count, frame_usage.descriptors.bytes);
+            usage.per_frame[frame_id] = frame_usage;
+        }
+    }
+
+    return usage;
+}
+
+void ESAM::governMemory()
+{
+    this->executor.drain();
+
+    const MemoryGovernorParams &params = this->memory_parameters;
+    MemoryGovernorStatistics &statistics = this->memory_statistics;
+    if (params.budget == 0)
+        return;
+
+    std::size_t bytes = this->memoryUsage().bytes();
+    statistics.peak_bytes = std::max(statistics.peak_bytes, bytes);
+    const double budget = static_cast<double>(params.budget);
+
+    /** Frames old enough to act on, the current frame is always kept **/
+    const unsigned long int keep_frames = std::max(params.keep_frames, 1u);
+    const unsigned long int old_frames = (this->pose_idx + 1 > keep_frames) ? this->pose_idx + 1 - keep_frames : 0;
+
+    /** Compress, oldest frames first **/
+    for(unsigned long int i=0; i<old_frames && bytes > params.compress_threshold * budget; ++i)
+    {
+        bytes -= std::min(bytes, this->compressFramePointCloud(gtsam::Symbol(this->pose_key, i)));
+    }
+
+    /** Spill **/
+    if (!params.spill_directory.empty())
+    {
+        for(unsigned long int i=0; i<old_frames && bytes > params.spill_threshold * budget; ++i)
+        {
+            bytes -= std::min(bytes, this->spillFramePointCloud(gtsam::Symbol(this->pose_key, i)));
+        }
+    }
+
+    /** Cull and marginalize change the factor graph, not while staging **/
+    if (bytes > params.cull_threshold * budget && !this->transaction.open)
+    {
+        statistics.culled_landmarks += this->cullLandmarks();
+        bytes = this->memoryUsage().bytes();
+    }
+
+    if (bytes > params.marginalize_threshold * budget && !this->transaction.open)
+    {
+        gtsam::KeySet frames;
+        for(unsigned long int i=0; i<old_frames && frames.size() < params.marginalize_frames; ++i)
+        {
+            gtsam::Symbol frame_id(this->pose_key, i);
+            if (this->estimates_values.exists(frame_id) && !this->marginalized_frames.count(frame_id))
+                frames.insert(frame_id);
+        }
+
+        this->marginalizeFrames(frames);
+        statistics.marginalized_frames += frames.size();
+        bytes = this->memoryUsage().bytes();
+    }
+
+    /** Hard budget: the oldest frames lose their sensor data **/
+    if (bytes > params.budget)
+    {
+        MemoryUsage usage = this->memoryUsage();
+        for(unsigned long int i=0; i<old_frames && bytes > params.budget; ++i)
+        {
+            std::map<std::string, FrameMemoryUsage>::const_iterator frame = usage.per_frame.find(gtsam::Symbol(this->pose_key, i));
+            if (frame == usage.per_frame.end())
+                continue;
+
+            this->dropFrameData(frame->first);
+            bytes -= std::min(bytes, frame->second.bytes());
+            statistics.dropped_frames++;
+        }
+    }
+
+    statistics.bytes = bytes;
+    if (bytes > params.budget)
+    {
+        std::cerr<<"[MEMORY] "<<bytes<<" bytes after all actions, over the budget of "<<params.budget<<" bytes\n";
+    }
+}
+
+bool ESAM::hasPointCloud(const std::string &frame_id)
+{
+    return this->_transform_graph.containsItems<envire::sam::PointCloudItem>(frame_id) ||
+        this->_transform_graph.containsItems<envire::sam::CompressedPointCloudItem>(frame_id);
+}
+
+bool ESAM::copyPointCloud(const std::string &frame_id, PCLPointCloud &point_cloud)
+{
+    if (this->_transform_graph.containsItems<envire::sam::PointCloudItem>(frame_id))
+    {
+        point_cloud = this->_transform_graph.getItem<envire::sam::PointCloudItem>(frame_id)->getData();
+        return true;
+    }
+
+    if (!this->_transform_graph.containsItems<envire::sam::CompressedPointCloudItem>(frame_id))
+        return false;
+
+    const CompressedPointCloud &compressed = this->_transform_graph.getItem<envire::sam::CompressedPointCloudItem>(frame_id)->getData();
+    if (!compressed.spilled())
+    {
+        envire::sam::decompressPointCloud(compressed, point_cloud);
+        return true;
+    }
+
+    CompressedPointCloud loaded;
+    if (!envire::sam::loadSpilledPointCloud(compressed, loaded))
+    {
+        std::cerr<<"[MEMORY] Cannot read "<<compressed.spill_file<<"\n";
+        return false;
+    }
+    envire::sam::decompressPointCloud(loaded, point_cloud);
+    return true;
+}
+
+bool ESAM::restorePointCloud(const std::string &frame_id)
+{
+    if (!this->_transform_graph.containsFrame(frame_id) ||
+            !this->_transform_graph.containsItems<envire::sam::CompressedPointCloudItem>(frame_id))
+        return false;
+
+    envire::sam::PointCloudItem::Ptr point_cloud_item(new PointCloudItem);
+    if (!this->copyPointCloud(frame_id, point_cloud_item->getData()))
+        return false;
+
+    const std::string spill_file = this->_transform_graph.getItem<envire::sam::CompressedPointCloudItem>(frame_id)->getData().spill_file;
+    if (!spill_file.empty())
+        std::remove(spill_file.c_str());
+
+    this->_transform_graph.removeItemFromFrame(frame_id, this->_transform_graph.getItem<envire::sam::CompressedPointCloudItem>(frame_id));
+    this->_transform_graph.addItemToFrame(frame_id, point_cloud_item);
+    this->memory_statistics.restored_clouds++;
+    return true;
+}
+
+std::size_t ESAM::compressFramePointCloud(const std::string &frame_id)
+{
+    if (!this->_transform_graph.containsFrame(frame_id) ||
+            !this->_transform_graph.containsItems<envire::sam::PointCloudItem>(frame_id))
+        return 0;
+
+    const PCLPointCloud &point_cloud = this->_transform_graph.getItem<envire::sam::PointCloudItem>(frame_id)->getData();
+    const std::size_t bytes = point_cloud.points.capacity() * sizeof(PointType);
+
+    envire::sam::CompressedPointCloudItem::Ptr compressed_item(new CompressedPointCloudItem);
+    envire::sam::compressPointCloud(point_cloud, this->memory_parameters.compression_resolution, compressed_item->getData());
+    const std::size_t compressed_bytes = compressed_item->getData().bytes();
+
+    this->_transform_graph.removeItemFromFrame(frame_id, this->_transform_graph.getItem<envire::sam::PointCloudItem>(frame_id));
+    this->_transform_graph.addItemToFrame(frame_id, compressed_item);
+    this->memory_statistics.compressed_clouds++;
+
+    return (bytes > compressed_bytes) ? bytes - compressed_bytes : 0;
+}
+
+std::size_t ESAM::spillFramePointCloud(const std::string &frame_id)
+{
+    if (!this->_transform_graph.containsFrame(frame_id) ||
+            !this->_transform_graph.containsItems<envire::sam::CompressedPointCloudItem>(frame_id))
+        return 0;
+
+    CompressedPointCloud &compressed = this->_transform_graph.getItem<envire::sam::CompressedPointCloudItem>(frame_id)->getData();
+    if (compressed.spilled())
+        return 0;
+
+    const std::size_t bytes = compressed.bytes();
+    const std::string filename = this->memory_parameters.spill_directory + "/" + frame_id + ".zcloud";
+    if (!envire::sam::spillPointCloud(compressed, filename))
+    {
+        std::cerr<<"[MEMORY] Cannot spill to "<<filename<<"\n";
+        return 0;
+    }
+
+    this->memory_statistics.spilled_clouds++;
+    return bytes;
+}
+
+void ESAM::dropFrameData(const std::string &frame_id)
+{
+    if (!this->_transform_graph.containsFrame(frame_id))
+        return;
+
+    while (this->_transform_graph.containsItems<envire::sam::CompressedPointCloudItem>(frame_id))
+    {
+        const CompressedPointCloud &compressed = this->_transform_graph.getItem<envire::sam::CompressedPointCloudItem>(frame_id)->getData();
+        if (compressed.spilled())
+            std::remove(compressed.spill_file.c_str());
+        this->_transform_graph.removeItemFromFrame(frame_id, this->_transform_graph.getItem<envire::sam::CompressedPointCloudItem>(frame_id));
+    }
+    while (this->_transform_graph.containsItems<envire::sam::PointCloudItem>(frame_id))
+        this->_transform_graph.removeItemFromFrame(frame_id, this->_transform_graph.getItem<envire::sam::PointCloudItem>(frame_id));
+    while (this->_transform_graph.containsItems<envire::sam::KeypointItem>(frame_id))
+        this->_transform_graph.removeItemFromFrame(frame_id, this->_transform_graph.getItem<envire::sam::KeypointItem>(frame_id));
+    while (this->_transform_graph.containsItems<envire::sam::FPFHDescriptorItem>(frame_id))
+        this->_transform_graph.removeItemFromFrame(frame_id, this->_transform_graph.getItem<envire::sam::FPFHDescriptorItem>(frame_id));
+    while (this->_transform_graph.containsItems<envire::sam::PFHDescriptorItem>(frame_id))
+        this->_transform_graph.removeItemFromFrame(frame_id, this->_transform_graph.getItem<envire::sam::PFHDescriptorItem>(frame_id));
+    while (this->_transform_graph.containsItems<envire::sam::BinaryDescriptorItem>(frame_id))
+        this->_transform_graph.removeItemFromFrame(frame_id, this->_transform_graph.getItem<envire::sam::BinaryDescriptorItem>(frame_id));
+    while (this->_transform_graph.containsItems<envire::sam::KeypointLinkItem>(frame_id))
+        this->_transform_graph.removeItemFromFrame(frame_id, this->_transform_graph.getItem<envire::sam::KeypointLinkItem>(frame_id));
+
+    this->journal_payloads.erase(frame_id);
+    this->normal_map.remove(frame_id);
+}
+
+int ESAM::cullLandmarks()
+{
+    this->executor.drain();
+
+    /** Observation statistics of the landmarks **/
+    std::map<gtsam::Key, gtsam::KeySet> observing_frames;
+    std::map<gtsam::Key, double> residuals;
+
+    for(gtsam::NonlinearFactorGraph::const_iterator it = this->_factor_graph.begin();
+            it != this->_factor_graph.end(); ++it)
+    {
+        if (!(*it))
+            continue;
+
+        /** Landmark observations connect a pose with a landmark **/
+        gtsam::Key landmark = 0, frame = 0;
+        bool has_landmark = false, has_frame = false;
+        for(gtsam::NonlinearFactor::const_iterator key = (*it)->begin(); key != (*it)->end(); ++key)
+        {
+            gtsam::Symbol symbol(*key);
+            if (symbol.chr() == this->landmark_key)
+            {
+                landmark = *key; has_landmark = true;
+            }
+            else if (symbol.chr() == this->pose_key)
+            {
+                frame = *key; has_frame = true;
+            }
+        }
+
+        if (has_landmark && has_frame)
+        {
+            observing_frames[landmark].insert(frame);
+
+            /** Chi-square error at the last estimate **/
+            if (this->culling_parameters.max_residual > 0.0 &&
+                    this->estimates_values.exists(landmark) && this->estimates_values.exists(frame))
+            {
+                residuals[landmark] += 2.0 * (*it)->error(this->estimates_values);
+            }
+        }
+    }
+
+    gtsam::KeySet landmarks_to_cull;
+    std::map<gtsam::Key, gtsam::KeySet>::const_iterator it = observing_frames.begin();
+    for(; it != observing_frames.end(); ++it)
+    {
+        const unsigned int number_observations = it->second.size();
+
+        /** Weak landmark which has not been observed again for a while **/
+        const unsigned long int last_frame_idx = gtsam::Symbol(*(it->second.rbegin())).index();
+        if (number_observations < this->culling_parameters.min_observations &&
+                this->pose_idx - last_frame_idx > this->culling_parameters.max_age)
+        {
+            landmarks_to_cull.insert(it->first);
+            continue;
+        }
+
+        /** Landmark which does not fit the estimate **/
+        if (this->culling_parameters.max_residual > 0.0 && residuals.count(it->first) &&
+                residuals[it->first] / number_observations > this->culling_parameters.max_residual)
+        {
+            landmarks_to_cull.insert(it->first);
+            continue;
+        }
+
+        /** Landmark which is not well constrained **/
+        if (this->culling_parameters.max_covariance_trace > 0.0 &&
+                this->estimates_values.exists(it->first) &&
+                this->currentMarginals()->marginalCovariance(it->first).trace() > this->culling_parameters.max_covariance_trace)
+        {
+            landmarks_to_cull.insert(it->first);
+        }
+    }
+
+    #ifdef DEBUG_PRINTS
+    std::cout<<"CULLING "<<landmarks_to_cull.size()<<" OF "<<observing_frames.size()<<" LANDMARKS\n";
+    #endif
+
+    if (this->culling_parameters.marginalize)
+    {
+        this->marginalizeFrames(landmarks_to_cull);
+    }
+    else
+    {
+        this->removeLandmarks(landmarks_to_cull);
+    }
+
+    return landmarks_to_cull.size();
+}
+
+void ESAM::removeLandmarks(const gtsam::KeySet &landmarks)
+{
+    this->executor.drain();
+
+    if (landmarks.empty())
+        return;
+
+    if (this->journal.isOpen())
+    {
+        JournalRecord record = this->journalHeader(JOURNAL_REMOVE_LANDMARKS);
+        record.write(static_cast<boost::uint32_t>(landmarks.size()));
+        for(gtsam::KeySet::const_iterator it = landmarks.begin(); it != landmarks.end(); ++it)
+            record.write(static_cast<boost::uint64_t>(*it));
+        this->appendJournal(record);
+    }
+
+    /** Keep only the factors which do not involve the landmarks **/
+    gtsam::NonlinearFactorGraph remaining_factors;
+    for(gtsam::NonlinearFactorGraph::const_iterator it = this->_factor_graph.begin();
+            it != this->_factor_graph.end(); ++it)
+    {
+        if (!(*it))
+            continue;
+
+        gtsam::KeySet::const_iterator landmark = landmarks.end();
+        for(gtsam::NonlinearFactor::const_iterator key = (*it)->begin(); key != (*it)->end() && landmark == landmarks.end(); ++key)
+        {
+            landmark = landmarks.find(*key);
+        }
+
+        if (landmark == landmarks.end())
+        {
+            remaining_factors.push_back(*it);
+            continue;
+        }
+
+        /** Remove the measurement edges from envire **/
+        for(gtsam::NonlinearFactor::const_iterator key = (*it)->begin(); key != (*it)->end(); ++key)
+        {
+            if (*key == *landmark)
+                continue;
+
+            gtsam::Symbol frame_id(*key), landmark_id(*landmark);
+            try
+            {
+                this->_transform_graph.removeTransform(frame_id, landmark_id);
+            }catch(envire::core::UnknownTransformException &utex)
+            {
+                std::cerr << utex.what() << std::endl;
+            }
+        }
+    }
+    this->_factor_graph = remaining_factors;
+
+    /** The linear system and the marginals belong to the previous graph **/
+    this->linear_graph.reset();
+    this->marginals.reset();
+
+    /** Remove the landmark frames and their estimates **/
+    for(gtsam::KeySet::const_iterator it = landmarks.begin(); it != landmarks.end(); ++it)
+    {
+        gtsam::Symbol landmark_id(*it);
+        try
+        {
+            this->_transform_graph.clearFrame(landmark_id);
+            this->_transform_graph.removeFrame(landmark_id);
+        }catch(envire::core::UnknownFrameException &ufex)
+        {
+            std::cerr << ufex.what() << std::endl;
+        }
+
+        if (this->estimates_values.exists(*it))
+        {
+            this->estimates_values.erase(*it);
+        }
+    }
+}
+
+void ESAM::marginalizeFrames(const gtsam::KeySet &frames)
+{
+    this->executor.drain();
+
+    if (frames.empty())
+        return;
+
+    /** Factors involving the frames and their Markov blanket **/
+    gtsam::NonlinearFactorGraph marginalized_factors;
+    gtsam::KeySet blanket;
+    for(gtsam::NonlinearFactorGraph::const_iterator it = this->_factor_graph.begin();
+            it != this->_factor_graph.end(); ++it)
+    {
+        if (!(*it))
+            continue;
+
+        bool involved = false;
+        for(gtsam::NonlinearFactor::const_iterator key = (*it)->begin(); key != (*it)->end(); ++key)
+        {
+            involved |= (frames.count(*key) > 0);
+        }
+
+        if (involved)
+        {
+            marginalized_factors.push_back(*it);
+            blanket.insert((*it)->begin(), (*it)->end());
+        }
+    }
+
+    gtsam::Ordering ordering;
+    for(gtsam::KeySet::const_iterator it = frames.begin(); it != frames.end(); ++it)
+    {
+        if (blanket.erase(*it))
+            ordering.push_back(*it);
+    }
+
+    /** Marginal on the blanket from eliminating the frames **/
+    gtsam::NonlinearFactorGraph marginal_factors;
+    if (!blanket.empty())
+    {
+        gtsam::KeySet keys(blanket);
+        keys.insert(ordering.begin(), ordering.end());
+
+        gtsam::Values linearization_point;
+        try
+        {
+            this->currentEstimates(keys, linearization_point);
+        }catch(envire::core::UnknownFrameException &ufex)
+        {
+            std::cerr << ufex.what() << std::endl;
+            return;
+        }
+
+        gtsam::GaussianFactorGraph::shared_ptr linear_factors = marginalized_factors.linearize(linearization_point);
+        gtsam::GaussianFactorGraph::shared_ptr marginal = linear_factors->eliminatePartialMultifrontal(ordering).second;
+
+        if (this->marginalization_parameters.sparsification == CHOW_LIU)
+        {
+            this->chowLiuSparsification(*marginal, blanket, linearization_point, marginal_factors);
+        }
+        else
+        {
+            for(gtsam::GaussianFactorGraph::const_iterator it = marginal->begin(); it != marginal->end(); ++it)
+            {
+                if (*it)
+                    marginal_factors.add(gtsam::LinearContainerFactor(*it, linearization_point));
+            }
+        }
+    }
+
+    #ifdef DEBUG_PRINTS
+    std::cout<<"MARGINALIZING "<<frames.size()<<" FRAMES: "<<marginalized_factors.size()<<" FACTORS REPLACED BY "<<marginal_factors.size()<<"\n";
+    #endif
+
+    /** Landmarks are removed together with their measurements **/
+    gtsam::KeySet landmarks;
+    for(gtsam::KeySet::const_iterator it = frames.begin(); it != frames.end(); ++it)
+    {
+        if (gtsam::Symbol(*it).chr() == this->landmark_key)
+            landmarks.insert(*it);
+    }
+    this->removeLandmarks(landmarks);
+
+    /** The replay drops the same factors before adding the marginal ones **/
+    if (this->journal.isOpen())
+    {
+        JournalRecord record = this->journalHeader(JOURNAL_MARGINALIZED_FRAMES);
+        record.write(static_cast<boost::uint32_t>(frames.size()));
+        for(gtsam::KeySet::const_iterator it = frames.begin(); it != frames.end(); ++it)
+            record.write(static_cast<boost::uint64_t>(*it));
+        this->appendJournal(record);
+    }
+
+    /** Poses stay in the envire graph with their last estimate, only their factors are replaced **/
+    this->dropMarginalizedFrames(frames);
+
+    for(gtsam::NonlinearFactorGraph::const_iterator it = marginal_factors.begin(); it != marginal_factors.end(); ++it)
+    {
+        this->_factor_graph.push_back(*it);
+        this->journalFactor(*it);
+    }
+    this->linear_graph.reset();
+}
+
+void ESAM::dropMarginalizedFrames(const gtsam::KeySet &frames)
+{
+    gtsam::NonlinearFactorGraph remaining_factors;
+    for(gtsam::NonlinearFactorGraph::const_iterator it = this->_factor_graph.begin();
+            it != this->_factor_graph.end(); ++it)
+    {
+        if (!(*it))
+            continue;
+
+        bool involved = false;
+        for(gtsam::NonlinearFactor::const_iterator key = (*it)->begin(); key != (*it)->end(); ++key)
+        {
+            involved |= (frames.count(*key) > 0);
+        }
+
+        if (!involved)
+            remaining_factors.push_back(*it);
+    }
+    this->_factor_graph = remaining_factors;
+    this->marginals.reset();
+
+    for(gtsam::KeySet::const_iterator it = frames.begin(); it != frames.end(); ++it)
+    {
+        if (this->estimates_values.exists(*it))
+            this->estimates_values.erase(*it);
+
+        if (gtsam::Symbol(*it).chr() == this->pose_key)
+            this->marginalized_frames.insert(*it);
     }
 }
 
-void ESAM::mergePointClouds(PCLPointCloud &merged_point_cloud, bool downsample)
+bool ESAM::chordalInitialization(gtsam::Values &values)
 {
-    merged_point_cloud.clear();
-    for(register unsigned int i=0; i<this->pose_idx+1; ++i)
+    typedef Eigen::SparseMatrix<double> SparseMatrix;
+
+    /** Relative pose factors between poses to initialize **/
+    std::vector< boost::shared_ptr< gtsam::BetweenFactor<gtsam::Pose3> > > edges;
+    boost::shared_ptr< gtsam::PriorFactor<gtsam::Pose3> > prior;
+    std::map<gtsam::Key, int> index;
+    for(gtsam::NonlinearFactorGraph::const_iterator it = this->_factor_graph.begin();
+            it != this->_factor_graph.end(); ++it)
     {
-        gtsam::Symbol frame_id(this->pose_key, i);
-        //std::cout<<"MERGING POINT CLOUDS: ";
-        //frame_id.print();
-        if (this->_transform_graph.containsItems<envire::sam::PointCloudItem>(frame_id))
+        boost::shared_ptr< gtsam::BetweenFactor<gtsam::Pose3> > between =
+            boost::dynamic_pointer_cast< gtsam::BetweenFactor<gtsam::Pose3> >(*it);
+        if (between && values.exists(between->key1()) && values.exists(between->key2()))
         {
-            PCLPointCloud local_points = this->getPointCloud(frame_id);
-            base::TransformWithCovariance tf_cov = this->getTransformPose(frame_id);
-            this->transformPointCloud(local_points, tf_cov.getTransform());
-            merged_point_cloud += local_points;
-            //std::cout<<"local_points.size(); "<<local_points.size()<<"\n";
+            edges.push_back(between);
+            index[between->key1()] = 0; index[between->key2()] = 0;
+        }
+        else if (!prior)
+        {
+            prior = boost::dynamic_pointer_cast< gtsam::PriorFactor<gtsam::Pose3> >(*it);
         }
     }
 
-    /** Downsample **/
-    if (downsample)
-    {
-        PCLPointCloudPtr merged_point_cloud_ptr = boost::make_shared<PCLPointCloud>(merged_point_cloud);
-        PCLPointCloudPtr downsample_point_cloud (new PCLPointCloud);
-        this->downsample (merged_point_cloud_ptr, this->downsample_size, downsample_point_cloud);
+    if (edges.empty())
+        return false;
 
-        merged_point_cloud = *downsample_point_cloud;
+    const int n = index.size();
+    int id = 0;
+    for(std::map<gtsam::Key, int>::iterator it = index.begin(); it != index.end(); ++it)
+        it->second = id++;
+
+    /** The prior fixes the gauge, otherwise the first pose stays where it is **/
+    gtsam::Key anchor_key = index.begin()->first;
+    gtsam::Pose3 anchor_pose = values.at<gtsam::Pose3>(anchor_key);
+    if (prior && index.count(prior->key()))
+    {
+        anchor_key = prior->key();
+        anchor_pose = prior->prior();
     }
-}
+    const int anchor = index[anchor_key];
 
-void ESAM::mergePointClouds(base::samples::Pointcloud &base_point_cloud, bool downsample)
-{
-    PCLPointCloud pcl_point_cloud;
-    this->mergePointClouds(pcl_point_cloud, downsample);
+    /** Edges weighted by their information: isotropic for the rotation, full for the translation **/
+    std::vector<double> rotation_weights(edges.size());
+    std::vector<Eigen::Matrix3d, Eigen::aligned_allocator<Eigen::Matrix3d> > translation_covariances(edges.size());
+    double max_weight = 0.0;
+    for(size_t e = 0; e < edges.size(); ++e)
+    {
+        const gtsam::Matrix cov = noiseCovariance(edges[e]->noiseModel(), 6);
+        rotation_weights[e] = std::sqrt(3.0 / cov.block<3,3>(0,0).trace());
+        translation_covariances[e] = cov.block<3,3>(3,3);
+        const double translation_weight = 1.0 / std::sqrt(Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d>(
+                    translation_covariances[e], Eigen::EigenvaluesOnly).eigenvalues()[0]);
+        max_weight = std::max(max_weight, std::max(rotation_weights[e], translation_weight));
+    }
 
-    //std::cout<<"merged_points.size(); "<<pcl_point_cloud.size()<<"\n";
-    base_point_cloud.points.clear();
-    base_point_cloud.colors.clear();
-    envire::sam::fromPCLPointCloud<PointType>(base_point_cloud, pcl_point_cloud);
-    //std::cout<<"base merged point cloud.size(); "<<base_point_cloud.points.size()<<"\n";
-}
+    /** The anchor dominates the most precise edge **/
+    const double anchor_weight = 1e3 * max_weight;
 
-void ESAM::currentPointCloud(base::samples::Pointcloud &base_point_cloud, bool downsample)
-{
-    /** Get the current point cloud **/
-    gtsam::Symbol frame_id = gtsam::Symbol(this->pose_key, this->pose_idx-1);
+    /** Rotations: w_ij (R_i R_ij - R_j) = 0, unknowns are the column-major entries of each R **/
+    const int rotation_rows = 9 * (edges.size() + 1);
+    std::vector< Eigen::Triplet<double> > triplets;
+    Eigen::VectorXd b(Eigen::VectorXd::Zero(rotation_rows));
+    for(size_t e = 0; e < edges.size(); ++e)
+    {
+        const int i = index[edges[e]->key1()], j = index[edges[e]->key2()];
+        const Eigen::Matrix3d R_ij = edges[e]->measured().rotation().matrix();
+        const double w = rotation_weights[e];
+        for (register int c=0; c<3; ++c)
+        {
+            for (register int r=0; r<3; ++r)
+            {
+                const int row = 9*e + 3*c + r;
+                for (register int k=0; k<3; ++k)
+                    triplets.push_back(Eigen::Triplet<double>(row, 9*i + 3*k + r, w * R_ij(k,c)));
+                triplets.push_back(Eigen::Triplet<double>(row, 9*j + 3*c + r, -w));
+            }
+        }
+    }
+    const Eigen::Matrix3d R_anchor = anchor_pose.rotation().matrix();
+    for (register int m=0; m<9; ++m)
+    {
+        triplets.push_back(Eigen::Triplet<double>(9*edges.size() + m, 9*anchor + m, anchor_weight));
+        b[9*edges.size() + m] = anchor_weight * R_anchor.data()[m];
+    }
 
-    /* Clear point cloud **/
-    base_point_cloud.points.clear();
-    base_point_cloud.colors.clear();
+    SparseMatrix A(rotation_rows, 9*n);
+    A.setFromTriplets(triplets.begin(), triplets.end());
+    Eigen::SimplicialLDLT<SparseMatrix> rotation_solver(SparseMatrix(A.transpose() * A));
+    if (rotation_solver.info() != Eigen::Success)
+        return false;
+    const Eigen::VectorXd relaxed = rotation_solver.solve(A.transpose() * b);
 
-    if (this->_transform_graph.containsItems<envire::sam::PointCloudItem>(frame_id))
+    /** Closest rotation matrix of each relaxed solution **/
+    std::vector<Eigen::Matrix3d, Eigen::aligned_allocator<Eigen::Matrix3d> > rotations(n);
+    for (int i=0; i<n; ++i)
     {
-        /** Get point cloud **/
-        PCLPointCloud current_point_cloud = this->getPointCloud(frame_id);
+        Eigen::JacobiSVD<Eigen::Matrix3d> svd(Eigen::Map<const Eigen::Matrix3d>(relaxed.data() + 9*i),
+                Eigen::ComputeFullU | Eigen::ComputeFullV);
+        Eigen::Matrix3d S(Eigen::Matrix3d::Identity());
+        S(2,2) = (svd.matrixU() * svd.matrixV().transpose()).determinant() > 0.0 ? 1.0 : -1.0;
+        rotations[i] = svd.matrixU() * S * svd.matrixV().transpose();
+    }
 
-        /** Downsample **/
-        if (downsample)
+    /** Translations: U (t_j - t_i) = U R_i t_ij with U^T U the information of R_i t_ij **/
+    const int translation_rows = 3 * (edges.size() + 1);
+    triplets.clear();
+    b = Eigen::VectorXd::Zero(translation_rows);
+    for(size_t e = 0; e < edges.size(); ++e)
+    {
+        const int i = index[edges[e]->key1()], j = index[edges[e]->key2()];
+        const Eigen::Vector3d t_ij = rotations[i] * edges[e]->measured().translation().vector();
+        const Eigen::Matrix3d information = (rotations[i] * translation_covariances[e] * rotations[i].transpose()).inverse();
+        const Eigen::Matrix3d U = information.llt().matrixU();
+        const Eigen::Vector3d whitened = U * t_ij;
+        for (register int r=0; r<3; ++r)
         {
-            PCLPointCloudPtr current_point_cloud_ptr = boost::make_shared<PCLPointCloud>(current_point_cloud);
-            PCLPointCloudPtr downsample_point_cloud (new PCLPointCloud);
-            this->downsample (current_point_cloud_ptr, this->downsample_size, downsample_point_cloud);
-            current_point_cloud = *downsample_point_cloud;
+            for (register int k=0; k<3; ++k)
+            {
+                if (U(r,k) == 0.0)
+                    continue;
+                triplets.push_back(Eigen::Triplet<double>(3*e + r, 3*j + k, U(r,k)));
+                triplets.push_back(Eigen::Triplet<double>(3*e + r, 3*i + k, -U(r,k)));
+            }
+            b[3*e + r] = whitened[r];
         }
+    }
+    for (register int r=0; r<3; ++r)
+    {
+        triplets.push_back(Eigen::Triplet<double>(3*edges.size() + r, 3*anchor + r, anchor_weight));
+        b[3*edges.size() + r] = anchor_weight * anchor_pose.translation().vector()[r];
+    }
 
-        /** Convert to base point cloud **/
-        envire::sam::fromPCLPointCloud<PointType>(base_point_cloud, current_point_cloud);
+    A.resize(translation_rows, 3*n);
+    A.setFromTriplets(triplets.begin(), triplets.end());
+    Eigen::SimplicialLDLT<SparseMatrix> translation_solver(SparseMatrix(A.transpose() * A));
+    if (translation_solver.info() != Eigen::Success)
+        return false;
+    const Eigen::VectorXd translations = translation_solver.solve(A.transpose() * b);
+
+    /** Update the poses and move the landmarks with their first observing frame **/
+    std::map<gtsam::Key, gtsam::Pose3> corrections;
+    for(std::map<gtsam::Key, int>::const_iterator it = index.begin(); it != index.end(); ++it)
+    {
+        const gtsam::Pose3 pose(gtsam::Rot3(rotations[it->second]), gtsam::Point3(translations.segment<3>(3*it->second)));
+        corrections[it->first] = pose * values.at<gtsam::Pose3>(it->first).inverse();
+        values.update(it->first, pose);
+    }
+
+    gtsam::KeySet moved_landmarks;
+    for(gtsam::NonlinearFactorGraph::const_iterator it = this->_factor_graph.begin();
+            it != this->_factor_graph.end(); ++it)
+    {
+        boost::shared_ptr<LandmarkFactor> landmark_factor = boost::dynamic_pointer_cast<LandmarkFactor>(*it);
+        if (landmark_factor && corrections.count(landmark_factor->key1()) &&
+                values.exists(landmark_factor->key2()) && moved_landmarks.insert(landmark_factor->key2()).second)
+        {
+            values.update(landmark_factor->key2(), corrections[landmark_factor->key1()].transform_from(
+                        values.at<gtsam::Point3>(landmark_factor->key2())));
+        }
     }
+
+    return true;
 }
 
-void ESAM::currentPointCloudtoPLY(const std::string &prefixname, bool downsample)
+void ESAM::chowLiuSparsification(const gtsam::GaussianFactorGraph &marginal, const gtsam::KeySet &blanket,
+                        const gtsam::Values &linearization_point, gtsam::NonlinearFactorGraph &sparse_factors_out)
 {
-    base::samples::Pointcloud base_point_cloud;
+    /** Blanket ordering with a pose as the root of the tree **/
+    gtsam::Ordering ordering;
+    for(gtsam::KeySet::const_iterator it = blanket.begin(); it != blanket.end(); ++it)
+    {
+        if (gtsam::Symbol(*it).chr() == this->pose_key && ordering.empty())
+            ordering.push_back(*it);
+    }
+    for(gtsam::KeySet::const_iterator it = blanket.begin(); it != blanket.end(); ++it)
+    {
+        if (ordering.empty() || *it != ordering.front())
+            ordering.push_back(*it);
+    }
 
-    /** Get the current point cloud **/
-    gtsam::Symbol frame_id = gtsam::Symbol(this->pose_key, this->pose_idx-1);
+    const size_t n = ordering.size();
+    std::vector<size_t> offsets(n), dims(n);
+    size_t total_dim = 0;
+    for(size_t i = 0; i < n; ++i)
+    {
+        dims[i] = linearization_point.at(ordering[i]).dim();
+        offsets[i] = total_dim;
+        total_dim += dims[i];
+    }
 
-    if (this->_transform_graph.containsItems<envire::sam::PointCloudItem>(frame_id))
+    /** Dense information of the marginal **/
+    gtsam::Matrix information = marginal.hessian(ordering).first;
+
+    /** Relative-only information leaves the gauge free: condition on the root (a prior of infinite precision) **/
+    Eigen::SelfAdjointEigenSolver<gtsam::Matrix> eigen_solver(information, Eigen::EigenvaluesOnly);
+    const double max_eigenvalue = eigen_solver.eigenvalues().maxCoeff();
+    const bool absolute = eigen_solver.eigenvalues().minCoeff() > 1e-9 * max_eigenvalue;
+    const size_t first = absolute ? 0 : 1;
+    const size_t free_dim = total_dim - offsets[first];
+    information.diagonal().array() += this->marginalization_parameters.regularization;
+    gtsam::Matrix covariance = gtsam::Matrix::Zero(total_dim, total_dim);
+    covariance.bottomRightCorner(free_dim, free_dim) = information.bottomRightCorner(free_dim, free_dim).ldlt()
+        .solve(gtsam::Matrix::Identity(free_dim, free_dim));
+
+    /** Mutual information between each pair of variables (the anchored root has none) **/
+    std::vector<double> log_det(n, 0.0);
+    for(size_t i = first; i < n; ++i)
     {
-        /** Get the point cloud in the frame **/
-        PCLPointCloud current_point_cloud = this->getPointCloud(frame_id);
+        log_det[i] = 2.0 * gtsam::Matrix(covariance.block(offsets[i], offsets[i], dims[i], dims[i]).llt().matrixL())
+            .diagonal().array().log().sum();
+    }
 
-        /** Downsample **/
-        if (downsample)
+    gtsam::Matrix mutual_information = gtsam::Matrix::Zero(n, n);
+    for(size_t i = first; i < n; ++i)
+    {
+        for(size_t j = i+1; j < n; ++j)
         {
-            PCLPointCloudPtr current_point_cloud_ptr = boost::make_shared<PCLPointCloud>(current_point_cloud);
-            PCLPointCloudPtr downsample_point_cloud (new PCLPointCloud);
-            this->downsample (current_point_cloud_ptr, this->downsample_size, downsample_point_cloud);
-            current_point_cloud = *downsample_point_cloud;
+            gtsam::Matrix joint(dims[i]+dims[j], dims[i]+dims[j]);
+            joint << covariance.block(offsets[i], offsets[i], dims[i], dims[i]), covariance.block(offsets[i], offsets[j], dims[i], dims[j]),
+                  covariance.block(offsets[j], offsets[i], dims[j], dims[i]), covariance.block(offsets[j], offsets[j], dims[j], dims[j]);
+            const double log_det_joint = 2.0 * gtsam::Matrix(joint.llt().matrixL()).diagonal().array().log().sum();
+            mutual_information(i, j) = mutual_information(j, i) = 0.5 * (log_det[i] + log_det[j] - log_det_joint);
         }
+    }
 
-        /** Convert to base point cloud **/
-        envire::sam::fromPCLPointCloud<PointType>(base_point_cloud, current_point_cloud);
+    /** Maximum spanning tree (Prim) from the root **/
+    std::vector<bool> in_tree(n, false);
+    std::vector<size_t> parent(n, 0);
+    std::vector<double> best(n, -std::numeric_limits<double>::infinity());
+    in_tree[0] = true;
+    if (absolute)
+    {
+        for(size_t i = 1; i < n; ++i)
+        {
+            best[i] = mutual_information(0, i);
+        }
+    }
+    else if (n > 1)
+    {
+        /** The anchored root takes the variable it determines best **/
+        best[std::min_element(log_det.begin() + 1, log_det.end()) - log_det.begin()] = 0.0;
     }
 
-    /** Write to PLY **/
-    std::string filename; filename = prefixname + static_cast<std::string>(frame_id) + ".ply";
-    this->writePlyFile(base_point_cloud, filename);
-}
+    for(size_t step = 1; step < n; ++step)
+    {
+        size_t child = 0;
+        double best_mi = -std::numeric_limits<double>::infinity();
+        for(size_t i = 1; i < n; ++i)
+        {
+            if (!in_tree[i] && best[i] >= best_mi)
+            {
+                best_mi = best[i]; child = i;
+            }
+        }
+        in_tree[child] = true;
 
+        for(size_t i = 1; i < n; ++i)
+        {
+            if (!in_tree[i] && mutual_information(child, i) > best[i])
+            {
+                best[i] = mutual_information(child, i);
+                parent[i] = child;
+            }
+        }
 
-void ESAM::printMarginals()
-{
-    std::cout.precision(3);
-    for(register unsigned int i=0; i<this->pose_idx+1; ++i)
-    {
-        gtsam::Symbol frame_id(this->pose_key, i);
-        std::cout <<this->pose_key<<i<<" covariance:\n" << this->marginals->marginalCovariance(frame_id) << std::endl;
+        /** Relative constraint between the child and its parent **/
+        size_t p = parent[child], c = child;
+        if (gtsam::Symbol(ordering[p]).chr() != this->pose_key)
+            std::swap(p, c);
+
+        gtsam::Matrix joint(dims[p]+dims[c], dims[p]+dims[c]);
+        joint << covariance.block(offsets[p], offsets[p], dims[p], dims[p]), covariance.block(offsets[p], offsets[c], dims[p], dims[c]),
+              covariance.block(offsets[c], offsets[p], dims[c], dims[p]), covariance.block(offsets[c], offsets[c], dims[c], dims[c]);
+
+        gtsam::Matrix H1, H2;
+        const bool pose_p = (gtsam::Symbol(ordering[p]).chr() == this->pose_key);
+        const bool pose_c = (gtsam::Symbol(ordering[c]).chr() == this->pose_key);
+        if (pose_p && pose_c)
+        {
+            gtsam::Pose3 measurement = linearization_point.at<gtsam::Pose3>(ordering[p]).between(
+                    linearization_point.at<gtsam::Pose3>(ordering[c]), H1, H2);
+            gtsam::Matrix H(H1.rows(), H1.cols() + H2.cols()); H << H1, H2;
+            gtsam::Matrix relative_cov = H * joint * H.transpose();
+            sparse_factors_out.add(gtsam::BetweenFactor<gtsam::Pose3>(ordering[p], ordering[c], measurement,
+                        gtsam::noiseModel::Gaussian::Covariance(0.5 * (relative_cov + relative_cov.transpose()))));
+        }
+        else if (pose_p)
+        {
+            gtsam::Point3 measurement = linearization_point.at<gtsam::Pose3>(ordering[p]).transform_to(
+                    linearization_point.at<gtsam::Point3>(ordering[c]), H1, H2);
+            gtsam::Matrix H(H1.rows(), H1.cols() + H2.cols()); H << H1, H2;
+            gtsam::Matrix relative_cov = H * joint * H.transpose();
+            sparse_factors_out.add(LandmarkFactor(ordering[p], ordering[c], measurement,
+                        gtsam::noiseModel::Gaussian::Covariance(0.5 * (relative_cov + relative_cov.transpose()))));
+        }
+        else
+        {
+            gtsam::Point3 measurement = linearization_point.at<gtsam::Point3>(ordering[c]) -
+                    linearization_point.at<gtsam::Point3>(ordering[p]);
+            gtsam::Matrix H(3, 6); H << -gtsam::Matrix::Identity(3, 3), gtsam::Matrix::Identity(3, 3);
+            gtsam::Matrix relative_cov = H * joint * H.transpose();
+            sparse_factors_out.add(gtsam::BetweenFactor<gtsam::Point3>(ordering[p], ordering[c], measurement,
+                        gtsam::noiseModel::Gaussian::Covariance(0.5 * (relative_cov + relative_cov.transpose()))));
+        }
     }
 
-    for(register unsigned int i=0; i<this->landmark_idx; ++i)
+    /** Keep the absolute information as a prior on the root **/
+    if (absolute)
     {
-        gtsam::Symbol frame_id(this->landmark_key, i);
-        std::cout <<this->landmark_key<<i<<" covariance:\n" << this->marginals->marginalCovariance(frame_id) << std::endl;
+        gtsam::Matrix root_cov = covariance.block(offsets[0], offsets[0], dims[0], dims[0]);
+        if (gtsam::Symbol(ordering[0]).chr() == this->pose_key)
+        {
+            sparse_factors_out.add(gtsam::PriorFactor<gtsam::Pose3>(ordering[0], linearization_point.at<gtsam::Pose3>(ordering[0]),
+                        gtsam::noiseModel::Gaussian::Covariance(0.5 * (root_cov + root_cov.transpose()))));
+        }
+        else
+        {
+            sparse_factors_out.add(gtsam::PriorFactor<gtsam::Point3>(ordering[0], linearization_point.at<gtsam::Point3>(ordering[0]),
+                        gtsam::noiseModel::Gaussian::Covariance(0.5 * (root_cov + root_cov.transpose()))));
+        }
     }
 }
 
-
 void ESAM::pushPointCloud(const ::base::samples::Pointcloud &base_point_cloud, const int height, const int width)
 {
+    /** Decided on the queue as submitted, before waiting for it **/
+    const bool shed = this->shedding_parameters.sheddingOn && this->overloaded();
+
+    this->executor.drain();
+
+    StageTimer timer(this->latency_statistics.current.stages[CLOUD_STAGE]);
+
+    this->restorePointCloud(gtsam::Symbol(this->pose_key, this->pose_idx));
+
+    /** The frame keeps the point cloud it already has **/
+    if (shed && this->shedding_parameters.drop_clouds &&
+            this->_transform_graph.getItemCount<envire::sam::PointCloudItem>(gtsam::Symbol(this->pose_key, this->pose_idx)))
+    {
+        this->shedding_statistics.dropped_clouds++;
+        return;
+    }
+
     #ifdef DEBUG_PRINTS
     std::cout<<"Transform point cloud\n";
     std::cout<<"Number points: "<<base_point_cloud.points.size()<<"\n";
@@ -836,7 +3548,8 @@ void ESAM::pushPointCloud(const ::base::samples::Pointcloud &base_point_cloud, c
 
     /** Downsample, lost the organized point cloud **/
     PCLPointCloudPtr downsample_point_cloud (new PCLPointCloud);
-    this->downsample (radius_point_cloud, this->downsample_size, downsample_point_cloud);
+    const float leaf_size = this->budget_parameters.budgetOn ? this->pointBudgetLeafSize(*radius_point_cloud) : this->downsample_size;
+    this->downsample (radius_point_cloud, leaf_size, downsample_point_cloud);
 
     radius_point_cloud.reset();
 
@@ -849,7 +3562,12 @@ void ESAM::pushPointCloud(const ::base::samples::Pointcloud &base_point_cloud, c
 
     /** Statistical outlier removal **/
     PCLPointCloudPtr statistical_point_cloud(new PCLPointCloud);
-    if (outlier_paramaters.type == STATISTICAL)
+    if (outlier_paramaters.type == STATISTICAL && shed && this->shedding_parameters.skip_outlier_removal)
+    {
+        statistical_point_cloud = downsample_point_cloud;
+        this->shedding_statistics.skipped_outlier_removals++;
+    }
+    else if (outlier_paramaters.type == STATISTICAL)
     {
         this->statisticalOutlierRemoval(downsample_point_cloud, outlier_paramaters.parameter_one,
                 outlier_paramaters.parameter_two, statistical_point_cloud);
@@ -885,20 +3603,33 @@ void ESAM::pushPointCloud(const ::base::samples::Pointcloud &base_point_cloud, c
     std::cout<<" with "<<number_pointclouds<<" point clouds\n";
 
     /** Merge with the existing point cloud **/
+    PCLPointCloudPtr journal_point_cloud;
     if (number_pointclouds)
     {
         /** Get the current point cloud **/
         /** Get Item return an iterator to the first element **/
         envire::sam::PointCloudItem &point_cloud_item = *(this->_transform_graph.getItem<envire::sam::PointCloudItem>(frame_id));
 
+        /** Keep the cloud of a frame older than the open transaction to roll it back **/
+        if (this->transaction.open && frame_id.index() <= this->transaction.pose_idx)
+        {
+            bool kept = false;
+            for(size_t i = 0; i < this->transaction.point_clouds.size() && !kept; ++i)
+                kept = (this->transaction.point_clouds[i].first == frame_id);
+            if (!kept)
+                this->transaction.point_clouds.push_back(std::make_pair(frame_id, point_cloud_item.getData()));
+        }
+
         /** Concatenate fields **/
         point_cloud_item.getData() += *final_point_cloud;
 
         /** Downsample the union **/
         PCLPointCloudPtr point_cloud_in_node = boost::make_shared<PCLPointCloud>(point_cloud_item.getData());
         PCLPointCloudPtr downsample_point_cloud (new PCLPointCloud);
-        this->uniformsample(point_cloud_in_node, 2.0 * this->downsample_size, downsample_point_cloud);
+        const float merge_size = this->budget_parameters.budgetOn ? this->pointBudgetLeafSize(*point_cloud_in_node) : 2.0 * this->downsample_size;
+        this->uniformsample(point_cloud_in_node, merge_size, downsample_point_cloud);
         point_cloud_item.setData(*downsample_point_cloud.get());
+        journal_point_cloud = downsample_point_cloud;
 
         #ifdef DEBUG_PRINTS
         std::cout<<"Merging Point cloud with the existing one\n";
@@ -911,6 +3642,8 @@ void ESAM::pushPointCloud(const ::base::samples::Pointcloud &base_point_cloud, c
         envire::sam::PointCloudItem::Ptr point_cloud_item(new PointCloudItem);
         point_cloud_item->setData(*final_point_cloud);
         this->_transform_graph.addItemToFrame(frame_id, point_cloud_item);
+        journal_point_cloud = final_point_cloud;
+        this->transactionItem(point_cloud_item);
 
         #ifdef DEBUG_PRINTS
         std::cout<<"First time to push Point cloud\n";
@@ -920,6 +3653,19 @@ void ESAM::pushPointCloud(const ::base::samples::Pointcloud &base_point_cloud, c
 
     final_point_cloud.reset();
 
+    if (this->normal_map_parameters.normalMapOn)
+    {
+        PCLPointCloud frame_point_cloud;
+        this->copyPointCloud(frame_id, frame_point_cloud);
+        this->normal_map.insert(frame_id, frame_point_cloud,
+                this->_transform_graph.getItem<envire::sam::PoseItem>(frame_id)->getData().getTransform());
+    }
+
+    this->journalPointCloud(frame_id, journal_point_cloud);
+
+    if (this->memory_parameters.governorOn)
+        this->governMemory();
+
     #ifdef DEBUG_PRINTS
     std::cout<<"END!!\n";
     #endif
@@ -930,61 +3676,288 @@ void ESAM::pushPointCloud(const ::base::samples::Pointcloud &base_point_cloud, c
 int ESAM::keypointsPointCloud(const boost::shared_ptr<gtsam::Symbol> &frame_id, const float normal_radius, const float feature_radius)
 {
     /** Get the point cloud in the node **/
-    /** Get Item return an iterator to the first element **/
-    envire::sam::PointCloudItem &point_cloud_item = *(this->_transform_graph.getItem<envire::sam::PointCloudItem>(*frame_id));
-    PCLPointCloudPtr point_cloud_ptr = boost::make_shared<PCLPointCloud>(point_cloud_item.getData());
+    PCLPointCloudPtr point_cloud_ptr(new PCLPointCloud);
+    this->copyPointCloud(*frame_id, *point_cloud_ptr);
 
     std::cout<<"FRAME ID: ";
     frame_id->print();
 
-    /** Downsample **/
-    PCLPointCloudPtr downsample_point_cloud (new PCLPointCloud);
-    this->downsample (point_cloud_ptr, 5.0 * this->downsample_size, downsample_point_cloud);
+    /** Downsample **/
+    PCLPointCloudPtr downsample_point_cloud (new PCLPointCloud);
+    this->downsample (point_cloud_ptr, 5.0 * this->downsample_size, downsample_point_cloud);
+
+    #ifdef DEBUG_PRINTS
+    std::cout<<"DOWNSAMPLE SIZE: "<< 5.0 * this->downsample_size <<"\n";
+    std::cout<<"NORMAL RADIUS: "<< normal_radius <<"\n";
+    #endif
+
+    /**  Compute surface normals **/
+    pcl::PointCloud<pcl::Normal>::Ptr normals (new pcl::PointCloud<pcl::Normal>);
+    if (this->normal_map_parameters.normalMapOn)
+        this->mapNormals (*frame_id, downsample_point_cloud, normal_radius, normals);
+    else
+        this->computeNormals (downsample_point_cloud, normal_radius, normals);
+
+    /** Only the regions without keypoints in the recent frames, surface support from the whole cloud **/
+    PCLPointCloudPtr keypoint_point_cloud = point_cloud_ptr;
+    if (this->overlap_parameters.overlapOn)
+    {
+        keypoint_point_cloud.reset(new PCLPointCloud);
+        envire::sam::KeypointLinkItem::Ptr links_item (new KeypointLinkItem);
+        this->uncoveredPoints(*frame_id, *point_cloud_ptr, *keypoint_point_cloud, links_item->getData());
+
+        #ifdef DEBUG_PRINTS
+        std::cout<<"UNCOVERED "<<keypoint_point_cloud->size()<<" OF "<<point_cloud_ptr->size()<<" POINTS, "<<links_item->getData().size()<<" LINKED KEYPOINTS\n";
+        #endif
+
+        this->overlap_statistics.frames++;
+        this->overlap_statistics.uncovered_points += keypoint_point_cloud->size();
+        this->overlap_statistics.covered_points += point_cloud_ptr->size() - keypoint_point_cloud->size();
+        this->overlap_statistics.linked_keypoints += links_item->getData().size();
+
+        if (!links_item->getData().keypoints.empty())
+        {
+            this->_transform_graph.addItemToFrame(*frame_id, links_item);
+            this->transactionItem(links_item);
+        }
+    }
+
+    /** Compute keypoints **/
+    pcl::PointCloud<pcl::PointWithScale>::Ptr keypoints (new pcl::PointCloud<pcl::PointWithScale>);
+    if (!keypoint_point_cloud->empty())
+        this->detectKeypoints (keypoint_point_cloud, keypoint_parameters.min_scale,
+            keypoint_parameters.nr_octaves, keypoint_parameters.nr_octaves_per_scale,
+            keypoint_parameters.min_contrast, keypoints);
+
+    #ifdef DEBUG_PRINTS
+    std::cout<<"DETECTED "<<keypoints->size()<<" KEYPOINTS\n";
+    this->printKeypoints(keypoints);
+    #endif
+
+    /**  Compute PFH features **/
+    pcl::PointCloud<pcl::FPFHSignature33>::Ptr descriptors (new pcl::PointCloud<pcl::FPFHSignature33>);
+    if (keypoints->size() > 0)
+    {
+        /** Store the keypoints in the envire node **/
+        envire::sam::KeypointItem::Ptr keypoints_item (new KeypointItem);
+        keypoints_item->setData(*keypoints);
+        this->_transform_graph.addItemToFrame(*frame_id, keypoints_item);
+        this->transactionItem(keypoints_item);
+
+        /** Compute the features descriptors **/
+        this->computeFPFHFeaturesAtKeypoints (downsample_point_cloud, normals, keypoints, feature_radius, descriptors);
+
+        #ifdef DEBUG_PRINTS
+        std::cout<<"DETECTED "<<descriptors->size()<<" FEATURE DESCRIPTORS\n";
+        #endif
+
+        /** Store the features descriptors in the envire node **/
+        if (!this->binary_parameters.binaryOn || this->binary_parameters.keep_fpfh)
+        {
+            envire::sam::FPFHDescriptorItem::Ptr descriptors_item (new FPFHDescriptorItem);
+            descriptors_item->setData(*descriptors);
+            this->_transform_graph.addItemToFrame(*frame_id, descriptors_item);
+            this->transactionItem(descriptors_item);
+        }
+
+        /** And their binary codes **/
+        if (this->binary_parameters.binaryOn)
+        {
+            envire::sam::BinaryDescriptorItem::Ptr binary_item (new BinaryDescriptorItem);
+            BinaryFPFHDescriptors binary_descriptors;
+            binarizeFPFH(*descriptors, binary_descriptors);
+            binary_item->setData(binary_descriptors);
+            this->_transform_graph.addItemToFrame(*frame_id, binary_item);
+            this->transactionItem(binary_item);
+        }
+       // std::cout<<"FRAME: "<<static_cast<std::string>(*frame_id)<<" HAS "<<items.size()<<" ELEMENTS\n";
+    }
+
+    return keypoints->size();
+}
+
+void ESAM::setNormalMapParams(const NormalMapParams &params)
+{
+    this->executor.drain();
+
+    this->normal_map_parameters = params;
+    this->normal_map.reset(params.voxel_size, params.min_points);
+}
+
+void ESAM::updateNormalMap()
+{
+    for(unsigned long int i=0; i<=this->pose_idx; ++i)
+    {
+        gtsam::Symbol frame_id(this->pose_key, i);
+        if (!this->normal_map.contains(frame_id) || !this->_transform_graph.containsFrame(frame_id))
+            continue;
+
+        this->normal_map.update(frame_id, this->_transform_graph.getItem<envire::sam::PoseItem>(frame_id)->getData().getTransform());
+        this->normal_map_statistics.reposed_frames++;
+    }
+}
+
+void ESAM::rebuildNormalMap()
+{
+    this->normal_map.clear();
+    for(unsigned long int i=0; i<=this->pose_idx; ++i)
+    {
+        gtsam::Symbol frame_id(this->pose_key, i);
+        if (!this->_transform_graph.containsFrame(frame_id) ||
+                !this->_transform_graph.containsItems<envire::sam::PoseItem>(frame_id))
+            continue;
+
+        PCLPointCloud frame_point_cloud;
+        if (!this->copyPointCloud(frame_id, frame_point_cloud))
+            continue;
+
+        this->normal_map.insert(frame_id, frame_point_cloud,
+                this->_transform_graph.getItem<envire::sam::PoseItem>(frame_id)->getData().getTransform());
+    }
+}
+
+void ESAM::mapNormals(const gtsam::Symbol &frame_id, PCLPointCloud::Ptr &points,
+        float normal_radius, pcl::PointCloud<pcl::Normal>::Ptr &normals_out)
+{
+    const Eigen::Affine3d tf = this->_transform_graph.getItem<envire::sam::PoseItem>(frame_id)->getData().getTransform();
+    const Eigen::Matrix3d inverse_rotation = tf.linear().transpose();
+
+    /** Moments around each point in the world, solved in a batch **/
+    std::vector<int> covered, uncovered;
+    CovarianceBatch covariances;
+    covariances.resize(points->size());
+    for(size_t i=0; i<points->size(); ++i)
+    {
+        VoxelMoments moments;
+        if (!this->normal_map.moments(tf * Eigen::Vector3d(points->points[i].x, points->points[i].y, points->points[i].z), moments))
+        {
+            uncovered.push_back(i);
+            continue;
+        }
+        covariances.set(covered.size(), moments.covariance(), moments.count);
+        covered.push_back(i);
+    }
+    covariances.resize(covered.size());
+
+    NormalBatch normals;
+    solveNormals(covariances, normals);
+
+    normals_out->clear();
+    normals_out->points.resize(points->size());
+    for(size_t k=0; k<covered.size(); ++k)
+    {
+        const PointType &point = points->points[covered[k]];
+        Eigen::Vector3d normal = inverse_rotation * Eigen::Vector3d(normals.x[k], normals.y[k], normals.z[k]);
+
+        /** Towards the sensor as the radius search does **/
+        if (normal.dot(Eigen::Vector3d(point.x, point.y, point.z)) > 0.0)
+            normal = -normal;
+
+        pcl::Normal &point_normal = normals_out->points[covered[k]];
+        point_normal.normal_x = normal[0];
+        point_normal.normal_y = normal[1];
+        point_normal.normal_z = normal[2];
+        point_normal.curvature = normals.curvature[k];
+    }
+    normals_out->width = normals_out->points.size();
+    normals_out->height = 1;
+
+    this->normal_map_statistics.map_normals += points->size() - uncovered.size();
+    this->normal_map_statistics.computed_normals += uncovered.size();
+    if (uncovered.empty())
+        return;
+
+    /** Radius search for the points in voxels with too few points **/
+    pcl::PointCloud<pcl::Normal> computed_normals;
+    batchNormals(points, uncovered, normal_radius, computed_normals);
+    for(size_t i=0; i<uncovered.size(); ++i)
+        normals_out->points[uncovered[i]] = computed_normals.points[i];
+}
+
+void ESAM::uncoveredPoints(const gtsam::Symbol &frame_id, const PCLPointCloud &points,
+        PCLPointCloud &uncovered_out, KeypointLinks &links_out)
+{
+    typedef std::unordered_map< boost::uint64_t, std::vector< std::pair<gtsam::Key, int> > > CoverageMap;
+    const double inverse_voxel = 1.0 / this->overlap_parameters.voxel_size;
+
+    uncovered_out.clear();
+    links_out.keypoints.clear();
 
-    #ifdef DEBUG_PRINTS
-    std::cout<<"DOWNSAMPLE SIZE: "<< 5.0 * this->downsample_size <<"\n";
-    std::cout<<"NORMAL RADIUS: "<< normal_radius <<"\n";
-    #endif
+    /** Keypoints of the recent frames by voxel in the world, linked keypoints point to the frame owning them **/
+    CoverageMap coverage;
+    const unsigned long int first_frame = (frame_id.index() > this->overlap_parameters.recent_frames) ?
+        frame_id.index() - this->overlap_parameters.recent_frames : 0;
+    for(unsigned long int i=first_frame; i<frame_id.index(); ++i)
+    {
+        gtsam::Symbol recent_id(this->pose_key, i);
+        if (!this->_transform_graph.containsFrame(recent_id))
+            continue;
 
-    /**  Compute surface normals **/
-    pcl::PointCloud<pcl::Normal>::Ptr normals (new pcl::PointCloud<pcl::Normal>);
-    this->computeNormals (downsample_point_cloud, normal_radius, normals);
+        std::map<gtsam::Key, std::vector<int> > owners;
+        if (this->_transform_graph.containsItems<envire::sam::KeypointItem>(recent_id))
+        {
+            const pcl::PointCloud<pcl::PointWithScale> &keypoints = this->_transform_graph.getItem<envire::sam::KeypointItem>(recent_id)->getData();
+            std::vector<int> &indices = owners[recent_id];
+            for(size_t k=0; k<keypoints.size(); ++k)
+                indices.push_back(k);
+        }
+        if (this->_transform_graph.containsItems<envire::sam::KeypointLinkItem>(recent_id))
+        {
+            const KeypointLinks &links = this->_transform_graph.getItem<envire::sam::KeypointLinkItem>(recent_id)->getData();
+            for(std::map<gtsam::Key, std::vector<int> >::const_iterator it = links.keypoints.begin(); it != links.keypoints.end(); ++it)
+                owners[it->first].insert(owners[it->first].end(), it->second.begin(), it->second.end());
+        }
 
-    /** Compute keypoints **/
-    pcl::PointCloud<pcl::PointWithScale>::Ptr keypoints (new pcl::PointCloud<pcl::PointWithScale>);
-    this->detectKeypoints (point_cloud_ptr, keypoint_parameters.min_scale,
-            keypoint_parameters.nr_octaves, keypoint_parameters.nr_octaves_per_scale,
-            keypoint_parameters.min_contrast, keypoints);
+        for(std::map<gtsam::Key, std::vector<int> >::const_iterator owner = owners.begin(); owner != owners.end(); ++owner)
+        {
+            const gtsam::Symbol owner_id(owner->first);
+            if (!this->_transform_graph.containsFrame(owner_id) ||
+                    !this->_transform_graph.containsItems<envire::sam::KeypointItem>(owner_id))
+                continue;
+
+            const pcl::PointCloud<pcl::PointWithScale> &keypoints = this->_transform_graph.getItem<envire::sam::KeypointItem>(owner_id)->getData();
+            const Eigen::Affine3d tf = this->_transform_graph.getItem<envire::sam::PoseItem>(owner_id)->getData().getTransform();
+            for(std::vector<int>::const_iterator k = owner->second.begin(); k != owner->second.end(); ++k)
+            {
+                if (*k < 0 || static_cast<size_t>(*k) >= keypoints.size())
+                    continue;
 
-    #ifdef DEBUG_PRINTS
-    std::cout<<"DETECTED "<<keypoints->size()<<" KEYPOINTS\n";
-    this->printKeypoints(keypoints);
-    #endif
+                const Eigen::Vector3d point = tf * Eigen::Vector3d(keypoints.points[*k].x, keypoints.points[*k].y, keypoints.points[*k].z);
+                coverage[voxelKey(point[0], point[1], point[2], inverse_voxel)].push_back(std::make_pair(owner->first, *k));
+            }
+        }
+    }
 
-    /**  Compute PFH features **/
-    pcl::PointCloud<pcl::FPFHSignature33>::Ptr descriptors (new pcl::PointCloud<pcl::FPFHSignature33>);
-    if (keypoints->size() > 0)
+    /** Points in voxels without keypoints, links to the keypoints of the others **/
+    std::unordered_set<boost::uint64_t> linked_voxels;
+    const Eigen::Affine3d tf = this->_transform_graph.getItem<envire::sam::PoseItem>(frame_id)->getData().getTransform();
+    for(size_t i=0; i<points.size(); ++i)
     {
-        /** Store the keypoints in the envire node **/
-        envire::sam::KeypointItem::Ptr keypoints_item (new KeypointItem);
-        keypoints_item->setData(*keypoints);
-        this->_transform_graph.addItemToFrame(*frame_id, keypoints_item);
-
-        /** Compute the features descriptors **/
-        this->computeFPFHFeaturesAtKeypoints (downsample_point_cloud, normals, keypoints, feature_radius, descriptors);
+        const PointType &local_point = points.points[i];
+        const Eigen::Vector3d point = tf * Eigen::Vector3d(local_point.x, local_point.y, local_point.z);
+        const boost::uint64_t voxel = voxelKey(point[0], point[1], point[2], inverse_voxel);
 
-        #ifdef DEBUG_PRINTS
-        std::cout<<"DETECTED "<<descriptors->size()<<" FEATURE DESCRIPTORS\n";
-        #endif
+        CoverageMap::const_iterator covered = coverage.find(voxel);
+        if (covered == coverage.end())
+        {
+            uncovered_out.push_back(local_point);
+        }
+        else if (linked_voxels.insert(voxel).second)
+        {
+            for(std::vector< std::pair<gtsam::Key, int> >::const_iterator it = covered->second.begin(); it != covered->second.end(); ++it)
+                links_out.keypoints[it->first].push_back(it->second);
+        }
+    }
 
-        /** Store the features descriptors in the envire node **/
-        envire::sam::FPFHDescriptorItem::Ptr descriptors_item (new FPFHDescriptorItem);
-        descriptors_item->setData(*descriptors);
-        this->_transform_graph.addItemToFrame(*frame_id, descriptors_item);
-       // std::cout<<"FRAME: "<<static_cast<std::string>(*frame_id)<<" HAS "<<items.size()<<" ELEMENTS\n";
+    /** The same keypoint can be linked from several recent frames **/
+    for(std::map<gtsam::Key, std::vector<int> >::iterator it = links_out.keypoints.begin(); it != links_out.keypoints.end(); ++it)
+    {
+        std::sort(it->second.begin(), it->second.end());
+        it->second.erase(std::unique(it->second.begin(), it->second.end()), it->second.end());
     }
 
-    return keypoints->size();
+    uncovered_out.width = uncovered_out.size();
+    uncovered_out.height = 1;
 }
 
 boost::shared_ptr<gtsam::Symbol> ESAM::computeAlignedBoundingBox()
@@ -1007,14 +3980,12 @@ boost::shared_ptr<gtsam::Symbol> ESAM::computeAlignedBoundingBox()
 
     /** Get Item return an iterator to the first element **/
     envire::sam::PoseItem &current_pose_item = *(this->_transform_graph.getItem<envire::sam::PoseItem>(current_frame_id));
-    boost::shared_ptr<base::TransformWithCovariance> current_pose = boost::make_shared<base::TransformWithCovariance>(prev_pose_item.getData());
+    boost::shared_ptr<base::TransformWithCovariance> current_pose = boost::make_shared<base::TransformWithCovariance>(current_pose_item.getData());
 
-    /** Computer standard deviation **/
-    Eigen::Vector3d std_prev_pose = prev_pose->cov.block<3,3>(0,0).diagonal().array().sqrt();
-    Eigen::Vector3d std_current_pose = current_pose->cov.block<3,3>(0,0).diagonal().array().sqrt();
-    std_prev_pose[0] = 0.05; std_current_pose[0] = 0.05;
-    std_prev_pose[1] = 0.4; std_current_pose[1] = 0.4;
-    std_prev_pose[2] = 1.0; std_current_pose[2] = 1.0;
+    /** Half size of the confidence region along each axis **/
+    const double chi2 = boost::math::quantile(boost::math::chi_squared(3), this->search_parameters.confidence);
+    Eigen::Vector3d std_prev_pose = (chi2 * prev_pose->cov.block<3,3>(0,0).diagonal().array().max(0.0)).sqrt();
+    Eigen::Vector3d std_current_pose = (chi2 * current_pose->cov.block<3,3>(0,0).diagonal().array().max(0.0)).sqrt();
 
     /** Compute Bounding box limits in the global frame **/
     Eigen::Vector3d front_limit(current_pose->translation);
@@ -1056,13 +4027,48 @@ boost::shared_ptr<gtsam::Symbol> ESAM::computeAlignedBoundingBox()
 
 void ESAM::computeKeypoints()
 {
+    this->computeKeypointsAsync().get();
+}
+
+void ESAM::detectLandmarks(const base::Time &time)
+{
+    this->detectLandmarksAsync(time).get();
+}
+
+std::future<void> ESAM::computeKeypointsAsync()
+{
+    return this->executor.submit(std::bind(&ESAM::runComputeKeypoints, this));
+}
+
+std::future<void> ESAM::detectLandmarksAsync(const base::Time &time)
+{
+    return this->executor.submit(std::bind(&ESAM::runDetectLandmarks, this, time));
+}
+
+void ESAM::runComputeKeypoints()
+{
+    StageTimer timer(this->latency_statistics.current.stages[KEYPOINTS_STAGE]);
+
     /** Compute aligned bounding box from the previous to the current frame **/
     std::cout<<"COMPUTE BOUNDING BOX\n";
     boost::shared_ptr<gtsam::Symbol> frame_id = this->computeAlignedBoundingBox();
 
     /** Compute the keypoints in case of valid frame and it has point cloud **/
-    if ((*frame_id != invalid_symbol) && (this->_transform_graph.containsItems<envire::sam::PointCloudItem>(*frame_id)))
+    if ((*frame_id != invalid_symbol) && this->hasPointCloud(*frame_id))
     {
+        /** Keypoints when idle, the previous frame is still searched **/
+        if (this->shedding_parameters.sheddingOn && this->shedding_parameters.defer_keypoints && this->overloaded())
+        {
+            this->deferred_keypoints.push_back(*frame_id);
+            this->shedding_statistics.deferred_keypoints++;
+
+            this->frames_to_search = this->candidates_to_search;
+            this->frame_to_search_landmarks = this->candidate_to_search_landmarks;
+            this->candidates_to_search.clear();
+            this->candidate_to_search_landmarks.reset(new gtsam::Symbol(invalid_symbol));
+            return;
+        }
+
         /** Compute the keypoints and features of the frame **/
         std::cout<<"KEYPOINTS AND FEATURES DESCRIPTORS\n";
         this->keypointsPointCloud(frame_id, this->feature_parameters.normal_radius, this->feature_parameters.feature_radius);
@@ -1083,23 +4089,100 @@ void ESAM::computeKeypoints()
     return;
 }
 
-void ESAM::detectLandmarks(const base::Time &time)
+void ESAM::runDetectLandmarks(const base::Time &time)
 {
-    std::cout<<"DETECTING LANDMARKS FOR FRAME: "<<static_cast<std::string>(*this->frame_to_search_landmarks)<<"\n";
-    std::cout<<"TO SEARCH IN "<<this->frames_to_search.size()<<" FRAMES\n";
-
-    /** Verify that we can search for the landmarks **/
-    if (this->frames_to_search.size() > 0 &&
-            (*this->frame_to_search_landmarks) != invalid_symbol)
     {
-        /** Features Correspondences **/
-        this->featuresCorrespondences(time, this->frame_to_search_landmarks, this->frames_to_search);
+        double *stages = this->latency_statistics.current.stages;
+        StageTimer timer(stages[LANDMARKS_STAGE]);
+        const double optimize_seconds = stages[OPTIMIZE_STAGE];
+
+        std::cout<<"DETECTING LANDMARKS FOR FRAME: "<<static_cast<std::string>(*this->frame_to_search_landmarks)<<"\n";
+        std::cout<<"TO SEARCH IN "<<this->frames_to_search.size()<<" FRAMES\n";
+
+        /** Verify that we can search for the landmarks **/
+        if (this->frames_to_search.size() > 0 &&
+                (*this->frame_to_search_landmarks) != invalid_symbol)
+        {
+            /** Features Correspondences **/
+            this->featuresCorrespondences(time, this->frame_to_search_landmarks, this->frames_to_search);
+
+        }
 
+        /** The optimization triggered by the landmarks has its own stage **/
+        stages[LANDMARKS_STAGE] -= stages[OPTIMIZE_STAGE] - optimize_seconds;
     }
 
+    /** Last stage of the frame **/
+    this->endFrame();
+
+    /** Deferred keypoints after anything the callers queue, timed in the next frame **/
+    if (!this->deferred_keypoints.empty())
+        this->executor.submitIdle(std::bind(&ESAM::processDeferredKeypoints, this));
+
     return;
 }
 
+void ESAM::endFrame()
+{
+    LatencyStatistics &statistics = this->latency_statistics;
+    const LatencyParams &params = this->latency_parameters;
+
+    statistics.last = statistics.current;
+    statistics.current = FrameLatency();
+    statistics.frames++;
+
+    const double latency = statistics.last.total();
+    if (latency > params.target_latency)
+        statistics.overruns++;
+
+    if (!params.controllerOn || latency <= 0.0 || params.target_latency <= 0.0)
+        return;
+
+    /** Proportional on the logarithm: twice and half the target give the same correction **/
+    statistics.effort -= params.gain * std::log(latency / params.target_latency);
+    statistics.effort = std::min(std::max(statistics.effort, 0.0), 1.0);
+
+    /** Lower effort: bigger voxels, fewer keypoints, smaller descriptors and fewer candidates **/
+    const double effort = statistics.effort;
+    this->downsample_size = params.max_downsample_size - effort * (params.max_downsample_size - params.min_downsample_size);
+    this->keypoint_parameters.min_contrast = params.max_keypoint_contrast - effort * (params.max_keypoint_contrast - params.min_keypoint_contrast);
+    this->feature_parameters.feature_radius = params.min_feature_radius + effort * (params.max_feature_radius - params.min_feature_radius);
+    this->search_parameters.max_candidates = params.min_candidates +
+        static_cast<unsigned int>(effort * (params.max_candidates - params.min_candidates) + 0.5);
+
+    #ifdef DEBUG_PRINTS
+    std::cout<<"[LATENCY] Frame "<<latency<<" [s] target "<<params.target_latency<<" [s] effort "<<effort<<"\n";
+    #endif
+}
+
+bool ESAM::overloaded()
+{
+    const LoadSheddingParams &params = this->shedding_parameters;
+    return (params.max_latency > 0.0 && this->latency_statistics.last.total() > params.max_latency) ||
+        (params.max_queue_depth > 0 && this->executor.pending() >= params.max_queue_depth);
+}
+
+void ESAM::processDeferredKeypoints()
+{
+    /** One frame at a time and only with nothing else waiting **/
+    if (this->deferred_keypoints.empty() || this->executor.pending() > 0 || this->overloaded())
+        return;
+
+    /** Counts toward the budget of the frame in progress **/
+    StageTimer timer(this->latency_statistics.current.stages[DEFERRED_STAGE]);
+
+    boost::shared_ptr<gtsam::Symbol> frame_id(new gtsam::Symbol(this->deferred_keypoints.front()));
+    this->deferred_keypoints.pop_front();
+
+    /** The frame is a search target of the next frames **/
+    if (this->_transform_graph.containsFrame(*frame_id) && this->hasPointCloud(*frame_id))
+    {
+        std::cout<<"IDLE KEYPOINTS AND FEATURES DESCRIPTORS\n";
+        this->keypointsPointCloud(frame_id, this->feature_parameters.normal_radius, this->feature_parameters.feature_radius);
+        this->shedding_statistics.idle_keypoints++;
+    }
+}
+
 bool ESAM::intersects(const gtsam::Symbol &frame1, const gtsam::Symbol &frame2)
 {
     /** Get Spatial item of the first frame **/
@@ -1143,14 +4226,14 @@ void ESAM::containsFrames (const boost::shared_ptr<gtsam::Symbol> &container_fra
     for(register unsigned int i=0; i<this->pose_idx+1; ++i)
     {
         boost::shared_ptr<gtsam::Symbol> target_frame_id(new gtsam::Symbol(this->pose_key, i));
-        if (*target_frame_id != *container_frame_id)
+        if (*target_frame_id != *container_frame_id && !this->marginalized_frames.count(*target_frame_id))
         {
             std::cout<<"TARGET FRAME ID: "; target_frame_id->print();
 
             if (this->contains(container_frame_id, target_frame_id))
             {
                 std::cout<<"CONTAINS FOUND!\n";
-                frames_to_search.push_back(std::move(target_frame_id));
+                frames_to_search.push_back(target_frame_id);
 
                 if (std::fabs(container_frame_id->index() - target_frame_id->index()) > 10.00)
                 {
@@ -1162,14 +4245,76 @@ void ESAM::containsFrames (const boost::shared_ptr<gtsam::Symbol> &container_fra
             {
                 std::cout<<"NO FOUND!\n";
             }
+        }
+    }
+
+    /** Search first in the frames which can be closest given the relative uncertainty **/
+    std::vector< std::pair<gtsam::Symbol, gtsam::Symbol> > frame_pairs;
+    std::vector< boost::shared_ptr<gtsam::Symbol> >::const_iterator it = frames_to_search.begin();
+    for(; it != frames_to_search.end(); ++it)
+    {
+        frame_pairs.push_back(std::make_pair(*container_frame_id, *(*it)));
+    }
+
+    std::vector< ::base::TransformWithCovariance > relative_poses;
+    this->relativePoses(frame_pairs, relative_poses);
+
+    std::vector< std::pair<double, boost::shared_ptr<gtsam::Symbol> > > candidates;
+    const double chi = std::sqrt(boost::math::quantile(boost::math::chi_squared(3), this->search_parameters.confidence));
+    for(size_t i = 0; i < frames_to_search.size(); ++i)
+    {
+        /** Closest distance within the confidence region of the relative position (same confidence as the search region) **/
+        Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> eigen_solver(relative_poses[i].cov.block<3,3>(0,0), Eigen::EigenvaluesOnly);
+        const double max_std = std::sqrt(std::max(eigen_solver.eigenvalues().maxCoeff(), 0.0));
+        candidates.push_back(std::make_pair(relative_poses[i].translation.norm() - chi * max_std, frames_to_search[i]));
+    }
+    std::stable_sort(candidates.begin(), candidates.end(), closerCandidate);
+
+    /** Candidates which were not fully described bring the frames holding the rest of their keypoints right after them **/
+    frames_to_search.clear();
+    std::set<gtsam::Key> searched;
+    for(size_t i = 0; i < candidates.size(); ++i)
+    {
+        const boost::shared_ptr<gtsam::Symbol> &candidate = candidates[i].second;
+        if (searched.insert(*candidate).second)
+            frames_to_search.push_back(candidate);
+
+        if (!this->_transform_graph.containsItems<envire::sam::KeypointLinkItem>(*candidate))
+            continue;
+
+        const KeypointLinks &links = this->_transform_graph.getItem<envire::sam::KeypointLinkItem>(*candidate)->getData();
+        for(std::map<gtsam::Key, std::vector<int> >::const_iterator link = links.keypoints.begin(); link != links.keypoints.end(); ++link)
+        {
+            if (link->first != gtsam::Key(*container_frame_id) && !this->marginalized_frames.count(link->first) &&
+                    searched.insert(link->first).second)
+                frames_to_search.push_back(boost::shared_ptr<gtsam::Symbol>(new gtsam::Symbol(link->first)));
+        }
+    }
+
+    /** Keep the matching cost bounded **/
+    unsigned int max_candidates = this->search_parameters.max_candidates;
+    const unsigned int shed_candidates = this->shedding_parameters.max_candidates;
+    if (this->shedding_parameters.sheddingOn && shed_candidates > 0 && frames_to_search.size() > shed_candidates &&
+            (max_candidates == 0 || max_candidates > shed_candidates) && this->overloaded())
+    {
+        max_candidates = shed_candidates;
+        this->shedding_statistics.capped_searches++;
+    }
 
-            if (container_frame_id->index() > 88 && container_frame_id->index() < 91)
+    if (max_candidates > 0 && frames_to_search.size() > max_candidates)
+    {
+        frames_to_search.resize(max_candidates);
+    }
+
+    for(register unsigned int i=0; i<this->pose_idx+1; ++i)
+    {
+        boost::shared_ptr<gtsam::Symbol> target_frame_id(new gtsam::Symbol(this->pose_key, i));
+        if (container_frame_id->index() > 88 && container_frame_id->index() < 91)
+        {
+            if (target_frame_id->index() > 18 && target_frame_id->index() < 22 && !this->marginalized_frames.count(*target_frame_id))
             {
-                if (target_frame_id->index() > 18 && target_frame_id->index() < 22)
-                {
-                    frames_to_search.push_back(std::move(target_frame_id));
-                    std::cout<<"ARTIFICIAL LOOP CLOSURE "<<container_frame_id->index()<<" with "<<target_frame_id->index()<<"\n";
-                }
+                frames_to_search.push_back(target_frame_id);
+                std::cout<<"ARTIFICIAL LOOP CLOSURE "<<container_frame_id->index()<<" with "<<target_frame_id->index()<<"\n";
             }
         }
     }
@@ -1183,9 +4328,14 @@ void ESAM::featuresCorrespondences(const base::Time &time, const boost::shared_p
     /** At least we found one landmark **/
     bool found_landmarks = false;
 
+    /** Binary descriptors are matched by Hamming distance with the frames having them **/
+    const bool source_binary = this->binary_parameters.binaryOn &&
+        this->_transform_graph.containsItems<BinaryDescriptorItem>(*frame_id);
+    const bool source_fpfh = this->_transform_graph.containsItems<FPFHDescriptorItem>(*frame_id);
+
     /** Return in case there is not keypoints and features descriptors **/
     if (!this->_transform_graph.containsItems<KeypointItem>(*frame_id) ||
-            !this->_transform_graph.containsItems<FPFHDescriptorItem>(*frame_id))
+            (!source_binary && !source_fpfh))
     {
 
         std::cout<<"Frame does not contain keypoints and features\n";
@@ -1201,15 +4351,41 @@ void ESAM::featuresCorrespondences(const base::Time &time, const boost::shared_p
     pcl::PointCloud<pcl::PointWithScale>::Ptr source_keypoints = boost::make_shared< pcl::PointCloud<pcl::PointWithScale> >(source_keypoints_item.getData());
 
     /** Get the source descriptors **/
-    envire::sam::FPFHDescriptorItem &source_descriptors_item = *(this->_transform_graph.getItem<envire::sam::FPFHDescriptorItem>(*frame_id));
-    pcl::PointCloud<pcl::FPFHSignature33>::Ptr source_descriptors = boost::make_shared<pcl::PointCloud<pcl::FPFHSignature33> >(source_descriptors_item.getData());
+    pcl::PointCloud<pcl::FPFHSignature33>::Ptr source_descriptors (new pcl::PointCloud<pcl::FPFHSignature33>);
+    if (source_fpfh)
+        *source_descriptors = this->_transform_graph.getItem<envire::sam::FPFHDescriptorItem>(*frame_id)->getData();
 
+    BinaryFPFHDescriptors source_binary_descriptors;
+    if (source_binary)
+        source_binary_descriptors = this->_transform_graph.getItem<envire::sam::BinaryDescriptorItem>(*frame_id)->getData();
+
+    /** Relative poses (with their joint uncertainty) to all the candidate frames in one go **/
+    std::vector< std::pair<gtsam::Symbol, gtsam::Symbol> > frame_pairs;
     std::vector< boost::shared_ptr<gtsam::Symbol> >::const_iterator it = frames_to_search.begin();
     for(; it != frames_to_search.end(); ++it)
     {
+        frame_pairs.push_back(std::make_pair(*frame_id, *(*it)));
+    }
+
+    std::vector< ::base::TransformWithCovariance > relative_poses;
+    this->relativePoses(frame_pairs, relative_poses);
+
+    it = frames_to_search.begin();
+    for(; it != frames_to_search.end(); ++it)
+    {
+        /** Relative pose source to target **/
+        const ::base::TransformWithCovariance &relative_tf = relative_poses[it - frames_to_search.begin()];
+        const gtsam::Pose3 relative_pose(gtsam::Rot3(relative_tf.orientation), gtsam::Point3(relative_tf.translation));
+        const gtsam::Matrix relative_cov = swapCovarianceBlocks(relative_tf.cov);
+        const Eigen::Matrix3d relative_rot = relative_tf.orientation.toRotationMatrix();
+
+        /** Match the binary descriptors when both frames have them, the float ones otherwise **/
+        const bool binary = source_binary &&
+            this->_transform_graph.containsItems<envire::sam::BinaryDescriptorItem>(*(*it));
+
         /** In case the frame has keypoints and features descriptors **/
         if (this->_transform_graph.containsItems<envire::sam::KeypointItem>(*(*it)) &&
-                this->_transform_graph.containsItems<envire::sam::FPFHDescriptorItem>(*(*it)))
+                (binary || (source_fpfh && this->_transform_graph.containsItems<envire::sam::FPFHDescriptorItem>(*(*it)))))
         {
             /** Get the target pose **/
             envire::sam::KeypointItem &target_keypoints_item = *(this->_transform_graph.getItem<envire::sam::KeypointItem>(*(*it)));
@@ -1220,17 +4396,28 @@ void ESAM::featuresCorrespondences(const base::Time &time, const boost::shared_p
             /** Get the target keypoints **/
             pcl::PointCloud<pcl::PointWithScale>::Ptr target_keypoints = boost::make_shared< pcl::PointCloud<pcl::PointWithScale> >(target_keypoints_item.getData());
 
-            /** Get the target descriptors **/
-            /** Get Item return an iterator to the first element **/
-            envire::sam::FPFHDescriptorItem &target_descriptors_item = *(this->_transform_graph.getItem<envire::sam::FPFHDescriptorItem>(*(*it)));
-            pcl::PointCloud<pcl::FPFHSignature33>::Ptr target_descriptors = boost::make_shared<pcl::PointCloud<pcl::FPFHSignature33> >(target_descriptors_item.getData());
-
-            /** Find features correspondences **/
+            /** Find features correspondences (the scores are Hamming distances for the binary descriptors) **/
             std::vector<int> source2target;
             std::vector<float> k_squared_distances;
-            this->findFPFHFeatureCorrespondences(source_descriptors, target_descriptors, source2target, k_squared_distances);
+            std::size_t number_target_descriptors = 0;
+            if (binary)
+            {
+                const BinaryFPFHDescriptors &target_binary_descriptors = this->_transform_graph.getItem<envire::sam::BinaryDescriptorItem>(*(*it))->getData();
+                findHammingCorrespondences(source_binary_descriptors, target_binary_descriptors, source2target, k_squared_distances);
+                number_target_descriptors = target_binary_descriptors.size();
+            }
+            else
+            {
+                /** Get the target descriptors **/
+                /** Get Item return an iterator to the first element **/
+                envire::sam::FPFHDescriptorItem &target_descriptors_item = *(this->_transform_graph.getItem<envire::sam::FPFHDescriptorItem>(*(*it)));
+                pcl::PointCloud<pcl::FPFHSignature33>::Ptr target_descriptors = boost::make_shared<pcl::PointCloud<pcl::FPFHSignature33> >(target_descriptors_item.getData());
+
+                this->findFPFHFeatureCorrespondences(source_descriptors, target_descriptors, source2target, k_squared_distances);
+                number_target_descriptors = target_descriptors->size();
+            }
 
-            std::cout << "TARGET FRAME " << static_cast<std::string>(*(*it)) << " HAS" << target_descriptors->size() <<" DESCRIPTORS\n";
+            std::cout << "TARGET FRAME " << static_cast<std::string>(*(*it)) << " HAS" << number_target_descriptors <<" DESCRIPTORS\n";
 
             /** Compute the median correspondence score **/
             std::vector<float> temp(k_squared_distances);
@@ -1267,22 +4454,24 @@ void ESAM::featuresCorrespondences(const base::Time &time, const boost::shared_p
                 std::cout<<"SOURCE POINT: "<<p_source_global[1]<<"TARGET POINT: "<<p_target_global[1]<<"\n";
                 std::cout<<"SOURCE POINT: "<<p_source_global[2]<<"TARGET POINT: "<<p_target_global[2]<<"\n";
 
-                Eigen::Vector3d innovation = p_source_global - p_target_global;
+                /** Innovation in the source frame **/
+                gtsam::Matrix H_pose;
+                Eigen::Vector3d innovation = p_source - relative_pose.transform_from(gtsam::Point3(p_target), H_pose).vector();
 
                 std::cout<<"DIFF NORM: "<<innovation.norm()<<"\n";
 
-                /** Get the uncertainty of both poses **/
-                base::TransformWithCovariance add_tf(source_pose.getData());// * target_pose.getData());
-                Eigen::Matrix3d add_cov = static_cast<Eigen::Matrix3d>(add_tf.cov.block<3,3>(0,0)) +
-                    static_cast<Eigen::Matrix3d>(this->landmark_var.asDiagonal());
+                /** Uncertainty of the relative pose and of both measurements **/
+                Eigen::Matrix3d add_cov = H_pose * relative_cov * H_pose.transpose() +
+                    static_cast<Eigen::Matrix3d>(this->landmark_var.asDiagonal()) +
+                    relative_rot * this->landmark_var.asDiagonal() * relative_rot.transpose();
 
                 std::cout<<"ADD COVARIANCE:\n"<<add_cov<<"\n";
 
                 /** Compute Mahalanobis **/
                 const float mahalanobis = innovation.transpose() * add_cov.inverse() * innovation;
 
-                //if (this->acceptPointDistance(mahalanobis, this->landmark_var.size()))
-                //{
+                if (this->acceptPointDistance(mahalanobis, this->landmark_var.size()))
+                {
                     std::cout<<"POINT PASSED MAHALANOBIS TEST("<<mahalanobis<<")\n";
                     std::cout<<"MEDIAN SCORE ("<<median_score<<") PERCENTAGE ("<<percentage<<")\n";
 
@@ -1316,11 +4505,11 @@ void ESAM::featuresCorrespondences(const base::Time &time, const boost::shared_p
                         /** Increase landmark index **/
                         this->landmark_idx++;
                     }
-                //}
-                //else
-                //{
-                //    std::cout<<"MAHALANOBIS REJECTED!\n";
-                //}
+                }
+                else
+                {
+                    std::cout<<"MAHALANOBIS REJECTED!\n";
+                }
             }
         }
     }
@@ -1331,6 +4520,12 @@ void ESAM::featuresCorrespondences(const base::Time &time, const boost::shared_p
         std::cout<<"OPTIMIZE!!!\n";
         this->optimize();
 
+        /** Cull the landmarks which do not contribute **/
+        if (this->culling_parameters.cullingOn && !this->transaction.open)
+        {
+            this->cullLandmarks();
+        }
+
         /** Marginals **/
         //std::cout<<"MARGINALS!!!\n";
         //this->printMarginals();
@@ -1351,6 +4546,190 @@ void ESAM::graphViz(const std::string &filename)
     viz.write(this->_transform_graph, filename);
 }
 
+bool ESAM::readPoseGraph(const std::string &filename, const DatasetFormat format)
+{
+    this->executor.drain();
+
+    std::ifstream file(filename.c_str());
+    if (!file.is_open())
+    {
+        std::cerr<<"[READ_POSE_GRAPH] Cannot open "<<filename<<"\n";
+        return false;
+    }
+
+    std::string line;
+    unsigned int line_number = 0;
+    while (std::getline(file, line))
+    {
+        ++line_number;
+        std::istringstream stream(line);
+        std::string tag;
+        if (!(stream >> tag))
+            continue;
+
+        bool is_vertex = false, is_edge = false, valid = true;
+        unsigned long int id1 = 0, id2 = 0;
+        gtsam::Pose3 pose;
+        base::Matrix6d information; // GTSAM ordering (rotation, translation)
+
+        if (format == G2O && (tag == "VERTEX_SE3:QUAT" || tag == "EDGE_SE3:QUAT"))
+        {
+            is_edge = (tag == "EDGE_SE3:QUAT"); is_vertex = !is_edge;
+            double x, y, z, qx, qy, qz, qw;
+            valid = static_cast<bool>(stream >> id1);
+            if (is_edge) valid = valid && (stream >> id2);
+            valid = valid && (stream >> x >> y >> z >> qx >> qy >> qz >> qw);
+            pose = gtsam::Pose3(gtsam::Rot3(Eigen::Quaterniond(qw, qx, qy, qz).normalized()), gtsam::Point3(x, y, z));
+
+            /** The quaternion vector part is taken as rotation vector, as other solvers do **/
+            if (is_edge && valid && (valid = readUpperTriangular(stream, information)))
+                information = swapCovarianceBlocks(information);
+        }
+        else if (format == TORO && (tag == "VERTEX3" || tag == "EDGE3"))
+        {
+            is_edge = (tag == "EDGE3"); is_vertex = !is_edge;
+            double x, y, z, roll, pitch, yaw;
+            valid = static_cast<bool>(stream >> id1);
+            if (is_edge) valid = valid && (stream >> id2);
+            valid = valid && (stream >> x >> y >> z >> roll >> pitch >> yaw);
+            pose = gtsam::Pose3(gtsam::Rot3::RzRyRx(roll, pitch, yaw), gtsam::Point3(x, y, z));
+
+            if (is_edge && valid && (valid = readUpperTriangular(stream, information)))
+                information = swapCovarianceBlocks(information);
+        }
+        else if ((format == G2O && (tag == "VERTEX_SE2" || tag == "EDGE_SE2")) ||
+                (format == TORO && (tag == "VERTEX2" || tag == "EDGE2")))
+        {
+            is_edge = (tag == "EDGE_SE2" || tag == "EDGE2"); is_vertex = !is_edge;
+            double x, y, theta;
+            valid = static_cast<bool>(stream >> id1);
+            if (is_edge) valid = valid && (stream >> id2);
+            valid = valid && (stream >> x >> y >> theta);
+            pose = gtsam::Pose3(gtsam::Rot3::RzRyRx(0.0, 0.0, theta), gtsam::Point3(x, y, 0.0));
+
+            if (is_edge && valid)
+            {
+                /** g2o: I11 I12 I13 I22 I23 I33, TORO: I11 I12 I22 I33 I13 I23 **/
+                Eigen::Matrix3d planar;
+                if (format == G2O)
+                    valid = static_cast<bool>(stream >> planar(0,0) >> planar(0,1) >> planar(0,2) >> planar(1,1) >> planar(1,2) >> planar(2,2));
+                else
+                    valid = static_cast<bool>(stream >> planar(0,0) >> planar(0,1) >> planar(1,1) >> planar(2,2) >> planar(0,2) >> planar(1,2));
+                planar(1,0) = planar(0,1); planar(2,0) = planar(0,2); planar(2,1) = planar(1,2);
+                information = liftPlanarInformation(planar);
+            }
+        }
+
+        if (!valid)
+        {
+            std::cerr<<"[READ_POSE_GRAPH] Wrong "<<tag<<" in line "<<line_number<<" of "<<filename<<"\n";
+            return false;
+        }
+
+        if (is_vertex)
+        {
+            gtsam::Symbol frame_id(this->pose_key, id1);
+            base::TransformWithCovariance pose_with_cov(pose.translation().vector(), pose.rotation().toQuaternion());
+            pose_with_cov.cov.setZero();
+
+            if (!this->_transform_graph.containsFrame(frame_id))
+                this->_transform_graph.addFrame(frame_id);
+
+            if (this->_transform_graph.containsItems<envire::sam::PoseItem>(frame_id))
+                this->_transform_graph.getItem<envire::sam::PoseItem>(frame_id)->setData(pose_with_cov);
+            else
+                this->insertPoseValue(this->pose_key, id1, pose_with_cov);
+
+            this->pose_idx = std::max(this->pose_idx, id1);
+        }
+        else if (is_edge)
+        {
+            /** Repeated and reversed edges are measurements too, only self edges are skipped **/
+            if (id1 == id2)
+            {
+                std::cerr<<"[READ_POSE_GRAPH] Skip self edge "<<id1<<" in line "<<line_number<<"\n";
+                continue;
+            }
+
+            base::Pose delta_pose(pose.translation().vector(), pose.rotation().toQuaternion());
+            this->insertPoseFactor(this->pose_key, id1, this->pose_key, id2, base::Time(), delta_pose,
+                    static_cast<base::Matrix6d>(information.inverse()));
+
+            this->pose_idx = std::max(this->pose_idx, std::max(id1, id2));
+        }
+    }
+
+    return true;
+}
+
+bool ESAM::writePoseGraph(const std::string &filename, const DatasetFormat format)
+{
+    std::ofstream file(filename.c_str());
+    if (!file.is_open())
+    {
+        std::cerr<<"[WRITE_POSE_GRAPH] Cannot open "<<filename<<"\n";
+        return false;
+    }
+    file.precision(12);
+
+    /** Vertices at the current estimates **/
+    for(register unsigned long int i=0; i<this->pose_idx+1; ++i)
+    {
+        gtsam::Symbol frame_id(this->pose_key, i);
+        if (!this->_transform_graph.containsFrame(frame_id) ||
+                !this->_transform_graph.containsItems<envire::sam::PoseItem>(frame_id))
+            continue;
+
+        const base::TransformWithCovariance &pose = this->_transform_graph.getItem<envire::sam::PoseItem>(frame_id)->getData();
+        if (format == G2O)
+        {
+            file<<"VERTEX_SE3:QUAT "<<i<<" "<<pose.translation.x()<<" "<<pose.translation.y()<<" "<<pose.translation.z()
+                <<" "<<pose.orientation.x()<<" "<<pose.orientation.y()<<" "<<pose.orientation.z()<<" "<<pose.orientation.w()<<"\n";
+        }
+        else
+        {
+            gtsam::Vector rpy = gtsam::Rot3(pose.orientation).rpy();
+            file<<"VERTEX3 "<<i<<" "<<pose.translation.x()<<" "<<pose.translation.y()<<" "<<pose.translation.z()
+                <<" "<<rpy[0]<<" "<<rpy[1]<<" "<<rpy[2]<<"\n";
+        }
+    }
+
+    /** Edges from the pose factors **/
+    for(gtsam::NonlinearFactorGraph::const_iterator it = this->_factor_graph.begin();
+            it != this->_factor_graph.end(); ++it)
+    {
+        boost::shared_ptr< gtsam::BetweenFactor<gtsam::Pose3> > between =
+            boost::dynamic_pointer_cast< gtsam::BetweenFactor<gtsam::Pose3> >(*it);
+        if (!between)
+            continue;
+
+        gtsam::Symbol frame1(between->key1()), frame2(between->key2());
+        gtsam::noiseModel::Gaussian::shared_ptr gaussian =
+            boost::dynamic_pointer_cast<gtsam::noiseModel::Gaussian>(between->noiseModel());
+        if (frame1.chr() != this->pose_key || frame2.chr() != this->pose_key || !gaussian)
+            continue;
+
+        const gtsam::Pose3 &delta = between->measured();
+        const base::Matrix6d information = swapCovarianceBlocks(gaussian->R().transpose() * gaussian->R());
+        if (format == G2O)
+        {
+            Eigen::Quaterniond q = delta.rotation().toQuaternion();
+            file<<"EDGE_SE3:QUAT "<<frame1.index()<<" "<<frame2.index()<<" "<<delta.x()<<" "<<delta.y()<<" "<<delta.z()
+                <<" "<<q.x()<<" "<<q.y()<<" "<<q.z()<<" "<<q.w();
+        }
+        else
+        {
+            gtsam::Vector rpy = delta.rotation().rpy();
+            file<<"EDGE3 "<<frame1.index()<<" "<<frame2.index()<<" "<<delta.x()<<" "<<delta.y()<<" "<<delta.z()
+                <<" "<<rpy[0]<<" "<<rpy[1]<<" "<<rpy[2];
+        }
+        writeUpperTriangular(file, information);
+        file<<"\n";
+    }
+
+    return file.good();
+}
+
 void ESAM::writePlyFile(const base::samples::Pointcloud& points, const std::string& file)
 {
     std::ofstream data( file.c_str() );
@@ -1447,6 +4826,46 @@ void ESAM::downsample (PCLPointCloud::Ptr &points, float leaf_size, PCLPointClou
   return;
 }
 
+float ESAM::pointBudgetLeafSize(const PCLPointCloud &points)
+{
+    const PointBudgetParams &params = this->budget_parameters;
+    const double target = params.target_points;
+    float lower = params.min_leaf_size, upper = params.max_leaf_size;
+
+    /** Fewer voxels for bigger sizes: the finest size if it is already within the budget **/
+    float leaf_size = std::min(std::max(this->budget_leaf_size, lower), upper);
+    bool within_tolerance = false;
+    for(unsigned int i=0; i<params.max_iterations; ++i)
+    {
+        const double occupied = occupiedVoxels(points, leaf_size);
+        within_tolerance = std::fabs(occupied - target) <= params.tolerance * target;
+        if (within_tolerance)
+            break;
+
+        if (occupied > target)
+            lower = leaf_size;
+        else
+            upper = leaf_size;
+
+        if (upper <= lower * (1.0 + 1e-3))
+            break;
+
+        /** Bisection of the logarithm, the occupancy goes with a power of the size **/
+        leaf_size = std::sqrt(lower * upper);
+    }
+
+    /** Without a size within tolerance, the closest bound which does not exceed the budget **/
+    if (!within_tolerance)
+        leaf_size = upper;
+
+    #ifdef DEBUG_PRINTS
+    std::cout<<"POINT BUDGET LEAF SIZE: "<<leaf_size<<" FOR "<<points.size()<<" POINTS\n";
+    #endif
+
+    this->budget_leaf_size = leaf_size;
+    return leaf_size;
+}
+
 void ESAM::uniformsample (PCLPointCloud::Ptr &points, float radius_search, PCLPointCloud::Ptr &uniformsampled_out)
 {
     pcl::PointCloud<int> sampled_indices;
@@ -1528,21 +4947,8 @@ void ESAM::computeNormals (PCLPointCloud::Ptr &points,
                                 float normal_radius,
                                 pcl::PointCloud<pcl::Normal>::Ptr &normals_out)
 {
-  pcl::NormalEstimation<PointType, pcl::Normal> norm_est;
-
-  // Use a FLANN-based KdTree to perform neighborhood searches
-  //norm_est.setSearchMethod (pcl::KdTreeFLANN<PointType>::Ptr (new pcl::KdTreeFLANN<PointType>));
-  norm_est.setSearchMethod (pcl::search::KdTree<PointType>::Ptr (new pcl::search::KdTree<PointType>));
-
-
-  // Specify the size of the local neighborhood to use when computing the surface normals
-  norm_est.setRadiusSearch (normal_radius);
-
-  // Set the input points
-  norm_est.setInputCloud (points);
-
-  // Estimate the surface normals and store the result in "normals_out"
-  norm_est.compute (*normals_out);
+  // Batched covariances and closed form eigenproblems instead of pcl::NormalEstimation
+  batchNormals (points, std::vector<int>(), normal_radius, *normals_out);
 }
 
 void ESAM::computePFHFeatures (PCLPointCloud::Ptr &points,
@@ -1633,34 +5039,9 @@ void ESAM::computeFPFHFeaturesAtKeypoints (PCLPointCloud::Ptr &points,
                            pcl::PointCloud<pcl::PointWithScale>::Ptr &keypoints, float feature_radius,
                            pcl::PointCloud<pcl::FPFHSignature33>::Ptr &descriptors_out)
 {
-    // Create a FPFHEstimation object
-    pcl::FPFHEstimation<PointType, pcl::Normal, pcl::FPFHSignature33> fpfh_est;
-
-    // Set it to use a FLANN-based KdTree to perform its neighborhood searches
-    fpfh_est.setSearchMethod (pcl::search::KdTree<PointType>::Ptr (new pcl::search::KdTree<PointType>));
-
-    // Specify the radius of the PFH feature
-    fpfh_est.setRadiusSearch (feature_radius);
-
-    /* This is a little bit messy: since our keypoint detection returns PointWithScale points, but we want to
-    * use them as an input to our PFH estimation, which expects clouds of PointXYZRGBA points.  To get around this,
-    * we'll use copyPointCloud to convert "keypoints" (a cloud of type PointCloud<PointWithScale>) to
-    * "keypoints_xyzrgb" (a cloud of type PointCloud<PointXYZRGBA>).  Note that the original cloud doesn't have any RGB
-    * values, so when we copy from PointWithScale to PointXYZRGBA, the new r,g,b fields will all be zero.
-    */
-
-    PCLPointCloud::Ptr keypoints_xyzrgb (new PCLPointCloud);
-    pcl::copyPointCloud (*keypoints, *keypoints_xyzrgb);
-
-    // Use all of the points for analyzing the local structure of the cloud
-    fpfh_est.setSearchSurface (points);
-    fpfh_est.setInputNormals (normals);
-
-    // But only compute features at the keypoints
-    fpfh_est.setInputCloud (keypoints_xyzrgb);
-
-    // Compute the features
-    fpfh_est.compute (*descriptors_out);
+    // Same descriptors as pcl::FPFHEstimation with all the points as search
+    // surface and the keypoints as input, vectorized over the neighbors
+    computeFPFH<PointType, pcl::PointWithScale> (points, *normals, *keypoints, feature_radius, *descriptors_out);
 
     return;
 }
@@ -20,6 +20,7 @@
 
 /** Eigen **/
 #include <Eigen/Eigenvalues>
+#include <Eigen/SVD>
 
 /** Envire **/
 #include <envire_core/all>
@@ -46,10 +47,17 @@
 
 /** GTSAM Marginals **/
 #include <gtsam/nonlinear/Marginals.h>
+#include <gtsam/nonlinear/LinearContainerFactor.h>
 
 /** GTSAM Values to estimate **/
 #include <gtsam/nonlinear/Values.h>
 
+/** Threads of the elimination **/
+#include <gtsam/config.h>
+#ifdef GTSAM_USE_TBB
+#include <tbb/task_arena.h>
+#endif
+
 
 /** PCL **/
 #include <pcl/point_types.h>
@@ -69,13 +77,34 @@
 /** Envire SAM **/
 #include <envire_sam/Configuration.hpp>
 #include <envire_sam/Conversions.hpp>
+#include <envire_sam/Statistics.hpp>
+#include <envire_sam/SparseInverse.hpp>
+#include <envire_sam/Journal.hpp>
+#include <envire_sam/SeqLock.hpp>
+#include <envire_sam/Executor.hpp>
+#include <envire_sam/PointCloudCompression.hpp>
+#include <envire_sam/VoxelNormalMap.hpp>
+#include <envire_sam/BatchEigenSolver.hpp>
+#include <envire_sam/BatchFPFH.hpp>
+#include <envire_sam/BinaryDescriptor.hpp>
 
 /** SAM Factors **/
 #include "LandmarkTransformFactor.h"
 
 /** Standard C++ **/
+#include <map>
+#include <set>
+#include <deque>
+#include <unordered_set>
+#include <unordered_map>
+#include <chrono>
+#include <mutex>
+#include <limits>
+#include <cstdio>
 #include <vector>
+#include <future>
 #include <fstream>
+#include <sstream>
 #include <utility>
 
 namespace envire { namespace sam
@@ -89,13 +118,71 @@ namespace envire { namespace sam
     /** GTSAM Types **/
     typedef gtsam::LandmarkTransformFactor<gtsam::Pose3, gtsam::Point3> LandmarkFactor;
 
+    /** Keypoints of other frames in the regions of a frame which were not described again **/
+    struct KeypointLinks
+    {
+        //keypoint indices by frame
+        std::map<gtsam::Key, std::vector<int> > keypoints;
+
+        inline std::size_t size() const
+        {
+            std::size_t number = 0;
+            for (std::map<gtsam::Key, std::vector<int> >::const_iterator it = keypoints.begin(); it != keypoints.end(); ++it)
+                number += it->second.size();
+            return number;
+        }
+    };
+
     /** Transform Graph types **/
     typedef envire::core::SpatialItem<base::TransformWithCovariance> PoseItem;
     typedef envire::core::SpatialItem<base::Vector3d> LandmarkItem;
     typedef envire::core::Item<PCLPointCloud> PointCloudItem;
+    typedef envire::core::Item<CompressedPointCloud> CompressedPointCloudItem;
     typedef envire::core::Item< pcl::PointCloud<pcl::PointWithScale> > KeypointItem;
     typedef envire::core::Item< pcl::PointCloud<pcl::PFHSignature125> > PFHDescriptorItem;
     typedef envire::core::Item< pcl::PointCloud<pcl::FPFHSignature33> > FPFHDescriptorItem;
+    typedef envire::core::Item<BinaryFPFHDescriptors> BinaryDescriptorItem;
+    typedef envire::core::Item<KeypointLinks> KeypointLinkItem;
+
+    /** What is needed to undo the staged factors of a transaction **/
+    struct TransactionState
+    {
+        bool open;
+        size_t number_factors;
+        unsigned long int pose_idx, landmark_idx;
+        bool loop_closure_pending;
+
+        //envire edges added in the transaction
+        std::vector< std::pair<gtsam::Symbol, gtsam::Symbol> > transforms;
+
+        //items added to frames in the transaction
+        std::vector<envire::core::ItemBase::Ptr> items;
+
+        //point clouds of existing frames before the transaction merged into them
+        std::vector< std::pair<gtsam::Symbol, PCLPointCloud> > point_clouds;
+
+        //journal records appended when the transaction is committed
+        std::vector<JournalRecord> journal;
+
+        TransactionState()
+            :open(false), number_factors(0), pose_idx(0), landmark_idx(0), loop_closure_pending(false){}
+    };
+
+    /** Last optimized keyframe composed with the odometry received after it **/
+    struct FastPose
+    {
+        //time of the last odometry delta (of the keyframe without deltas)
+        base::Time time;
+
+        //covariance in the base ordering (translation, rotation)
+        base::TransformWithCovariance pose;
+
+        unsigned long int keyframe_idx;
+        unsigned int number_deltas;
+
+        FastPose()
+            :keyframe_idx(0), number_deltas(0){}
+    };
 
     /**
      * A class to perform SAM using PCL and Envire
@@ -132,12 +219,29 @@ namespace envire { namespace sam
         /** Optimization **/
         gtsam::GaussNewtonParams optimization_parameters;
 
-        /** Marginals in the estimation **/
+        /** Solver parameters **/
+        SolverParams solver_parameters;
+
+        #ifdef GTSAM_USE_TBB
+        /** Threads of the elimination, created once per solver parameters **/
+        boost::shared_ptr<tbb::task_arena> solver_arena;
+        #endif
+
+        /** Marginals in the estimation (built on demand, see currentMarginals(), reset when the graph changes) **/
         boost::shared_ptr<gtsam::Marginals> marginals;
 
         /** Values estimates **/
         gtsam::Values estimates_values;
 
+        /** Factor graph linearized at the last optimization (extended by the committed transactions) **/
+        boost::shared_ptr<gtsam::GaussianFactorGraph> linear_graph;
+
+        /** Values at which linear_graph is linearized **/
+        gtsam::Values linearization_point;
+
+        /** Frames which have been marginalized out of the factor graph **/
+        gtsam::KeySet marginalized_frames;
+
         /** Filter parameters **/
         BilateralFilterParams bfilter_paramaters;
 
@@ -150,12 +254,123 @@ namespace envire { namespace sam
         /** Feature parameters **/
         PFHFeatureParams feature_parameters;
 
+        /** Landmark culling parameters **/
+        LandmarkCullingParams culling_parameters;
+
+        /** Marginalization parameters **/
+        MarginalizationParams marginalization_parameters;
+
+        /** Candidate search parameters **/
+        CandidateSearchParams search_parameters;
+
+        /** Initialization parameters **/
+        InitializationParams initialization_parameters;
+
+        /** A loop closure was added since the last optimization **/
+        bool loop_closure_pending;
+
+        /** Transaction parameters **/
+        TransactionParams transaction_parameters;
+
+        /** Ordering parameters **/
+        OrderingParams ordering_parameters;
+
+        /** Elimination group of the variables for GROUPED_ORDERING **/
+        gtsam::FastMap<gtsam::Key, int> ordering_groups;
+
+        /** Diagnostics parameters **/
+        DiagnosticsParams diagnostics_parameters;
+
+        /** Diagnostics of the last solve **/
+        SolverDiagnostics solver_diagnostics;
+
+        /** Open transaction **/
+        TransactionState transaction;
+
+        /** Journal parameters **/
+        JournalParams journal_parameters;
+
+        /** Journal of the insertions since the last snapshot **/
+        Journal journal;
+
+        /** Records appended since the last snapshot **/
+        size_t journal_records;
+
+        /** Time of the last snapshot **/
+        base::Time journal_snapshot_time;
+
+        /** Frames whose point cloud payload in the journal is up to date **/
+        std::set<std::string> journal_payloads;
+
+        /** Time of each keyframe by pose index (null if unknown) **/
+        std::vector<base::Time> pose_times;
+
+        /** Pose items by pose index, looked up once (NULL until then) **/
+        std::vector<envire::sam::PoseItem*> pose_items;
+
+        /** Odometry deltas after the keyframe of the fast pose **/
+        std::deque< std::pair<base::Time, base::TransformWithCovariance> > odometry_deltas;
+
+        /** Serializes the writers of the fast pose **/
+        std::mutex odometry_mutex;
+
+        /** Fast pose for readers in any thread **/
+        SeqLock<FastPose> fast_pose;
+
         /** Landmark minimal var **/
         Eigen::Vector3d landmark_var;
 
         /** Downsampling factor **/
         float downsample_size;
 
+        /** Latency parameters **/
+        LatencyParams latency_parameters;
+
+        /** Stage timings and state of the latency controller **/
+        LatencyStatistics latency_statistics;
+
+        /** Load shedding parameters **/
+        LoadSheddingParams shedding_parameters;
+
+        /** Decisions of the load shedding **/
+        SheddingStatistics shedding_statistics;
+
+        /** Frames whose keypoints wait for the executor to be idle **/
+        std::deque<gtsam::Symbol> deferred_keypoints;
+
+        /** Point budget parameters **/
+        PointBudgetParams budget_parameters;
+
+        /** Last voxel size chosen for the point budget (first guess of the next search) **/
+        float budget_leaf_size;
+
+        /** Overlap keypoint parameters **/
+        OverlapKeypointParams overlap_parameters;
+
+        /** Regions skipped by the overlap keypoints **/
+        OverlapKeypointStatistics overlap_statistics;
+
+        /** Normal map parameters **/
+        NormalMapParams normal_map_parameters;
+
+        /** Use of the normal map **/
+        NormalMapStatistics normal_map_statistics;
+
+        /** Moments of the point clouds of all the frames in the world **/
+        VoxelNormalMap normal_map;
+
+        /** Binary descriptor parameters **/
+        BinaryDescriptorParams binary_parameters;
+
+        /** Memory governor parameters **/
+        MemoryGovernorParams memory_parameters;
+
+        /** Actions of the memory governor **/
+        MemoryGovernorStatistics memory_statistics;
+
+        /** Runs optimize, computeKeypoints and detectLandmarks in submission order **/
+        Executor executor;
+
     public:
 
         /** Constructors **/
@@ -264,14 +479,108 @@ namespace envire { namespace sam
 
         const std::string currentLandmarkId();
 
+        /** Same as optimizeAsync().get() **/
         void optimize();
 
+        /**@brief Optimize on the internal executor
+         *
+         * Asynchronous calls run one after the other in the order they
+         * were submitted. The insertions, removals, transactions and the
+         * journal wait for the submitted calls before changing the state,
+         * the queries do not: wait on the future (or waitAsync()) before
+         * reading the estimates. addOdometry() and getFastPose() never wait.
+         */
+        std::future<void> optimizeAsync();
+
+        /** Wait for the asynchronous calls submitted so far **/
+        inline void waitAsync() { this->executor.drain(); };
+
+        inline gtsam::GaussNewtonParams& optimizationParameters() { return this->optimization_parameters; };
+
+        inline void setOrderingParams(const OrderingParams &params) { this->ordering_parameters = params; };
+
+        inline const OrderingParams& orderingParams() { return this->ordering_parameters; };
+
+        /** Variables in lower groups are eliminated first, variables without group are in group 0 **/
+        inline void setOrderingGroups(const gtsam::FastMap<gtsam::Key, int> &groups) { this->ordering_groups = groups; };
+
+        /**@brief Elimination ordering of the current factor graph given the ordering parameters **/
+        gtsam::Ordering eliminationOrdering();
+
+        inline void setDiagnosticsParams(const DiagnosticsParams &params) { this->diagnostics_parameters = params; };
+
+        inline const DiagnosticsParams& diagnosticsParams() { return this->diagnostics_parameters; };
+
+        /** Per iteration error, step and residuals of the last solve (when diagnostics are on) **/
+        inline const SolverDiagnostics& solverDiagnostics() { return this->solver_diagnostics; };
+
+        /**@brief Number of threads of the elimination
+         *
+         * The optimizer and the marginals run in a TBB arena of that many
+         * threads, created here and kept until the next call.
+         */
+        void setSolverParams(const SolverParams &params);
+
+        inline const SolverParams& solverParams() { return this->solver_parameters; };
+
         ::base::TransformWithCovariance getTransformPose(const std::string &frame_id);
 
         ::base::samples::RigidBodyState getRbsPose(const std::string &frame_id);
 
         std::vector< ::base::samples::RigidBodyState > getRbsPoses();
 
+        inline size_t numberPoses() { return this->pose_idx + 1; };
+
+        /**@brief Trajectory of all the poses into caller arrays
+         *
+         * Arrays of numberPoses() rows: timestamps in microseconds,
+         * positions (x, y, z), orientations (x, y, z, w) and optionally
+         * covariances as 6x6 row-major in the base ordering (translation,
+         * rotation). Poses without estimate are NaN.
+         *
+         * @return number of poses written
+         */
+        size_t exportTrajectory(boost::int64_t *timestamps, double *positions, double *orientations,
+                double *covariances = NULL);
+
+        /**@brief Binary trajectory file
+         *
+         * uint32 magic, uint32 version, uint64 number of poses, uint8
+         * with covariances, then the arrays of exportTrajectory() one
+         * after the other (native endianness).
+         */
+        bool writeTrajectory(const std::string &filename, const bool covariances = true);
+
+        static bool readTrajectory(const std::string &filename, std::vector<boost::int64_t> &timestamps,
+                std::vector<double> &positions, std::vector<double> &orientations, std::vector<double> &covariances);
+
+        /**@brief Odometry delta since the previous one, at high rate
+         *
+         * Composed with the last optimized keyframe into the fast pose.
+         * The deltas up to the time of a keyframe are dropped once that
+         * keyframe is optimized.
+         */
+        void addOdometry(const base::Time &time, const ::base::TransformWithCovariance &delta_pose_with_cov);
+
+        /**@brief Last optimized keyframe composed with the odometry after it
+         *
+         * Lock-free, it can be called from any thread at any rate.
+         */
+        inline FastPose getFastPose() const { return this->fast_pose.load(); };
+
+        ::base::samples::RigidBodyState getFastRbsPose() const;
+
+        /**@brief Relative pose between frame pairs
+         *
+         * Relative transformation source to target for each pair with
+         * its covariance from the joint marginal of the pair. Frames
+         * without estimate use their envire poses as independent, pairs
+         * with a frame without pose keep a default transform.
+         * Covariances follow the base ordering (translation, rotation).
+         */
+        void relativePoses(const std::vector< std::pair<gtsam::Symbol, gtsam::Symbol> > &frame_pairs,
+                std::vector< ::base::TransformWithCovariance > &relative_poses_out);
+
         void pushPointCloud(const ::base::samples::Pointcloud &base_point_cloud, const int height, const int width);
 
         int keypointsPointCloud(const boost::shared_ptr<gtsam::Symbol> &frame_id, const float normal_radius, const float feature_radius);
@@ -294,10 +603,18 @@ namespace envire { namespace sam
 
         boost::shared_ptr<gtsam::Symbol> computeAlignedBoundingBox();
 
+        /** Same as computeKeypointsAsync().get() **/
         void computeKeypoints();
 
+        /** Same as detectLandmarksAsync(time).get() **/
         void detectLandmarks(const base::Time &time);
 
+        /** computeKeypoints() on the executor, see optimizeAsync() for the ordering **/
+        std::future<void> computeKeypointsAsync();
+
+        /** detectLandmarks() on the executor, see optimizeAsync() for the ordering **/
+        std::future<void> detectLandmarksAsync(const base::Time &time);
+
         bool intersects(const gtsam::Symbol &frame1, const gtsam::Symbol &frame2);
 
         bool contains(const boost::shared_ptr<gtsam::Symbol> &container_frame, const boost::shared_ptr<gtsam::Symbol> &query_frame);
@@ -306,14 +623,267 @@ namespace envire { namespace sam
 
         void featuresCorrespondences(const base::Time &time, const boost::shared_ptr<gtsam::Symbol> &frame_id, const std::vector< boost::shared_ptr<gtsam::Symbol> > &frames_to_search);
 
+        inline void setCandidateSearchParams(const CandidateSearchParams &params) { this->search_parameters = params; };
+
+        inline const CandidateSearchParams& candidateSearchParams() { return this->search_parameters; };
+
+        inline void setInitializationParams(const InitializationParams &params) { this->initialization_parameters = params; };
+
+        inline const InitializationParams& initializationParams() { return this->initialization_parameters; };
+
+        /**@brief Latency controller
+         *
+         * When on, after each detectLandmarks() the frame latency moves the
+         * voxel size, the SIFT minimum contrast, the feature radius and
+         * the maximum number of candidate frames within their bounds
+         * toward the target latency.
+         */
+        inline void setLatencyParams(const LatencyParams &params) { this->latency_parameters = params; };
+
+        inline const LatencyParams& latencyParams() { return this->latency_parameters; };
+
+        /** Time per stage of the frames and effort of the controller **/
+        inline const LatencyStatistics& latencyStatistics() { return this->latency_statistics; };
+
+        /**@brief Load shedding
+         *
+         * While overloaded (last frame latency or executor queue over
+         * the limits) drops the extra point clouds of a frame, skips the
+         * statistical outlier removal, defers the keypoints of the frame
+         * and caps the candidate frames. Each decision is counted. The
+         * deferred keypoints run as idle tasks of the executor, timed in
+         * the DEFERRED_STAGE of the frame in progress.
+         */
+        inline void setLoadSheddingParams(const LoadSheddingParams &params) { this->shedding_parameters = params; };
+
+        inline const LoadSheddingParams& loadSheddingParams() { return this->shedding_parameters; };
+
+        inline const SheddingStatistics& sheddingStatistics() { return this->shedding_statistics; };
+
+        inline float downsampleSize() { return this->downsample_size; };
+
+        inline const SIFTKeypointParams& keypointParams() { return this->keypoint_parameters; };
+
+        inline const PFHFeatureParams& featureParams() { return this->feature_parameters; };
+
+        /**@brief Stage the factors inserted from now on
+         *
+         * optimize() is deferred until the transaction is committed or
+         * rolled back. Factors must only be added (no culling or
+         * marginalization) while the transaction is open.
+         */
+        void beginTransaction();
+
+        /**@brief Solve incrementally and keep the staged factors if they
+         * pass the chi-square test, otherwise roll back
+         *
+         * Only the factors added since the last optimize() are
+         * linearized, the rest of the linear system is the one kept from
+         * it. The solution is one Gauss-Newton step from that
+         * linearization point and the pose covariances are recovered from
+         * the same system. optimize() relinearizes the whole graph.
+         *
+         * @return true if committed
+         */
+        bool commitTransaction();
+
+        /**@brief Remove the staged factors, edges, frames and the items
+         * added to existing frames **/
+        void rollbackTransaction();
+
+        inline bool inTransaction() { return this->transaction.open; };
+
+        inline void setTransactionParams(const TransactionParams &params) { this->transaction_parameters = params; };
+
+        inline const TransactionParams& transactionParams() { return this->transaction_parameters; };
+
+        /**@brief Journal every insertion from now on
+         *
+         * Writes a snapshot of the current state to the directory and
+         * appends each factor, value and point cloud reference inserted
+         * afterwards. Records are written and synced by a background
+         * thread, a crash loses at most the last flush period.
+         */
+        bool startJournal(const JournalParams &params);
+
+        /** Flush and close the journal **/
+        void stopJournal();
+
+        /** Snapshot the current state and drop the records it covers **/
+        bool compactJournal();
+
+        /**@brief Replace the current state by the journal in the directory
+         *
+         * Loads the last snapshot and replays the records after it. The
+         * journal is stopped, start it again to keep journaling.
+         *
+         * @return false if there is no snapshot in the directory
+         */
+        bool recoverJournal(const std::string &directory);
+
+        inline bool journalOn() { return this->journal.isOpen(); };
+
+        inline const JournalParams& journalParams() { return this->journal_parameters; };
+
+        int cullLandmarks();
+
+        void removeLandmarks(const gtsam::KeySet &landmarks);
+
+        inline void setLandmarkCullingParams(const LandmarkCullingParams &params) { this->culling_parameters = params; };
+
+        inline const LandmarkCullingParams& landmarkCullingParams() { return this->culling_parameters; };
+
+        /**@brief Replace the frames by the marginal on their Markov blanket
+         *
+         * Landmarks are removed. Poses keep their envire frame, sensor data
+         * and last estimate but leave the factor graph: factors involving
+         * them are rejected and they are not searched for correspondences.
+         * The journal records the frames and the marginal factors.
+         */
+        void marginalizeFrames(const gtsam::KeySet &frames);
+
+        inline const gtsam::KeySet& marginalizedFrames() { return this->marginalized_frames; };
+
+        inline void setMarginalizationParams(const MarginalizationParams &params) { this->marginalization_parameters = params; };
+
+        inline const MarginalizationParams& marginalizationParams() { return this->marginalization_parameters; };
+
+        void currentEstimates(const gtsam::KeySet &keys, gtsam::Values &values);
+
+        /**@brief Global initialization of the poses
+         *
+         * Rotations from the chordal relaxation of the relative pose
+         * factors projected to SO(3), then translations from the
+         * linear system given those rotations. Landmarks follow the
+         * first frame observing them.
+         *
+         * @return false if there are no relative pose factors
+         */
+        bool chordalInitialization(gtsam::Values &values);
+
+        /**@brief Marginal covariances of many variables at once
+         *
+         * Recovers the block diagonal of the inverse information at the
+         * last estimates in a single sweep over its sparse factor.
+         *
+         * @return false if the information is not positive definite or a
+         * key (of the query or of a factor) has no estimate
+         */
+        bool marginalCovariances(const gtsam::KeySet &keys, std::map<gtsam::Key, gtsam::Matrix> &covariances);
+
+        /**@brief Marginals at the last estimates
+         *
+         * optimize() only recovers the pose covariances with
+         * marginalCovariances(), the full marginals are factorized at the
+         * first call after each optimization.
+         */
+        boost::shared_ptr<gtsam::Marginals> currentMarginals();
+
         void printMarginals();
 
+        /**@brief Resources used by the factor graph and the map
+         *
+         * Counts and approximate resident bytes per category and per
+         * frame. Linear in the number of factors and frames, without
+         * touching the marginals.
+         */
+        MemoryUsage memoryUsage();
+
+        /**@brief Keypoints only where the recent frames have none
+         *
+         * When on, keypointsPointCloud() detects keypoints only in the
+         * points whose voxel holds no keypoint (own or linked) of the
+         * recent frames and stores a KeypointLinkItem with those
+         * keypoints for the rest. A frame selected as search target
+         * brings its linked frames right after it, within the same
+         * maximum number of frames to search.
+         */
+        inline void setOverlapKeypointParams(const OverlapKeypointParams &params) { this->overlap_parameters = params; };
+
+        inline const OverlapKeypointParams& overlapKeypointParams() { return this->overlap_parameters; };
+
+        inline const OverlapKeypointStatistics& overlapKeypointStatistics() { return this->overlap_statistics; };
+
+        /**@brief Point budget per frame
+         *
+         * When on, pushPointCloud() downsamples (and merges) with the
+         * voxel size whose number of occupied voxels is closest to the
+         * target, searched in logarithmic steps between the bounds
+         * starting from the size of the previous point cloud.
+         */
+        inline void setPointBudgetParams(const PointBudgetParams &params) { this->budget_parameters = params; };
+
+        inline const PointBudgetParams& pointBudgetParams() { return this->budget_parameters; };
+
+        inline float budgetLeafSize() { return this->budget_leaf_size; };
+
+        /**@brief Normals from a map shared by all the frames
+         *
+         * When on, pushPointCloud() adds the point cloud of the frame to a
+         * world voxel map of point moments, optimize() moves the frames to
+         * their new poses and keypointsPointCloud() reads the normals from
+         * the map. Setting the parameters clears the map. The scale of the
+         * map normals is the voxel size, the normal radius is only used for
+         * the points of voxels with too few points.
+         */
+        void setNormalMapParams(const NormalMapParams &params);
+
+        inline const NormalMapParams& normalMapParams() { return this->normal_map_parameters; };
+
+        inline const NormalMapStatistics& normalMapStatistics() { return this->normal_map_statistics; };
+
+        inline const VoxelNormalMap& normalMap() { return this->normal_map; };
+
+        /**@brief Binarized FPFH descriptors
+         *
+         * When on, keypointsPointCloud() stores a binary code of the FPFH of
+         * each keypoint and the correspondences between frames having them
+         * are searched by Hamming distance.
+         */
+        inline void setBinaryDescriptorParams(const BinaryDescriptorParams &params) { this->binary_parameters = params; };
+
+        inline const BinaryDescriptorParams& binaryDescriptorParams() { return this->binary_parameters; };
+
+        /**@brief Keep the memory within the budget of the governor
+         *
+         * Escalates while over the thresholds: compresses the point
+         * clouds of the old frames, spills them to disk, culls landmarks,
+         * marginalizes old keyframes and finally drops the sensor data of
+         * the oldest frames. Runs after each pushPointCloud() and
+         * optimize() when the governor is on. Compressed point clouds
+         * come back on access through getPointCloud().
+         */
+        void governMemory();
+
+        inline void setMemoryGovernorParams(const MemoryGovernorParams &params) { this->memory_parameters = params; };
+
+        inline const MemoryGovernorParams& memoryGovernorParams() { return this->memory_parameters; };
+
+        inline const MemoryGovernorStatistics& memoryGovernorStatistics() { return this->memory_statistics; };
+
         inline gtsam::NonlinearFactorGraph& factor_graph() { return this->_factor_graph; };
 
+        inline const envire::core::EnvireGraph& transform_graph() { return this->_transform_graph; };
+
         void printFactorGraph(const std::string &title);
 
         void graphViz(const std::string &filename);
 
+        /**@brief Load a pose graph dataset
+         *
+         * Vertices become pose values and edges between pose factors
+         * with the key of this ESAM. Repeated (or reversed) edges are all
+         * factors, the envire graph keeps one transform per pair of
+         * frames. The first vertex is expected to be at the origin given
+         * by the prior of the constructor.
+         *
+         * @return false if the file cannot be read or has a wrong line
+         */
+        bool readPoseGraph(const std::string &filename, const DatasetFormat format);
+
+        /**@brief Write the current pose estimates and pose factors as dataset **/
+        bool writePoseGraph(const std::string &filename, const DatasetFormat format);
+
         void writePlyFile(const base::samples::Pointcloud& points, const std::string& file);
 
         int getPoseCorrespodences(std::vector<int> &pose_correspodences);
@@ -322,6 +892,25 @@ namespace envire { namespace sam
 
         void downsample (PCLPointCloud::Ptr &points, float leaf_size, PCLPointCloud::Ptr &downsampled_out);
 
+        /** Both frames exist and envire has a transform between them (either direction) **/
+        bool containsTransform(const gtsam::Symbol &frame1, const gtsam::Symbol &frame2);
+
+        /** Any of the frames has been marginalized (the factor between them is rejected) **/
+        bool marginalizedFactor(const gtsam::Symbol &frame1, const gtsam::Symbol &frame2);
+
+        float pointBudgetLeafSize(const PCLPointCloud &points);
+
+        void updateNormalMap();
+
+        /** Insert the point clouds of all the frames at their poses in an empty map **/
+        void rebuildNormalMap();
+
+        void mapNormals(const gtsam::Symbol &frame_id, PCLPointCloud::Ptr &points,
+                float normal_radius, pcl::PointCloud<pcl::Normal>::Ptr &normals_out);
+
+        void uncoveredPoints(const gtsam::Symbol &frame_id, const PCLPointCloud &points,
+                PCLPointCloud &uncovered_out, KeypointLinks &links_out);
+
         void uniformsample (PCLPointCloud::Ptr &points, float leaf_size, PCLPointCloud::Ptr &uniformsampled_out);
 
         void removePointsWithoutColor (const PCLPointCloud::Ptr &points, PCLPointCloud::Ptr &points_out);
@@ -367,6 +956,82 @@ namespace envire { namespace sam
 
         bool acceptPointDistance(const float &mahalanobis2, const int dof);
 
+        void runOptimize();
+
+        void runComputeKeypoints();
+
+        void runDetectLandmarks(const base::Time &time);
+
+        void endFrame();
+
+        bool hasPointCloud(const std::string &frame_id);
+
+        bool copyPointCloud(const std::string &frame_id, PCLPointCloud &point_cloud);
+
+        bool restorePointCloud(const std::string &frame_id);
+
+        std::size_t compressFramePointCloud(const std::string &frame_id);
+
+        std::size_t spillFramePointCloud(const std::string &frame_id);
+
+        void dropFrameData(const std::string &frame_id);
+
+        bool overloaded();
+
+        void processDeferredKeypoints();
+
+        /** Gauss-Newton in the solver arena **/
+        gtsam::Values solve(const gtsam::Values &initial_estimate);
+
+        gtsam::Values gaussNewton(const gtsam::Values &initial_estimate);
+
+        #ifdef GTSAM_USE_TBB
+        tbb::task_arena& solverArena();
+        #endif
+
+        JournalRecord journalHeader(const JournalRecordType type);
+
+        bool encodeFactor(const gtsam::NonlinearFactor::shared_ptr &factor, JournalRecord &record);
+
+        void journalFactor(const gtsam::NonlinearFactor::shared_ptr &factor);
+
+        void journalValue(const std::string &frame_id, const ::base::TransformWithCovariance &pose_with_cov);
+
+        void journalValue(const std::string &frame_id, const ::base::Vector3d &landmark);
+
+        /** The journal thread writes the cloud, it must not change afterwards **/
+        void journalPointCloud(const gtsam::Symbol &frame_id, const PCLPointCloudPtr &point_cloud);
+
+        void appendJournal(const JournalRecord &record);
+
+        void journalSnapshot(std::vector<JournalRecord> &records, std::set<std::string> &payloads);
+
+        /** Remove the factors involving the frames, their estimates and keep them as marginalized **/
+        void dropMarginalizedFrames(const gtsam::KeySet &frames);
+
+        bool applyJournalRecord(JournalRecord &record);
+
+        void updateEstimates(const gtsam::Values &result);
+
+        /**@brief Store the result with the linear system it was solved
+         * from, which is kept for the next transactions **/
+        void updateEstimates(const gtsam::Values &result, const boost::shared_ptr<gtsam::GaussianFactorGraph> &linear,
+                        const gtsam::Values &linearization_point);
+
+        bool marginalCovariances(const gtsam::GaussianFactorGraph &linear, const gtsam::KeySet &keys,
+                        std::map<gtsam::Key, gtsam::Matrix> &covariances);
+
+        void transactionItem(const envire::core::ItemBase::Ptr &item);
+
+        void stampPose(const unsigned long int &idx, const base::Time &time);
+
+        envire::sam::PoseItem* poseItem(const unsigned long int &idx);
+
+        void publishFastPose(const unsigned long int &keyframe_idx);
+
+        void chowLiuSparsification(const gtsam::GaussianFactorGraph &marginal, const gtsam::KeySet &blanket,
+                        const gtsam::Values &linearization_point, gtsam::NonlinearFactorGraph &sparse_factors_out);
+
 
     public:
         EIGEN_MAKE_ALIGNED_OPERATOR_NEW //Structures having Eigen members
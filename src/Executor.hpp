@@ -0,0 +1,179 @@
+/**\file Executor.hpp
+ *
+ * Single thread executor running tasks in submission order
+ *
+ * Tasks return a future. A task submitted from the executor thread
+ * itself runs in place, so tasks can call the synchronous methods built
+ * on top of the executor. Idle tasks only start when no regular task is
+ * waiting.
+ *
+ * @author Javier Hidalgo Carrio et. al
+ * See LICENSE for the license information
+ *
+ */
+
+
+#ifndef __ENVIRE_SAM_EXECUTOR__
+#define __ENVIRE_SAM_EXECUTOR__
+
+#include <deque>
+#include <cstddef>
+#include <thread>
+#include <mutex>
+#include <future>
+#include <memory>
+#include <functional>
+#include <type_traits>
+#include <condition_variable>
+
+namespace envire { namespace sam
+{
+
+    class Executor
+    {
+    private:
+        std::deque< std::function<void ()> > queue, idle_queue;
+        std::mutex mutex;
+        std::condition_variable condition, idle_condition;
+        std::thread thread;
+        bool stop, busy;
+
+    public:
+        Executor()
+            :stop(false), busy(false)
+        {
+            this->thread = std::thread(&Executor::run, this);
+        }
+
+        /** Runs the queued tasks before returning **/
+        ~Executor()
+        {
+            this->shutdown();
+        }
+
+        /**@brief Queue a task after the ones already submitted
+         *
+         * Exceptions of the task are rethrown by the get() of the future.
+         */
+        template<typename F>
+        std::future<typename std::result_of<F()>::type> submit(F function)
+        {
+            typedef typename std::result_of<F()>::type R;
+            std::shared_ptr< std::packaged_task<R ()> > task(new std::packaged_task<R ()>(function));
+            std::future<R> future = task->get_future();
+
+            /** Nested submission, queueing it would wait for itself **/
+            if (this->inWorker() || !this->thread.joinable())
+            {
+                (*task)();
+                return future;
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(this->mutex);
+                this->queue.push_back([task](){ (*task)(); });
+            }
+            this->condition.notify_one();
+            return future;
+        }
+
+        /**@brief Queue a task to run when no regular task is waiting
+         *
+         * Also queued from the executor thread (it runs after the current
+         * task), in place only once the executor is shut down.
+         */
+        template<typename F>
+        std::future<typename std::result_of<F()>::type> submitIdle(F function)
+        {
+            typedef typename std::result_of<F()>::type R;
+            std::shared_ptr< std::packaged_task<R ()> > task(new std::packaged_task<R ()>(function));
+            std::future<R> future = task->get_future();
+
+            if (!this->thread.joinable())
+            {
+                (*task)();
+                return future;
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(this->mutex);
+                this->idle_queue.push_back([task](){ (*task)(); });
+            }
+            this->condition.notify_one();
+            return future;
+        }
+
+        /**@brief Wait until all the submitted tasks (idle ones too) are done
+         *
+         * No-op from the executor thread.
+         */
+        void drain()
+        {
+            if (this->inWorker())
+                return;
+
+            std::unique_lock<std::mutex> lock(this->mutex);
+            this->idle_condition.wait(lock, [this]{ return this->queue.empty() && this->idle_queue.empty() && !this->busy; });
+        }
+
+        /** Regular tasks waiting to start **/
+        std::size_t pending()
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            return this->queue.size();
+        }
+
+        /** Idle tasks waiting to start **/
+        std::size_t pendingIdle()
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            return this->idle_queue.size();
+        }
+
+        inline bool inWorker() const { return std::this_thread::get_id() == this->thread.get_id(); };
+
+        /** Run the queued tasks and stop the thread, later tasks run in the caller **/
+        void shutdown()
+        {
+            if (!this->thread.joinable() || this->inWorker())
+                return;
+
+            {
+                std::lock_guard<std::mutex> lock(this->mutex);
+                this->stop = true;
+            }
+            this->condition.notify_one();
+            this->thread.join();
+        }
+
+    private:
+
+        void run()
+        {
+            std::unique_lock<std::mutex> lock(this->mutex);
+            while (true)
+            {
+                this->condition.wait(lock, [this]{ return !this->queue.empty() || !this->idle_queue.empty() || this->stop; });
+                if (this->queue.empty() && this->idle_queue.empty())
+                    break;
+
+                /** Regular tasks first **/
+                std::deque< std::function<void ()> > &next = this->queue.empty() ? this->idle_queue : this->queue;
+                std::function<void ()> task = std::move(next.front());
+                next.pop_front();
+                this->busy = true;
+                lock.unlock();
+
+                task();
+
+                lock.lock();
+                this->busy = false;
+                if (this->queue.empty() && this->idle_queue.empty())
+                    this->idle_condition.notify_all();
+            }
+        }
+    };
+
+}}
+
+#endif
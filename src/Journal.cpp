@@ -0,0 +1,388 @@
+/**\file Journal.cpp
+ *
+ * Append-only binary journal of the ESAM insertions with snapshot
+ * compaction
+ *
+ * @author Javier Hidalgo Carrio et. al
+ * See LICENSE for the license information
+ *
+ */
+
+#include "Journal.hpp"
+
+#include <boost/crc.hpp>
+
+#include <cstdio>
+#include <cerrno>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+using namespace envire::sam;
+
+static const boost::uint32_t journal_magic = 0x4c4e524a; //JRNL
+static const boost::uint32_t snapshot_magic = 0x50414e53; //SNAP
+
+/** Write all the bytes, retrying on partial writes **/
+static bool writeAll(const int fd, const char *data, std::size_t size)
+{
+    while (size > 0)
+    {
+        const ssize_t written = ::write(fd, data, size);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        data += written;
+        size -= written;
+    }
+    return true;
+}
+
+/** Record framing on disk: uint32 size, uint32 crc32 of the bytes, bytes **/
+static void frameRecord(const std::string &bytes, std::string &buffer)
+{
+    boost::crc_32_type crc;
+    crc.process_bytes(bytes.data(), bytes.size());
+    const boost::uint32_t size = bytes.size(), checksum = crc.checksum();
+    buffer.append(reinterpret_cast<const char*>(&size), sizeof(size));
+    buffer.append(reinterpret_cast<const char*>(&checksum), sizeof(checksum));
+    buffer.append(bytes);
+}
+
+/** Read framed records until the end of the stream, false at a torn or corrupted record **/
+static bool readRecords(std::istream &stream, std::vector<JournalRecord> &records)
+{
+    boost::uint32_t size = 0, checksum = 0;
+    while (stream.read(reinterpret_cast<char*>(&size), sizeof(size)))
+    {
+        std::string bytes(size, '\0');
+        if (!stream.read(reinterpret_cast<char*>(&checksum), sizeof(checksum)) ||
+                !stream.read(&bytes[0], size))
+            return false;
+
+        boost::crc_32_type crc;
+        crc.process_bytes(bytes.data(), bytes.size());
+        if (crc.checksum() != checksum)
+            return false;
+
+        records.push_back(JournalRecord(bytes));
+    }
+
+    /** A partial size field is a torn record too **/
+    return stream.gcount() == 0;
+}
+
+static bool readHeader(std::istream &stream, const boost::uint32_t magic, boost::uint32_t *value = NULL)
+{
+    boost::uint32_t file_magic = 0, file_value = 0;
+    if (!stream.read(reinterpret_cast<char*>(&file_magic), sizeof(file_magic)) || file_magic != magic)
+        return false;
+
+    if (value)
+    {
+        if (!stream.read(reinterpret_cast<char*>(&file_value), sizeof(file_value)))
+            return false;
+        *value = file_value;
+    }
+    return true;
+}
+
+static bool exists(const std::string &filename)
+{
+    struct stat info;
+    return ::stat(filename.c_str(), &info) == 0;
+}
+
+Journal::Journal()
+    :flush_period(1.0), fd(-1), segment(0), first_segment(0), stop(false)
+{
+}
+
+Journal::~Journal()
+{
+    this->close();
+}
+
+bool Journal::open(const std::string &directory, const double flush_period)
+{
+    this->close();
+
+    if (::mkdir(directory.c_str(), 0755) != 0 && errno != EEXIST)
+    {
+        std::cerr<<"[JOURNAL] Cannot create "<<directory<<"\n";
+        return false;
+    }
+
+    this->directory = directory;
+    this->flush_period = std::chrono::duration<double>(flush_period);
+    this->payload_files.clear();
+
+    /** Continue after the segments of the last snapshot, they are removed by the next one **/
+    boost::uint32_t first = 0;
+    std::ifstream snapshot_file(snapshotName(directory).c_str(), std::ios::binary);
+    if (!snapshot_file.is_open() || !readHeader(snapshot_file, snapshot_magic, &first))
+        first = 0;
+
+    unsigned int number = first;
+    while (exists(segmentName(directory, number)))
+        ++number;
+
+    this->first_segment = first;
+    if (!this->openSegment(number))
+        return false;
+
+    this->stop = false;
+    this->thread = std::thread(&Journal::run, this);
+    return true;
+}
+
+void Journal::close()
+{
+    if (!this->thread.joinable())
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->stop = true;
+    }
+    this->condition.notify_one();
+    this->thread.join();
+
+    ::close(this->fd);
+    this->fd = -1;
+}
+
+void Journal::append(const JournalRecord &record)
+{
+    Entry entry;
+    entry.kind = Entry::RECORD;
+    entry.bytes = record.bytes();
+
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->queue.push_back(std::move(entry));
+    }
+    this->condition.notify_one();
+}
+
+void Journal::appendPayload(const std::string &filename, const PayloadWriter &payload)
+{
+    Entry entry;
+    entry.kind = Entry::PAYLOAD;
+    entry.filename = filename;
+    entry.payload = payload;
+
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->queue.push_back(std::move(entry));
+    }
+    this->condition.notify_one();
+}
+
+void Journal::snapshot(const std::vector<JournalRecord> &records, const std::set<std::string> &payloads)
+{
+    Entry entry;
+    entry.kind = Entry::SNAPSHOT;
+    entry.payloads = payloads;
+    entry.snapshot.reserve(records.size());
+    for (std::vector<JournalRecord>::const_iterator it = records.begin(); it != records.end(); ++it)
+    {
+        entry.snapshot.push_back(it->bytes());
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->queue.push_back(std::move(entry));
+    }
+    this->condition.notify_one();
+}
+
+bool Journal::recover(const std::string &directory, std::vector<JournalRecord> &records)
+{
+    records.clear();
+
+    boost::uint32_t first = 0;
+    std::ifstream snapshot_file(snapshotName(directory).c_str(), std::ios::binary);
+    if (!snapshot_file.is_open() || !readHeader(snapshot_file, snapshot_magic, &first) ||
+            !readRecords(snapshot_file, records))
+    {
+        std::cerr<<"[JOURNAL] No valid snapshot in "<<directory<<"\n";
+        records.clear();
+        return false;
+    }
+
+    /** Only the tail of the last segment can be torn, nothing after it is trusted **/
+    for (unsigned int number = first; exists(segmentName(directory, number)); ++number)
+    {
+        std::ifstream segment_file(segmentName(directory, number).c_str(), std::ios::binary);
+        if (!readHeader(segment_file, journal_magic) || !readRecords(segment_file, records))
+        {
+            std::cerr<<"[JOURNAL] Segment "<<number<<" ends in a torn record, replay stops there\n";
+            break;
+        }
+    }
+
+    return true;
+}
+
+void Journal::run()
+{
+    std::chrono::steady_clock::time_point last_sync = std::chrono::steady_clock::now();
+    std::unique_lock<std::mutex> lock(this->mutex);
+    while (true)
+    {
+        this->condition.wait_for(lock, this->flush_period,
+                [this]{ return !this->queue.empty() || this->stop; });
+
+        std::deque<Entry> entries;
+        entries.swap(this->queue);
+        const bool stopping = this->stop;
+        lock.unlock();
+
+        /** Records go to the page cache right away, the sync is periodic **/
+        std::string buffer;
+        for (std::deque<Entry>::iterator it = entries.begin(); it != entries.end(); ++it)
+        {
+            switch (it->kind)
+            {
+                case Entry::RECORD:
+                    frameRecord(it->bytes, buffer);
+                    break;
+                case Entry::PAYLOAD:
+                    writeAll(this->fd, buffer.data(), buffer.size());
+                    buffer.clear();
+                    this->writePayload(it->filename, it->payload);
+                    break;
+                case Entry::SNAPSHOT:
+                    writeAll(this->fd, buffer.data(), buffer.size());
+                    buffer.clear();
+                    this->writeSnapshot(it->snapshot, it->payloads);
+                    last_sync = std::chrono::steady_clock::now();
+                    break;
+            }
+        }
+
+        if (!writeAll(this->fd, buffer.data(), buffer.size()))
+            std::cerr<<"[JOURNAL] Cannot write segment "<<this->segment<<"\n";
+
+        if (stopping || std::chrono::steady_clock::now() - last_sync >= this->flush_period)
+        {
+            ::fdatasync(this->fd);
+            last_sync = std::chrono::steady_clock::now();
+        }
+
+        lock.lock();
+        if (stopping && this->queue.empty())
+            break;
+    }
+}
+
+bool Journal::openSegment(const unsigned int number)
+{
+    const std::string filename = segmentName(this->directory, number);
+    this->fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (this->fd < 0)
+    {
+        std::cerr<<"[JOURNAL] Cannot open "<<filename<<"\n";
+        return false;
+    }
+
+    this->segment = number;
+    return writeAll(this->fd, reinterpret_cast<const char*>(&journal_magic), sizeof(journal_magic));
+}
+
+bool Journal::writeSnapshot(const std::vector<std::string> &records, const std::set<std::string> &payloads)
+{
+    /** Close the segment covered by the snapshot and continue in a new one **/
+    ::fdatasync(this->fd);
+    ::close(this->fd);
+    const unsigned int covered = this->segment;
+    if (!this->openSegment(covered + 1))
+        return false;
+
+    std::string buffer(reinterpret_cast<const char*>(&snapshot_magic), sizeof(snapshot_magic));
+    const boost::uint32_t first = this->segment;
+    buffer.append(reinterpret_cast<const char*>(&first), sizeof(first));
+    for (std::vector<std::string>::const_iterator it = records.begin(); it != records.end(); ++it)
+    {
+        frameRecord(*it, buffer);
+    }
+
+    /** Replace the previous snapshot atomically **/
+    const std::string filename = snapshotName(this->directory), tmp_filename = filename + ".tmp";
+    const int snapshot_fd = ::open(tmp_filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (snapshot_fd < 0 || !writeAll(snapshot_fd, buffer.data(), buffer.size()) || ::fsync(snapshot_fd) != 0)
+    {
+        std::cerr<<"[JOURNAL] Cannot write "<<tmp_filename<<"\n";
+        if (snapshot_fd >= 0)
+            ::close(snapshot_fd);
+        return false;
+    }
+    ::close(snapshot_fd);
+
+    if (std::rename(tmp_filename.c_str(), filename.c_str()) != 0)
+    {
+        std::cerr<<"[JOURNAL] Cannot replace "<<filename<<"\n";
+        return false;
+    }
+
+    for (unsigned int number = this->first_segment; number <= covered; ++number)
+    {
+        std::remove(segmentName(this->directory, number).c_str());
+    }
+    this->first_segment = this->segment;
+
+    /** Payloads of frames which are not in the snapshot any more **/
+    for (std::set<std::string>::iterator it = this->payload_files.begin(); it != this->payload_files.end();)
+    {
+        if (payloads.count(*it))
+        {
+            ++it;
+            continue;
+        }
+        std::remove((this->directory + "/" + *it).c_str());
+        this->payload_files.erase(it++);
+    }
+
+    return true;
+}
+
+void Journal::writePayload(const std::string &filename, const PayloadWriter &payload)
+{
+    std::ostringstream stream;
+    payload(stream);
+    const std::string bytes = stream.str();
+
+    /** Synced before the records referencing it are written **/
+    const std::string path = this->directory + "/" + filename, tmp_path = path + ".tmp";
+    const int payload_fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (payload_fd < 0 || !writeAll(payload_fd, bytes.data(), bytes.size()) || ::fsync(payload_fd) != 0)
+    {
+        std::cerr<<"[JOURNAL] Cannot write "<<tmp_path<<"\n";
+        if (payload_fd >= 0)
+            ::close(payload_fd);
+        return;
+    }
+    ::close(payload_fd);
+    if (std::rename(tmp_path.c_str(), path.c_str()) == 0)
+        this->payload_files.insert(filename);
+}
+
+std::string Journal::segmentName(const std::string &directory, const unsigned int number)
+{
+    char name[32];
+    std::snprintf(name, sizeof(name), "/journal_%08u.bin", number);
+    return directory + name;
+}
+
+std::string Journal::snapshotName(const std::string &directory)
+{
+    return directory + "/snapshot.bin";
+}
@@ -0,0 +1,211 @@
+/**\file Journal.hpp
+ *
+ * Append-only binary journal of the ESAM insertions with snapshot
+ * compaction
+ *
+ * Records are handed to a background thread which appends them to the
+ * current segment file and syncs it to disk every flush period. A
+ * snapshot starts a new segment and removes the segments it covers, so
+ * recovery reads the snapshot and replays the segments after it.
+ *
+ * @author Javier Hidalgo Carrio et. al
+ * See LICENSE for the license information
+ *
+ */
+
+
+#ifndef __ENVIRE_SAM_JOURNAL__
+#define __ENVIRE_SAM_JOURNAL__
+
+#include <set>
+#include <deque>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <ostream>
+#include <cstring>
+#include <functional>
+#include <condition_variable>
+
+#include <boost/cstdint.hpp>
+
+#include <Eigen/Core>
+
+namespace envire { namespace sam
+{
+    enum JournalRecordType
+    {
+        JOURNAL_PRIOR_FACTOR,
+        JOURNAL_POSE_FACTOR,
+        JOURNAL_POINT_FACTOR,
+        JOURNAL_LANDMARK_FACTOR,
+        JOURNAL_BEARING_RANGE_FACTOR,
+        JOURNAL_LINEAR_FACTOR,
+        JOURNAL_POSE_VALUE,
+        JOURNAL_LANDMARK_VALUE,
+        JOURNAL_POINT_CLOUD, //reference to a payload file in the journal directory
+        JOURNAL_REMOVE_LANDMARKS,
+        JOURNAL_MARGINALIZED_FRAMES
+    };
+
+    /** Sequential binary encoding of one record (native endianness) **/
+    class JournalRecord
+    {
+    private:
+        std::string data;
+        std::size_t position;
+
+    public:
+        JournalRecord()
+            :position(0){}
+
+        explicit JournalRecord(const std::string &bytes)
+            :data(bytes), position(0){}
+
+        template<typename T>
+        inline void write(const T &value)
+        {
+            this->data.append(reinterpret_cast<const char*>(&value), sizeof(T));
+        }
+
+        inline void write(const std::string &value)
+        {
+            this->write(static_cast<boost::uint32_t>(value.size()));
+            this->data.append(value);
+        }
+
+        template<typename Derived>
+        inline void writeMatrix(const Eigen::DenseBase<Derived> &matrix)
+        {
+            for (int j=0; j<matrix.cols(); ++j)
+                for (int i=0; i<matrix.rows(); ++i)
+                    this->write(static_cast<double>(matrix(i,j)));
+        }
+
+        template<typename T>
+        inline bool read(T &value)
+        {
+            if (this->position + sizeof(T) > this->data.size())
+                return false;
+            std::memcpy(&value, this->data.data() + this->position, sizeof(T));
+            this->position += sizeof(T);
+            return true;
+        }
+
+        inline bool read(std::string &value)
+        {
+            boost::uint32_t size = 0;
+            if (!this->read(size) || this->position + size > this->data.size())
+                return false;
+            value.assign(this->data.data() + this->position, size);
+            this->position += size;
+            return true;
+        }
+
+        /** The matrix must have its size already **/
+        template<typename Derived>
+        inline bool readMatrix(Eigen::DenseBase<Derived> &matrix)
+        {
+            for (int j=0; j<matrix.cols(); ++j)
+                for (int i=0; i<matrix.rows(); ++i)
+                    if (!this->read(matrix(i,j)))
+                        return false;
+            return true;
+        }
+
+        inline const std::string& bytes() const { return this->data; };
+    };
+
+    class Journal
+    {
+    public:
+        /** Serializes a payload, called from the journal thread **/
+        typedef std::function<void (std::ostream&)> PayloadWriter;
+
+    private:
+        struct Entry
+        {
+            enum Kind { RECORD, PAYLOAD, SNAPSHOT } kind;
+            std::string bytes;
+            std::string filename;
+            PayloadWriter payload;
+            std::vector<std::string> snapshot;
+            std::set<std::string> payloads;
+        };
+
+        std::string directory;
+        std::chrono::duration<double> flush_period;
+
+        /** Segment being written and first segment not covered by the snapshot **/
+        int fd;
+        unsigned int segment, first_segment;
+
+        /** Payload files written since the journal was opened (journal thread only) **/
+        std::set<std::string> payload_files;
+
+        std::deque<Entry> queue;
+        std::mutex mutex;
+        std::condition_variable condition;
+        std::thread thread;
+        bool stop;
+
+    public:
+        Journal();
+
+        ~Journal();
+
+        /**@brief Start a new segment in the directory (created if needed)
+         * and the thread writing to it
+         *
+         * @param flush_period seconds between syncs of the segment to disk
+         */
+        bool open(const std::string &directory, const double flush_period);
+
+        /**@brief Write the pending records, sync and stop the thread **/
+        void close();
+
+        inline bool isOpen() const { return this->thread.joinable(); };
+
+        inline const std::string& path() const { return this->directory; };
+
+        /** Queue a record, it never waits for the disk **/
+        void append(const JournalRecord &record);
+
+        /** Queue a payload file, written (atomically) before any record queued after it **/
+        void appendPayload(const std::string &filename, const PayloadWriter &payload);
+
+        /**@brief Queue a snapshot of the whole state
+         *
+         * The records appended after it go to a new segment. The
+         * segments before and the payload files written before which
+         * are not in payloads are removed once the snapshot is on disk.
+         */
+        void snapshot(const std::vector<JournalRecord> &records, const std::set<std::string> &payloads);
+
+        /**@brief Records of the last snapshot followed by the records
+         * of the segments after it, up to the first torn record
+         *
+         * @return false if there is no valid snapshot in the directory
+         */
+        static bool recover(const std::string &directory, std::vector<JournalRecord> &records);
+
+    private:
+
+        void run();
+
+        bool openSegment(const unsigned int number);
+
+        bool writeSnapshot(const std::vector<std::string> &records, const std::set<std::string> &payloads);
+
+        void writePayload(const std::string &filename, const PayloadWriter &payload);
+
+        static std::string segmentName(const std::string &directory, const unsigned int number);
+
+        static std::string snapshotName(const std::string &directory);
+    };
+
+}}
+
+#endif
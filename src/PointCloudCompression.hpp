@@ -0,0 +1,154 @@
+/**\file PointCloudCompression.hpp
+ *
+ * Quantized storage of colored point clouds
+ *
+ * Positions are stored as 16 bit offsets from the minimum corner of the
+ * cloud at a fixed resolution and colors as packed rgba: 10 bytes per
+ * point instead of the 32 bytes of an aligned pcl::PointXYZRGB.
+ *
+ * @author Javier Hidalgo Carrio et. al
+ * See LICENSE for the license information
+ *
+ */
+
+
+#ifndef __ENVIRE_SAM_POINT_CLOUD_COMPRESSION__
+#define __ENVIRE_SAM_POINT_CLOUD_COMPRESSION__
+
+#include <string>
+#include <vector>
+#include <limits>
+#include <fstream>
+#include <algorithm>
+
+#include <boost/cstdint.hpp>
+
+#include <Eigen/Core>
+
+#include <pcl/point_cloud.h>
+
+namespace envire { namespace sam
+{
+
+    struct CompressedPointCloud
+    {
+        //minimum corner and size of the quantization step in meters
+        Eigen::Vector3f origin;
+        float resolution;
+
+        //three offsets and one color per point, empty while spilled to disk
+        std::vector<boost::uint16_t> positions;
+        std::vector<boost::uint32_t> colors;
+
+        //number of points (also while spilled)
+        std::size_t number_points;
+
+        //file holding the data while it is not in memory (empty if in memory)
+        std::string spill_file;
+
+        CompressedPointCloud()
+            :origin(Eigen::Vector3f::Zero()), resolution(0.0), number_points(0){}
+
+        inline bool spilled() const { return !spill_file.empty(); }
+
+        inline std::size_t bytes() const
+        {
+            return positions.capacity() * sizeof(boost::uint16_t) + colors.capacity() * sizeof(boost::uint32_t);
+        }
+    };
+
+    /**@brief Quantize a cloud, the resolution grows if the cloud does not fit in 16 bits **/
+    template <class PointType>
+    void compressPointCloud(const pcl::PointCloud<PointType> &cloud, const float resolution, CompressedPointCloud &compressed)
+    {
+        compressed = CompressedPointCloud();
+        compressed.number_points = cloud.size();
+        if (cloud.empty())
+            return;
+
+        Eigen::Vector3f min_corner(Eigen::Vector3f::Constant(std::numeric_limits<float>::max()));
+        Eigen::Vector3f max_corner(-min_corner);
+        for (std::size_t i=0; i<cloud.size(); ++i)
+        {
+            const Eigen::Vector3f point(cloud.points[i].x, cloud.points[i].y, cloud.points[i].z);
+            min_corner = min_corner.cwiseMin(point);
+            max_corner = max_corner.cwiseMax(point);
+        }
+
+        const float max_steps = std::numeric_limits<boost::uint16_t>::max();
+        compressed.origin = min_corner;
+        compressed.resolution = std::max(resolution, (max_corner - min_corner).maxCoeff() / max_steps);
+        if (compressed.resolution <= 0.0)
+            compressed.resolution = 1.0;
+
+        compressed.positions.resize(3 * cloud.size());
+        compressed.colors.resize(cloud.size());
+        for (std::size_t i=0; i<cloud.size(); ++i)
+        {
+            const Eigen::Vector3f point(cloud.points[i].x, cloud.points[i].y, cloud.points[i].z);
+            const Eigen::Vector3f steps = ((point - min_corner) / compressed.resolution).array().round().min(max_steps);
+            for (int j=0; j<3; ++j)
+                compressed.positions[3*i+j] = static_cast<boost::uint16_t>(steps[j]);
+            compressed.colors[i] = cloud.points[i].rgba;
+        }
+    }
+
+    /**@brief Points at the center of their quantization step, the cloud is unorganized **/
+    template <class PointType>
+    void decompressPointCloud(const CompressedPointCloud &compressed, pcl::PointCloud<PointType> &cloud)
+    {
+        const std::size_t number_points = compressed.colors.size();
+        cloud.clear();
+        cloud.points.resize(number_points);
+        for (std::size_t i=0; i<number_points; ++i)
+        {
+            PointType &point = cloud.points[i];
+            point.x = compressed.origin[0] + compressed.resolution * compressed.positions[3*i];
+            point.y = compressed.origin[1] + compressed.resolution * compressed.positions[3*i+1];
+            point.z = compressed.origin[2] + compressed.resolution * compressed.positions[3*i+2];
+            point.rgba = compressed.colors[i];
+        }
+        cloud.width = number_points;
+        cloud.height = 1;
+        cloud.is_dense = true;
+    }
+
+    /**@brief Move the point data to a file and release its memory **/
+    inline bool spillPointCloud(CompressedPointCloud &compressed, const std::string &filename)
+    {
+        std::ofstream file(filename.c_str(), std::ios::binary | std::ios::trunc);
+        const boost::uint64_t number_points = compressed.colors.size();
+        file.write(reinterpret_cast<const char*>(&number_points), sizeof(number_points));
+        file.write(reinterpret_cast<const char*>(compressed.positions.data()), compressed.positions.size() * sizeof(boost::uint16_t));
+        file.write(reinterpret_cast<const char*>(compressed.colors.data()), compressed.colors.size() * sizeof(boost::uint32_t));
+        if (!file)
+            return false;
+
+        compressed.spill_file = filename;
+        std::vector<boost::uint16_t>().swap(compressed.positions);
+        std::vector<boost::uint32_t>().swap(compressed.colors);
+        return true;
+    }
+
+    /**@brief Copy of a spilled cloud with the point data read back from its file (which is kept) **/
+    inline bool loadSpilledPointCloud(const CompressedPointCloud &spilled, CompressedPointCloud &loaded)
+    {
+        std::ifstream file(spilled.spill_file.c_str(), std::ios::binary);
+        boost::uint64_t number_points = 0;
+        if (!file.read(reinterpret_cast<char*>(&number_points), sizeof(number_points)))
+            return false;
+
+        loaded.origin = spilled.origin;
+        loaded.resolution = spilled.resolution;
+        loaded.number_points = spilled.number_points;
+        loaded.spill_file.clear();
+        loaded.positions.resize(3 * number_points);
+        loaded.colors.resize(number_points);
+        file.read(reinterpret_cast<char*>(loaded.positions.data()), loaded.positions.size() * sizeof(boost::uint16_t));
+        file.read(reinterpret_cast<char*>(loaded.colors.data()), loaded.colors.size() * sizeof(boost::uint32_t));
+        return static_cast<bool>(file);
+    }
+
+}}
+
+#endif
@@ -0,0 +1,67 @@
+/**\file SeqLock.hpp
+ *
+ * Sequence lock to publish a value to readers in other threads
+ *
+ * The writer never waits for the readers and the readers never block
+ * the writer: a reader copies the value and retries if a store happened
+ * in between.
+ *
+ * @author Javier Hidalgo Carrio et. al
+ * See LICENSE for the license information
+ *
+ */
+
+
+#ifndef __ENVIRE_SAM_SEQLOCK__
+#define __ENVIRE_SAM_SEQLOCK__
+
+#include <atomic>
+
+namespace envire { namespace sam
+{
+
+    /** T is a plain value (no pointers or owned memory), stores come from one thread at a time **/
+    template<typename T>
+    class SeqLock
+    {
+    private:
+        /** Odd while a store is in progress **/
+        std::atomic<unsigned int> sequence;
+
+        T value;
+
+    public:
+        SeqLock()
+            :sequence(0){}
+
+        explicit SeqLock(const T &initial)
+            :sequence(0), value(initial){}
+
+        void store(const T &data)
+        {
+            const unsigned int seq = this->sequence.load(std::memory_order_relaxed);
+            this->sequence.store(seq + 1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+            this->value = data;
+            this->sequence.store(seq + 2, std::memory_order_release);
+        }
+
+        T load() const
+        {
+            T data;
+            unsigned int before, after;
+            do
+            {
+                before = this->sequence.load(std::memory_order_acquire);
+                data = this->value;
+                std::atomic_thread_fence(std::memory_order_acquire);
+                after = this->sequence.load(std::memory_order_relaxed);
+            } while ((before & 1) || before != after);
+
+            return data;
+        }
+    };
+
+}}
+
+#endif
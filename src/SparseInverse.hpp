@@ -0,0 +1,164 @@
+/**\file SparseInverse.hpp
+ *
+ * Selected inversion of a sparse symmetric positive definite matrix
+ *
+ * The entries of the inverse on the pattern of the Cholesky factor are
+ * recovered in one backward sweep (Takahashi recursion). This includes
+ * the diagonal blocks of all the variables, i.e. the marginal
+ * covariances, at a fraction of the cost of one solve per variable.
+ *
+ * @author Javier Hidalgo Carrio et. al
+ * See LICENSE for the license information
+ *
+ */
+
+
+#ifndef __ENVIRE_SAM_SPARSE_INVERSE__
+#define __ENVIRE_SAM_SPARSE_INVERSE__
+
+#include <Eigen/Core>
+#include <Eigen/SparseCore>
+#include <Eigen/SparseCholesky>
+
+#include <vector>
+#include <limits>
+#include <algorithm>
+
+namespace envire { namespace sam
+{
+
+    class SparseInverse
+    {
+    public:
+        typedef Eigen::SparseMatrix<double> SparseMatrix;
+
+    private:
+        /** P A P^T = L D L^T **/
+        Eigen::SimplicialLDLT<SparseMatrix, Eigen::Lower> ldlt;
+
+        /** Inverse of P A P^T on the lower pattern of L (diagonal first in each column) **/
+        SparseMatrix z;
+
+        /** Original to permuted index **/
+        Eigen::VectorXi permutation;
+
+    public:
+
+        /**@brief Factorize the matrix and recover its inverse on the factor pattern
+         *
+         * Only the lower triangle of the information matrix is read.
+         *
+         * @return false if the matrix is not positive definite
+         */
+        bool compute(const SparseMatrix &information)
+        {
+            this->ldlt.compute(information);
+            if (this->ldlt.info() != Eigen::Success)
+                return false;
+
+            const int n = information.rows();
+            this->permutation = this->ldlt.permutationP().indices();
+            const Eigen::VectorXd d = this->ldlt.vectorD();
+            if ((d.array() <= 0.0).any())
+                return false;
+
+            /** Pattern of Z: diagonal followed by the sorted rows of L in each column **/
+            const SparseMatrix &L = this->ldlt.matrixL().nestedExpression();
+            std::vector<int> outer(n+1, 0), inner;
+            std::vector<double> l_values;
+            inner.reserve(L.nonZeros() + n);
+            l_values.reserve(L.nonZeros() + n);
+            for (int j=0; j<n; ++j)
+            {
+                outer[j] = inner.size();
+                inner.push_back(j); l_values.push_back(1.0);
+                for (SparseMatrix::InnerIterator it(L, j); it; ++it)
+                {
+                    if (it.row() > j)
+                    {
+                        inner.push_back(it.row()); l_values.push_back(it.value());
+                    }
+                }
+            }
+            outer[n] = inner.size();
+
+            this->z.resize(n, n);
+            this->z.resizeNonZeros(inner.size());
+            std::copy(outer.begin(), outer.end(), this->z.outerIndexPtr());
+            std::copy(inner.begin(), inner.end(), this->z.innerIndexPtr());
+            double *z_values = this->z.valuePtr();
+
+            /** Backward sweep:
+             * Z_ij = -sum_k Z_ik L_kj (i > j)
+             * Z_jj = 1/d_j - sum_k Z_kj L_kj
+             * with k over the rows of column j of L **/
+            for (int j=n-1; j>=0; --j)
+            {
+                const int begin = outer[j] + 1, end = outer[j+1];
+                for (int p=begin; p<end; ++p)
+                {
+                    const int i = inner[p];
+                    double sum = 0.0;
+                    for (int q=begin; q<end; ++q)
+                    {
+                        sum += this->lookup(i, inner[q]) * l_values[q];
+                    }
+                    z_values[p] = -sum;
+                }
+
+                double sum = 0.0;
+                for (int p=begin; p<end; ++p)
+                {
+                    sum += z_values[p] * l_values[p];
+                }
+                z_values[outer[j]] = 1.0/d[j] - sum;
+            }
+
+            return true;
+        }
+
+        /**@brief Entry of the inverse in the original ordering
+         *
+         * NaN when the entry is outside the pattern of the factor.
+         */
+        double coeff(const int row, const int col) const
+        {
+            return this->lookup(this->permutation[row], this->permutation[col]);
+        }
+
+        /**@brief Diagonal block of the inverse (marginal covariance of one variable) **/
+        Eigen::MatrixXd block(const int start, const int size) const
+        {
+            Eigen::MatrixXd cov(size, size);
+            for (int i=0; i<size; ++i)
+            {
+                for (int j=0; j<=i; ++j)
+                {
+                    cov(i,j) = cov(j,i) = this->coeff(start+i, start+j);
+                }
+            }
+            return cov;
+        }
+
+    private:
+
+        /** Entry (i,j) of Z in the permuted ordering **/
+        double lookup(int i, int j) const
+        {
+            if (i < j)
+                std::swap(i, j);
+
+            const int *inner = this->z.innerIndexPtr();
+            const int *begin = inner + this->z.outerIndexPtr()[j];
+            const int *end = inner + this->z.outerIndexPtr()[j+1];
+            const int *found = std::lower_bound(begin, end, i);
+            if (found == end || *found != i)
+                return std::numeric_limits<double>::quiet_NaN();
+
+            return this->z.valuePtr()[found - inner];
+        }
+    };
+
+}}
+
+#endif
@@ -0,0 +1,327 @@
+/**\file Statistics.hpp
+ *
+ * Introspection of the resources used by ESAM
+ *
+ * @author Javier Hidalgo Carrio et. al
+ * See LICENSE for the license information
+ *
+ */
+
+
+#ifndef __ENVIRE_SAM_STATISTICS__
+#define __ENVIRE_SAM_STATISTICS__
+
+#include <map>
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <istream>
+#include <ostream>
+#include <boost/cstdint.hpp>
+
+namespace envire { namespace sam
+{
+    enum FactorType
+    {
+        PRIOR_FACTOR,
+        BETWEEN_FACTOR,
+        LANDMARK_FACTOR,
+        BEARING_RANGE_FACTOR,
+        LINEAR_FACTOR, //marginals of removed variables
+        OTHER_FACTOR,
+        NUMBER_FACTOR_TYPES
+    };
+
+    enum PipelineStage
+    {
+        CLOUD_STAGE, //pushPointCloud
+        KEYPOINTS_STAGE, //computeKeypoints
+        LANDMARKS_STAGE, //detectLandmarks without its optimization
+        OPTIMIZE_STAGE,
+        DEFERRED_STAGE, //keypoints of deferred frames, on the executor when idle
+        NUMBER_PIPELINE_STAGES
+    };
+
+    struct FrameLatency
+    {
+        //seconds spent in each stage
+        double stages[NUMBER_PIPELINE_STAGES];
+
+        FrameLatency()
+        {
+            for (int i=0; i<NUMBER_PIPELINE_STAGES; ++i)
+                stages[i] = 0.0;
+        }
+
+        inline double total() const
+        {
+            double sum = 0.0;
+            for (int i=0; i<NUMBER_PIPELINE_STAGES; ++i)
+                sum += stages[i];
+            return sum;
+        }
+    };
+
+    struct LatencyStatistics
+    {
+        //stages of the frame in progress and of the last complete frame
+        FrameLatency current;
+        FrameLatency last;
+
+        //number of complete frames
+        std::size_t frames;
+
+        //frames over the target latency
+        std::size_t overruns;
+
+        //detail of the parameters set by the controller: 0 cheapest, 1 most detailed
+        double effort;
+
+        LatencyStatistics()
+            :frames(0), overruns(0), effort(1.0){}
+    };
+
+    struct SheddingStatistics
+    {
+        //work shed while overloaded
+        std::size_t dropped_clouds;
+        std::size_t skipped_outlier_removals;
+        std::size_t deferred_keypoints;
+        std::size_t capped_searches;
+
+        //deferred keypoints computed later when idle
+        std::size_t idle_keypoints;
+
+        SheddingStatistics()
+            :dropped_clouds(0), skipped_outlier_removals(0), deferred_keypoints(0),
+            capped_searches(0), idle_keypoints(0){}
+    };
+
+    struct OverlapKeypointStatistics
+    {
+        //frames described with the coverage of the recent frames
+        std::size_t frames;
+
+        //points searched for keypoints and points in covered voxels
+        std::size_t uncovered_points;
+        std::size_t covered_points;
+
+        //keypoints of other frames linked instead of detected again
+        std::size_t linked_keypoints;
+
+        OverlapKeypointStatistics()
+            :frames(0), uncovered_points(0), covered_points(0), linked_keypoints(0){}
+    };
+
+    struct NormalMapStatistics
+    {
+        //normals read from the map and computed with a radius search for the uncovered points
+        std::size_t map_normals;
+        std::size_t computed_normals;
+
+        //frames moved in the map after an optimization
+        std::size_t reposed_frames;
+
+        NormalMapStatistics()
+            :map_normals(0), computed_normals(0), reposed_frames(0){}
+    };
+
+    struct MemoryGovernorStatistics
+    {
+        //estimated bytes after the last pass of the governor and the maximum seen before any action
+        std::size_t bytes;
+        std::size_t peak_bytes;
+
+        //actions taken
+        std::size_t compressed_clouds;
+        std::size_t spilled_clouds;
+        std::size_t culled_landmarks;
+        std::size_t marginalized_frames;
+        std::size_t dropped_frames;
+
+        //compressed clouds brought back by an access to the point cloud
+        std::size_t restored_clouds;
+
+        MemoryGovernorStatistics()
+            :bytes(0), peak_bytes(0), compressed_clouds(0), spilled_clouds(0), culled_landmarks(0),
+            marginalized_frames(0), dropped_frames(0), restored_clouds(0){}
+    };
+
+    struct MemoryCount
+    {
+        //number of elements
+        std::size_t count;
+
+        //approximate resident size in bytes
+        std::size_t bytes;
+
+        MemoryCount()
+            :count(0), bytes(0){}
+
+        inline void add(const std::size_t elements, const std::size_t size)
+        {
+            count += elements; bytes += size;
+        }
+    };
+
+    struct FrameMemoryUsage
+    {
+        MemoryCount point_cloud;
+        MemoryCount keypoints;
+        MemoryCount descriptors;
+
+        inline std::size_t bytes() const
+        {
+            return point_cloud.bytes + keypoints.bytes + descriptors.bytes;
+        }
+    };
+
+    struct MemoryUsage
+    {
+        //factor graph by type of factor
+        MemoryCount factors[NUMBER_FACTOR_TYPES];
+
+        //current estimates
+        MemoryCount values;
+
+        //linear systems kept for the transactions and behind the marginals (approximation)
+        MemoryCount marginals;
+
+        //envire frames and edges
+        MemoryCount frames;
+        MemoryCount transforms;
+
+        //sensor data in all the frames
+        MemoryCount point_clouds;
+        MemoryCount keypoints;
+        MemoryCount descriptors;
+
+        //voxels and frame cells of the normal map
+        MemoryCount normal_map;
+
+        //sensor data of each frame which has any
+        std::map<std::string, FrameMemoryUsage> per_frame;
+
+        inline std::size_t bytes() const
+        {
+            std::size_t total = values.bytes + marginals.bytes + frames.bytes + transforms.bytes +
+                point_clouds.bytes + keypoints.bytes + descriptors.bytes + normal_map.bytes;
+            for (int i=0; i<NUMBER_FACTOR_TYPES; ++i)
+                total += factors[i].bytes;
+            return total;
+        }
+    };
+
+    struct ResidualStatistics
+    {
+        //number of factors
+        std::size_t count;
+
+        //sum and maximum of the chi-square error of the factors
+        double chi2;
+        double max_chi2;
+
+        ResidualStatistics()
+            :count(0), chi2(0.0), max_chi2(0.0){}
+
+        inline void add(const double factor_chi2)
+        {
+            ++count; chi2 += factor_chi2;
+            if (factor_chi2 > max_chi2) max_chi2 = factor_chi2;
+        }
+
+        inline double mean() const
+        {
+            return (count > 0) ? chi2 / count : 0.0;
+        }
+    };
+
+    struct IterationDiagnostics
+    {
+        //total error (half the chi-square) at the end of the iteration
+        double error;
+
+        //norm of the update in the tangent space
+        double step_norm;
+
+        ResidualStatistics residuals[NUMBER_FACTOR_TYPES];
+
+        IterationDiagnostics()
+            :error(0.0), step_norm(0.0){}
+    };
+
+    struct SolverDiagnostics
+    {
+        //microseconds since epoch when the solve started
+        boost::int64_t time;
+
+        //initial estimate first, then one entry per iteration
+        std::vector<IterationDiagnostics> iterations;
+
+        bool converged;
+
+        SolverDiagnostics()
+            :time(0), converged(false){}
+    };
+
+    /**@brief Append the diagnostics of one solve to a binary log
+     *
+     * Layout (native endianness): int64 time, uint8 converged, uint32
+     * number of iterations, then per iteration double error, double
+     * step_norm and per factor type uint32 count, double chi2, double max_chi2.
+     */
+    inline void writeDiagnostics(std::ostream &stream, const SolverDiagnostics &diagnostics)
+    {
+        const boost::uint8_t converged = diagnostics.converged;
+        const boost::uint32_t size = diagnostics.iterations.size();
+        stream.write(reinterpret_cast<const char*>(&diagnostics.time), sizeof(diagnostics.time));
+        stream.write(reinterpret_cast<const char*>(&converged), sizeof(converged));
+        stream.write(reinterpret_cast<const char*>(&size), sizeof(size));
+        for (std::vector<IterationDiagnostics>::const_iterator it = diagnostics.iterations.begin();
+                it != diagnostics.iterations.end(); ++it)
+        {
+            stream.write(reinterpret_cast<const char*>(&it->error), sizeof(it->error));
+            stream.write(reinterpret_cast<const char*>(&it->step_norm), sizeof(it->step_norm));
+            for (int i=0; i<NUMBER_FACTOR_TYPES; ++i)
+            {
+                const boost::uint32_t count = it->residuals[i].count;
+                stream.write(reinterpret_cast<const char*>(&count), sizeof(count));
+                stream.write(reinterpret_cast<const char*>(&it->residuals[i].chi2), sizeof(double));
+                stream.write(reinterpret_cast<const char*>(&it->residuals[i].max_chi2), sizeof(double));
+            }
+        }
+    }
+
+    /**@brief Read the next solve of a binary log, false at the end **/
+    inline bool readDiagnostics(std::istream &stream, SolverDiagnostics &diagnostics)
+    {
+        boost::uint8_t converged = 0;
+        boost::uint32_t size = 0;
+        stream.read(reinterpret_cast<char*>(&diagnostics.time), sizeof(diagnostics.time));
+        stream.read(reinterpret_cast<char*>(&converged), sizeof(converged));
+        stream.read(reinterpret_cast<char*>(&size), sizeof(size));
+        if (!stream)
+            return false;
+
+        diagnostics.converged = converged;
+        diagnostics.iterations.resize(size);
+        for (std::vector<IterationDiagnostics>::iterator it = diagnostics.iterations.begin();
+                it != diagnostics.iterations.end(); ++it)
+        {
+            stream.read(reinterpret_cast<char*>(&it->error), sizeof(it->error));
+            stream.read(reinterpret_cast<char*>(&it->step_norm), sizeof(it->step_norm));
+            for (int i=0; i<NUMBER_FACTOR_TYPES; ++i)
+            {
+                boost::uint32_t count = 0;
+                stream.read(reinterpret_cast<char*>(&count), sizeof(count));
+                stream.read(reinterpret_cast<char*>(&it->residuals[i].chi2), sizeof(double));
+                stream.read(reinterpret_cast<char*>(&it->residuals[i].max_chi2), sizeof(double));
+                it->residuals[i].count = count;
+            }
+        }
+        return static_cast<bool>(stream);
+    }
+
+}}
+
+#endif
@@ -0,0 +1,292 @@
+/**\file VoxelNormalMap.hpp
+ *
+ * Normals and curvature from running point moments in a world voxel hash
+ *
+ * Each voxel keeps the number of points, their sum and the sum of their
+ * outer products, so the covariance (hence normal and curvature) of the
+ * surface in the voxel is read in constant time. The points of a frame
+ * are kept as moments of local cells: re-posing a frame moves its cells
+ * to the voxels of the new pose without the points.
+ *
+ * @author Javier Hidalgo Carrio et. al
+ * See LICENSE for the license information
+ *
+ */
+
+
+#ifndef __ENVIRE_SAM_VOXEL_NORMAL_MAP__
+#define __ENVIRE_SAM_VOXEL_NORMAL_MAP__
+
+#include <map>
+#include <string>
+#include <vector>
+#include <cmath>
+#include <unordered_map>
+
+#include <boost/cstdint.hpp>
+
+#include <Eigen/Core>
+#include <Eigen/Geometry>
+#include <Eigen/Eigenvalues>
+#include <Eigen/StdVector>
+
+#include <pcl/point_cloud.h>
+
+namespace envire { namespace sam
+{
+
+    /** Voxel of a point packed in 21 bits per axis **/
+    inline boost::uint64_t voxelKey(const double x, const double y, const double z, const double inverse_leaf)
+    {
+        const boost::uint64_t i = static_cast<boost::int64_t>(std::floor(x * inverse_leaf)) & 0x1fffff;
+        const boost::uint64_t j = static_cast<boost::int64_t>(std::floor(y * inverse_leaf)) & 0x1fffff;
+        const boost::uint64_t k = static_cast<boost::int64_t>(std::floor(z * inverse_leaf)) & 0x1fffff;
+        return (i << 42) | (j << 21) | k;
+    }
+
+    struct VoxelMoments
+    {
+        //number of points, their sum and the sum of their outer products
+        double count;
+        Eigen::Vector3d sum;
+        Eigen::Matrix3d sum_squares;
+
+        VoxelMoments()
+            :count(0.0), sum(Eigen::Vector3d::Zero()), sum_squares(Eigen::Matrix3d::Zero()){}
+
+        inline void add(const Eigen::Vector3d &point)
+        {
+            count += 1.0;
+            sum += point;
+            sum_squares += point * point.transpose();
+        }
+
+        inline void add(const VoxelMoments &other, const double sign)
+        {
+            count += sign * other.count;
+            sum += sign * other.sum;
+            sum_squares += sign * other.sum_squares;
+        }
+
+        /** Moments of the same points after the transformation **/
+        inline VoxelMoments transformed(const Eigen::Affine3d &tf) const
+        {
+            const Eigen::Matrix3d rotation = tf.linear();
+            const Eigen::Vector3d translation = tf.translation();
+            const Eigen::Vector3d rotated_sum = rotation * sum;
+
+            VoxelMoments moments;
+            moments.count = count;
+            moments.sum = rotated_sum + count * translation;
+            moments.sum_squares = rotation * sum_squares * rotation.transpose()
+                + rotated_sum * translation.transpose() + translation * rotated_sum.transpose()
+                + count * translation * translation.transpose();
+            return moments;
+        }
+
+        inline Eigen::Matrix3d covariance() const
+        {
+            const Eigen::Vector3d mean = sum / count;
+            return sum_squares / count - mean * mean.transpose();
+        }
+    };
+
+    class VoxelNormalMap
+    {
+    public:
+        typedef std::vector<VoxelMoments, Eigen::aligned_allocator<VoxelMoments> > Cells;
+
+    private:
+        struct Frame
+        {
+            Eigen::Affine3d pose;
+
+            //moments of the points in local voxels
+            Cells cells;
+
+            EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+        };
+
+        double voxel_size;
+        unsigned int min_points;
+
+        typedef std::map<std::string, Frame, std::less<std::string>,
+            Eigen::aligned_allocator< std::pair<const std::string, Frame> > > FrameMap;
+
+        std::unordered_map<boost::uint64_t, VoxelMoments> voxels;
+        FrameMap frames;
+
+    public:
+        VoxelNormalMap(const double voxel_size = 0.2, const unsigned int min_points = 5)
+            :voxel_size(voxel_size), min_points(min_points){}
+
+        /** Change the voxels, the map is cleared **/
+        void reset(const double voxel_size, const unsigned int min_points)
+        {
+            this->voxel_size = voxel_size;
+            this->min_points = min_points;
+            this->clear();
+        }
+
+        void clear()
+        {
+            this->voxels.clear();
+            this->frames.clear();
+        }
+
+        /**@brief Add the points of a frame in local coordinates at its pose
+         *
+         * A frame already in the map is replaced.
+         */
+        template <class PointType>
+        void insert(const std::string &frame_id, const pcl::PointCloud<PointType> &points, const Eigen::Affine3d &pose)
+        {
+            this->remove(frame_id);
+
+            const double inverse_voxel = 1.0 / this->voxel_size;
+            std::unordered_map<boost::uint64_t, std::size_t> cell_index;
+            Frame frame;
+            frame.pose = pose;
+            for (std::size_t i=0; i<points.size(); ++i)
+            {
+                const PointType &point = points.points[i];
+                if (!std::isfinite(point.x) || !std::isfinite(point.y) || !std::isfinite(point.z))
+                    continue;
+
+                const boost::uint64_t key = voxelKey(point.x, point.y, point.z, inverse_voxel);
+                std::unordered_map<boost::uint64_t, std::size_t>::iterator it = cell_index.find(key);
+                if (it == cell_index.end())
+                {
+                    it = cell_index.insert(std::make_pair(key, frame.cells.size())).first;
+                    frame.cells.push_back(VoxelMoments());
+                }
+                frame.cells[it->second].add(Eigen::Vector3d(point.x, point.y, point.z));
+            }
+
+            this->apply(frame, 1.0);
+            this->frames.insert(std::make_pair(frame_id, frame));
+        }
+
+        /** Move a frame to a new pose, false if the frame is not in the map **/
+        bool update(const std::string &frame_id, const Eigen::Affine3d &pose)
+        {
+            FrameMap::iterator it = this->frames.find(frame_id);
+            if (it == this->frames.end())
+                return false;
+
+            if (it->second.pose.isApprox(pose, 1e-12))
+                return true;
+
+            this->apply(it->second, -1.0);
+            it->second.pose = pose;
+            this->apply(it->second, 1.0);
+            return true;
+        }
+
+        void remove(const std::string &frame_id)
+        {
+            FrameMap::iterator it = this->frames.find(frame_id);
+            if (it == this->frames.end())
+                return;
+
+            this->apply(it->second, -1.0);
+            this->frames.erase(it);
+        }
+
+        inline bool contains(const std::string &frame_id) const { return this->frames.count(frame_id) > 0; };
+
+        /**@brief Normal and curvature of the surface at a point in world coordinates
+         *
+         * The curvature is the smallest eigenvalue over the sum of them
+         * (as pcl). The sign of the normal is arbitrary. False if the
+         * neighborhood has fewer than min_points points.
+         */
+        bool normal(const Eigen::Vector3d &point, Eigen::Vector3d &normal_out, float &curvature_out) const
+        {
+            VoxelMoments neighborhood;
+            if (!this->moments(point, neighborhood))
+                return false;
+
+            Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> solver;
+            solver.computeDirect(neighborhood.covariance());
+            normal_out = solver.eigenvectors().col(0);
+            const double trace = solver.eigenvalues().sum();
+            curvature_out = (trace > 0.0) ? solver.eigenvalues()[0] / trace : 0.0;
+            return true;
+        }
+
+        /**@brief Moments of the eight voxels whose centers surround a point
+         *
+         * The neighborhood spans one voxel in each direction around the
+         * point, wherever the point lies in its voxel. False if it has
+         * fewer than min_points points.
+         */
+        bool moments(const Eigen::Vector3d &point, VoxelMoments &moments_out) const
+        {
+            const double inverse_voxel = 1.0 / this->voxel_size;
+            const Eigen::Vector3d corner = (point * inverse_voxel).array() - 0.5;
+            const boost::int64_t i = std::floor(corner[0]), j = std::floor(corner[1]), k = std::floor(corner[2]);
+
+            moments_out = VoxelMoments();
+            for (int n=0; n<8; ++n)
+            {
+                const boost::uint64_t key = (static_cast<boost::uint64_t>(i + (n & 1)) & 0x1fffff) << 42
+                    | (static_cast<boost::uint64_t>(j + ((n >> 1) & 1)) & 0x1fffff) << 21
+                    | (static_cast<boost::uint64_t>(k + ((n >> 2) & 1)) & 0x1fffff);
+                std::unordered_map<boost::uint64_t, VoxelMoments>::const_iterator it = this->voxels.find(key);
+                if (it != this->voxels.end())
+                    moments_out.add(it->second, 1.0);
+            }
+
+            return moments_out.count >= this->min_points - 0.5;
+        }
+
+        inline double voxelSize() const { return this->voxel_size; };
+
+        inline std::size_t numberVoxels() const { return this->voxels.size(); };
+
+        inline std::size_t numberFrames() const { return this->frames.size(); };
+
+        /** Cells of all the frames **/
+        std::size_t numberCells() const
+        {
+            std::size_t cells = 0;
+            for (FrameMap::const_iterator it = this->frames.begin(); it != this->frames.end(); ++it)
+                cells += it->second.cells.size();
+            return cells;
+        }
+
+        /** Approximate resident size of the voxels (hash nodes and buckets) and the frames **/
+        std::size_t bytes() const
+        {
+            std::size_t total = this->voxels.size() * (sizeof(boost::uint64_t) + sizeof(VoxelMoments) + 2 * sizeof(void*))
+                + this->voxels.bucket_count() * sizeof(void*);
+            for (FrameMap::const_iterator it = this->frames.begin(); it != this->frames.end(); ++it)
+                total += sizeof(Frame) + it->first.capacity() + 4 * sizeof(void*) + it->second.cells.capacity() * sizeof(VoxelMoments);
+            return total;
+        }
+
+    private:
+        /** Add (sign 1) or subtract (sign -1) the cells of a frame at its pose **/
+        void apply(const Frame &frame, const double sign)
+        {
+            const double inverse_voxel = 1.0 / this->voxel_size;
+            for (Cells::const_iterator cell = frame.cells.begin(); cell != frame.cells.end(); ++cell)
+            {
+                const VoxelMoments moments = cell->transformed(frame.pose);
+                const Eigen::Vector3d centroid = moments.sum / moments.count;
+                const boost::uint64_t key = voxelKey(centroid[0], centroid[1], centroid[2], inverse_voxel);
+
+                VoxelMoments &voxel = this->voxels[key];
+                voxel.add(moments, sign);
+
+                /** Less than half a point left is rounding **/
+                if (voxel.count < 0.5)
+                    this->voxels.erase(key);
+            }
+        }
+    };
+
+}}
+
+#endif
@@ -0,0 +1,144 @@
+/**\file benchmark_binary_descriptors.cpp
+ *
+ * Descriptor matching between two noisy scans of a synthetic surface:
+ * kd-tree search of the FPFH (as ESAM::findFPFHFeatureCorrespondences)
+ * against exhaustive Hamming search of their binary codes
+ *
+ * A match is correct when the matched keypoint is closer than half the
+ * feature radius to the true one. The precision is given for all the
+ * matches and for those passing the median test of featuresCorrespondences.
+ *
+ * Usage: benchmark_binary_descriptors [points_per_side] [number_keypoints] [radius]
+ *
+ */
+
+#include <envire_sam/ESAM.hpp>
+
+#include <pcl/search/kdtree.h>
+
+#include <chrono>
+#include <random>
+#include <cstdlib>
+#include <iostream>
+#include <algorithm>
+
+using namespace envire::sam;
+
+/** Wavy surface with noise and its analytic normals **/
+void buildSurface(PCLPointCloud &surface, pcl::PointCloud<pcl::Normal> &normals, const unsigned int side, const unsigned int seed)
+{
+    std::mt19937 generator(seed);
+    std::normal_distribution<float> noise(0.0, 0.002);
+    const float step = 2.0 / side;
+    for (unsigned int i=0; i<side; ++i)
+        for (unsigned int j=0; j<side; ++j)
+        {
+            PointType point;
+            point.x = step * i + noise(generator); point.y = step * j + noise(generator);
+            point.z = 0.1 * std::sin(3.0*point.x) * std::cos(2.0*point.y) + noise(generator);
+            surface.push_back(point);
+
+            const Eigen::Vector3f normal = Eigen::Vector3f(-0.3 * std::cos(3.0*point.x) * std::cos(2.0*point.y),
+                    0.2 * std::sin(3.0*point.x) * std::sin(2.0*point.y), 1.0).normalized();
+            pcl::Normal point_normal;
+            point_normal.normal_x = normal[0]; point_normal.normal_y = normal[1]; point_normal.normal_z = normal[2];
+            normals.push_back(point_normal);
+        }
+}
+
+/** Precision of all the matches and of those not above the median score **/
+void precision(const pcl::PointCloud<pcl::PointWithScale> &source, const pcl::PointCloud<pcl::PointWithScale> &target,
+        const std::vector<int> &source2target, const std::vector<float> &scores, const float tolerance,
+        double &precision_all, double &precision_median, std::size_t &number_median)
+{
+    std::vector<float> sorted(scores);
+    std::sort(sorted.begin(), sorted.end());
+    const float median_score = sorted[sorted.size()/2];
+
+    std::size_t correct = 0, correct_median = 0;
+    number_median = 0;
+    for (std::size_t i=0; i<source.size(); ++i)
+    {
+        const pcl::PointWithScale &p = source.points[i];
+        const pcl::PointWithScale &q = target.points[source2target[i]];
+        const bool is_correct = Eigen::Vector3f(p.x - q.x, p.y - q.y, p.z - q.z).norm() < tolerance;
+        correct += is_correct;
+        if (scores[i] <= median_score)
+        {
+            ++number_median;
+            correct_median += is_correct;
+        }
+    }
+    precision_all = static_cast<double>(correct) / source.size();
+    precision_median = static_cast<double>(correct_median) / number_median;
+}
+
+int main(int argc, char **argv)
+{
+    const unsigned int side = (argc > 1) ? std::atoi(argv[1]) : 200;
+    const unsigned int number_keypoints = (argc > 2) ? std::atoi(argv[2]) : 1000;
+    const float radius = (argc > 3) ? std::atof(argv[3]) : 0.1;
+
+    /** Two scans of the surface, the keypoints at the same places **/
+    PCLPointCloud::Ptr source_surface(new PCLPointCloud), target_surface(new PCLPointCloud);
+    pcl::PointCloud<pcl::Normal> source_normals, target_normals;
+    buildSurface(*source_surface, source_normals, side, 42);
+    buildSurface(*target_surface, target_normals, side, 43);
+
+    std::mt19937 generator(7);
+    std::uniform_int_distribution<std::size_t> index(0, source_surface->size() - 1);
+    pcl::PointCloud<pcl::PointWithScale> source_keypoints, target_keypoints;
+    for (unsigned int k=0; k<number_keypoints; ++k)
+    {
+        const std::size_t n = index(generator);
+        pcl::PointWithScale keypoint;
+        keypoint.x = source_surface->points[n].x; keypoint.y = source_surface->points[n].y; keypoint.z = source_surface->points[n].z;
+        source_keypoints.push_back(keypoint);
+        keypoint.x = target_surface->points[n].x; keypoint.y = target_surface->points[n].y; keypoint.z = target_surface->points[n].z;
+        target_keypoints.push_back(keypoint);
+    }
+
+    pcl::PointCloud<pcl::FPFHSignature33>::Ptr source_descriptors(new pcl::PointCloud<pcl::FPFHSignature33>);
+    pcl::PointCloud<pcl::FPFHSignature33>::Ptr target_descriptors(new pcl::PointCloud<pcl::FPFHSignature33>);
+    computeFPFH<PointType, pcl::PointWithScale>(source_surface, source_normals, source_keypoints, radius, *source_descriptors);
+    computeFPFH<PointType, pcl::PointWithScale>(target_surface, target_normals, target_keypoints, radius, *target_descriptors);
+
+    BinaryFPFHDescriptors source_binary, target_binary;
+    binarizeFPFH(*source_descriptors, source_binary);
+    binarizeFPFH(*target_descriptors, target_binary);
+
+    /** FPFH kd-tree **/
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    pcl::search::KdTree<pcl::FPFHSignature33> descriptor_kdtree;
+    descriptor_kdtree.setInputCloud(target_descriptors);
+    std::vector<int> fpfh_matches(source_descriptors->size());
+    std::vector<float> fpfh_scores(source_descriptors->size());
+    std::vector<int> k_indices(1);
+    std::vector<float> k_squared_distances(1);
+    for (std::size_t i=0; i<source_descriptors->size(); ++i)
+    {
+        descriptor_kdtree.nearestKSearch(*source_descriptors, i, 1, k_indices, k_squared_distances);
+        fpfh_matches[i] = k_indices[0];
+        fpfh_scores[i] = k_squared_distances[0];
+    }
+    const double fpfh_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    /** Binary Hamming **/
+    start = std::chrono::steady_clock::now();
+    std::vector<int> binary_matches;
+    std::vector<float> binary_scores;
+    findHammingCorrespondences(source_binary, target_binary, binary_matches, binary_scores);
+    const double binary_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    double fpfh_precision, fpfh_precision_median, binary_precision, binary_precision_median;
+    std::size_t fpfh_median, binary_median;
+    precision(source_keypoints, target_keypoints, fpfh_matches, fpfh_scores, 0.5 * radius, fpfh_precision, fpfh_precision_median, fpfh_median);
+    precision(source_keypoints, target_keypoints, binary_matches, binary_scores, 0.5 * radius, binary_precision, binary_precision_median, binary_median);
+
+    std::cout<<"keypoints\tfpfh[s]\tbinary[s]\tspeedup\tfpfh_precision\tbinary_precision\tfpfh_median_precision\tbinary_median_precision\tbytes_fpfh\tbytes_binary\n";
+    std::cout<<number_keypoints<<"\t"<<fpfh_time<<"\t"<<binary_time<<"\t"<<fpfh_time/binary_time
+        <<"\t"<<fpfh_precision<<"\t"<<binary_precision<<"\t"<<fpfh_precision_median<<"\t"<<binary_precision_median
+        <<"\t"<<sizeof(pcl::FPFHSignature33)<<"\t"<<sizeof(BinaryFPFHSignature)<<"\n";
+
+    return 0;
+}
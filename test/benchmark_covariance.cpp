@@ -0,0 +1,89 @@
+/**\file benchmark_covariance.cpp
+ *
+ * Recovery of all the pose covariances: one Marginals query per pose
+ * against the batched sparse inverse of ESAM::marginalCovariances()
+ *
+ * Usage: benchmark_covariance [number_poses]
+ *
+ */
+
+#include <envire_sam/ESAM.hpp>
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+
+using namespace envire::sam;
+
+/** Square loops of poses closed every lap **/
+void buildPoseGraph(envire::sam::ESAM &esam, const unsigned int number_poses)
+{
+    const unsigned int side = 10, lap = 4 * side;
+
+    base::Vector6d var_odometry;
+    var_odometry << 0.02*0.02, 0.02*0.02, 0.02*0.02, 0.05*0.05, 0.05*0.05, 0.05*0.05;
+
+    base::TransformWithCovariance pose;
+    esam.addPoseValue(pose);
+    for (unsigned int i=1; i<number_poses; ++i)
+    {
+        base::Pose delta_pose;
+        delta_pose.position << 1.0, 0.0, 0.1;
+        if (i % side == 0)
+            delta_pose.orientation = Eigen::Quaterniond(Eigen::AngleAxisd(M_PI_2, Eigen::Vector3d::UnitZ()));
+
+        esam.addDeltaPoseFactor(base::Time::now(), delta_pose, var_odometry);
+        pose = pose * base::TransformWithCovariance(delta_pose.position, delta_pose.orientation);
+        esam.addPoseValue(pose);
+
+        /** Same place one lap before **/
+        if (i >= lap)
+        {
+            base::Pose loop_pose;
+            loop_pose.position << 0.0, 0.0, 0.1 * lap;
+            esam.insertPoseFactor('x', i - lap, 'x', i, base::Time::now(), loop_pose, var_odometry);
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    const unsigned int number_poses = (argc > 1) ? std::atoi(argv[1]) : 2000;
+
+    base::Pose pose_0;
+    base::Vector6d var_pose_0(base::Vector6d::Constant(1e-6));
+    envire::sam::ESAM esam(pose_0, var_pose_0, 'x', 'l');
+    buildPoseGraph(esam, number_poses);
+    esam.optimize();
+
+    gtsam::KeySet keys = esam.factor_graph().keys();
+    gtsam::Values values;
+    esam.currentEstimates(keys, values);
+
+    /** One query per pose **/
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    gtsam::Marginals marginals(esam.factor_graph(), values);
+    std::map<gtsam::Key, gtsam::Matrix> per_key;
+    for (gtsam::KeySet::const_iterator key = keys.begin(); key != keys.end(); ++key)
+    {
+        per_key[*key] = marginals.marginalCovariance(*key);
+    }
+    const double per_key_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    /** Batched **/
+    start = std::chrono::steady_clock::now();
+    std::map<gtsam::Key, gtsam::Matrix> batched;
+    esam.marginalCovariances(keys, batched);
+    const double batched_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    double max_error = 0.0;
+    for (std::map<gtsam::Key, gtsam::Matrix>::const_iterator it = per_key.begin(); it != per_key.end(); ++it)
+    {
+        max_error = std::max(max_error, (batched[it->first] - it->second).cwiseAbs().maxCoeff());
+    }
+
+    std::cout<<"poses\tper_key[s]\tbatched[s]\tspeedup\tmax_error\n";
+    std::cout<<number_poses<<"\t"<<per_key_time<<"\t"<<batched_time<<"\t"<<per_key_time/batched_time<<"\t"<<max_error<<"\n";
+
+    return 0;
+}
@@ -0,0 +1,52 @@
+/**\file benchmark_dataset.cpp
+ *
+ * Load and solve time of ESAM on pose graph datasets (sphere, garage,
+ * parking, Manhattan, ...)
+ *
+ * Usage: benchmark_dataset <g2o|toro> dataset [dataset ...]
+ *
+ */
+
+#include <envire_sam/ESAM.hpp>
+
+#include <chrono>
+#include <cstring>
+#include <iostream>
+
+using namespace envire::sam;
+
+int main(int argc, char **argv)
+{
+    if (argc < 3 || (std::strcmp(argv[1], "g2o") != 0 && std::strcmp(argv[1], "toro") != 0))
+    {
+        std::cerr<<"Usage: "<<argv[0]<<" <g2o|toro> dataset [dataset ...]\n";
+        return 1;
+    }
+    const DatasetFormat format = (std::strcmp(argv[1], "g2o") == 0) ? G2O : TORO;
+
+    std::cout<<"dataset\tfactors\tload[s]\toptimize[s]\n";
+    for (int i=2; i<argc; ++i)
+    {
+        /** Datasets start at the origin **/
+        base::Pose pose_0;
+        base::Vector6d var_pose_0(base::Vector6d::Constant(1e-6));
+        envire::sam::ESAM esam(pose_0, var_pose_0, 'x', 'l');
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        if (!esam.readPoseGraph(argv[i], format))
+        {
+            std::cout<<argv[i]<<"\tfailed to load\n";
+            continue;
+        }
+        const double load_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        start = std::chrono::steady_clock::now();
+        esam.optimize();
+        const double optimize_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        std::cout<<argv[i]<<"\t"<<esam.factor_graph().size()
+            <<"\t"<<load_time<<"\t"<<optimize_time<<"\n";
+    }
+
+    return 0;
+}
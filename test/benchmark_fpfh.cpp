@@ -0,0 +1,101 @@
+/**\file benchmark_fpfh.cpp
+ *
+ * FPFH descriptors at keypoints: pcl::FPFHEstimation against
+ * envire::sam::computeFPFH (AVX2 when built with USE_AVX2, parallel
+ * when GTSAM has TBB) on a synthetic surface
+ *
+ * Usage: benchmark_fpfh [points_per_side] [number_keypoints] [radius]
+ *
+ */
+
+#include <envire_sam/ESAM.hpp>
+
+#include <pcl/features/fpfh.h>
+#include <pcl/common/io.h>
+
+#include <chrono>
+#include <random>
+#include <cstdlib>
+#include <iostream>
+
+using namespace envire::sam;
+
+/** Wavy surface with noise and its analytic normals **/
+void buildSurface(PCLPointCloud &surface, pcl::PointCloud<pcl::Normal> &normals, const unsigned int side)
+{
+    std::mt19937 generator(42);
+    std::normal_distribution<float> noise(0.0, 0.002);
+    const float step = 2.0 / side;
+    for (unsigned int i=0; i<side; ++i)
+        for (unsigned int j=0; j<side; ++j)
+        {
+            PointType point;
+            point.x = step * i; point.y = step * j;
+            point.z = 0.1 * std::sin(3.0*point.x) * std::cos(2.0*point.y) + noise(generator);
+            surface.push_back(point);
+
+            const Eigen::Vector3f normal = Eigen::Vector3f(-0.3 * std::cos(3.0*point.x) * std::cos(2.0*point.y),
+                    0.2 * std::sin(3.0*point.x) * std::sin(2.0*point.y), 1.0).normalized();
+            pcl::Normal point_normal;
+            point_normal.normal_x = normal[0]; point_normal.normal_y = normal[1]; point_normal.normal_z = normal[2];
+            normals.push_back(point_normal);
+        }
+}
+
+int main(int argc, char **argv)
+{
+    const unsigned int side = (argc > 1) ? std::atoi(argv[1]) : 200;
+    const unsigned int number_keypoints = (argc > 2) ? std::atoi(argv[2]) : 1000;
+    const float radius = (argc > 3) ? std::atof(argv[3]) : 0.1;
+
+    PCLPointCloud::Ptr surface(new PCLPointCloud);
+    pcl::PointCloud<pcl::Normal>::Ptr normals(new pcl::PointCloud<pcl::Normal>);
+    buildSurface(*surface, *normals, side);
+
+    std::mt19937 generator(7);
+    std::uniform_int_distribution<std::size_t> index(0, surface->size() - 1);
+    pcl::PointCloud<pcl::PointWithScale>::Ptr keypoints(new pcl::PointCloud<pcl::PointWithScale>);
+    for (unsigned int k=0; k<number_keypoints; ++k)
+    {
+        const PointType &point = surface->points[index(generator)];
+        pcl::PointWithScale keypoint;
+        keypoint.x = point.x; keypoint.y = point.y; keypoint.z = point.z;
+        keypoints->push_back(keypoint);
+    }
+
+    /** pcl **/
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    PCLPointCloud::Ptr keypoints_xyzrgb(new PCLPointCloud);
+    pcl::copyPointCloud(*keypoints, *keypoints_xyzrgb);
+    pcl::FPFHEstimation<PointType, pcl::Normal, pcl::FPFHSignature33> fpfh_est;
+    fpfh_est.setSearchMethod(pcl::search::KdTree<PointType>::Ptr(new pcl::search::KdTree<PointType>));
+    fpfh_est.setRadiusSearch(radius);
+    fpfh_est.setSearchSurface(surface);
+    fpfh_est.setInputNormals(normals);
+    fpfh_est.setInputCloud(keypoints_xyzrgb);
+    pcl::PointCloud<pcl::FPFHSignature33> pcl_descriptors;
+    fpfh_est.compute(pcl_descriptors);
+    const double pcl_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    /** Batched **/
+    start = std::chrono::steady_clock::now();
+    pcl::PointCloud<pcl::FPFHSignature33> descriptors;
+    computeFPFH<PointType, pcl::PointWithScale>(surface, *normals, *keypoints, radius, descriptors);
+    const double batched_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    float max_difference = 0.0;
+    std::size_t different_bins = 0;
+    for (std::size_t i=0; i<descriptors.size(); ++i)
+        for (int j=0; j<33; ++j)
+        {
+            const float difference = std::fabs(descriptors.points[i].histogram[j] - pcl_descriptors.points[i].histogram[j]);
+            max_difference = std::max(max_difference, difference);
+            different_bins += (difference > 0.0f);
+        }
+
+    std::cout<<"points\tkeypoints\tradius\tpcl[s]\tbatched[s]\tspeedup\tmax_difference\tdifferent_bins\n";
+    std::cout<<surface->size()<<"\t"<<number_keypoints<<"\t"<<radius<<"\t"<<pcl_time<<"\t"<<batched_time
+        <<"\t"<<pcl_time/batched_time<<"\t"<<max_difference<<"\t"<<different_bins<<"\n";
+
+    return 0;
+}
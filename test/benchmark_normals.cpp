@@ -0,0 +1,126 @@
+/**\file benchmark_normals.cpp
+ *
+ * Normals and curvature of symmetric 3x3 covariances: Eigen solvers one
+ * matrix at a time against the closed form of BatchEigenSolver.hpp, one
+ * at a time and batched (AVX2 when built with USE_AVX2), plus the
+ * accumulation of the neighborhood covariances
+ *
+ * Usage: benchmark_normals [number_matrices]
+ *
+ */
+
+#include <envire_sam/BatchEigenSolver.hpp>
+
+#include <Eigen/Geometry>
+
+#include <chrono>
+#include <random>
+#include <cstdlib>
+#include <iostream>
+
+using namespace envire::sam;
+
+/** Surface patches: two large eigenvalues, one small, random orientation and scale **/
+void buildCovariances(CovarianceBatch &covariances, const std::size_t number_matrices)
+{
+    std::mt19937 generator(42);
+    std::normal_distribution<double> normal(0.0, 1.0);
+    covariances.resize(number_matrices);
+    for (std::size_t i=0; i<number_matrices; ++i)
+    {
+        const Eigen::Matrix3d rotation = Eigen::Quaterniond(normal(generator), normal(generator),
+                normal(generator), normal(generator)).normalized().toRotationMatrix();
+        const Eigen::Vector3d eigenvalues(1e-4 * std::fabs(normal(generator)),
+                1.0 + std::fabs(normal(generator)), 1.0 + std::fabs(normal(generator)));
+        const double scale = 1e-3 * (1.0 + std::fabs(normal(generator)));
+        covariances.set(i, scale * rotation * eigenvalues.asDiagonal() * rotation.transpose(), 30.0);
+    }
+}
+
+template <typename F>
+double seconds(F function)
+{
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    function();
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char **argv)
+{
+    const std::size_t number_matrices = (argc > 1) ? std::atoi(argv[1]) : 1000000;
+
+    CovarianceBatch covariances;
+    buildCovariances(covariances, number_matrices);
+
+    /** Eigen, iterative and direct **/
+    NormalBatch reference;
+    reference.resize(number_matrices);
+    const double iterative_time = seconds([&]()
+    {
+        for (std::size_t i=0; i<number_matrices; ++i)
+            detail::robustNormal(covariances, i, reference);
+    });
+
+    NormalBatch direct;
+    direct.resize(number_matrices);
+    const double direct_time = seconds([&]()
+    {
+        for (std::size_t i=0; i<number_matrices; ++i)
+        {
+            Eigen::Matrix3d matrix;
+            matrix << covariances.xx[i], covariances.xy[i], covariances.xz[i],
+                   covariances.xy[i], covariances.yy[i], covariances.yz[i],
+                   covariances.xz[i], covariances.yz[i], covariances.zz[i];
+            Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> solver;
+            solver.computeDirect(matrix);
+            direct.x[i] = solver.eigenvectors()(0,0);
+            direct.y[i] = solver.eigenvectors()(1,0);
+            direct.z[i] = solver.eigenvectors()(2,0);
+            direct.curvature[i] = solver.eigenvalues()[0] / solver.eigenvalues().sum();
+        }
+    });
+
+    /** Closed form **/
+    NormalBatch scalar, batched;
+    const double scalar_time = seconds([&](){ solveNormalsScalar(covariances, scalar); });
+    const double batched_time = seconds([&](){ solveNormals(covariances, batched); });
+
+    double max_angle = 0.0, max_curvature = 0.0;
+    for (std::size_t i=0; i<number_matrices; ++i)
+    {
+        const double cosine = std::fabs(reference.x[i] * batched.x[i] + reference.y[i] * batched.y[i] + reference.z[i] * batched.z[i]);
+        max_angle = std::max(max_angle, std::acos(std::min(cosine, 1.0)));
+        max_curvature = std::max(max_curvature, std::fabs(reference.curvature[i] - batched.curvature[i]));
+    }
+
+    std::cout<<"matrices\titerative[s]\tdirect[s]\tscalar[s]\tbatched[s]\tspeedup\tmax_angle[rad]\tmax_curvature_error\n";
+    std::cout<<number_matrices<<"\t"<<iterative_time<<"\t"<<direct_time<<"\t"<<scalar_time<<"\t"<<batched_time
+        <<"\t"<<direct_time/batched_time<<"\t"<<max_angle<<"\t"<<max_curvature<<"\n";
+
+    /** Accumulation: 32 random neighbors per query in a cloud of a tenth of the queries **/
+    const std::size_t number_points = std::max<std::size_t>(number_matrices / 10, 32), number_neighbors = 32;
+    std::mt19937 generator(7);
+    std::uniform_real_distribution<double> coordinate(-10.0, 10.0);
+    std::uniform_int_distribution<int> neighbor(0, number_points - 1);
+    PointBatch points;
+    for (std::size_t i=0; i<number_points; ++i)
+    {
+        points.x.push_back(coordinate(generator));
+        points.y.push_back(coordinate(generator));
+        points.z.push_back(coordinate(generator));
+    }
+    std::vector<int> indices(number_matrices * number_neighbors);
+    std::vector<std::size_t> offsets(number_matrices + 1);
+    for (std::size_t i=0; i<indices.size(); ++i)
+        indices[i] = neighbor(generator);
+    for (std::size_t i=0; i<offsets.size(); ++i)
+        offsets[i] = i * number_neighbors;
+
+    CovarianceBatch accumulated;
+    const double accumulation_time = seconds([&](){ accumulateCovariances(points, indices, offsets, accumulated); });
+
+    std::cout<<"queries\tneighbors\taccumulation[s]\n";
+    std::cout<<number_matrices<<"\t"<<number_neighbors<<"\t"<<accumulation_time<<"\n";
+
+    return 0;
+}
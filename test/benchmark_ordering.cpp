@@ -0,0 +1,116 @@
+/**\file benchmark_ordering.cpp
+ *
+ * Fill-in of the Bayes net and solve time of a landmark-heavy graph
+ * under each elimination ordering of ESAM
+ *
+ * Usage: benchmark_ordering [number_poses] [landmarks_per_pose]
+ *
+ */
+
+#include <envire_sam/ESAM.hpp>
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+
+using namespace envire::sam;
+
+/** Straight trajectory observing landmarks on both sides, each one seen from the next poses **/
+void buildLandmarkGraph(envire::sam::ESAM &esam, const unsigned int number_poses,
+                        const unsigned int landmarks_per_pose)
+{
+    const unsigned int visibility = 5;
+
+    base::Vector6d var_odometry;
+    var_odometry << 0.02*0.02, 0.02*0.02, 0.02*0.02, 0.05*0.05, 0.05*0.05, 0.05*0.05;
+    base::Vector3d var_landmark(base::Vector3d::Constant(0.05*0.05));
+
+    std::vector<base::Vector3d> landmarks;
+    base::TransformWithCovariance pose;
+    esam.addPoseValue(pose);
+    for (unsigned int i=0; i<number_poses; ++i)
+    {
+        if (i > 0)
+        {
+            base::Pose delta_pose;
+            delta_pose.position << 1.0, 0.0, 0.0;
+            esam.addDeltaPoseFactor(base::Time::now(), delta_pose, var_odometry);
+            pose.translation += delta_pose.position;
+            esam.addPoseValue(pose);
+        }
+
+        /** New landmarks ahead of the pose **/
+        for (unsigned int j=0; j<landmarks_per_pose; ++j)
+        {
+            base::Vector3d landmark;
+            landmark << i + static_cast<double>(j)/landmarks_per_pose, (j % 2)? 2.0 : -2.0, 0.1 * j;
+            esam.insertLandmarkFactor('x', i, 'l', landmarks.size(), base::Time::now(), landmark - pose.translation, var_landmark);
+            esam.insertLandmarkValue('l', landmarks.size(), landmark);
+            landmarks.push_back(landmark);
+        }
+
+        /** Landmarks of the previous poses still in sight **/
+        for (unsigned int k=1; k<visibility && k<=i; ++k)
+        {
+            for (unsigned int j=0; j<landmarks_per_pose; ++j)
+            {
+                const unsigned int l_idx = (i-k) * landmarks_per_pose + j;
+                esam.insertLandmarkFactor('x', i, 'l', l_idx, base::Time::now(), landmarks[l_idx] - pose.translation, var_landmark);
+            }
+        }
+    }
+}
+
+/** Number of entries of the conditionals after eliminating in the given ordering **/
+size_t fillIn(envire::sam::ESAM &esam, const gtsam::Ordering &ordering)
+{
+    gtsam::Values values;
+    esam.currentEstimates(esam.factor_graph().keys(), values);
+    boost::shared_ptr<gtsam::GaussianFactorGraph> linear = esam.factor_graph().linearize(values);
+    boost::shared_ptr<gtsam::GaussianBayesNet> bayes_net = linear->eliminateSequential(ordering);
+
+    size_t entries = 0;
+    for (gtsam::GaussianBayesNet::const_iterator conditional = bayes_net->begin();
+            conditional != bayes_net->end(); ++conditional)
+    {
+        entries += (*conditional)->rows() * (*conditional)->cols();
+    }
+    return entries;
+}
+
+int main(int argc, char **argv)
+{
+    const unsigned int number_poses = (argc > 1) ? std::atoi(argv[1]) : 500;
+    const unsigned int landmarks_per_pose = (argc > 2) ? std::atoi(argv[2]) : 10;
+
+    const char *names[] = {"colamd", "landmarks_first", "recent_poses_last", "grouped"};
+
+    std::cout<<"ordering\tposes\tlandmarks\tfill_in\tsolve[s]\n";
+    for (int type = COLAMD_ORDERING; type <= GROUPED_ORDERING; ++type)
+    {
+        base::Pose pose_0;
+        base::Vector6d var_pose_0(base::Vector6d::Constant(1e-6));
+        envire::sam::ESAM esam(pose_0, var_pose_0, 'x', 'l');
+        buildLandmarkGraph(esam, number_poses, landmarks_per_pose);
+
+        OrderingParams params;
+        params.type = static_cast<EliminationOrderingType>(type);
+        esam.setOrderingParams(params);
+
+        /** Poses in blocks of 50 keyframes, landmarks before all of them **/
+        gtsam::FastMap<gtsam::Key, int> groups;
+        for (unsigned int i=0; i<number_poses; ++i)
+            groups[gtsam::Symbol('x', i)] = 1 + i / 50;
+        esam.setOrderingGroups(groups);
+
+        const size_t entries = fillIn(esam, esam.eliminationOrdering());
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        esam.optimize();
+        const double solve_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        std::cout<<names[type]<<"\t"<<number_poses<<"\t"<<number_poses * landmarks_per_pose<<"\t"<<entries<<"\t"<<solve_time<<"\n";
+    }
+
+    return 0;
+}
@@ -0,0 +1,120 @@
+/**\file benchmark_solver_threads.cpp
+ *
+ * Time of the Gauss-Newton solve of ESAM on a large pose graph from one
+ * to N threads (without the covariances and the write back of optimize())
+ *
+ * Usage: benchmark_solver_threads [number_poses] [max_threads]
+ *
+ */
+
+#include <envire_sam/ESAM.hpp>
+
+#include <boost/random.hpp>
+#include <gtsam/config.h>
+
+#include <chrono>
+#include <thread>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+
+using namespace envire::sam;
+
+/** Access to the solver alone **/
+class SolverESAM : public envire::sam::ESAM
+{
+    public:
+        SolverESAM(const base::Pose &pose, const base::Vector6d &var_pose, const char pose_key, const char landmark_key)
+            :envire::sam::ESAM(pose, var_pose, pose_key, landmark_key){}
+
+        using envire::sam::ESAM::solve;
+};
+
+/** Manhattan world trajectory with loop closures between revisited places **/
+void buildPoseGraph(envire::sam::ESAM &esam, const unsigned int number_poses)
+{
+    boost::mt19937 generator(42);
+    boost::uniform_int<> turn_distribution(0, 3);
+    boost::normal_distribution<> noise_distribution(0.0, 0.02);
+    boost::variate_generator<boost::mt19937&, boost::normal_distribution<> > noise(generator, noise_distribution);
+
+    base::Vector6d var_odometry;
+    var_odometry << 0.02*0.02, 0.02*0.02, 0.02*0.02, 0.05*0.05, 0.05*0.05, 0.05*0.05;
+
+    /** Ground truth and dead reckoning **/
+    Eigen::Affine3d ground_truth(Eigen::Affine3d::Identity());
+    base::TransformWithCovariance dead_reckoning;
+    std::vector<Eigen::Affine3d, Eigen::aligned_allocator<Eigen::Affine3d> > trajectory(1, ground_truth);
+    std::multimap< std::pair<int, int>, unsigned int> places;
+    places.insert(std::make_pair(std::make_pair(0, 0), 0));
+
+    esam.addPoseValue(dead_reckoning);
+
+    for (unsigned int i=1; i<number_poses; ++i)
+    {
+        /** Move one meter and turn at random **/
+        Eigen::Affine3d delta(Eigen::Translation3d(1.0, 0.0, 0.0));
+        const int turn = turn_distribution(generator);
+        if (turn == 1) delta.rotate(Eigen::AngleAxisd(M_PI_2, Eigen::Vector3d::UnitZ()));
+        if (turn == 2) delta.rotate(Eigen::AngleAxisd(-M_PI_2, Eigen::Vector3d::UnitZ()));
+        ground_truth = ground_truth * delta;
+        trajectory.push_back(ground_truth);
+
+        /** Noisy odometry **/
+        Eigen::Affine3d noisy_delta(delta);
+        noisy_delta.translation() += Eigen::Vector3d(noise(), noise(), noise());
+        noisy_delta.rotate(Eigen::AngleAxisd(noise(), Eigen::Vector3d::UnitZ()));
+        esam.addDeltaPoseFactor(base::Time::now(), noisy_delta, var_odometry);
+        dead_reckoning = dead_reckoning * base::TransformWithCovariance(noisy_delta);
+        esam.addPoseValue(dead_reckoning);
+
+        /** Loop closure with the first visit of the place **/
+        std::pair<int, int> place(static_cast<int>(std::floor(ground_truth.translation().x() + 0.5)),
+                static_cast<int>(std::floor(ground_truth.translation().y() + 0.5)));
+        std::multimap< std::pair<int, int>, unsigned int>::iterator visit = places.find(place);
+        if (visit != places.end() && i - visit->second > 20)
+        {
+            base::Pose loop_delta(trajectory[visit->second].inverse() * ground_truth);
+            esam.insertPoseFactor('x', visit->second, 'x', i, base::Time::now(), loop_delta, var_odometry);
+        }
+        places.insert(std::make_pair(place, i));
+    }
+}
+
+int main(int argc, char **argv)
+{
+    const unsigned int number_poses = (argc > 1) ? std::atoi(argv[1]) : 10000;
+    const int max_threads = (argc > 2) ? std::atoi(argv[2]) : static_cast<int>(std::thread::hardware_concurrency());
+
+    #ifndef GTSAM_USE_TBB
+    std::cout<<"GTSAM is built without TBB, the elimination runs in one thread\n";
+    #endif
+
+    std::cout<<"threads\tfactors\tsolve[s]\tspeedup\n";
+    double single_thread_time = 0.0;
+    for (int threads=1; threads<=max_threads; ++threads)
+    {
+        base::Pose pose_0;
+        base::Vector6d var_pose_0(base::Vector6d::Constant(1e-6));
+        SolverESAM esam(pose_0, var_pose_0, 'x', 'l');
+        buildPoseGraph(esam, number_poses);
+
+        envire::sam::SolverParams solver;
+        solver.number_threads = threads;
+        esam.setSolverParams(solver);
+
+        gtsam::Values initial_estimate;
+        esam.currentEstimates(esam.factor_graph().keys(), initial_estimate);
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        esam.solve(initial_estimate);
+        const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        if (threads == 1)
+            single_thread_time = elapsed;
+
+        std::cout<<threads<<"\t"<<esam.factor_graph().size()<<"\t"<<elapsed<<"\t"<<single_thread_time/elapsed<<"\n";
+    }
+
+    return 0;
+}
@@ -0,0 +1,73 @@
+/**\file benchmark_trajectory.cpp
+ *
+ * Export of a long trajectory: the per frame envire lookup of
+ * getRbsPose() and the cached getRbsPoses() against the contiguous
+ * arrays of ESAM::exportTrajectory() and the binary trajectory file
+ *
+ * Usage: benchmark_trajectory [number_poses]
+ *
+ */
+
+#include <envire_sam/ESAM.hpp>
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+
+using namespace envire::sam;
+
+int main(int argc, char **argv)
+{
+    const unsigned int number_poses = (argc > 1) ? std::atoi(argv[1]) : 50000;
+
+    base::Pose pose_0;
+    base::Vector6d var_pose(base::Vector6d::Constant(1e-4));
+    envire::sam::ESAM esam(pose_0, var_pose, 'x', 'l');
+
+    base::Pose delta_pose;
+    delta_pose.position << 0.1, 0.0, 0.0;
+    base::TransformWithCovariance pose;
+    pose.cov = base::Matrix6d::Identity();
+    esam.addPoseValue(pose);
+    for (unsigned int i=1; i<number_poses; ++i)
+    {
+        esam.addDeltaPoseFactor(base::Time::fromSeconds(0.1 * i), delta_pose, var_pose);
+        pose.translation.x() += 0.1;
+        esam.addPoseValue(pose);
+    }
+
+    std::vector<boost::int64_t> timestamps(number_poses);
+    std::vector<double> positions(3 * number_poses), orientations(4 * number_poses), covariances(36 * number_poses);
+    std::vector<base::samples::RigidBodyState> rbs_poses(number_poses);
+
+    /** Warm up both paths (the pose item cache is filled at the first call) **/
+    for (unsigned int i=0; i<number_poses; ++i)
+        rbs_poses[i] = esam.getRbsPose(gtsam::Symbol('x', i));
+    esam.exportTrajectory(timestamps.data(), positions.data(), orientations.data(), covariances.data());
+
+    /** Baseline: envire lookup of each frame **/
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (unsigned int i=0; i<number_poses; ++i)
+        rbs_poses[i] = esam.getRbsPose(gtsam::Symbol('x', i));
+    const double lookup_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    /** Vector of rigid body states from the cached pose items **/
+    start = std::chrono::steady_clock::now();
+    rbs_poses = esam.getRbsPoses();
+    const double rbs_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    /** Contiguous arrays **/
+    start = std::chrono::steady_clock::now();
+    esam.exportTrajectory(timestamps.data(), positions.data(), orientations.data(), covariances.data());
+    const double export_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    /** Binary file **/
+    start = std::chrono::steady_clock::now();
+    esam.writeTrajectory("benchmark_trajectory.bin");
+    const double file_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::cout<<"poses\tlookup[s]\trbs_poses[s]\texport[s]\tfile[s]\tspeedup\n";
+    std::cout<<number_poses<<"\t"<<lookup_time<<"\t"<<rbs_time<<"\t"<<export_time<<"\t"<<file_time<<"\t"<<lookup_time/export_time<<"\n";
+
+    return 0;
+}
@@ -0,0 +1,101 @@
+#include <boost/test/unit_test.hpp>
+#include <envire_sam/BatchFPFH.hpp>
+
+#include <cstdlib>
+
+/** Built with -mavx2: the AVX2 pair features against the scalar ones of the same build **/
+
+#ifdef __AVX2__
+
+/** Random points in a cube with unit normals, some NaN normals and coincident points **/
+static void randomSurface(const int size, envire::sam::SurfaceBatch &surface)
+{
+    std::srand(42);
+    for (int i=0; i<size; ++i)
+    {
+        Eigen::Vector3f point = Eigen::Vector3f::Random();
+        Eigen::Vector3f normal = Eigen::Vector3f::Random().normalized();
+        if (i % 17 == 3)
+            normal.setConstant(std::numeric_limits<float>::quiet_NaN());
+        if (i % 23 == 5)
+            point = Eigen::Vector3f(surface.x[0], surface.y[0], surface.z[0]);
+
+        surface.x.push_back(point[0]); surface.y.push_back(point[1]); surface.z.push_back(point[2]);
+        surface.nx.push_back(normal[0]); surface.ny.push_back(normal[1]); surface.nz.push_back(normal[2]);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(batch_fpfh_avx2_pairs)
+{
+    BOOST_TEST_MESSAGE( "\n**********************************************************\n" );
+    BOOST_TEST_MESSAGE( "BATCH_FPFH_AVX2_PAIRS" );
+
+    const int bins = 3 * envire::sam::detail::fpfh_bins, size = 1024;
+    envire::sam::SurfaceBatch surface;
+    randomSurface(size, surface);
+
+    // Each point with eight others, the histograms only differ where the approximated atan2 changes a bin
+    int groups = 0, different_groups = 0;
+    double avx2_mass = 0.0, scalar_mass = 0.0;
+    for (int p=0; p<size; ++p)
+    {
+        int neighbors[8];
+        for (int k=0; k<8; ++k)
+            neighbors[k] = (p + 1 + 37*k) % size;
+
+        float avx2[3 * 11] = {0}, scalar[3 * 11] = {0};
+        envire::sam::detail::addPairs8(surface, p, neighbors, 1.0f, avx2);
+        for (int k=0; k<8; ++k)
+            envire::sam::detail::addPairScalar(surface, p, neighbors[k], 1.0f, scalar);
+
+        bool different = false;
+        for (int j=0; j<bins; ++j)
+        {
+            different |= (avx2[j] != scalar[j]);
+            avx2_mass += avx2[j];
+            scalar_mass += scalar[j];
+        }
+        groups++;
+        different_groups += different;
+    }
+
+    // Same pairs skipped (coincident points) and NaN features in the same bins
+    BOOST_CHECK_EQUAL(avx2_mass, scalar_mass);
+    BOOST_CHECK(scalar_mass < 3.0 * 8 * size);
+    BOOST_CHECK(different_groups * 100 <= groups);
+}
+
+BOOST_AUTO_TEST_CASE(batch_fpfh_avx2_spfh)
+{
+    BOOST_TEST_MESSAGE( "\n**********************************************************\n" );
+    BOOST_TEST_MESSAGE( "BATCH_FPFH_AVX2_SPFH" );
+
+    const int bins = 3 * envire::sam::detail::fpfh_bins, size = 256;
+    envire::sam::SurfaceBatch surface;
+    randomSurface(size, surface);
+
+    // 20 neighbors: two AVX2 groups and a scalar tail, with the point itself in between
+    for (int p=0; p<size; ++p)
+    {
+        std::vector<int> neighbors;
+        for (int k=0; k<21; ++k)
+            neighbors.push_back((k == 10) ? p : (p + 1 + 11*k) % size);
+
+        float spfh[3 * 11], scalar[3 * 11] = {0};
+        envire::sam::computeSPFH(surface, p, neighbors, spfh);
+        for (std::size_t k=0; k<neighbors.size(); ++k)
+        {
+            if (neighbors[k] != p)
+                envire::sam::detail::addPairScalar(surface, p, neighbors[k], 100.0f / 20.0f, scalar);
+        }
+
+        float difference = 0.0f;
+        for (int j=0; j<bins; ++j)
+            difference += std::fabs(spfh[j] - scalar[j]);
+
+        // At most one pair in another bin of f1
+        BOOST_CHECK_SMALL(difference, 2.0f * 100.0f / 20.0f + 1e-3f);
+    }
+}
+
+#endif
@@ -1,6 +1,10 @@
 #include <boost/test/unit_test.hpp>
 #include <envire_sam/ESAM.hpp>
 
+#include <cstdio>
+#include <cstdlib>
+#include <ftw.h>
+
 #ifndef D2R
 #define D2R M_PI/180.00 /** Convert degree to radian **/
 #endif
@@ -10,6 +14,131 @@
 
 using namespace envire::sam;
 
+/** Fresh directory for the files of a test **/
+static std::string temporaryDirectory(const std::string &name)
+{
+    const char *tmp = std::getenv("TMPDIR");
+    std::string path = std::string(tmp ? tmp : "/tmp") + "/" + name + "_XXXXXX";
+    if (!::mkdtemp(&path[0]))
+        return name;
+    return path;
+}
+
+static int removeEntry(const char *path, const struct stat *, int, struct FTW *)
+{
+    return std::remove(path);
+}
+
+/** Remove a directory with its files **/
+static void removeDirectory(const std::string &path)
+{
+    ::nftw(path.c_str(), removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+/** Point cloud pipeline of the tests: no bilateral filter, no outlier
+ * removal and keypoint thresholds which find nothing on a uniform plane **/
+struct PipelineParams
+{
+    float downsample_size;
+    envire::sam::BilateralFilterParams bfilter;
+    envire::sam::OutlierRemovalParams outliers;
+    envire::sam::SIFTKeypointParams keypoint;
+    envire::sam::PFHFeatureParams feature;
+
+    PipelineParams()
+        :downsample_size(0.01)
+    {
+        bfilter.filterOn = false;
+        bfilter.spatial_width = 15.0; bfilter.range_sigma = 0.05;
+        outliers.type = envire::sam::NONE;
+        outliers.parameter_one = 0; outliers.parameter_two = 0;
+        keypoint.min_scale = 0.06; keypoint.nr_octaves = 3; keypoint.nr_octaves_per_scale = 3; keypoint.min_contrast = 10.0;
+        feature.normal_radius = 0.1; feature.feature_radius = 1.0;
+    }
+};
+
+/** Pipeline which finds and describes keypoints on the textured plane **/
+static PipelineParams texturedPipelineParams()
+{
+    PipelineParams params;
+    params.downsample_size = 0.005;
+    params.keypoint.min_scale = 0.02; params.keypoint.min_contrast = 0.01;
+    params.feature.feature_radius = 0.2;
+    return params;
+}
+
+/** ESAM with the pipeline and the first pose at the origin **/
+static boost::shared_ptr<envire::sam::ESAM> pipelineESAM(const PipelineParams &params = PipelineParams())
+{
+    base::TransformWithCovariance pose_0;
+    pose_0.cov = base::Matrix6d::Identity() * 0.01;
+    return boost::shared_ptr<envire::sam::ESAM>(new envire::sam::ESAM(pose_0, 'x', 'l', params.downsample_size,
+                params.bfilter, params.outliers, params.keypoint, params.feature, Eigen::Vector3d(0.01, 0.01, 0.01)));
+}
+
+/** Square plane of size x size points at z = 1 m in uniform gray **/
+static base::samples::Pointcloud planeCloud(const int size, const double spacing)
+{
+    base::samples::Pointcloud cloud;
+    for (register int i=0; i<size; ++i)
+        for (register int j=0; j<size; ++j)
+        {
+            cloud.points.push_back(base::Point(spacing*i, spacing*j, 1.0));
+            cloud.colors.push_back(base::Vector4d(0.5, 0.5, 0.5, 1.0));
+        }
+    return cloud;
+}
+
+/** Same plane with patches of 5 x 5 points of scattered gray levels **/
+static base::samples::Pointcloud texturedPlaneCloud(const int size, const double spacing)
+{
+    base::samples::Pointcloud cloud;
+    for (register int i=0; i<size; ++i)
+        for (register int j=0; j<size; ++j)
+        {
+            const double gray = 0.1 + 0.8 * (((i/5) * 7919 + (j/5) * 104729) % 97) / 96.0;
+            cloud.points.push_back(base::Point(spacing*i, spacing*j, 1.0));
+            cloud.colors.push_back(base::Vector4d(gray, gray, gray, 1.0));
+        }
+    return cloud;
+}
+
+/** Same textured plane seen three times from the same pose: the keypoints of
+ * x0 (first params) are searched in x1 (second params). Returns the number of
+ * landmarks, the memory usage is taken at the end. **/
+static size_t binaryDescriptorLandmarks(const envire::sam::BinaryDescriptorParams &first,
+        const envire::sam::BinaryDescriptorParams &second, envire::sam::MemoryUsage &usage)
+{
+    boost::shared_ptr<envire::sam::ESAM> esam_ptr = pipelineESAM(texturedPipelineParams());
+    envire::sam::ESAM &esam = *esam_ptr;
+    esam.setBinaryDescriptorParams(first);
+
+    // Patches of 5 cm with scattered gray levels
+    base::samples::Pointcloud cloud = texturedPlaneCloud(100, 0.01);
+
+    base::Pose delta_pose;
+    base::TransformWithCovariance pose;
+    pose.cov = base::Matrix6d::Identity() * 0.01;
+    esam.pushPointCloud(cloud, 1, cloud.points.size());
+    size_t number_factors = 0;
+    for (register int i=1; i<=2; ++i)
+    {
+        if (i == 2)
+            esam.setBinaryDescriptorParams(second);
+        esam.addDeltaPoseFactor(base::Time::fromSeconds(i), delta_pose, base::Vector6d(base::Vector6d::Constant(0.01)));
+        esam.addPoseValue(pose);
+        esam.pushPointCloud(cloud, 1, cloud.points.size());
+        esam.computeKeypoints();
+        number_factors = esam.factor_graph().size();
+        esam.detectLandmarks(base::Time::fromSeconds(i));
+    }
+
+    usage = esam.memoryUsage();
+
+    // Two landmark factors per landmark
+    return (esam.factor_graph().size() - number_factors) / 2;
+}
+
 BOOST_AUTO_TEST_CASE(gtsam_simple_visual_slam)
 {
     BOOST_TEST_MESSAGE( "\n**********************************************************\n" );
@@ -238,3 +367,1288 @@ BOOST_AUTO_TEST_CASE(envire_sam_simple_landmark_slam)
 }
 
 
+BOOST_AUTO_TEST_CASE(envire_sam_landmark_culling)
+{
+    BOOST_TEST_MESSAGE( "\n**********************************************************\n" );
+    BOOST_TEST_MESSAGE( "ENVIRE_SAM_LANDMARK_CULLING" );
+
+    base::Pose pose_0;
+    base::Vector6d var_pose_0;
+    var_pose_0 << 0.3*0.3, 0.3*0.3, 0.3*0.3, 0.1*0.1, 0.1*0.1, 0.1*0.1;
+    envire::sam::ESAM esam(pose_0, var_pose_0, 'x', 'l');
+
+    base::Pose delta_pose;
+    delta_pose.position << 2.0, 0.0, 0.0;
+    base::Vector6d var_model;
+    var_model << 0.2*0.2, 0.2*0.2, 0.2*0.2, 0.1*0.1, 0.1*0.1, 0.1*0.1;
+    esam.addDeltaPoseFactor(base::Time::now(), delta_pose, var_model);
+    esam.addDeltaPoseFactor(base::Time::now(), delta_pose, var_model);
+
+    // l0 is observed from two frames, l1 only once from the first frame
+    base::Vector3d var_measurement (0.1, 0.1, 0.02);
+    esam.addLandmarkFactor('x', 0, base::Time::now(), base::Vector3d(2, 2, 0), var_measurement);
+    esam.insertLandmarkFactor('x', 1, 'l', 0, base::Time::now(), base::Vector3d(0, 2, 0), var_measurement);
+    esam.addLandmarkFactor('x', 0, base::Time::now(), base::Vector3d(4, -2, 0), var_measurement);
+
+    base::Pose pose;
+    esam.insertPoseValue('x', 0, pose);
+    pose.position << 2.0, 0.0, 0.0;
+    esam.insertPoseValue('x', 1, pose);
+    pose.position << 4.0, 0.0, 0.0;
+    esam.insertPoseValue('x', 2, pose);
+    esam.insertLandmarkValue('l', 0, base::Vector3d(2, 2, 0));
+    esam.insertLandmarkValue('l', 1, base::Vector3d(4, -2, 0));
+
+    esam.optimize();
+    const size_t number_factors = esam.factor_graph().size();
+
+    // Marginals of the graph before culling
+    esam.printMarginals();
+    BOOST_CHECK(esam.memoryUsage().marginals.bytes > 0);
+
+    envire::sam::LandmarkCullingParams culling;
+    culling.cullingOn = true;
+    culling.min_observations = 2;
+    culling.max_age = 1;
+    esam.setLandmarkCullingParams(culling);
+
+    BOOST_CHECK_EQUAL(esam.cullLandmarks(), 1);
+    BOOST_CHECK_EQUAL(esam.factor_graph().size(), number_factors - 1);
+
+    // They are factorized again for the remaining graph
+    BOOST_CHECK_EQUAL(esam.memoryUsage().marginals.bytes, 0);
+    esam.printMarginals();
+    BOOST_CHECK(esam.memoryUsage().marginals.bytes > 0);
+
+    // The graph without the culled landmark is still solvable
+    esam.optimize();
+    esam.printMarginals();
+}
+
+BOOST_AUTO_TEST_CASE(envire_sam_sparse_marginalization)
+{
+    BOOST_TEST_MESSAGE( "\n**********************************************************\n" );
+    BOOST_TEST_MESSAGE( "ENVIRE_SAM_SPARSE_MARGINALIZATION" );
+
+    base::Pose pose_0;
+    base::Vector6d var_pose_0;
+    var_pose_0 << 0.3*0.3, 0.3*0.3, 0.3*0.3, 0.1*0.1, 0.1*0.1, 0.1*0.1;
+    envire::sam::ESAM esam(pose_0, var_pose_0, 'x', 'l');
+
+    base::Vector6d var_model;
+    var_model << 0.2*0.2, 0.2*0.2, 0.2*0.2, 0.1*0.1, 0.1*0.1, 0.1*0.1;
+
+    base::Pose delta_pose;
+    delta_pose.position << 2.0, 0.0, 0.0;
+    delta_pose.orientation = Eigen::Quaternion <double> (Eigen::AngleAxisd(M_PI_2, Eigen::Vector3d::UnitZ()));
+    base::TransformWithCovariance pose_with_cov;
+    esam.addPoseValue(pose_with_cov);
+    for (register int i=0; i<4; ++i)
+    {
+        esam.addDeltaPoseFactor(base::Time::now(), delta_pose, var_model);
+        pose_with_cov = pose_with_cov * base::TransformWithCovariance(delta_pose.position, delta_pose.orientation);
+        esam.addPoseValue(pose_with_cov);
+    }
+    esam.insertPoseFactor('x', 4, 'x', 0, base::Time::now(), base::Pose(), var_model);
+    esam.optimize();
+
+    // Marginalize the prior frame and one in the middle of the loop
+    gtsam::KeySet frames;
+    frames.insert(gtsam::Symbol('x', 0));
+    frames.insert(gtsam::Symbol('x', 2));
+    esam.marginalizeFrames(frames);
+
+    gtsam::KeySet keys = esam.factor_graph().keys();
+    BOOST_CHECK(keys.find(gtsam::Symbol('x', 0)) == keys.end());
+    BOOST_CHECK(keys.find(gtsam::Symbol('x', 2)) == keys.end());
+    BOOST_CHECK_EQUAL(esam.marginalizedFrames().size(), 2);
+
+    // The tree keeps the absolute information of the prior
+    esam.optimize();
+    esam.printMarginals();
+
+    // Factors on a marginalized frame are rejected
+    const size_t number_factors = esam.factor_graph().size();
+    esam.insertPoseFactor('x', 2, 'x', 4, base::Time::now(), base::Pose(), var_model);
+    BOOST_CHECK_EQUAL(esam.factor_graph().size(), number_factors);
+
+    // Relative-only marginal anchored at the root keeps the covariance of the loop
+    envire::sam::ESAM relative(pose_0, var_pose_0, 'x', 'l');
+    pose_with_cov = base::TransformWithCovariance();
+    relative.addPoseValue(pose_with_cov);
+    for (register int i=0; i<4; ++i)
+    {
+        relative.addDeltaPoseFactor(base::Time::now(), delta_pose, var_model);
+        pose_with_cov = pose_with_cov * base::TransformWithCovariance(delta_pose.position, delta_pose.orientation);
+        relative.addPoseValue(pose_with_cov);
+    }
+    relative.insertPoseFactor('x', 4, 'x', 0, base::Time::now(), base::Pose(), var_model);
+    relative.optimize();
+    const base::Matrix3d cov_position = relative.getRbsPose("x3").cov_position;
+
+    frames.clear();
+    frames.insert(gtsam::Symbol('x', 2));
+    relative.marginalizeFrames(frames);
+    relative.optimize();
+    BOOST_CHECK_SMALL((relative.getRbsPose("x3").cov_position - cov_position).norm(), 1e-3 * cov_position.norm());
+}
+
+
+BOOST_AUTO_TEST_CASE(envire_sam_relative_poses)
+{
+    BOOST_TEST_MESSAGE( "\n**********************************************************\n" );
+    BOOST_TEST_MESSAGE( "ENVIRE_SAM_RELATIVE_POSES" );
+
+    base::Pose pose_0;
+    base::Vector6d var_pose_0;
+    var_pose_0 << 0.3*0.3, 0.3*0.3, 0.3*0.3, 0.1*0.1, 0.1*0.1, 0.1*0.1;
+    envire::sam::ESAM esam(pose_0, var_pose_0, 'x', 'l');
+
+    base::Vector6d var_model;
+    var_model << 0.2*0.2, 0.2*0.2, 0.2*0.2, 0.1*0.1, 0.1*0.1, 0.1*0.1;
+
+    base::Pose delta_pose;
+    delta_pose.position << 2.0, 0.0, 0.0;
+    base::TransformWithCovariance pose_with_cov;
+    esam.addPoseValue(pose_with_cov);
+    for (register int i=0; i<2; ++i)
+    {
+        esam.addDeltaPoseFactor(base::Time::now(), delta_pose, var_model);
+        pose_with_cov = pose_with_cov * base::TransformWithCovariance(delta_pose.position, delta_pose.orientation);
+        esam.addPoseValue(pose_with_cov);
+    }
+    esam.optimize();
+
+    std::vector< std::pair<gtsam::Symbol, gtsam::Symbol> > pairs;
+    pairs.push_back(std::make_pair(gtsam::Symbol('x', 0), gtsam::Symbol('x', 1)));
+    pairs.push_back(std::make_pair(gtsam::Symbol('x', 0), gtsam::Symbol('x', 2)));
+    std::vector<base::TransformWithCovariance> relative;
+    esam.relativePoses(pairs, relative);
+
+    BOOST_CHECK_EQUAL(relative.size(), 2);
+    BOOST_CHECK_CLOSE(relative[1].translation.x(), 4.0, 1e-3);
+
+    // The prior does not contribute to the relative uncertainty (noise is rotation first)
+    BOOST_CHECK_CLOSE(relative[0].cov(0,0), var_model[3], 1e-3);
+    BOOST_CHECK(relative[1].cov(0,0) > relative[0].cov(0,0));
+
+    // A frame which does not exist keeps the default transform
+    pairs.push_back(std::make_pair(gtsam::Symbol('x', 0), gtsam::Symbol('x', 9)));
+    esam.relativePoses(pairs, relative);
+    BOOST_CHECK_EQUAL(relative.size(), 3);
+    BOOST_CHECK_CLOSE(relative[1].translation.x(), 4.0, 1e-3);
+    BOOST_CHECK_SMALL(relative[2].translation.norm(), 1e-9);
+}
+
+BOOST_AUTO_TEST_CASE(envire_sam_candidate_search)
+{
+    BOOST_TEST_MESSAGE( "\n**********************************************************\n" );
+    BOOST_TEST_MESSAGE( "ENVIRE_SAM_CANDIDATE_SEARCH" );
+
+    base::Pose pose_0;
+    base::Vector6d var_pose(base::Vector6d::Constant(4.0));
+    envire::sam::ESAM esam(pose_0, var_pose, 'x', 'l');
+    BOOST_CHECK_EQUAL(esam.candidateSearchParams().max_candidates, 0);
+
+    // Poses x1 to x4 one meter apart and x5 half a meter after x4
+    base::Pose delta_pose;
+    base::TransformWithCovariance pose;
+    pose.cov = base::Matrix6d::Identity() * 4.0;
+    for (register int i=1; i<=5; ++i)
+    {
+        esam.addDeltaPoseFactor(base::Time::fromSeconds(i), delta_pose, var_pose);
+        pose.translation.x() = (i < 5) ? i : 4.5;
+        esam.addPoseValue(pose);
+    }
+
+    // The search region of x4 covers all the other frames
+    boost::shared_ptr<gtsam::Symbol> frame_id = esam.computeAlignedBoundingBox();
+    BOOST_CHECK_EQUAL(static_cast<std::string>(*frame_id), "x4");
+
+    std::vector< boost::shared_ptr<gtsam::Symbol> > frames_to_search;
+    esam.containsFrames(frame_id, frames_to_search);
+    BOOST_REQUIRE_EQUAL(frames_to_search.size(), 5);
+
+    // Closest frames first
+    const char *expected[] = {"x5", "x3", "x2", "x1", "x0"};
+    for (size_t i=0; i<frames_to_search.size(); ++i)
+        BOOST_CHECK_EQUAL(static_cast<std::string>(*frames_to_search[i]), expected[i]);
+
+    // The cap keeps the closest ones
+    envire::sam::CandidateSearchParams params;
+    params.max_candidates = 2;
+    esam.setCandidateSearchParams(params);
+    esam.containsFrames(frame_id, frames_to_search);
+    BOOST_REQUIRE_EQUAL(frames_to_search.size(), 2);
+    BOOST_CHECK_EQUAL(static_cast<std::string>(*frames_to_search[0]), "x5");
+    BOOST_CHECK_EQUAL(static_cast<std::string>(*frames_to_search[1]), "x3");
+}
+
+BOOST_AUTO_TEST_CASE(envire_sam_pose_graph_dataset)
+{
+    BOOST_TEST_MESSAGE( "\n**********************************************************\n" );
+    BOOST_TEST_MESSAGE( "ENVIRE_SAM_POSE_GRAPH_DATASET" );
+
+    const std::string directory = temporaryDirectory("envire_sam_pose_graph");
+    const std::string g2o_file(directory + "/envire_sam_pose_graph.g2o");
+    std::ofstream dataset(g2o_file.c_str());
+    dataset<<"VERTEX_SE3:QUAT 0 0 0 0 0 0 0 1\n";
+    dataset<<"VERTEX_SE3:QUAT 1 1.1 0 0 0 0 0 1\n";
+    dataset<<"VERTEX_SE2 2 1.9 0.1 0.0\n";
+    dataset<<"EDGE_SE3:QUAT 0 1 1 0 0 0 0 0 1 100 0 0 0 0 0 100 0 0 0 0 100 0 0 0 400 0 0 400 0 400\n";
+    dataset<<"EDGE_SE2 1 2 1 0 0 100 0 0 100 0 400\n";
+    dataset<<"EDGE_SE2 0 2 2 0 0 100 0 0 100 0 400\n";
+    // A repeated and a reversed measurement are factors as well
+    dataset<<"EDGE_SE3:QUAT 0 1 1 0 0 0 0 0 1 100 0 0 0 0 0 100 0 0 0 0 100 0 0 0 400 0 0 400 0 400\n";
+    dataset<<"EDGE_SE2 2 0 -2 0 0 100 0 0 100 0 400\n";
+    dataset.close();
+
+    base::Pose pose_0;
+    base::Vector6d var_pose_0(base::Vector6d::Constant(1e-6));
+    envire::sam::ESAM esam(pose_0, var_pose_0, 'x', 'l');
+    BOOST_CHECK(esam.readPoseGraph(g2o_file, envire::sam::G2O));
+    BOOST_CHECK_EQUAL(esam.factor_graph().size(), 6);
+    BOOST_CHECK_EQUAL(esam.currentPoseId(), "x2");
+
+    // One envire edge per pair of frames (and its inverse)
+    BOOST_CHECK_EQUAL(esam.memoryUsage().transforms.count, 6);
+
+    esam.optimize();
+    BOOST_CHECK_CLOSE(esam.getRbsPose("x2").position.x(), 2.0, 1e-3);
+
+    // Round trip through TORO
+    const std::string toro_file(directory + "/envire_sam_pose_graph.graph");
+    BOOST_CHECK(esam.writePoseGraph(toro_file, envire::sam::TORO));
+    envire::sam::ESAM esam_toro(pose_0, var_pose_0, 'x', 'l');
+    BOOST_CHECK(esam_toro.readPoseGraph(toro_file, envire::sam::TORO));
+    BOOST_CHECK_EQUAL(esam_toro.factor_graph().size(), 6);
+    esam_toro.optimize();
+    BOOST_CHECK_CLOSE(esam_toro.getRbsPose("x2").position.x(), 2.0, 1e-3);
+
+    removeDirectory(directory);
+}
+
+BOOST_AUTO_TEST_CASE(envire_sam_memory_usage)
+{
+    BOOST_TEST_MESSAGE( "\n**********************************************************\n" );
+    BOOST_TEST_MESSAGE( "ENVIRE_SAM_MEMORY_USAGE" );
+
+    base::Pose pose_0;
+    base::Vector6d var_pose(base::Vector6d::Constant(0.1));
+    envire::sam::ESAM esam(pose_0, var_pose, 'x', 'l');
+
+    base::Pose delta_pose;
+    delta_pose.position << 1.0, 0.0, 0.0;
+    base::TransformWithCovariance pose_with_cov;
+    esam.addPoseValue(pose_with_cov);
+    for (register int i=0; i<3; ++i)
+    {
+        esam.addDeltaPoseFactor(base::Time::now(), delta_pose, var_pose);
+        pose_with_cov = pose_with_cov * base::TransformWithCovariance(delta_pose.position, delta_pose.orientation);
+        esam.addPoseValue(pose_with_cov);
+    }
+    esam.optimize();
+
+    envire::sam::MemoryUsage usage = esam.memoryUsage();
+    BOOST_CHECK_EQUAL(usage.factors[envire::sam::PRIOR_FACTOR].count, 1);
+    BOOST_CHECK_EQUAL(usage.factors[envire::sam::BETWEEN_FACTOR].count, 3);
+    BOOST_CHECK_EQUAL(usage.values.count, 4);
+    BOOST_CHECK_EQUAL(usage.frames.count, 4);
+    BOOST_CHECK(usage.per_frame.empty());
+    BOOST_CHECK(usage.bytes() > 0);
+
+    // The linear system is kept for the transactions, the marginals are only factorized when asked for
+    const std::size_t linear_bytes = usage.marginals.bytes;
+    BOOST_CHECK(linear_bytes > 0);
+    gtsam::Matrix covariance = esam.currentMarginals()->marginalCovariance(gtsam::Symbol('x', 3));
+    BOOST_CHECK(esam.memoryUsage().marginals.bytes > linear_bytes);
+
+    std::map<gtsam::Key, gtsam::Matrix> covariances;
+    gtsam::KeySet keys;
+    keys.insert(gtsam::Symbol('x', 3));
+    BOOST_CHECK(esam.marginalCovariances(keys, covariances));
+    BOOST_CHECK_SMALL((covariances[gtsam::Symbol('x', 3)] - covariance).cwiseAbs().maxCoeff(), 1e-6);
+
+    // A key without estimate is not another variable's block
+    keys.insert(gtsam::Symbol('x', 9));
+    BOOST_CHECK(!esam.marginalCovariances(keys, covariances));
+    BOOST_CHECK(covariances.empty());
+}
+
+BOOST_AUTO_TEST_CASE(envire_sam_sparse_inverse)
+{
+    BOOST_TEST_MESSAGE( "\n**********************************************************\n" );
+    BOOST_TEST_MESSAGE( "ENVIRE_SAM_SPARSE_INVERSE" );
+
+    // Chain of 3x3 blocks closed in a loop
+    const int number_blocks = 20, dim = 3, n = number_blocks * dim;
+    Eigen::MatrixXd dense(Eigen::MatrixXd::Identity(n, n));
+    for (int b=0; b<number_blocks; ++b)
+    {
+        const int idx[2] = {b, (b + 1) % number_blocks};
+        Eigen::MatrixXd A(dim, 2*dim);
+        for (int i=0; i<A.size(); ++i)
+            A.data()[i] = std::sin(1.0 + i + 7.0 * b);
+        Eigen::MatrixXd H = A.transpose() * A;
+        for (int x=0; x<2; ++x)
+            for (int y=0; y<2; ++y)
+                dense.block(idx[x]*dim, idx[y]*dim, dim, dim) += H.block(x*dim, y*dim, dim, dim);
+    }
+
+    envire::sam::SparseInverse inverse;
+    BOOST_CHECK(inverse.compute(dense.sparseView()));
+
+    Eigen::MatrixXd expected = dense.inverse();
+    for (int b=0; b<number_blocks; ++b)
+    {
+        BOOST_CHECK_SMALL((inverse.block(b*dim, dim) - expected.block(b*dim, b*dim, dim, dim)).cwiseAbs().maxCoeff(), 1e-9);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(envire_sam_chordal_initialization)
+{
+    BOOST_TEST_MESSAGE( "\n**********************************************************\n" );
+    BOOST_TEST_MESSAGE( "ENVIRE_SAM_CHORDAL_INITIALIZATION" );
+
+    base::Pose pose_0;
+    base::Vector6d var_pose_0(base::Vector6d::Constant(1e-6));
+    envire::sam::ESAM esam(pose_0, var_pose_0, 'x', 'l');
+
+    base::Vector6d var_model;
+    var_model << 0.01*0.01, 0.01*0.01, 0.01*0.01, 0.05*0.05, 0.05*0.05, 0.05*0.05;
+
+    // Circle of twelve poses with a dead reckoning drifting in heading
+    base::Pose delta_pose;
+    delta_pose.position << 1.0, 0.0, 0.0;
+    delta_pose.orientation = Eigen::Quaternion <double> (Eigen::AngleAxisd(30.0 * D2R, Eigen::Vector3d::UnitZ()));
+    base::Pose drifted_delta(delta_pose);
+    drifted_delta.orientation = Eigen::Quaternion <double> (Eigen::AngleAxisd(45.0 * D2R, Eigen::Vector3d::UnitZ()));
+
+    base::TransformWithCovariance truth, dead_reckoning;
+    esam.addPoseValue(dead_reckoning);
+    for (register int i=0; i<12; ++i)
+    {
+        esam.addDeltaPoseFactor(base::Time::now(), delta_pose, var_model);
+        truth = truth * base::TransformWithCovariance(delta_pose.position, delta_pose.orientation);
+        dead_reckoning = dead_reckoning * base::TransformWithCovariance(drifted_delta.position, drifted_delta.orientation);
+        esam.addPoseValue(dead_reckoning);
+    }
+    esam.insertPoseFactor('x', 0, 'x', 12, base::Time::now(), base::Pose(), var_model);
+
+    gtsam::Values values;
+    esam.currentEstimates(esam.factor_graph().keys(), values);
+    BOOST_CHECK(esam.chordalInitialization(values));
+
+    // The measurements are consistent, the relaxation is already the solution
+    BOOST_CHECK_SMALL((values.at<gtsam::Pose3>(gtsam::Symbol('x', 12)).translation().vector() - truth.translation).norm(), 1e-3);
+
+    // Off by default, optimize() relaxes after the loop closure when on
+    BOOST_CHECK(!esam.initializationParams().chordalOn);
+    envire::sam::InitializationParams initialization;
+    initialization.chordalOn = true;
+    initialization.min_loop_size = 10;
+    esam.setInitializationParams(initialization);
+    esam.optimize();
+    BOOST_CHECK_SMALL((esam.getRbsPose("x6").position - base::Vector3d(1.0, 2.0 + std::sqrt(3.0), 0.0)).norm(), 1e-3);
+
+    // Edges weighted by their information: the precise one of two conflicting measurements wins
+    envire::sam::ESAM weighted(pose_0, var_pose_0, 'x', 'l');
+    base::Pose step, long_step;
+    step.position << 1.0, 0.0, 0.0;
+    long_step.position << 2.0, 0.0, 0.0;
+    base::TransformWithCovariance origin;
+    weighted.addPoseValue(origin);
+    weighted.addDeltaPoseFactor(base::Time::now(), step, base::Vector6d(base::Vector6d::Constant(1e-4)));
+    weighted.addPoseValue(origin);
+    weighted.insertPoseFactor('x', 0, 'x', 1, base::Time::now(), long_step, base::Vector6d(base::Vector6d::Constant(1.0)));
+
+    gtsam::Values weighted_values;
+    weighted.currentEstimates(weighted.factor_graph().keys(), weighted_values);
+    BOOST_CHECK(weighted.chordalInitialization(weighted_values));
+    BOOST_CHECK_SMALL(weighted_values.at<gtsam::Pose3>(gtsam::Symbol('x', 1)).translation().x() - 1.0, 1e-3);
+}
+
+BOOST_AUTO_TEST_CASE(envire_sam_transaction)
+{
+    BOOST_TEST_MESSAGE( "\n**********************************************************\n" );
+    BOOST_TEST_MESSAGE( "ENVIRE_SAM_TRANSACTION" );
+
+    base::Pose pose_0;
+    base::Vector6d var_pose_0(base::Vector6d::Constant(1e-6));
+    envire::sam::ESAM esam(pose_0, var_pose_0, 'x', 'l');
+
+    base::Vector6d var_model;
+    var_model << 0.01*0.01, 0.01*0.01, 0.01*0.01, 0.05*0.05, 0.05*0.05, 0.05*0.05;
+
+    base::Pose delta_pose;
+    delta_pose.position << 1.0, 0.0, 0.0;
+    base::TransformWithCovariance pose_with_cov;
+    esam.addPoseValue(pose_with_cov);
+    for (register int i=0; i<4; ++i)
+    {
+        esam.addDeltaPoseFactor(base::Time::now(), delta_pose, var_model);
+        pose_with_cov = pose_with_cov * base::TransformWithCovariance(delta_pose.position, delta_pose.orientation);
+        esam.addPoseValue(pose_with_cov);
+    }
+    esam.optimize();
+    const size_t number_factors = esam.factor_graph().size();
+
+    // Wrong loop closure is rolled back
+    base::Pose loop_pose;
+    loop_pose.position << 1.0, 0.0, 0.0;
+    esam.beginTransaction();
+    esam.insertPoseFactor('x', 0, 'x', 4, base::Time::now(), loop_pose, var_model);
+    esam.optimize();
+    BOOST_CHECK(esam.inTransaction());
+    BOOST_CHECK(!esam.commitTransaction());
+    BOOST_CHECK(!esam.inTransaction());
+    BOOST_CHECK_EQUAL(esam.factor_graph().size(), number_factors);
+    BOOST_CHECK_CLOSE(esam.getRbsPose("x4").position.x(), 4.0, 1e-3);
+
+    // Consistent loop closure is kept
+    loop_pose.position << 4.0, 0.0, 0.0;
+    esam.beginTransaction();
+    esam.insertPoseFactor('x', 0, 'x', 4, base::Time::now(), loop_pose, var_model);
+    BOOST_CHECK(esam.commitTransaction());
+    BOOST_CHECK_EQUAL(esam.factor_graph().size(), number_factors + 1);
+
+    // The incremental step agrees with relinearizing the whole graph
+    const double committed_x = esam.getRbsPose("x2").position.x();
+    esam.optimize();
+    BOOST_CHECK_SMALL(esam.getRbsPose("x2").position.x() - committed_x, 1e-3);
+
+    // Values inserted on existing frames are removed
+    base::Vector3d var_landmark(base::Vector3d::Constant(0.01));
+    esam.insertLandmarkFactor('x', 4, 'l', 0, base::Time::now(), base::Vector3d(0.5, 1.0, 0.0), var_landmark);
+    esam.insertLandmarkValue('l', 0, base::Vector3d(4.5, 1.0, 0.0));
+    esam.beginTransaction();
+    esam.insertPoseValue('x', 4, pose_with_cov);
+    esam.insertPoseValue('x', 4, pose_0, base::Matrix6d::Identity());
+    esam.insertLandmarkValue('l', 0, base::Vector3d(4.0, 1.0, 0.0));
+    BOOST_CHECK_EQUAL(esam.transform_graph().getItemCount<envire::sam::PoseItem>(gtsam::Symbol('x', 4)), 3);
+    BOOST_CHECK_EQUAL(esam.transform_graph().getItemCount<envire::sam::LandmarkItem>(gtsam::Symbol('l', 0)), 2);
+    esam.rollbackTransaction();
+    BOOST_CHECK_EQUAL(esam.transform_graph().getItemCount<envire::sam::PoseItem>(gtsam::Symbol('x', 4)), 1);
+    BOOST_CHECK_EQUAL(esam.transform_graph().getItemCount<envire::sam::LandmarkItem>(gtsam::Symbol('l', 0)), 1);
+
+    // Items added to existing frames are removed and merged clouds restored
+    boost::shared_ptr<envire::sam::ESAM> mapping_ptr = pipelineESAM();
+    envire::sam::ESAM &mapping = *mapping_ptr;
+
+    base::samples::Pointcloud cloud = planeCloud(20, 0.05);
+
+    mapping.beginTransaction();
+    mapping.pushPointCloud(cloud, 1, cloud.points.size());
+    BOOST_CHECK(mapping.memoryUsage().point_clouds.count > 0);
+    mapping.rollbackTransaction();
+    BOOST_CHECK_EQUAL(mapping.memoryUsage().point_clouds.count, 0);
+
+    mapping.pushPointCloud(cloud, 1, cloud.points.size());
+    const std::size_t number_points = mapping.memoryUsage().point_clouds.count;
+    for (size_t i=0; i<cloud.points.size(); ++i)
+        cloud.points[i].z() = 2.0;
+    mapping.beginTransaction();
+    mapping.pushPointCloud(cloud, 1, cloud.points.size());
+    BOOST_CHECK(mapping.memoryUsage().point_clouds.count > number_points);
+    mapping.rollbackTransaction();
+    BOOST_CHECK_EQUAL(mapping.memoryUsage().point_clouds.count, number_points);
+}
+
+BOOST_AUTO_TEST_CASE(envire_sam_solver_diagnostics)
+{
+    BOOST_TEST_MESSAGE( "\n**********************************************************\n" );
+    BOOST_TEST_MESSAGE( "ENVIRE_SAM_SOLVER_DIAGNOSTICS" );
+
+    base::Pose pose_0;
+    base::Vector6d var_pose(base::Vector6d::Constant(0.01));
+    envire::sam::ESAM esam(pose_0, var_pose, 'x', 'l');
+
+    envire::sam::DiagnosticsParams diagnostics;
+    diagnostics.diagnosticsOn = true;
+    diagnostics.log_filename = "envire_sam_diagnostics.log";
+    std::remove(diagnostics.log_filename.c_str());
+    esam.setDiagnosticsParams(diagnostics);
+
+    base::Pose delta_pose;
+    delta_pose.position << 1.0, 0.0, 0.0;
+    base::TransformWithCovariance drifted;
+    esam.addPoseValue(drifted);
+    for (register int i=0; i<3; ++i)
+    {
+        esam.addDeltaPoseFactor(base::Time::now(), delta_pose, var_pose);
+        drifted = drifted * base::TransformWithCovariance(base::Vector3d(1.2, 0.1, 0.0), base::Quaterniond::Identity());
+        esam.addPoseValue(drifted);
+    }
+    esam.optimize();
+
+    const envire::sam::SolverDiagnostics &last = esam.solverDiagnostics();
+    BOOST_CHECK(last.converged);
+    BOOST_CHECK(last.iterations.size() > 1);
+    BOOST_CHECK_EQUAL(last.iterations.front().residuals[envire::sam::BETWEEN_FACTOR].count, 3);
+    BOOST_CHECK(last.iterations.back().error < last.iterations.front().error);
+    BOOST_CHECK(last.iterations[1].step_norm > 0.0);
+
+    std::ifstream log(diagnostics.log_filename.c_str(), std::ios::binary);
+    envire::sam::SolverDiagnostics logged;
+    BOOST_CHECK(envire::sam::readDiagnostics(log, logged));
+    BOOST_CHECK_EQUAL(logged.iterations.size(), last.iterations.size());
+    BOOST_CHECK_CLOSE(logged.iterations.back().error + 1.0, last.iterations.back().error + 1.0, 1e-9);
+}
+
+BOOST_AUTO_TEST_CASE(envire_sam_elimination_ordering)
+{
+    BOOST_TEST_MESSAGE( "\n**********************************************************\n" );
+    BOOST_TEST_MESSAGE( "ENVIRE_SAM_ELIMINATION_ORDERING" );
+
+    base::Pose pose_0;
+    base::Vector6d var_pose(base::Vector6d::Constant(0.01));
+    base::Vector3d var_landmark(base::Vector3d::Constant(0.01));
+    envire::sam::ESAM esam(pose_0, var_pose, 'x', 'l');
+
+    base::Pose delta_pose;
+    delta_pose.position << 1.0, 0.0, 0.0;
+    base::TransformWithCovariance pose;
+    esam.addPoseValue(pose);
+    for (register int i=0; i<4; ++i)
+    {
+        esam.addDeltaPoseFactor(base::Time::now(), delta_pose, var_pose);
+        pose.translation.x() += 1.0;
+        esam.addPoseValue(pose);
+    }
+    for (register int i=0; i<4; ++i)
+    {
+        base::Vector3d landmark(0.5 + i, 1.0, 0.0);
+        esam.insertLandmarkFactor('x', i, 'l', i, base::Time::now(), landmark - base::Vector3d(i, 0.0, 0.0), var_landmark);
+        esam.insertLandmarkFactor('x', i+1, 'l', i, base::Time::now(), landmark - base::Vector3d(i+1, 0.0, 0.0), var_landmark);
+        esam.insertLandmarkValue('l', i, landmark);
+    }
+
+    // Landmarks are eliminated before any pose
+    envire::sam::OrderingParams params;
+    params.type = envire::sam::LANDMARKS_FIRST;
+    esam.setOrderingParams(params);
+    gtsam::Ordering ordering = esam.eliminationOrdering();
+    BOOST_CHECK_EQUAL(ordering.size(), 9);
+    for (register size_t i=0; i<ordering.size(); ++i)
+        BOOST_CHECK_EQUAL(gtsam::Symbol(ordering[i]).chr(), (i < 4)? 'l' : 'x');
+
+    // The two most recent poses are eliminated last
+    params.type = envire::sam::RECENT_POSES_LAST;
+    params.recent_poses = 2;
+    esam.setOrderingParams(params);
+    ordering = esam.eliminationOrdering();
+    BOOST_CHECK(ordering[7] == gtsam::Symbol('x', 3) || ordering[7] == gtsam::Symbol('x', 4));
+    BOOST_CHECK(ordering[8] == gtsam::Symbol('x', 3) || ordering[8] == gtsam::Symbol('x', 4));
+
+    // User groups, the solution does not depend on the ordering
+    gtsam::FastMap<gtsam::Key, int> groups;
+    groups[gtsam::Symbol('x', 0)] = 2;
+    params.type = envire::sam::GROUPED_ORDERING;
+    esam.setOrderingParams(params);
+    esam.setOrderingGroups(groups);
+    ordering = esam.eliminationOrdering();
+    BOOST_CHECK_EQUAL(ordering.back(), gtsam::Symbol('x', 0));
+
+    esam.optimize();
+    BOOST_CHECK_SMALL(esam.getRbsPose("x4").position.x() - 4.0, 1e-3);
+}
+
+BOOST_AUTO_TEST_CASE(envire_sam_journal)
+{
+    BOOST_TEST_MESSAGE( "\n**********************************************************\n" );
+    BOOST_TEST_MESSAGE( "ENVIRE_SAM_JOURNAL" );
+
+    base::Pose pose_0;
+    base::Vector6d var_pose(base::Vector6d::Constant(0.01));
+    base::Vector3d var_landmark(base::Vector3d::Constant(0.01));
+    envire::sam::ESAM esam(pose_0, var_pose, 'x', 'l');
+
+    base::Pose delta_pose;
+    delta_pose.position << 1.0, 0.0, 0.0;
+    base::TransformWithCovariance pose;
+    esam.addPoseValue(pose);
+    esam.addDeltaPoseFactor(base::Time::now(), delta_pose, var_pose);
+    pose.translation.x() += 1.0;
+    esam.addPoseValue(pose);
+
+    // Snapshot of the first two poses, the rest goes to the journal
+    envire::sam::JournalParams params;
+    params.directory = temporaryDirectory("envire_sam_journal");
+    params.flush_period = 0.01;
+    BOOST_CHECK(esam.startJournal(params));
+
+    for (register int i=0; i<3; ++i)
+    {
+        esam.addDeltaPoseFactor(base::Time::now(), delta_pose, var_pose);
+        pose.translation.x() += 1.0;
+        esam.addPoseValue(pose);
+    }
+    esam.insertLandmarkFactor('x', 4, 'l', 0, base::Time::now(), base::Vector3d(0.5, 1.0, 0.0), var_landmark);
+    esam.insertLandmarkValue('l', 0, base::Vector3d(4.5, 1.0, 0.0));
+
+    // The marginalization is replayed from the journal, not from a new snapshot
+    gtsam::KeySet marginalized;
+    marginalized.insert(gtsam::Symbol('x', 1));
+    esam.marginalizeFrames(marginalized);
+
+    // Rolled back insertions never reach the journal
+    base::Pose loop_pose;
+    loop_pose.position << 1.0, 0.0, 0.0;
+    esam.beginTransaction();
+    esam.insertPoseFactor('x', 0, 'x', 4, base::Time::now(), loop_pose, var_pose);
+    esam.rollbackTransaction();
+    esam.stopJournal();
+
+    envire::sam::ESAM recovered;
+    BOOST_CHECK(recovered.recoverJournal(params.directory));
+    BOOST_CHECK_EQUAL(recovered.factor_graph().size(), esam.factor_graph().size());
+    BOOST_CHECK_EQUAL(recovered.currentPoseId(), esam.currentPoseId());
+
+    esam.optimize();
+    recovered.optimize();
+    BOOST_CHECK_SMALL(recovered.getRbsPose("x4").position.x() - esam.getRbsPose("x4").position.x(), 1e-6);
+    BOOST_CHECK_SMALL(recovered.getRbsPose("x4").position.x() - 4.0, 1e-3);
+    removeDirectory(params.directory);
+}
+
+BOOST_AUTO_TEST_CASE(envire_sam_fast_pose)
+{
+    BOOST_TEST_MESSAGE( "\n**********************************************************\n" );
+    BOOST_TEST_MESSAGE( "ENVIRE_SAM_FAST_POSE" );
+
+    base::Pose pose_0;
+    base::Vector6d var_pose(base::Vector6d::Constant(0.01));
+    envire::sam::ESAM esam(pose_0, var_pose, 'x', 'l');
+    base::TransformWithCovariance pose;
+    esam.addPoseValue(pose);
+
+    base::TransformWithCovariance delta_odometry(base::Vector3d(0.1, 0.0, 0.0), base::Quaterniond::Identity());
+    delta_odometry.cov = base::Matrix6d::Identity() * 1e-4;
+
+    // Prior composed with the odometry
+    for (register int i=1; i<=3; ++i)
+        esam.addOdometry(base::Time::fromSeconds(i), delta_odometry);
+    BOOST_CHECK_CLOSE(esam.getFastRbsPose().position.x(), 0.3, 1e-6);
+    BOOST_CHECK_EQUAL(esam.getFastPose().number_deltas, 3);
+
+    // New keyframe, not optimized yet: the fast pose keeps composing from x0
+    base::Pose delta_pose;
+    delta_pose.position << 0.3, 0.0, 0.0;
+    esam.addDeltaPoseFactor(base::Time::fromSeconds(3), delta_pose, var_pose);
+    pose.translation.x() = 0.3;
+    esam.addPoseValue(pose);
+    esam.addOdometry(base::Time::fromSeconds(4), delta_odometry);
+    BOOST_CHECK_EQUAL(esam.getFastPose().keyframe_idx, 0);
+    BOOST_CHECK_CLOSE(esam.getFastRbsPose().position.x(), 0.4, 1e-6);
+
+    // Optimized x1 plus the odometry after it
+    esam.optimize();
+    const envire::sam::FastPose fast_pose = esam.getFastPose();
+    BOOST_CHECK_EQUAL(fast_pose.keyframe_idx, 1);
+    BOOST_CHECK_EQUAL(fast_pose.number_deltas, 1);
+    BOOST_CHECK_CLOSE(fast_pose.pose.translation.x(), 0.4, 1e-3);
+    BOOST_CHECK(fast_pose.pose.cov(0,0) > esam.getTransformPose("x1").cov(0,0));
+}
+
+BOOST_AUTO_TEST_CASE(envire_sam_trajectory_export)
+{
+    BOOST_TEST_MESSAGE( "\n**********************************************************\n" );
+    BOOST_TEST_MESSAGE( "ENVIRE_SAM_TRAJECTORY_EXPORT" );
+
+    base::Pose pose_0;
+    base::Vector6d var_pose(base::Vector6d::Constant(0.01));
+    envire::sam::ESAM esam(pose_0, var_pose, 'x', 'l');
+
+    base::Pose delta_pose;
+    delta_pose.position << 1.0, 0.0, 0.0;
+    base::TransformWithCovariance pose;
+    esam.addPoseValue(pose);
+    for (register int i=1; i<=4; ++i)
+    {
+        esam.addDeltaPoseFactor(base::Time::fromSeconds(i), delta_pose, var_pose);
+        pose.translation.x() += 1.0;
+        esam.addPoseValue(pose);
+    }
+    esam.optimize();
+
+    const size_t number_poses = esam.numberPoses();
+    BOOST_CHECK_EQUAL(number_poses, 5);
+    std::vector<boost::int64_t> timestamps(number_poses);
+    std::vector<double> positions(3*number_poses), orientations(4*number_poses), covariances(36*number_poses);
+    BOOST_CHECK_EQUAL(esam.exportTrajectory(timestamps.data(), positions.data(), orientations.data(), covariances.data()), number_poses);
+
+    // Same content as the envire lookup of each frame (not the cached pose items)
+    for (register size_t i=0; i<number_poses; ++i)
+    {
+        const base::samples::RigidBodyState rbs_pose = esam.getRbsPose(gtsam::Symbol('x', i));
+        BOOST_CHECK_EQUAL(timestamps[i], base::Time::fromSeconds(i).toMicroseconds());
+        for (register int j=0; j<3; ++j)
+            BOOST_CHECK_EQUAL(positions[3*i+j], rbs_pose.position[j]);
+        for (register int j=0; j<4; ++j)
+            BOOST_CHECK_EQUAL(orientations[4*i+j], rbs_pose.orientation.coeffs()[j]);
+        for (register int r=0; r<3; ++r)
+            for (register int c=0; c<3; ++c)
+            {
+                BOOST_CHECK_EQUAL(covariances[36*i + 6*r + c], rbs_pose.cov_position(r, c));
+                BOOST_CHECK_EQUAL(covariances[36*i + 6*(r+3) + c+3], rbs_pose.cov_orientation(r, c));
+            }
+    }
+
+    std::vector<boost::int64_t> file_timestamps;
+    std::vector<double> file_positions, file_orientations, file_covariances;
+    BOOST_CHECK(esam.writeTrajectory("envire_sam_trajectory.bin"));
+    BOOST_CHECK(envire::sam::ESAM::readTrajectory("envire_sam_trajectory.bin", file_timestamps,
+                file_positions, file_orientations, file_covariances));
+    BOOST_CHECK(file_timestamps == timestamps);
+    BOOST_CHECK(file_positions == positions);
+    BOOST_CHECK(file_covariances == covariances);
+}
+
+BOOST_AUTO_TEST_CASE(envire_sam_async)
+{
+    BOOST_TEST_MESSAGE( "\n**********************************************************\n" );
+    BOOST_TEST_MESSAGE( "ENVIRE_SAM_ASYNC" );
+
+    base::Pose pose_0;
+    base::Vector6d var_pose(base::Vector6d::Constant(0.01));
+    envire::sam::ESAM esam(pose_0, var_pose, 'x', 'l');
+
+    base::Pose delta_pose;
+    delta_pose.position << 1.0, 0.0, 0.0;
+    base::TransformWithCovariance pose;
+    esam.addPoseValue(pose);
+    esam.addDeltaPoseFactor(base::Time::fromSeconds(1), delta_pose, var_pose);
+    pose.translation.x() = 0.5;
+    esam.addPoseValue(pose);
+
+    // The insertion waits for the submitted optimization
+    std::future<void> first = esam.optimizeAsync();
+    esam.addDeltaPoseFactor(base::Time::fromSeconds(2), delta_pose, var_pose);
+    BOOST_CHECK(first.wait_for(std::chrono::seconds(0)) == std::future_status::ready);
+    BOOST_CHECK_CLOSE(esam.getTransformPose("x1").translation.x(), 1.0, 1e-3);
+
+    pose.translation.x() = 1.5;
+    esam.addPoseValue(pose);
+    std::future<void> second = esam.optimizeAsync();
+    second.get();
+    BOOST_CHECK_CLOSE(esam.getTransformPose("x2").translation.x(), 2.0, 1e-3);
+
+    // Without point clouds the feature extraction has nothing to do
+    std::future<void> keypoints = esam.computeKeypointsAsync();
+    esam.waitAsync();
+    BOOST_CHECK(keypoints.wait_for(std::chrono::seconds(0)) == std::future_status::ready);
+
+    // Idle tasks wait for the regular ones, also those submitted after them
+    envire::sam::Executor executor;
+    std::vector<int> order;
+    executor.submit([&order](){ std::this_thread::sleep_for(std::chrono::milliseconds(20)); order.push_back(1); });
+    executor.submitIdle([&order](){ order.push_back(3); });
+    executor.submit([&order](){ order.push_back(2); });
+    executor.drain();
+    BOOST_CHECK_EQUAL(order.size(), 3);
+    for (size_t i=0; i<order.size(); ++i)
+        BOOST_CHECK_EQUAL(order[i], static_cast<int>(i + 1));
+}
+
+BOOST_AUTO_TEST_CASE(envire_sam_latency_controller)
+{
+    BOOST_TEST_MESSAGE( "\n**********************************************************\n" );
+    BOOST_TEST_MESSAGE( "ENVIRE_SAM_LATENCY_CONTROLLER" );
+
+    base::Pose pose_0;
+    base::Vector6d var_pose(base::Vector6d::Constant(0.01));
+    envire::sam::ESAM esam(pose_0, var_pose, 'x', 'l');
+    base::TransformWithCovariance pose;
+    esam.addPoseValue(pose);
+
+    envire::sam::LatencyParams params;
+    params.controllerOn = true;
+    params.target_latency = 1e-9;
+    esam.setLatencyParams(params);
+
+    // Every frame is over the target: cheapest parameters
+    esam.optimize();
+    esam.detectLandmarks(base::Time::fromSeconds(1));
+    const envire::sam::LatencyStatistics &statistics = esam.latencyStatistics();
+    BOOST_CHECK_EQUAL(statistics.frames, 1);
+    BOOST_CHECK_EQUAL(statistics.overruns, 1);
+    BOOST_CHECK(statistics.last.stages[envire::sam::OPTIMIZE_STAGE] > 0.0);
+    BOOST_CHECK_EQUAL(statistics.effort, 0.0);
+    BOOST_CHECK_CLOSE(esam.downsampleSize(), params.max_downsample_size, 1e-3);
+    BOOST_CHECK_CLOSE(esam.keypointParams().min_contrast, params.max_keypoint_contrast, 1e-3);
+    BOOST_CHECK_CLOSE(esam.featureParams().feature_radius, params.min_feature_radius, 1e-3);
+    BOOST_CHECK_EQUAL(esam.candidateSearchParams().max_candidates, params.min_candidates);
+
+    // Plenty of time: back to the most detailed parameters
+    params.target_latency = 1e3;
+    esam.setLatencyParams(params);
+    esam.detectLandmarks(base::Time::fromSeconds(2));
+    BOOST_CHECK_EQUAL(statistics.frames, 2);
+    BOOST_CHECK_EQUAL(statistics.overruns, 1);
+    BOOST_CHECK_EQUAL(statistics.effort, 1.0);
+    BOOST_CHECK_CLOSE(esam.downsampleSize(), params.min_downsample_size, 1e-3);
+    BOOST_CHECK_EQUAL(esam.candidateSearchParams().max_candidates, params.max_candidates);
+}
+
+BOOST_AUTO_TEST_CASE(envire_sam_load_shedding)
+{
+    BOOST_TEST_MESSAGE( "\n**********************************************************\n" );
+    BOOST_TEST_MESSAGE( "ENVIRE_SAM_LOAD_SHEDDING" );
+
+    PipelineParams pipeline;
+    pipeline.outliers.type = envire::sam::STATISTICAL;
+    pipeline.outliers.parameter_one = 10; pipeline.outliers.parameter_two = 1.0;
+    boost::shared_ptr<envire::sam::ESAM> esam_ptr = pipelineESAM(pipeline);
+    envire::sam::ESAM &esam = *esam_ptr;
+    base::samples::Pointcloud cloud = planeCloud(20, 0.05);
+
+    // Overloaded as soon as one frame took any time
+    envire::sam::LoadSheddingParams params;
+    params.sheddingOn = true;
+    params.max_latency = 1e-9;
+    params.max_queue_depth = 0;
+    esam.setLoadSheddingParams(params);
+
+    esam.pushPointCloud(cloud, 1, cloud.points.size());
+    esam.detectLandmarks(base::Time::fromSeconds(0));
+    const envire::sam::SheddingStatistics &statistics = esam.sheddingStatistics();
+    BOOST_CHECK_EQUAL(statistics.dropped_clouds, 0);
+    BOOST_CHECK_EQUAL(statistics.skipped_outlier_removals, 0);
+
+    // Second cloud of x0 dropped, x1 without statistical outlier removal
+    esam.pushPointCloud(cloud, 1, cloud.points.size());
+    BOOST_CHECK_EQUAL(statistics.dropped_clouds, 1);
+
+    base::Pose delta_pose;
+    delta_pose.position << 0.1, 0.0, 0.0;
+    esam.addDeltaPoseFactor(base::Time::fromSeconds(1), delta_pose, base::Vector6d(base::Vector6d::Constant(0.01)));
+    base::TransformWithCovariance pose;
+    pose.translation.x() = 0.1;
+    pose.cov = base::Matrix6d::Identity() * 0.01;
+    esam.addPoseValue(pose);
+    esam.pushPointCloud(cloud, 1, cloud.points.size());
+    BOOST_CHECK_EQUAL(statistics.skipped_outlier_removals, 1);
+
+    // Keypoints of x0 wait for an idle executor without overload
+    esam.computeKeypoints();
+    BOOST_CHECK_EQUAL(statistics.deferred_keypoints, 1);
+    params.max_latency = 0.0;
+    esam.setLoadSheddingParams(params);
+    esam.detectLandmarks(base::Time::fromSeconds(1));
+    esam.waitAsync();
+    BOOST_CHECK_EQUAL(statistics.idle_keypoints, 1);
+    BOOST_CHECK(esam.latencyStatistics().current.stages[envire::sam::DEFERRED_STAGE] > 0.0);
+
+    // Overloaded by the calls queued before the cloud, whatever the latency
+    params.max_latency = 0.0;
+    params.max_queue_depth = 2;
+    esam.setLoadSheddingParams(params);
+    for (register int i=0; i<8; ++i)
+        esam.optimizeAsync();
+    esam.pushPointCloud(cloud, 1, cloud.points.size());
+    BOOST_CHECK_EQUAL(statistics.dropped_clouds, 2);
+
+    esam.addDeltaPoseFactor(base::Time::fromSeconds(2), delta_pose, base::Vector6d(base::Vector6d::Constant(0.01)));
+    pose.translation.x() = 0.2;
+    esam.addPoseValue(pose);
+    for (register int i=0; i<8; ++i)
+        esam.optimizeAsync();
+    esam.pushPointCloud(cloud, 1, cloud.points.size());
+    BOOST_CHECK_EQUAL(statistics.skipped_outlier_removals, 2);
+}
+
+BOOST_AUTO_TEST_CASE(envire_sam_memory_governor)
+{
+    BOOST_TEST_MESSAGE( "\n**********************************************************\n" );
+    BOOST_TEST_MESSAGE( "ENVIRE_SAM_MEMORY_GOVERNOR" );
+
+    boost::shared_ptr<envire::sam::ESAM> esam_ptr = pipelineESAM();
+    envire::sam::ESAM &esam = *esam_ptr;
+
+    base::samples::Pointcloud cloud = planeCloud(20, 0.05);
+
+    // Compress and spill everything but the current frame, never cull, marginalize or drop
+    envire::sam::MemoryGovernorParams params;
+    params.governorOn = true;
+    params.budget = std::size_t(1) << 40;
+    params.compress_threshold = 0.0;
+    params.spill_threshold = 0.0;
+    params.cull_threshold = 2.0;
+    params.marginalize_threshold = 2.0;
+    params.spill_directory = temporaryDirectory("envire_sam_memory_governor");
+    params.keep_frames = 1;
+    esam.setMemoryGovernorParams(params);
+
+    base::Pose delta_pose;
+    delta_pose.position << 0.1, 0.0, 0.0;
+    base::TransformWithCovariance pose;
+    pose.cov = base::Matrix6d::Identity() * 0.01;
+    esam.pushPointCloud(cloud, 1, cloud.points.size());
+    for (register int i=1; i<=2; ++i)
+    {
+        esam.addDeltaPoseFactor(base::Time::fromSeconds(i), delta_pose, base::Vector6d(base::Vector6d::Constant(0.01)));
+        pose.translation.x() += 0.1;
+        esam.addPoseValue(pose);
+        esam.pushPointCloud(cloud, 1, cloud.points.size());
+    }
+
+    const envire::sam::MemoryGovernorStatistics &statistics = esam.memoryGovernorStatistics();
+    BOOST_CHECK_EQUAL(statistics.compressed_clouds, 2);
+    BOOST_CHECK_EQUAL(statistics.spilled_clouds, 2);
+    BOOST_CHECK_EQUAL(statistics.dropped_frames, 0);
+    envire::sam::MemoryUsage usage = esam.memoryUsage();
+    BOOST_CHECK_EQUAL(usage.per_frame["x0"].point_cloud.bytes, 0);
+    BOOST_CHECK(usage.per_frame["x2"].point_cloud.bytes > 0);
+
+    // Merging reads the spilled clouds without restoring them
+    base::samples::Pointcloud merged;
+    esam.mergePointClouds(merged);
+    BOOST_CHECK_EQUAL(statistics.restored_clouds, 0);
+    BOOST_CHECK(merged.points.size() > 2 * esam.getPointCloud("x2").size());
+
+    // Access brings the point cloud back within the quantization step
+    const envire::sam::PCLPointCloud &restored = esam.getPointCloud("x0");
+    BOOST_CHECK_EQUAL(statistics.restored_clouds, 1);
+    BOOST_CHECK_EQUAL(restored.size(), esam.getPointCloud("x2").size());
+    removeDirectory(params.spill_directory);
+}
+
+BOOST_AUTO_TEST_CASE(envire_sam_point_budget)
+{
+    BOOST_TEST_MESSAGE( "\n**********************************************************\n" );
+    BOOST_TEST_MESSAGE( "ENVIRE_SAM_POINT_BUDGET" );
+
+    PipelineParams pipeline;
+    pipeline.downsample_size = 0.005;
+    boost::shared_ptr<envire::sam::ESAM> esam_ptr = pipelineESAM(pipeline);
+    envire::sam::ESAM &esam = *esam_ptr;
+
+    // 1 m x 1 m at 5 mm: 40000 points
+    base::samples::Pointcloud cloud = planeCloud(200, 0.005);
+
+    envire::sam::PointBudgetParams params;
+    params.budgetOn = true;
+    params.target_points = 1000;
+    esam.setPointBudgetParams(params);
+
+    esam.pushPointCloud(cloud, 1, cloud.points.size());
+    BOOST_CHECK(esam.budgetLeafSize() > 0.02);
+    BOOST_CHECK_CLOSE(static_cast<double>(esam.getPointCloud("x0").size()), 1000.0, 20.0);
+
+    // The merge of a second cloud stays on the budget
+    esam.pushPointCloud(cloud, 1, cloud.points.size());
+    BOOST_CHECK_CLOSE(static_cast<double>(esam.getPointCloud("x0").size()), 1000.0, 20.0);
+}
+
+BOOST_AUTO_TEST_CASE(envire_sam_overlap_keypoints)
+{
+    BOOST_TEST_MESSAGE( "\n**********************************************************\n" );
+    BOOST_TEST_MESSAGE( "ENVIRE_SAM_OVERLAP_KEYPOINTS" );
+
+    boost::shared_ptr<envire::sam::ESAM> esam_ptr = pipelineESAM(texturedPipelineParams());
+    envire::sam::ESAM &esam = *esam_ptr;
+
+    // Patches of 5 cm with scattered gray levels, the same region in every frame
+    base::samples::Pointcloud cloud = texturedPlaneCloud(100, 0.01);
+
+    envire::sam::OverlapKeypointParams params;
+    params.overlapOn = true;
+    params.voxel_size = 2.0;
+    params.recent_frames = 3;
+    esam.setOverlapKeypointParams(params);
+
+    base::Pose delta_pose;
+    base::TransformWithCovariance pose;
+    pose.cov = base::Matrix6d::Identity() * 0.01;
+    esam.pushPointCloud(cloud, 1, cloud.points.size());
+    for (register int i=1; i<=2; ++i)
+    {
+        esam.addDeltaPoseFactor(base::Time::fromSeconds(i), delta_pose, base::Vector6d(base::Vector6d::Constant(0.01)));
+        esam.addPoseValue(pose);
+        esam.pushPointCloud(cloud, 1, cloud.points.size());
+        esam.computeKeypoints();
+    }
+
+    // The first frame is described, the second one lies in its voxels
+    const envire::sam::OverlapKeypointStatistics &statistics = esam.overlapKeypointStatistics();
+    BOOST_CHECK_EQUAL(statistics.frames, 2);
+    BOOST_CHECK(statistics.linked_keypoints > 0);
+    BOOST_CHECK(statistics.covered_points > 0);
+    BOOST_CHECK(statistics.uncovered_points < 2 * esam.getPointCloud("x1").size());
+}
+
+BOOST_AUTO_TEST_CASE(envire_sam_normal_map)
+{
+    BOOST_TEST_MESSAGE( "\n**********************************************************\n" );
+    BOOST_TEST_MESSAGE( "ENVIRE_SAM_NORMAL_MAP" );
+
+    boost::shared_ptr<envire::sam::ESAM> esam_ptr = pipelineESAM();
+    envire::sam::ESAM &esam = *esam_ptr;
+
+    envire::sam::NormalMapParams params;
+    params.normalMapOn = true;
+    params.voxel_size = 0.2;
+    params.min_points = 5;
+    esam.setNormalMapParams(params);
+
+    // Plane at z = 1 m in the first frame
+    base::samples::Pointcloud cloud = planeCloud(50, 0.02);
+    esam.pushPointCloud(cloud, 1, cloud.points.size());
+    BOOST_CHECK_EQUAL(esam.normalMap().numberFrames(), 1);
+
+    Eigen::Vector3d normal;
+    float curvature = 1.0;
+    BOOST_CHECK(esam.normalMap().normal(Eigen::Vector3d(0.5, 0.5, 1.0), normal, curvature));
+    BOOST_CHECK_CLOSE(std::fabs(normal.z()), 1.0, 1e-3);
+    BOOST_CHECK_SMALL(curvature, 1e-6f);
+
+    // Nothing around a point away from the surface
+    BOOST_CHECK(!esam.normalMap().normal(Eigen::Vector3d(0.5, 0.5, 3.0), normal, curvature));
+
+    // The same plane from a second frame one meter ahead adds to the same voxels
+    base::Pose delta_pose;
+    delta_pose.position << 1.0, 0.0, 0.0;
+    base::TransformWithCovariance pose;
+    pose.cov = base::Matrix6d::Identity() * 0.01;
+    pose.translation.x() = 1.0;
+    esam.addDeltaPoseFactor(base::Time::fromSeconds(1), delta_pose, base::Vector6d(base::Vector6d::Constant(0.01)));
+    esam.addPoseValue(pose);
+    esam.pushPointCloud(cloud, 1, cloud.points.size());
+    BOOST_CHECK_EQUAL(esam.normalMap().numberFrames(), 2);
+    BOOST_CHECK(esam.normalMap().normal(Eigen::Vector3d(1.5, 0.5, 1.0), normal, curvature));
+    BOOST_CHECK_CLOSE(std::fabs(normal.z()), 1.0, 1e-3);
+
+    // The map is part of the memory usage
+    envire::sam::MemoryUsage usage = esam.memoryUsage();
+    BOOST_CHECK_EQUAL(usage.normal_map.bytes, esam.normalMap().bytes());
+    BOOST_CHECK(usage.normal_map.count > 0);
+
+    // The optimized poses move the frames in the map
+    esam.optimize();
+    BOOST_CHECK(esam.normalMapStatistics().reposed_frames >= 2);
+    BOOST_CHECK(esam.normalMap().normal(Eigen::Vector3d(1.5, 0.5, 1.0), normal, curvature));
+
+    // Recovery puts the replayed point clouds back in the map
+    envire::sam::JournalParams journal;
+    journal.directory = temporaryDirectory("envire_sam_normal_map");
+    BOOST_CHECK(esam.startJournal(journal));
+    esam.stopJournal();
+
+    envire::sam::ESAM recovered;
+    recovered.setNormalMapParams(params);
+    BOOST_CHECK(recovered.recoverJournal(journal.directory));
+    BOOST_CHECK_EQUAL(recovered.normalMap().numberFrames(), 2);
+    BOOST_CHECK(recovered.normalMap().normal(Eigen::Vector3d(1.5, 0.5, 1.0), normal, curvature));
+    removeDirectory(journal.directory);
+}
+
+BOOST_AUTO_TEST_CASE(envire_sam_batch_normals)
+{
+    BOOST_TEST_MESSAGE( "\n**********************************************************\n" );
+    BOOST_TEST_MESSAGE( "ENVIRE_SAM_BATCH_NORMALS" );
+
+    // Tilted planes, a line (repeated smallest eigenvalue), an isotropic blob and too few points
+    envire::sam::CovarianceBatch covariances;
+    covariances.resize(8);
+    for (register int i=0; i<5; ++i)
+    {
+        const Eigen::Matrix3d rotation(Eigen::AngleAxisd(0.3 * i, Eigen::Vector3d(1.0, 2.0, 0.5).normalized()));
+        const Eigen::Vector3d eigenvalues(1e-5, 0.5 + i, 2.0);
+        covariances.set(i, rotation * eigenvalues.asDiagonal() * rotation.transpose(), 10);
+    }
+    covariances.set(5, Eigen::Vector3d(1e-6, 1e-6, 1.0).asDiagonal().toDenseMatrix(), 10);
+    covariances.set(6, Eigen::Matrix3d::Identity(), 10);
+    covariances.set(7, Eigen::Matrix3d::Identity(), 2);
+
+    envire::sam::NormalBatch normals;
+    envire::sam::solveNormals(covariances, normals);
+    BOOST_CHECK_EQUAL(normals.size(), 8);
+
+    for (register int i=0; i<5; ++i)
+    {
+        const Eigen::Vector3d expected = Eigen::AngleAxisd(0.3 * i, Eigen::Vector3d(1.0, 2.0, 0.5).normalized()) * Eigen::Vector3d::UnitX();
+        BOOST_CHECK_CLOSE(std::fabs(expected.dot(Eigen::Vector3d(normals.x[i], normals.y[i], normals.z[i]))), 1.0, 1e-6);
+        BOOST_CHECK_CLOSE(normals.curvature[i], 1e-5 / (2.5 + i + 1e-5), 1e-6);
+    }
+
+    // Degenerate matrices still give a unit normal, too few points give NaN
+    for (register int i=5; i<7; ++i)
+        BOOST_CHECK_CLOSE(Eigen::Vector3d(normals.x[i], normals.y[i], normals.z[i]).norm(), 1.0, 1e-6);
+    BOOST_CHECK_SMALL(std::fabs(normals.z[5]), 1e-6);
+    BOOST_CHECK(std::isnan(normals.x[7]));
+
+    // Covariance of a neighborhood far from the origin
+    envire::sam::PointBatch points;
+    for (register int i=0; i<10; ++i)
+    {
+        points.x.push_back(1000.0 + 0.1 * i);
+        points.y.push_back(-500.0 + 0.1 * (i % 3));
+        points.z.push_back(2000.0);
+    }
+    std::vector<int> indices;
+    for (register int i=0; i<10; ++i)
+        indices.push_back(i);
+    std::vector<std::size_t> offsets;
+    offsets.push_back(0); offsets.push_back(indices.size());
+    envire::sam::CovarianceBatch neighborhood;
+    envire::sam::accumulateCovariances(points, indices, offsets, neighborhood);
+    BOOST_CHECK_CLOSE(neighborhood.xx[0], 0.0825, 1e-6);
+    BOOST_CHECK_SMALL(neighborhood.zz[0], 1e-12);
+    envire::sam::solveNormals(neighborhood, normals);
+    BOOST_CHECK_CLOSE(std::fabs(normals.z[0]), 1.0, 1e-6);
+}
+
+BOOST_AUTO_TEST_CASE(envire_sam_batch_fpfh)
+{
+    BOOST_TEST_MESSAGE( "\n**********************************************************\n" );
+    BOOST_TEST_MESSAGE( "ENVIRE_SAM_BATCH_FPFH" );
+
+    // Wavy surface with its normals
+    envire::sam::PCLPointCloud::Ptr surface(new envire::sam::PCLPointCloud);
+    pcl::PointCloud<pcl::Normal>::Ptr normals(new pcl::PointCloud<pcl::Normal>);
+    for (register int i=0; i<40; ++i)
+        for (register int j=0; j<40; ++j)
+        {
+            envire::sam::PointType point;
+            point.x = 0.02*i; point.y = 0.02*j;
+            point.z = 0.1 * std::sin(3.0*point.x) * std::cos(2.0*point.y);
+            surface->push_back(point);
+
+            const Eigen::Vector3f normal = Eigen::Vector3f(-0.3 * std::cos(3.0*point.x) * std::cos(2.0*point.y),
+                    0.2 * std::sin(3.0*point.x) * std::sin(2.0*point.y), 1.0).normalized();
+            pcl::Normal point_normal;
+            point_normal.normal_x = normal[0]; point_normal.normal_y = normal[1]; point_normal.normal_z = normal[2];
+            normals->push_back(point_normal);
+        }
+
+    pcl::PointCloud<pcl::PointWithScale>::Ptr keypoints(new pcl::PointCloud<pcl::PointWithScale>);
+    for (register int k=0; k<50; ++k)
+    {
+        pcl::PointWithScale keypoint;
+        keypoint.x = surface->points[(k*31) % surface->size()].x;
+        keypoint.y = surface->points[(k*31) % surface->size()].y;
+        keypoint.z = surface->points[(k*31) % surface->size()].z;
+        keypoints->push_back(keypoint);
+    }
+
+    pcl::PointCloud<pcl::FPFHSignature33> descriptors;
+    envire::sam::computeFPFH<envire::sam::PointType, pcl::PointWithScale>(surface, *normals, *keypoints, 0.1, descriptors);
+
+    // The same descriptors as pcl
+    envire::sam::PCLPointCloud::Ptr keypoints_xyzrgb(new envire::sam::PCLPointCloud);
+    pcl::copyPointCloud(*keypoints, *keypoints_xyzrgb);
+    pcl::FPFHEstimation<envire::sam::PointType, pcl::Normal, pcl::FPFHSignature33> fpfh_est;
+    fpfh_est.setSearchMethod(pcl::search::KdTree<envire::sam::PointType>::Ptr(new pcl::search::KdTree<envire::sam::PointType>));
+    fpfh_est.setRadiusSearch(0.1);
+    fpfh_est.setSearchSurface(surface);
+    fpfh_est.setInputNormals(normals);
+    fpfh_est.setInputCloud(keypoints_xyzrgb);
+    pcl::PointCloud<pcl::FPFHSignature33> pcl_descriptors;
+    fpfh_est.compute(pcl_descriptors);
+
+    BOOST_CHECK_EQUAL(descriptors.size(), pcl_descriptors.size());
+    float max_difference = 0.0;
+    for (size_t i=0; i<descriptors.size(); ++i)
+        for (register int j=0; j<33; ++j)
+            max_difference = std::max(max_difference, std::fabs(descriptors.points[i].histogram[j] - pcl_descriptors.points[i].histogram[j]));
+    BOOST_CHECK_SMALL(max_difference, 1e-3f);
+
+    // No neighbors gives NaN
+    keypoints->points[0].x = 100.0;
+    envire::sam::computeFPFH<envire::sam::PointType, pcl::PointWithScale>(surface, *normals, *keypoints, 0.1, descriptors);
+    BOOST_CHECK(std::isnan(descriptors.points[0].histogram[0]));
+    BOOST_CHECK(!descriptors.is_dense);
+}
+
+BOOST_AUTO_TEST_CASE(envire_sam_binary_descriptors)
+{
+    BOOST_TEST_MESSAGE( "\n**********************************************************\n" );
+    BOOST_TEST_MESSAGE( "ENVIRE_SAM_BINARY_DESCRIPTORS" );
+
+    // Thermometer code: the Hamming distance counts the crossed thresholds
+    pcl::FPFHSignature33 a, b;
+    for (register int j=0; j<33; ++j)
+    {
+        a.histogram[j] = 0.0; b.histogram[j] = 0.0;
+    }
+    a.histogram[0] = 50.0; b.histogram[0] = 15.0;
+    a.histogram[32] = 3.0;
+    envire::sam::BinaryFPFHSignature code_a = envire::sam::binarizeFPFH(a);
+    envire::sam::BinaryFPFHSignature code_b = envire::sam::binarizeFPFH(b);
+    BOOST_CHECK_EQUAL(envire::sam::hammingDistance(code_a, code_a), 0);
+    BOOST_CHECK_EQUAL(envire::sam::hammingDistance(code_a, code_b), 3);
+
+    // NaN histograms (no neighbors) give an empty code
+    pcl::FPFHSignature33 invalid;
+    for (register int j=0; j<33; ++j)
+        invalid.histogram[j] = std::numeric_limits<float>::quiet_NaN();
+    envire::sam::BinaryFPFHSignature code_invalid = envire::sam::binarizeFPFH(invalid);
+    BOOST_CHECK_EQUAL(code_invalid.bits[0] | code_invalid.bits[1] | code_invalid.bits[2], 0u);
+
+    // The nearest code of each descriptor in a shuffled copy is itself
+    pcl::PointCloud<pcl::FPFHSignature33> source, target;
+    for (register int i=0; i<20; ++i)
+    {
+        pcl::FPFHSignature33 descriptor;
+        for (register int j=0; j<33; ++j)
+            descriptor.histogram[j] = (j % 11 == (i * 7 + j / 11) % 11) ? 30.0 + i : ((i + j) % 3) * 4.0;
+        source.push_back(descriptor);
+    }
+    for (register int i=0; i<20; ++i)
+        target.push_back(source.points[(i * 3) % 20]);
+
+    envire::sam::BinaryFPFHDescriptors source_codes, target_codes;
+    envire::sam::binarizeFPFH(source, source_codes);
+    envire::sam::binarizeFPFH(target, target_codes);
+    BOOST_CHECK_EQUAL(source_codes.size(), 20u);
+
+    std::vector<int> source2target;
+    std::vector<float> scores;
+    envire::sam::findHammingCorrespondences(source_codes, target_codes, source2target, scores);
+    for (register int i=0; i<20; ++i)
+    {
+        BOOST_CHECK_EQUAL(envire::sam::hammingDistance(source_codes[i], target_codes[source2target[i]]), 0);
+        BOOST_CHECK_EQUAL(scores[i], 0.0);
+    }
+
+    // No targets
+    envire::sam::findHammingCorrespondences(source_codes, envire::sam::BinaryFPFHDescriptors(), source2target, scores);
+    BOOST_CHECK_EQUAL(source2target[0], -1);
+
+    // The option is off by default and keeps the float descriptors
+    envire::sam::BinaryDescriptorParams params;
+    BOOST_CHECK(!params.binaryOn);
+    BOOST_CHECK(params.keep_fpfh);
+}
+
+BOOST_AUTO_TEST_CASE(envire_sam_binary_descriptors_matching)
+{
+    BOOST_TEST_MESSAGE( "\n**********************************************************\n" );
+    BOOST_TEST_MESSAGE( "ENVIRE_SAM_BINARY_DESCRIPTORS_MATCHING" );
+
+    envire::sam::BinaryDescriptorParams fpfh, binary, both;
+    binary.binaryOn = true; binary.keep_fpfh = false;
+    both.binaryOn = true; both.keep_fpfh = true;
+
+    // Only the binary codes: one 24 bytes descriptor per keypoint, matched by Hamming distance
+    envire::sam::MemoryUsage usage;
+    BOOST_CHECK(binaryDescriptorLandmarks(binary, binary, usage) > 0);
+    const envire::sam::FrameMemoryUsage &binary_x0 = usage.per_frame["x0"];
+    BOOST_CHECK(binary_x0.keypoints.count > 0);
+    BOOST_CHECK_EQUAL(binary_x0.descriptors.count, binary_x0.keypoints.count);
+    BOOST_CHECK_EQUAL(binary_x0.descriptors.bytes, binary_x0.keypoints.count * sizeof(envire::sam::BinaryFPFHSignature));
+
+    // Binary codes and float descriptors
+    BOOST_CHECK(binaryDescriptorLandmarks(both, both, usage) > 0);
+    const envire::sam::FrameMemoryUsage &both_x0 = usage.per_frame["x0"];
+    BOOST_CHECK(both_x0.keypoints.count > 0);
+    BOOST_CHECK_EQUAL(both_x0.descriptors.count, 2 * both_x0.keypoints.count);
+
+    // A frame without binary codes falls back to the float descriptors of the other one
+    BOOST_CHECK(binaryDescriptorLandmarks(fpfh, both, usage) > 0);
+    BOOST_CHECK_EQUAL(usage.per_frame["x0"].descriptors.count, usage.per_frame["x0"].keypoints.count);
+    BOOST_CHECK_EQUAL(usage.per_frame["x1"].descriptors.count, 2 * usage.per_frame["x1"].keypoints.count);
+
+    // And does not match a frame which only kept the binary codes
+    BOOST_CHECK_EQUAL(binaryDescriptorLandmarks(fpfh, binary, usage), 0);
+}